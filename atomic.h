@@ -1,61 +1,306 @@
 #ifndef atomic_h
 #define atomic_h
 
-#include <stdatomic.h>
+/*
+ * 原子操作, C 和 C++ 都可以包含.
+ * C 使用 <stdatomic.h>, C++ 使用 <atomic>, 类型名和 memory_order_* 常量两边相同.
+ *
+ * 类型: atomic_int (32 位), atomic_int64, atomic_ptr (指针宽度的无符号整数).
+ * load/store/exchange 不带后缀是 seq_cst, _explicit 版本指定内存序;
+ * fetch_add/fetch_sub/fetch_or/fetch_and/cmpxchg 总是指定内存序. 通常只需要
+ *   relaxed: 计数器, 统计
+ *   acquire/release: 发布数据, 锁
+ * cmpxchg 返回操作前观察到的值, 等于 expected 即成功. cmpxchg_weak 可能假失败, 此时观察到的值
+ * 也等于 expected, 所以它返回是否成功并更新 *expected, 和 C11 的接口一样, 只在循环里用.
+ * 失败路径的内存序由成功的内存序去掉 release 部分得到.
+ * atomic_pair 是两个指针宽的字, atomic_pair_cas 用于带版本号的指针.
+ */
+
 #include <stdint.h>
 #include <stddef.h>
 
+#ifdef __cplusplus
+
+#include <atomic>
+
+typedef std::atomic<int> atomic_int;
+typedef std::atomic<int64_t> atomic_int64;
+typedef std::atomic<uintptr_t> atomic_ptr;
+using std::memory_order;
+using std::memory_order_relaxed;
+using std::memory_order_consume;
+using std::memory_order_acquire;
+using std::memory_order_release;
+using std::memory_order_acq_rel;
+using std::memory_order_seq_cst;
+#define ATOMIC_STD std::
+
+#else
+
+#include <stdatomic.h>
+
+typedef _Atomic(int64_t) atomic_int64;
 typedef atomic_uintptr_t atomic_ptr;
+#define ATOMIC_STD
 
-static inline void
-atomic_int_init(atomic_int *aint, int v) {
-	atomic_init(aint, v);
+#endif
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#endif
+
+/*
+ * 各模块共用: cache line 大小, 按 cache line 对齐的声明, 线程局部变量.
+ * 只被一个线程频繁写的数据各占一个 cache line, 避免伪共享.
+ */
+#define ATOMIC_CACHELINE 64
+
+#if defined(_MSC_VER)
+#define ATOMIC_CACHELINE_ALIGNED __declspec(align(ATOMIC_CACHELINE))
+#define ATOMIC_THREAD __declspec(thread)
+#elif defined(__GNUC__) || defined(__clang__)
+#define ATOMIC_CACHELINE_ALIGNED __attribute__((aligned(ATOMIC_CACHELINE)))
+#define ATOMIC_THREAD __thread
+#else
+#define ATOMIC_CACHELINE_ALIGNED
+#define ATOMIC_THREAD _Thread_local
+#endif
+
+static inline memory_order
+atomic_fail_order(memory_order mo) {
+	if (mo == memory_order_acq_rel)
+		return memory_order_acquire;
+	if (mo == memory_order_release)
+		return memory_order_relaxed;
+	return mo;
 }
 
-static inline int
-atomic_int_load(atomic_int *aint) {
-	return atomic_load(aint);
+static inline void
+atomic_fence(memory_order mo) {
+	ATOMIC_STD atomic_thread_fence(mo);
 }
 
+/*
+ * 整数类型的操作, 为 atomic_int 和 atomic_int64 各生成一组.
+ */
+#define ATOMIC_INTEGER_OPS(name, atype, type)                                                        \
+	static inline void                                                                               \
+	name##_init(atype *a, type v) {                                                                  \
+		ATOMIC_STD atomic_init(a, v);                                                                \
+	}                                                                                                \
+	static inline type                                                                               \
+	name##_load(atype *a) {                                                                          \
+		return ATOMIC_STD atomic_load(a);                                                            \
+	}                                                                                                \
+	static inline type                                                                               \
+	name##_load_explicit(atype *a, memory_order mo) {                                                \
+		return ATOMIC_STD atomic_load_explicit(a, mo);                                               \
+	}                                                                                                \
+	static inline void                                                                               \
+	name##_store(atype *a, type v) {                                                                 \
+		ATOMIC_STD atomic_store(a, v);                                                               \
+	}                                                                                                \
+	static inline void                                                                               \
+	name##_store_explicit(atype *a, type v, memory_order mo) {                                       \
+		ATOMIC_STD atomic_store_explicit(a, v, mo);                                                  \
+	}                                                                                                \
+	/* 返回加一/减一之后的值 */                                                                      \
+	static inline type                                                                               \
+	name##_inc(atype *a) {                                                                           \
+		return ATOMIC_STD atomic_fetch_add(a, 1) + 1;                                                \
+	}                                                                                                \
+	static inline type                                                                               \
+	name##_dec(atype *a) {                                                                           \
+		return ATOMIC_STD atomic_fetch_sub(a, 1) - 1;                                                \
+	}                                                                                                \
+	/* fetch_* 返回操作之前的值 */                                                                   \
+	static inline type                                                                               \
+	name##_fetch_add(atype *a, type v, memory_order mo) {                                            \
+		return ATOMIC_STD atomic_fetch_add_explicit(a, v, mo);                                       \
+	}                                                                                                \
+	static inline type                                                                               \
+	name##_fetch_sub(atype *a, type v, memory_order mo) {                                            \
+		return ATOMIC_STD atomic_fetch_sub_explicit(a, v, mo);                                       \
+	}                                                                                                \
+	static inline type                                                                               \
+	name##_fetch_or(atype *a, type v, memory_order mo) {                                             \
+		return ATOMIC_STD atomic_fetch_or_explicit(a, v, mo);                                        \
+	}                                                                                                \
+	static inline type                                                                               \
+	name##_fetch_and(atype *a, type v, memory_order mo) {                                            \
+		return ATOMIC_STD atomic_fetch_and_explicit(a, v, mo);                                       \
+	}                                                                                                \
+	static inline type                                                                               \
+	name##_exchange(atype *a, type v) {                                                              \
+		return ATOMIC_STD atomic_exchange(a, v);                                                     \
+	}                                                                                                \
+	static inline type                                                                               \
+	name##_exchange_explicit(atype *a, type v, memory_order mo) {                                    \
+		return ATOMIC_STD atomic_exchange_explicit(a, v, mo);                                        \
+	}                                                                                                \
+	/* 成功返回 1, seq_cst */                                                                        \
+	static inline int                                                                                \
+	name##_cas(atype *a, type oval, type nval) {                                                     \
+		return ATOMIC_STD atomic_compare_exchange_strong(a, &oval, nval);                            \
+	}                                                                                                \
+	static inline type                                                                               \
+	name##_cmpxchg(atype *a, type expected, type desired, memory_order mo) {                         \
+		ATOMIC_STD atomic_compare_exchange_strong_explicit(a, &expected, desired, mo,                \
+														   atomic_fail_order(mo));                   \
+		return expected;                                                                             \
+	}                                                                                                \
+	/* 成功返回 1; 失败(包括假失败)返回 0 并把观察到的值写回 *expected */                           \
+	static inline int                                                                                \
+	name##_cmpxchg_weak(atype *a, type *expected, type desired, memory_order mo) {                   \
+		return ATOMIC_STD atomic_compare_exchange_weak_explicit(a, expected, desired, mo,            \
+																atomic_fail_order(mo));              \
+	}
+
+ATOMIC_INTEGER_OPS(atomic_int, atomic_int, int)
+ATOMIC_INTEGER_OPS(atomic_int64, atomic_int64, int64_t)
+
 static inline void
-atomic_int_store(atomic_int *aint, int v) {
-	atomic_store(aint, v);
+atomic_ptr_init(atomic_ptr *aptr, void *v) {
+	ATOMIC_STD atomic_init(aptr, (uintptr_t)v);
 }
 
-static inline int
-atomic_int_inc(atomic_int *aint) {
-	return atomic_fetch_add(aint, 1)+1;
+static inline void *
+atomic_ptr_load(atomic_ptr *aptr) {
+	return (void *)ATOMIC_STD atomic_load(aptr);
 }
 
-static inline int
-atomic_int_dec(atomic_int *aint) {
-	return atomic_fetch_sub(aint, 1)-1;
+static inline void *
+atomic_ptr_load_explicit(atomic_ptr *aptr, memory_order mo) {
+	return (void *)ATOMIC_STD atomic_load_explicit(aptr, mo);
 }
 
-static inline int
-atomic_int_cas(atomic_int *aint, int oval, int nval) {
-	return atomic_compare_exchange_weak(aint, &oval, nval);
+static inline void
+atomic_ptr_store(atomic_ptr *aptr, void *v) {
+	ATOMIC_STD atomic_store(aptr, (uintptr_t)v);
 }
 
 static inline void
-atomic_ptr_init(atomic_ptr *aptr, void *v) {
-	atomic_init(aptr, (uintptr_t)v);
+atomic_ptr_store_explicit(atomic_ptr *aptr, void *v, memory_order mo) {
+	ATOMIC_STD atomic_store_explicit(aptr, (uintptr_t)v, mo);
 }
 
 static inline void *
-atomic_ptr_load(atomic_ptr *aptr) {
-	return (void *)atomic_load(aptr);
+atomic_ptr_exchange(atomic_ptr *aptr, void *v) {
+	return (void *)ATOMIC_STD atomic_exchange(aptr, (uintptr_t)v);
 }
 
-static inline void
-atomic_ptr_store(atomic_ptr *aptr, void *v) {
-	atomic_store(aptr, (uintptr_t)v);
+static inline void *
+atomic_ptr_exchange_explicit(atomic_ptr *aptr, void *v, memory_order mo) {
+	return (void *)ATOMIC_STD atomic_exchange_explicit(aptr, (uintptr_t)v, mo);
+}
+
+/* 给指针低位打标记, 返回操作之前的值 */
+static inline void *
+atomic_ptr_fetch_or(atomic_ptr *aptr, uintptr_t bits, memory_order mo) {
+	return (void *)ATOMIC_STD atomic_fetch_or_explicit(aptr, bits, mo);
+}
+
+static inline void *
+atomic_ptr_fetch_and(atomic_ptr *aptr, uintptr_t bits, memory_order mo) {
+	return (void *)ATOMIC_STD atomic_fetch_and_explicit(aptr, bits, mo);
 }
 
+/* 成功返回 1, seq_cst */
 static inline int
 atomic_ptr_cas(atomic_ptr *aptr, void *oval, void *nval) {
 	uintptr_t temp = (uintptr_t)oval;
-	return atomic_compare_exchange_weak(aptr, &temp, (uintptr_t)nval);
+	return ATOMIC_STD atomic_compare_exchange_strong(aptr, &temp, (uintptr_t)nval);
+}
+
+static inline void *
+atomic_ptr_cmpxchg(atomic_ptr *aptr, void *expected, void *desired, memory_order mo) {
+	uintptr_t temp = (uintptr_t)expected;
+	ATOMIC_STD atomic_compare_exchange_strong_explicit(aptr, &temp, (uintptr_t)desired, mo, atomic_fail_order(mo));
+	return (void *)temp;
+}
+
+static inline int
+atomic_ptr_cmpxchg_weak(atomic_ptr *aptr, void **expected, void *desired, memory_order mo) {
+	uintptr_t temp = (uintptr_t)*expected;
+	int ok = ATOMIC_STD atomic_compare_exchange_weak_explicit(aptr, &temp, (uintptr_t)desired, mo,
+															  atomic_fail_order(mo));
+	*expected = (void *)temp;
+	return ok;
+}
+
+/*
+ * 双字 CAS, seq_cst. x86-64 上是 cmpxchg16b, 要求 16 字节对齐.
+ * 相等时写入 desired 返回 1, 否则把观察到的值写回 *expected 返回 0.
+ * 其他 64 位平台使用 __atomic 内建函数, 可能需要链接 libatomic.
+ */
+#if defined(_MSC_VER)
+#define ATOMIC_PAIR_ALIGNED __declspec(align(2 * sizeof(uintptr_t)))
+#else
+#define ATOMIC_PAIR_ALIGNED __attribute__((aligned(2 * sizeof(uintptr_t))))
+#endif
+
+typedef struct atomic_pair atomic_pair;
+struct ATOMIC_PAIR_ALIGNED atomic_pair {
+	uintptr_t lo;
+	uintptr_t hi;
+};
+
+static inline void
+atomic_pair_init(atomic_pair *p, uintptr_t lo, uintptr_t hi) {
+	p->lo = lo;
+	p->hi = hi;
+}
+
+static inline int
+atomic_pair_cas(atomic_pair *p, atomic_pair *expected, atomic_pair desired) {
+#if defined(_MSC_VER) && defined(_M_X64)
+	return _InterlockedCompareExchange128((volatile long long *)p, (long long)desired.hi,
+										  (long long)desired.lo, (long long *)expected);
+#elif defined(_MSC_VER) && defined(_M_IX86)
+	long long e = (long long)((uint64_t)expected->lo | (uint64_t)expected->hi << 32);
+	long long d = (long long)((uint64_t)desired.lo | (uint64_t)desired.hi << 32);
+	long long o = _InterlockedCompareExchange64((volatile long long *)p, d, e);
+	expected->lo = (uintptr_t)(uint64_t)o;
+	expected->hi = (uintptr_t)((uint64_t)o >> 32);
+	return o == e;
+#elif defined(__x86_64__)
+	unsigned char ok;
+	__asm__ __volatile__("lock cmpxchg16b %1\n\tsete %0"
+						 : "=q"(ok), "+m"(*p), "+a"(expected->lo), "+d"(expected->hi)
+						 : "b"(desired.lo), "c"(desired.hi)
+						 : "memory", "cc");
+	return ok;
+#elif UINTPTR_MAX == 0xffffffffu
+	uint64_t e = (uint64_t)expected->lo | (uint64_t)expected->hi << 32;
+	uint64_t d = (uint64_t)desired.lo | (uint64_t)desired.hi << 32;
+	int ok = __atomic_compare_exchange_n((uint64_t *)p, &e, d, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	expected->lo = (uintptr_t)e;
+	expected->hi = (uintptr_t)(e >> 32);
+	return ok;
+#else
+	return __atomic_compare_exchange((unsigned __int128 *)p, (unsigned __int128 *)expected,
+									 (unsigned __int128 *)&desired, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+#endif
+}
+
+/* 原子地读两个字, 用一次不改变值的 CAS 实现 */
+static inline atomic_pair
+atomic_pair_load(atomic_pair *p) {
+	atomic_pair v = {0, 0};
+	atomic_pair_cas(p, &v, v);
+	return v;
+}
+
+/* 自旋等待时调用, 降低功耗并让出超线程的执行单元 */
+static inline void
+atomic_pause(void) {
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+	_mm_pause();
+#elif defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+	__asm__ __volatile__("yield");
+#endif
 }
 
 #endif
@@ -0,0 +1,251 @@
+#include "atomic.h"
+#include "dtclock.h"
+#include "testthread.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+/*
+ * 比较各内存序的单线程开销: seq_cst 与 release/relaxed 写, seq_cst 与 acquire 读,
+ * fetch_add, 强/弱 CAS, 双字 CAS; 最后是多个线程对同一个计数器和各自计数器的 fetch_add.
+ * x86 上 seq_cst 写是 xchg (带完整屏障), release/relaxed 写是普通 mov.
+ *
+ *   bench-atomic [每项循环次数, 默认 20000000] [最大线程数, 默认 CPU 数]
+ */
+
+#define UNROLL 8
+
+typedef struct counter counter;
+struct counter
+{
+    atomic_int64 n;
+    char pad[64 - sizeof(atomic_int64)];
+};
+
+static atomic_int64 Word;
+static atomic_int Go;
+static atomic_int Ready;
+static atomic_pair Pair;
+static counter Shared;
+static int64_t Sink;
+
+static int64_t benchStoreSeqCst(int64_t n)
+{
+    for (int64_t i = 0; i < n; i += UNROLL)
+        for (int j = 0; j < UNROLL; j++)
+            atomic_int64_store(&Word, i + j);
+    return 0;
+}
+
+static int64_t benchStoreRelease(int64_t n)
+{
+    for (int64_t i = 0; i < n; i += UNROLL)
+        for (int j = 0; j < UNROLL; j++)
+            atomic_int64_store_explicit(&Word, i + j, memory_order_release);
+    return 0;
+}
+
+static int64_t benchStoreRelaxed(int64_t n)
+{
+    for (int64_t i = 0; i < n; i += UNROLL)
+        for (int j = 0; j < UNROLL; j++)
+            atomic_int64_store_explicit(&Word, i + j, memory_order_relaxed);
+    return 0;
+}
+
+static int64_t benchLoadSeqCst(int64_t n)
+{
+    int64_t s = 0;
+    for (int64_t i = 0; i < n; i += UNROLL)
+        for (int j = 0; j < UNROLL; j++)
+            s += atomic_int64_load(&Word);
+    return s;
+}
+
+static int64_t benchLoadAcquire(int64_t n)
+{
+    int64_t s = 0;
+    for (int64_t i = 0; i < n; i += UNROLL)
+        for (int j = 0; j < UNROLL; j++)
+            s += atomic_int64_load_explicit(&Word, memory_order_acquire);
+    return s;
+}
+
+static int64_t benchFetchAddSeqCst(int64_t n)
+{
+    for (int64_t i = 0; i < n; i += UNROLL)
+        for (int j = 0; j < UNROLL; j++)
+            atomic_int64_inc(&Word);
+    return 0;
+}
+
+static int64_t benchFetchAddRelaxed(int64_t n)
+{
+    for (int64_t i = 0; i < n; i += UNROLL)
+        for (int j = 0; j < UNROLL; j++)
+            atomic_int64_fetch_add(&Word, 1, memory_order_relaxed);
+    return 0;
+}
+
+static int64_t benchExchange(int64_t n)
+{
+    int64_t s = 0;
+    for (int64_t i = 0; i < n; i += UNROLL)
+        for (int j = 0; j < UNROLL; j++)
+            s += atomic_int64_exchange_explicit(&Word, i, memory_order_acq_rel);
+    return s;
+}
+
+static int64_t benchCasStrong(int64_t n)
+{
+    int64_t v = atomic_int64_load(&Word);
+    for (int64_t i = 0; i < n; i += UNROLL)
+        for (int j = 0; j < UNROLL; j++)
+            v = atomic_int64_cmpxchg(&Word, v, v + 1, memory_order_acq_rel) + 1;
+    return v;
+}
+
+static int64_t benchCasWeak(int64_t n)
+{
+    int64_t v = atomic_int64_load(&Word);
+    for (int64_t i = 0; i < n; i += UNROLL)
+        for (int j = 0; j < UNROLL; j++)
+        {
+            while (!atomic_int64_cmpxchg_weak(&Word, &v, v + 1, memory_order_acq_rel))
+                ;
+            v++;
+        }
+    return v;
+}
+
+static int64_t benchPairCas(int64_t n)
+{
+    atomic_pair e = atomic_pair_load(&Pair);
+    for (int64_t i = 0; i < n; i += UNROLL)
+        for (int j = 0; j < UNROLL; j++)
+        {
+            atomic_pair d;
+            do
+            {
+                d.lo = e.lo + 1;
+                d.hi = e.hi + 1;
+            } while (!atomic_pair_cas(&Pair, &e, d));
+            e = d;
+        }
+    return (int64_t)e.lo;
+}
+
+typedef struct bench bench;
+struct bench
+{
+    const char *name;
+    int64_t (*fn)(int64_t n);
+};
+
+static const bench Benches[] = {
+    {"store seq_cst", benchStoreSeqCst},
+    {"store release", benchStoreRelease},
+    {"store relaxed", benchStoreRelaxed},
+    {"load seq_cst", benchLoadSeqCst},
+    {"load acquire", benchLoadAcquire},
+    {"fetch_add seq_cst", benchFetchAddSeqCst},
+    {"fetch_add relaxed", benchFetchAddRelaxed},
+    {"exchange acq_rel", benchExchange},
+    {"cmpxchg strong", benchCasStrong},
+    {"cmpxchg weak", benchCasWeak},
+    {"pair cas", benchPairCas},
+};
+
+typedef struct worker worker;
+struct worker
+{
+    int shared;
+    int64_t loop;
+    counter local;
+};
+
+THREAD_MAIN(adderMain)
+{
+    worker *w = (worker *)arg;
+    atomic_int64 *c = w->shared ? &Shared.n : &w->local.n;
+    atomic_int_inc(&Ready);
+    while (!atomic_int_load_explicit(&Go, memory_order_acquire))
+        atomic_pause();
+    for (int64_t i = 0; i < w->loop; i++)
+        atomic_int64_fetch_add(c, 1, memory_order_relaxed);
+    return 0;
+}
+
+/* 返回每次 fetch_add 的平均纳秒数 (按总次数计) */
+static double measureAdd(int shared, int nthread, int64_t loop)
+{
+    worker *w = (worker *)calloc(nthread, sizeof(worker));
+    thread_t *th = (thread_t *)calloc(nthread, sizeof(thread_t));
+    int64_t t0, t1, total = 0;
+    int i;
+    atomic_int64_store(&Shared.n, 0);
+    atomic_int_store(&Ready, 0);
+    atomic_int_store(&Go, 0);
+    for (i = 0; i < nthread; i++)
+    {
+        w[i].shared = shared;
+        w[i].loop = loop / nthread;
+        atomic_int64_init(&w[i].local.n, 0);
+        START(th[i], adderMain, &w[i]);
+    }
+    while (atomic_int_load(&Ready) < nthread)
+        atomic_pause();
+    t0 = dt_now_precise_ns();
+    atomic_int_store_explicit(&Go, 1, memory_order_release);
+    for (i = 0; i < nthread; i++)
+    {
+        JOIN(th[i]);
+    }
+    t1 = dt_now_precise_ns();
+    if (shared)
+        total = atomic_int64_load(&Shared.n);
+    else
+        for (i = 0; i < nthread; i++)
+            total += atomic_int64_load(&w[i].local.n);
+    if (total != w[0].loop * nthread)
+    {
+        fprintf(stderr, "lost updates: %lld != %lld\n", (long long)total, (long long)(w[0].loop * nthread));
+        exit(1);
+    }
+    free(th);
+    free(w);
+    return (double)(t1 - t0) / total;
+}
+
+int main(int argc, char **argv)
+{
+    int64_t loop = argc > 1 ? atoll(argv[1]) : 20000000;
+    int nmax = argc > 2 ? atoi(argv[2]) : cpu_count();
+    atomic_int64_init(&Word, 0);
+    atomic_pair_init(&Pair, 0, 0);
+    loop = (loop + UNROLL - 1) / UNROLL * UNROLL;
+    printf("# %d cpus, %lld ops per case\n", cpu_count(), (long long)loop);
+    printf("%-20s %10s\n", "op", "ns/op");
+    for (size_t i = 0; i < sizeof(Benches) / sizeof(Benches[0]); i++)
+    {
+        int64_t t0 = dt_now_precise_ns(), t1;
+        Sink += Benches[i].fn(loop);
+        t1 = dt_now_precise_ns();
+        printf("%-20s %10.2f\n", Benches[i].name, (double)(t1 - t0) / loop);
+    }
+    printf("\n%-20s %8s %10s\n", "fetch_add relaxed", "threads", "ns/op");
+    for (int shared = 1; shared >= 0; shared--)
+    {
+        for (int n = 1;; n = n * 2 < nmax ? n * 2 : nmax)
+        {
+            printf("%-20s %8d %10.2f\n", shared ? "shared counter" : "per-thread counter", n,
+                   measureAdd(shared, n, loop));
+            if (n >= nmax)
+                break;
+        }
+    }
+    if (Sink == 42)
+        printf("\n");
+    return 0;
+}
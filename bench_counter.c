@@ -0,0 +1,181 @@
+#include "counter.h"
+#include "atomic.h"
+#include "dtclock.h"
+#include "testthread.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+/*
+ * 多线程计数的扩展性: N 个线程不停地给同一个统计加一, 输出总吞吐和每次更新的平均耗时:
+ *   atomic     一个共享的 atomic_int64, 所有线程写同一个 cache line
+ *   counter    counter_inc, 每个线程写自己的分片
+ *   histogram  histogram_record
+ * 最后是单线程读一次的耗时: counter_read, counter_read_exact, histogram_read.
+ * bench-counter-thread 按线程选分片, bench-counter-percpu 定义了 COUNTER_PERCPU, 按 CPU 选分片.
+ *
+ *   bench-counter-thread [最大线程数, 默认 CPU 数的两倍] [每轮毫秒数, 默认 200]
+ */
+
+#ifdef COUNTER_PERCPU
+#define SLOT_NAME "percpu"
+#else
+#define SLOT_NAME "thread"
+#endif
+
+#define NREAD 1000000
+
+enum
+{
+    K_ATOMIC = 0,
+    K_COUNTER,
+    K_HISTOGRAM,
+    K_COUNT
+};
+
+static const char *KindNames[] = {"atomic", "counter", "histogram"};
+
+typedef struct worker worker;
+struct worker
+{
+    int kind;
+    uint64_t ops;
+    char pad[ATOMIC_CACHELINE];
+};
+
+static atomic_int64 Shared;
+static struct counter Counter;
+static struct histogram Histogram;
+static atomic_int Stop;
+static atomic_int Ready;
+
+THREAD_MAIN(threadMain)
+{
+    worker *w = (worker *)arg;
+    uint64_t ops = 0;
+    atomic_int_inc(&Ready);
+    while (!atomic_int_load_explicit(&Stop, memory_order_relaxed))
+    {
+        /* 每查一次停止标志更新 64 次, 减少循环本身的开销 */
+        for (int i = 0; i < 64; i++)
+        {
+            switch (w->kind)
+            {
+            case K_ATOMIC:
+                atomic_int64_fetch_add(&Shared, 1, memory_order_relaxed);
+                break;
+            case K_COUNTER:
+                counter_inc(&Counter);
+                break;
+            case K_HISTOGRAM:
+                histogram_record(&Histogram, (int64_t)(ops + i));
+                break;
+            }
+        }
+        ops += 64;
+    }
+    w->ops = ops;
+    return 0;
+}
+
+static int measure(int kind, int nthread, int ms)
+{
+    worker *w = (worker *)calloc(nthread, sizeof(worker));
+    thread_t *th = (thread_t *)calloc(nthread, sizeof(thread_t));
+    struct histogram_stat st;
+    int64_t t0, t1, got = 0;
+    uint64_t total = 0;
+    int i;
+    atomic_int64_store(&Shared, 0);
+    counter_init(&Counter);
+    histogram_init(&Histogram);
+    atomic_int_store(&Stop, 0);
+    atomic_int_store(&Ready, 0);
+    for (i = 0; i < nthread; i++)
+    {
+        w[i].kind = kind;
+        START(th[i], threadMain, &w[i]);
+    }
+    while (atomic_int_load(&Ready) < nthread)
+        SLEEP_MS(1);
+    t0 = dt_now_precise_ns();
+    SLEEP_MS(ms);
+    atomic_int_store(&Stop, 1);
+    for (i = 0; i < nthread; i++)
+    {
+        JOIN(th[i]);
+        total += w[i].ops;
+    }
+    t1 = dt_now_precise_ns();
+    printf("%-10s %-7s %8d %14.0f %10.2f\n", KindNames[kind], SLOT_NAME, nthread, total * 1e9 / (t1 - t0),
+           (double)(t1 - t0) / (total ? total : 1));
+    free(th);
+    free(w);
+    switch (kind)
+    {
+    case K_ATOMIC:
+        got = atomic_int64_load(&Shared);
+        break;
+    case K_COUNTER:
+        got = counter_read_exact(&Counter);
+        break;
+    case K_HISTOGRAM:
+        histogram_read(&Histogram, &st);
+        got = st.count;
+        break;
+    }
+    if (got != (int64_t)total)
+    {
+        fprintf(stderr, "%s: lost updates, %lld != %llu\n", KindNames[kind], (long long)got,
+                (unsigned long long)total);
+        return 1;
+    }
+    return 0;
+}
+
+static void readCost(void)
+{
+    struct histogram_stat st;
+    int64_t t0, t1, sink = 0;
+    int i;
+    t0 = dt_now_precise_ns();
+    for (i = 0; i < NREAD; i++)
+        sink += counter_read(&Counter);
+    t1 = dt_now_precise_ns();
+    printf("%-20s %10.2f ns\n", "counter_read", (double)(t1 - t0) / NREAD);
+    t0 = dt_now_precise_ns();
+    for (i = 0; i < NREAD; i++)
+        sink += counter_read_exact(&Counter);
+    t1 = dt_now_precise_ns();
+    printf("%-20s %10.2f ns\n", "counter_read_exact", (double)(t1 - t0) / NREAD);
+    t0 = dt_now_precise_ns();
+    for (i = 0; i < NREAD / 100; i++)
+    {
+        histogram_read(&Histogram, &st);
+        sink += st.count;
+    }
+    t1 = dt_now_precise_ns();
+    printf("%-20s %10.2f ns\n", "histogram_read", (double)(t1 - t0) / (NREAD / 100));
+    if (sink == 42)
+        printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+    int nmax = argc > 1 ? atoi(argv[1]) : 2 * cpu_count();
+    int ms = argc > 2 ? atoi(argv[2]) : 200;
+    printf("# %s slots, %d cpus, %d slots, struct counter %d bytes, struct histogram %d bytes\n", SLOT_NAME,
+           cpu_count(), COUNTER_SLOTS, (int)sizeof(struct counter), (int)sizeof(struct histogram));
+    printf("%-10s %-7s %8s %14s %10s\n", "kind", "slots", "threads", "ops/s", "ns/op");
+    for (int n = 1; n <= nmax; n *= 2)
+    {
+        for (int kind = 0; kind < K_COUNT; kind++)
+        {
+            if (measure(kind, n, ms))
+                return 1;
+        }
+    }
+    readCost();
+    return 0;
+}
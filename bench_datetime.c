@@ -0,0 +1,215 @@
+#ifndef _WIN32
+#define _GNU_SOURCE /* strptime, timegm */
+#endif
+#include "datetime.h"
+#include "dtclock.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define NSAMPLE 1024
+#define NLOOP 1000000
+
+static const char *Formats[] = {
+    "%Y-%m-%d %H:%M:%S",
+    "%Y-%m-%dT%H:%M:%SZ",
+    "%d/%m/%Y %H:%M week %W day %j",
+};
+
+static const char *ScanFormats[][2] = {
+    /* dt_scan pattern, strftime/strptime pattern */
+    {"%d/%b/%Y:%H:%M:%S %z", "%d/%b/%Y:%H:%M:%S %z"},
+    {"%a, %d %b %Y %H:%M:%S %z", "%a, %d %b %Y %H:%M:%S %z"},
+    {"%Y%m%d%H%M%S", "%Y%m%d%H%M%S"},
+    {"%Y-%m-%dT%H:%M:%S%z", "%Y-%m-%dT%H:%M:%S%z"},
+};
+
+static char Stamps[NSAMPLE][24];
+static DateTime Dates[NSAMPLE];
+static time_t Times[NSAMPLE];
+static volatile size_t Sink;
+
+static void report(const char *name, const char *fmt, int64_t t0)
+{
+    printf("%-28s %-34s %8.1f ns/op\n", name, fmt, (double)(dt_now_precise_ns() - t0) / NLOOP);
+}
+
+int main()
+{
+    char buf[256];
+    srand(1);
+    for (int i = 0; i < NSAMPLE; i++)
+    {
+        const char *argv[2];
+        Times[i] = (time_t)(946684800 + (int64_t)rand() * 37 % 1000000000);
+        snprintf(Stamps[i], sizeof(Stamps[i]), "%lld", (long long)Times[i]);
+        argv[0] = Stamps[i];
+        argv[1] = "unixepoch";
+        dt_parse(&Dates[i], 2, argv);
+    }
+    for (int f = 0; f < (int)(sizeof(Formats) / sizeof(Formats[0])); f++)
+    {
+        const char *fmt = Formats[f];
+        dt_fmt *prog = dt_fmt_compile(fmt);
+        int64_t t0 = dt_now_precise_ns();
+        for (int i = 0; i < NLOOP; i++)
+            Sink += strlen(dt_strftime(fmt, 2, Stamps[i % NSAMPLE], "unixepoch"));
+        report("dt_strftime", fmt, t0);
+
+        t0 = dt_now_precise_ns();
+        for (int i = 0; i < NLOOP; i++)
+            Sink += dt_fmt_format(prog, &Dates[i % NSAMPLE], buf, sizeof(buf));
+        report("dt_fmt_format", fmt, t0);
+
+        t0 = dt_now_precise_ns();
+        for (int i = 0; i < NLOOP; i++)
+        {
+            struct tm tm;
+#ifdef _WIN32
+            gmtime_s(&tm, &Times[i % NSAMPLE]);
+#else
+            gmtime_r(&Times[i % NSAMPLE], &tm);
+#endif
+            Sink += strftime(buf, sizeof(buf), fmt, &tm);
+        }
+        report("gmtime_r+strftime", fmt, t0);
+        dt_fmt_free(prog);
+    }
+    {
+        /* Log style input: monotonic, about 10 calls per millisecond */
+        const char *fmt = "%Y-%m-%d %H:%M:%f";
+        dt_fmt *prog = dt_fmt_compile(fmt);
+        int64_t base = (int64_t)1700000000 * 1000000000, t0;
+        uint64_t hit, miss;
+        t0 = dt_now_precise_ns();
+        for (int i = 0; i < NLOOP; i++)
+        {
+            DateTime x;
+            int64_t ns = base + (int64_t)i * 100000;
+            memset(&x, 0, sizeof(x));
+            x.iJD = (ns / 1000000) + 21086676 * (int64_t)10000000;
+            x.validJD = 1;
+            Sink += dt_fmt_format(prog, &x, buf, sizeof(buf));
+        }
+        report("dt_fmt_format (log)", fmt, t0);
+        t0 = dt_now_precise_ns();
+        for (int i = 0; i < NLOOP; i++)
+            Sink += dt_fmt_cached(prog, NULL, base + (int64_t)i * 100000, buf, sizeof(buf));
+        report("dt_fmt_cached (log)", fmt, t0);
+        dt_fmt_cache_stats(&hit, &miss);
+        printf("%-28s hit %llu miss %llu\n", "dt_fmt_cached", (unsigned long long)hit, (unsigned long long)miss);
+        dt_fmt_free(prog);
+    }
+    {
+        /* Hourly and monthly buckets for a sorted column, string round trip vs dt_bucket */
+        static int64_t aIn[NSAMPLE], aOut[NSAMPLE];
+        dt_bucket b;
+        int64_t t0;
+        for (int i = 0; i < NSAMPLE; i++)
+            aIn[i] = (int64_t)1700000000 + (int64_t)i * 3607;
+        t0 = dt_now_precise_ns();
+        for (int i = 0; i < NLOOP; i++)
+        {
+            char z[24];
+            snprintf(z, sizeof(z), "%lld", (long long)aIn[i % NSAMPLE]);
+            Sink += (size_t)dt_unixepoch(3, z, "unixepoch", "start of month");
+        }
+        report("dt_unixepoch start of", "month", t0);
+        dt_bucket_init(&b, 1, DT_UNIT_MONTH, NULL, 1);
+        t0 = dt_now_precise_ns();
+        for (int i = 0; i < NLOOP; i++)
+            Sink += (size_t)dt_bucket_floor(&b, aIn[i % NSAMPLE]);
+        report("dt_bucket_floor", "month", t0);
+        t0 = dt_now_precise_ns();
+        for (int i = 0; i < NLOOP; i += NSAMPLE)
+            dt_bucket_floor_array(&b, aIn, aOut, NSAMPLE);
+        Sink += (size_t)aOut[0];
+        report("dt_bucket_floor_array", "month", t0);
+        dt_bucket_init(&b, 1, DT_UNIT_HOUR, NULL, 1);
+        t0 = dt_now_precise_ns();
+        for (int i = 0; i < NLOOP; i += NSAMPLE)
+            dt_bucket_floor_array(&b, aIn, aOut, NSAMPLE);
+        Sink += (size_t)aOut[0];
+        report("dt_bucket_floor_array", "hour", t0);
+    }
+    {
+        /* Differences between timestamp pairs */
+        static char aIso[NSAMPLE][24];
+        dt_duration d;
+        int64_t t0, ns;
+        for (int i = 0; i < NSAMPLE; i++)
+            strcpy(aIso[i], dt_datetime(2, Stamps[i], "unixepoch"));
+        t0 = dt_now_precise_ns();
+        for (int i = 0; i < NLOOP; i++)
+            Sink += strlen(dt_timediff(2, aIso[i % NSAMPLE], aIso[(i + 1) % NSAMPLE]));
+        report("dt_timediff", "iso strings", t0);
+        t0 = dt_now_precise_ns();
+        for (int i = 0; i < NLOOP; i++)
+        {
+            dt_diff(&d, &Dates[i % NSAMPLE], &Dates[(i + 1) % NSAMPLE]);
+            Sink += (size_t)d.ns;
+        }
+        report("dt_diff", "DateTime", t0);
+        t0 = dt_now_precise_ns();
+        for (int i = 0; i < NLOOP; i++)
+        {
+            dt_diff_ns(&Dates[i % NSAMPLE], &Dates[(i + 1) % NSAMPLE], &ns);
+            Sink += (size_t)ns;
+        }
+        report("dt_diff_ns", "DateTime", t0);
+    }
+    for (int f = 0; f < (int)(sizeof(ScanFormats) / sizeof(ScanFormats[0])); f++)
+    {
+        /* Format directed parsing, per format */
+        static char aText[NSAMPLE][64];
+        dt_scan *prog = dt_scan_compile(ScanFormats[f][0]);
+        int64_t t0;
+        for (int i = 0; i < NSAMPLE; i++)
+        {
+            struct tm tm;
+#ifdef _WIN32
+            gmtime_s(&tm, &Times[i]);
+#else
+            gmtime_r(&Times[i], &tm);
+#endif
+            strftime(aText[i], sizeof(aText[i]), ScanFormats[f][1], &tm);
+        }
+        t0 = dt_now_precise_ns();
+        for (int i = 0; i < NLOOP; i++)
+        {
+            DateTime x;
+            Sink += dt_scan_parse(prog, aText[i % NSAMPLE], &x);
+        }
+        report("dt_scan_parse", ScanFormats[f][0], t0);
+#ifndef _WIN32
+        t0 = dt_now_precise_ns();
+        for (int i = 0; i < NLOOP; i++)
+        {
+            struct tm tm;
+            memset(&tm, 0, sizeof(tm));
+            Sink += (size_t)strptime(aText[i % NSAMPLE], ScanFormats[f][1], &tm);
+            Sink += (size_t)timegm(&tm);
+        }
+        report("strptime+timegm", ScanFormats[f][1], t0);
+#endif
+        dt_scan_free(prog);
+    }
+    {
+        /* ISO text through the generic parser for reference */
+        static char aIso[NSAMPLE][24];
+        int64_t t0;
+        for (int i = 0; i < NSAMPLE; i++)
+            strcpy(aIso[i], dt_datetime(2, Stamps[i], "unixepoch"));
+        t0 = dt_now_precise_ns();
+        for (int i = 0; i < NLOOP; i++)
+        {
+            DateTime x;
+            const char *argv[1];
+            argv[0] = aIso[i % NSAMPLE];
+            Sink += dt_parse(&x, 1, argv);
+        }
+        report("dt_parse", "YYYY-MM-DD HH:MM:SS", t0);
+    }
+    return 0;
+}
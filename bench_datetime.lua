@@ -0,0 +1,96 @@
+-- luajit bench_datetime.lua
+-- Compares the varargs FFI path with the datetime C module for an
+-- event processing loop: parse a timestamp, shift it, bucket it, format it.
+local ffi = require "ffi"
+local datetime = require "datetime"
+
+ffi.cdef [[
+    const char *dt_datetime(int argc, ...);
+    const char *dt_strftime(const char *zFmt, int argc, ...);
+    int64_t dt_unixepoch(int argc, ...);
+]]
+
+local S = ffi.load("datetime.so")
+local N = 1000000
+
+local stamps = {}
+for i = 1, 1024 do
+    stamps[i] = os.date("!%Y-%m-%d %H:%M:%S", 1700000000 + i * 3607)
+end
+
+local sink
+local function bench(name, fn)
+    local t0 = os.clock()
+    sink = fn()
+    print(string.format("%-36s %8.1f ns/op", name, (os.clock() - t0) * 1e9 / N))
+end
+
+bench("ffi datetime +1 hours", function()
+    local s
+    for i = 1, N do
+        s = ffi.string(S.dt_datetime(2, stamps[i % 1024 + 1], "+1 hours"))
+    end
+    return s
+end)
+
+bench("module new():modify():datetime()", function()
+    local s
+    for i = 1, N do
+        s = datetime.new(stamps[i % 1024 + 1]):modify("+1 hours"):datetime()
+    end
+    return s
+end)
+
+bench("module parsed + 3600", function()
+    local ts, s = {}, nil
+    for i = 1, 1024 do
+        ts[i] = datetime.new(stamps[i])
+    end
+    for i = 1, N do
+        s = ts[i % 1024 + 1] + 3600
+    end
+    return s
+end)
+
+bench("ffi strftime start of month", function()
+    local s
+    for i = 1, N do
+        s = ffi.string(S.dt_strftime("%Y-%m", 2, stamps[i % 1024 + 1], "start of month"))
+    end
+    return s
+end)
+
+bench("module bucket + formatter", function()
+    local ts, s = {}, nil
+    local fmt = datetime.formatter("%Y-%m")
+    for i = 1, 1024 do
+        ts[i] = datetime.new(stamps[i])
+    end
+    for i = 1, N do
+        s = fmt(ts[i % 1024 + 1]:bucket(1, "month"))
+    end
+    return s
+end)
+
+bench("ffi compare via unixepoch", function()
+    local c = 0
+    for i = 1, N do
+        if S.dt_unixepoch(1, stamps[i % 1024 + 1]) < S.dt_unixepoch(1, stamps[(i + 1) % 1024 + 1]) then
+            c = c + 1
+        end
+    end
+    return c
+end)
+
+bench("module compare", function()
+    local ts, c = {}, 0
+    for i = 1, 1024 do
+        ts[i] = datetime.new(stamps[i])
+    end
+    for i = 1, N do
+        if ts[i % 1024 + 1] < ts[(i + 1) % 1024 + 1] then
+            c = c + 1
+        end
+    end
+    return c
+end)
@@ -0,0 +1,131 @@
+#include "datetime.h"
+#include "dtclock.h"
+#include "testthread.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * 多线程扩展性: 每个线程循环解析 + 格式化, 线程数从 1 到 CPU 数,
+ * 输出总吞吐和相对单线程的线性扩展效率.
+ */
+
+#define NSAMPLE 1024
+#ifndef NLOOP
+#define NLOOP 200000
+#endif
+
+typedef struct worker worker;
+struct worker
+{
+    int id;
+    int mode;
+    int64_t ns;
+    size_t sink;
+    thread_t th;
+};
+
+enum
+{
+    MODE_R = 0,   /* dt_datetime_r: 文本解析 + 修饰符 + 本地时区 + 输出 */
+    MODE_VARARGS, /* dt_datetime: 线程局部结果缓冲区 */
+    MODE_COMPILED /* dt_scan_parse + dt_fmt_format */
+};
+
+static const char *ModeNames[] = {"dt_datetime_r", "dt_datetime", "dt_scan+dt_fmt"};
+static char Stamps[NSAMPLE][24];
+static dt_scan *Scan;
+static dt_fmt *Fmt;
+
+static void run(worker *w)
+{
+    char buf[64];
+    const char *argv[3];
+    DateTime x;
+    size_t sink = 0;
+    int i, k = w->id * 97;
+    int64_t t0 = dt_now_precise_ns();
+    argv[1] = "+1 hour";
+    argv[2] = "localtime";
+    for (i = 0; i < NLOOP; i++)
+    {
+        const char *z = Stamps[(k + i) & (NSAMPLE - 1)];
+        switch (w->mode)
+        {
+        case MODE_R:
+            argv[0] = z;
+            sink += dt_datetime_r(buf, sizeof(buf), 3, argv);
+            break;
+        case MODE_VARARGS:
+            sink += strlen(dt_datetime(2, z, "+1 hour"));
+            break;
+        default:
+            dt_scan_parse(Scan, z, &x);
+            sink += dt_fmt_format(Fmt, &x, buf, sizeof(buf));
+            break;
+        }
+    }
+    w->ns = dt_now_precise_ns() - t0;
+    w->sink = sink;
+}
+
+THREAD_MAIN(threadMain)
+{
+    run((worker *)arg);
+    return 0;
+}
+
+/* 返回总吞吐, 单位 ops/s */
+static double measure(int mode, int nthread)
+{
+    worker *w = (worker *)calloc(nthread, sizeof(worker));
+    int64_t t0, t1;
+    int i;
+    t0 = dt_now_precise_ns();
+    for (i = 0; i < nthread; i++)
+    {
+        w[i].id = i;
+        w[i].mode = mode;
+        START(w[i].th, threadMain, &w[i]);
+    }
+    for (i = 0; i < nthread; i++)
+    {
+        JOIN(w[i].th);
+    }
+    t1 = dt_now_precise_ns();
+    free(w);
+    return (double)nthread * NLOOP * 1e9 / (double)(t1 - t0);
+}
+
+int main(int argc, char **argv)
+{
+    int mode, n, ncpu = argc > 1 ? atoi(argv[1]) : cpu_count();
+    int i;
+    if (ncpu < 1)
+        ncpu = 1;
+    for (i = 0; i < NSAMPLE; i++)
+    {
+        char mod[32];
+        snprintf(mod, sizeof(mod), "+%d seconds", i * 7919);
+        snprintf(Stamps[i], sizeof(Stamps[i]), "%s", dt_datetime(2, "2024-01-01 00:00:00", mod));
+    }
+    Scan = dt_scan_compile("%Y-%m-%d %H:%M:%S");
+    Fmt = dt_fmt_compile("%Y-%m-%dT%H:%M:%SZ");
+    printf("%-16s %8s %14s %10s\n", "api", "threads", "ops/s", "scaling");
+    for (mode = MODE_R; mode <= MODE_COMPILED; mode++)
+    {
+        double base = 0;
+        for (n = 1;; n = n * 2 < ncpu ? n * 2 : ncpu)
+        {
+            double ops = measure(mode, n);
+            if (n == 1)
+                base = ops;
+            printf("%-16s %8d %14.0f %9.1f%%\n", ModeNames[mode], n, ops, 100.0 * ops / (base * n));
+            if (n == ncpu)
+                break;
+        }
+    }
+    dt_scan_free(Scan);
+    dt_fmt_free(Fmt);
+    return 0;
+}
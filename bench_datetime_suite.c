@@ -0,0 +1,269 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include "datetime.h"
+#include "dtclock.h"
+
+/*
+ * 基准测试集: 解析, 各类修饰符, 时区, strftime, timediff.
+ * 每项报告 ns/op 和 allocs/op, --json 输出机器可读的结果用于回归比较.
+ *
+ *   bench-datetime-suite [--json] [--filter 子串] [--loop N]
+ */
+
+/*
+ * glibc 下替换 malloc 系列来统计分配次数, 其他平台或 sanitizer 下不统计.
+ */
+#if defined(__GLIBC__) && !defined(__SANITIZE_ADDRESS__) && !defined(__SANITIZE_THREAD__)
+#define HAVE_ALLOC_COUNT 1
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+extern void __libc_free(void *);
+
+static uint64_t AllocCount;
+
+void *malloc(size_t n)
+{
+    AllocCount++;
+    return __libc_malloc(n);
+}
+
+void *calloc(size_t n, size_t m)
+{
+    AllocCount++;
+    return __libc_calloc(n, m);
+}
+
+void *realloc(void *p, size_t n)
+{
+    AllocCount++;
+    return __libc_realloc(p, n);
+}
+
+void free(void *p)
+{
+    __libc_free(p);
+}
+#else
+#define HAVE_ALLOC_COUNT 0
+static uint64_t AllocCount;
+#endif
+
+#define NSAMPLE 4096
+#define NROUND 5
+
+enum
+{
+    IN_ISO = 0, /* 各种 ISO-8601 写法, 近几年居多 */
+    IN_UNIX,    /* unix 秒数, 配合 unixepoch/auto */
+    IN_JD,      /* 儒略日数 */
+    IN_NOW,
+    IN_PAIR,    /* timediff 的两个 ISO 时间 */
+    IN_COUNT
+};
+
+typedef struct bench_case bench_case;
+struct bench_case
+{
+    const char *group;
+    const char *name;
+    int input;
+    const char *zFmt;     /* 非 NULL 时用 dt_strftime_r */
+    const char *azMod[3]; /* 修饰符 */
+    int isVarargs;        /* 用 dt_strftime/dt_datetime 变参接口 */
+};
+
+static const bench_case Cases[] = {
+    {"parse", "iso", IN_ISO, NULL, {NULL}, 0},
+    {"parse", "julianday number", IN_JD, NULL, {NULL}, 0},
+    {"parse", "unixepoch number", IN_UNIX, NULL, {"unixepoch"}, 0},
+    {"parse", "auto number", IN_UNIX, NULL, {"auto"}, 0},
+    {"parse", "now", IN_NOW, NULL, {NULL}, 0},
+    {"parse", "iso varargs", IN_ISO, NULL, {NULL}, 1},
+
+    {"modifier", "+N days", IN_ISO, NULL, {"+7 days"}, 0},
+    {"modifier", "-N months", IN_ISO, NULL, {"-3 months"}, 0},
+    {"modifier", "+N years", IN_ISO, NULL, {"+1 years"}, 0},
+    {"modifier", "+N minutes", IN_ISO, NULL, {"+90 minutes"}, 0},
+    {"modifier", "+N.N seconds", IN_ISO, NULL, {"+1.5 seconds"}, 0},
+    {"modifier", "+HH:MM", IN_ISO, NULL, {"+05:30"}, 0},
+    {"modifier", "+YYYY-MM-DD HH:MM", IN_ISO, NULL, {"+0001-02-03 04:05"}, 0},
+    {"modifier", "start of day", IN_ISO, NULL, {"start of day"}, 0},
+    {"modifier", "start of month", IN_ISO, NULL, {"start of month"}, 0},
+    {"modifier", "start of year", IN_ISO, NULL, {"start of year"}, 0},
+    {"modifier", "weekday N", IN_ISO, NULL, {"weekday 1"}, 0},
+    {"modifier", "+1 month floor", IN_ISO, NULL, {"+1 month", "floor"}, 0},
+    {"modifier", "+1 month ceiling", IN_ISO, NULL, {"+1 month", "ceiling"}, 0},
+    {"modifier", "subsec", IN_ISO, NULL, {"subsec"}, 0},
+    {"modifier", "chain of three", IN_ISO, NULL, {"start of month", "+1 month", "-1 day"}, 0},
+
+    {"zone", "localtime", IN_ISO, NULL, {"localtime"}, 0},
+    {"zone", "utc", IN_ISO, NULL, {"utc"}, 0},
+    {"zone", "localtime utc", IN_ISO, NULL, {"localtime", "utc"}, 0},
+    {"zone", "tz:America/New_York", IN_ISO, NULL, {"tz:America/New_York"}, 0},
+    {"zone", "tz:Asia/Shanghai", IN_ISO, NULL, {"tz:Asia/Shanghai"}, 0},
+    {"zone", "unixepoch localtime", IN_UNIX, NULL, {"unixepoch", "localtime"}, 0},
+
+    {"strftime", "%Y-%m-%d %H:%M:%S", IN_ISO, "%Y-%m-%d %H:%M:%S", {NULL}, 0},
+    {"strftime", "%Y-%m-%dT%H:%M:%fZ", IN_ISO, "%Y-%m-%dT%H:%M:%fZ", {NULL}, 0},
+    {"strftime", "%s", IN_ISO, "%s", {NULL}, 0},
+    {"strftime", "%j %U %W %V %G %u", IN_ISO, "%j %U %W %V %G %u", {NULL}, 0},
+    {"strftime", "%d/%m/%Y %I:%M %p", IN_ISO, "%d/%m/%Y %I:%M %p", {NULL}, 0},
+    {"strftime", "%J", IN_ISO, "%J", {NULL}, 0},
+    {"strftime", "%9f unixepoch", IN_UNIX, "%Y-%m-%d %H:%M:%9f", {"unixepoch"}, 0},
+    {"strftime", "%F %T varargs", IN_ISO, "%F %T", {NULL}, 1},
+
+    {"timediff", "iso pair", IN_PAIR, NULL, {NULL}, 0},
+};
+
+static char Inputs[IN_COUNT][NSAMPLE][40];
+static volatile size_t Sink;
+
+static uint64_t Rng = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t rng(void)
+{
+    Rng ^= Rng << 13;
+    Rng ^= Rng >> 7;
+    Rng ^= Rng << 17;
+    return Rng;
+}
+
+/*
+ * 生成输入: 80% 在最近 5 年, 其余分布在 1970..2037,
+ * ISO 文本混合日期, 分钟, 秒, 毫秒, 'T' 分隔, Z 和 +hh:mm 后缀.
+ */
+static void makeInputs(void)
+{
+    static const char *aIso[] = {
+        "%Y-%m-%d", "%Y-%m-%d %H:%M", "%Y-%m-%d %H:%M:%S", "%Y-%m-%d %H:%M:%S",
+        "%Y-%m-%dT%H:%M:%f", "%Y-%m-%dT%H:%M:%SZ", "%Y-%m-%d %H:%M:%S+08:00", "%Y-%m-%d %H:%M:%f",
+    };
+    for (int i = 0; i < NSAMPLE; i++)
+    {
+        int64_t sec;
+        char zSec[24];
+        if (rng() % 5)
+            sec = 1600000000 + (int64_t)(rng() % (5 * 365 * 86400));
+        else
+            sec = (int64_t)(rng() % ((int64_t)2145916800));
+        snprintf(zSec, sizeof(zSec), "%lld.%03d", (long long)sec, (int)(rng() % 1000));
+        snprintf(Inputs[IN_ISO][i], 40, "%s", dt_strftime(aIso[rng() % 8], 2, zSec, "unixepoch"));
+        snprintf(Inputs[IN_UNIX][i], 40, "%lld", (long long)sec);
+        snprintf(Inputs[IN_JD][i], 40, "%.6f", dt_julianday(2, zSec, "unixepoch"));
+        strcpy(Inputs[IN_NOW][i], "now");
+    }
+    for (int i = 0; i < NSAMPLE; i++)
+        strcpy(Inputs[IN_PAIR][i], Inputs[IN_ISO][(i * 7 + 3) % NSAMPLE]);
+}
+
+static void runCase(const bench_case *c, int nLoop)
+{
+    char buf[128];
+    const char *argv[4];
+    int argc = 1;
+    while (argc < 4 && c->azMod[argc - 1])
+    {
+        argv[argc] = c->azMod[argc - 1];
+        argc++;
+    }
+    for (int i = 0; i < nLoop; i++)
+    {
+        const char *z = Inputs[c->input][i % NSAMPLE];
+        argv[0] = z;
+        if (c->input == IN_PAIR)
+        {
+            argv[0] = Inputs[IN_ISO][i % NSAMPLE];
+            argv[1] = z;
+            Sink += dt_timediff_r(buf, sizeof(buf), 2, argv);
+        }
+        else if (c->isVarargs)
+        {
+            const char *r;
+            if (c->zFmt)
+                r = dt_strftime(c->zFmt, 1, z);
+            else
+                r = dt_datetime(1, z);
+            Sink += r ? strlen(r) : 0;
+        }
+        else if (c->zFmt)
+            Sink += dt_strftime_r(buf, sizeof(buf), c->zFmt, argc, argv);
+        else
+            Sink += dt_datetime_r(buf, sizeof(buf), argc, argv);
+    }
+}
+
+static int cmpDouble(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+int main(int argc, char **argv)
+{
+    int isJson = 0, nLoop = 200000, nCase = (int)(sizeof(Cases) / sizeof(Cases[0]));
+    const char *zFilter = NULL;
+    int isFirst = 1;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--json") == 0)
+            isJson = 1;
+        else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc)
+            zFilter = argv[++i];
+        else if (strcmp(argv[i], "--loop") == 0 && i + 1 < argc)
+            nLoop = atoi(argv[++i]);
+        else
+        {
+            fprintf(stderr, "usage: %s [--json] [--filter text] [--loop N]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (nLoop < NSAMPLE)
+        nLoop = NSAMPLE;
+    makeInputs();
+    if (isJson)
+        printf("{\"suite\":\"datetime\",\"loop\":%d,\"rounds\":%d,\"alloc_count\":%s,\"results\":[",
+               nLoop, NROUND, HAVE_ALLOC_COUNT ? "true" : "false");
+    else
+        printf("%-10s %-26s %12s %12s\n", "group", "case", "ns/op", "allocs/op");
+    for (int k = 0; k < nCase; k++)
+    {
+        const bench_case *c = &Cases[k];
+        double aNs[NROUND], allocs;
+        uint64_t a0;
+        char zName[64];
+        snprintf(zName, sizeof(zName), "%s/%s", c->group, c->name);
+        if (zFilter && strstr(zName, zFilter) == NULL)
+            continue;
+        /* 预热: 加载时区, 编译并缓存格式, 扩展线程局部缓冲区 */
+        runCase(c, NSAMPLE);
+        a0 = AllocCount;
+        for (int r = 0; r < NROUND; r++)
+        {
+            int64_t t0 = dt_now_precise_ns();
+            runCase(c, nLoop);
+            aNs[r] = (double)(dt_now_precise_ns() - t0) / nLoop;
+        }
+        allocs = (double)(AllocCount - a0) / ((double)nLoop * NROUND);
+        qsort(aNs, NROUND, sizeof(double), cmpDouble);
+        if (isJson)
+        {
+            printf("%s\n{\"group\":\"%s\",\"case\":\"%s\",\"ns_per_op\":%.2f,\"ns_min\":%.2f,\"allocs_per_op\":",
+                   isFirst ? "" : ",", c->group, c->name, aNs[NROUND / 2], aNs[0]);
+            if (HAVE_ALLOC_COUNT)
+                printf("%.4f}", allocs);
+            else
+                printf("null}");
+            isFirst = 0;
+        }
+        else if (HAVE_ALLOC_COUNT)
+            printf("%-10s %-26s %12.1f %12.4f\n", c->group, c->name, aNs[NROUND / 2], allocs);
+        else
+            printf("%-10s %-26s %12.1f %12s\n", c->group, c->name, aNs[NROUND / 2], "-");
+    }
+    if (isJson)
+        printf("\n]}\n");
+    return 0;
+}
@@ -0,0 +1,202 @@
+#include "llist.h"
+#include "list.h"
+#include "spinlock.h"
+#include "atomic.h"
+#include "dtclock.h"
+#include "testthread.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+/*
+ * 多个生产者往一个消费者交付预先分配好的节点, 比较:
+ *   spin+list     每个节点加一次 spinlock 再 list_add_tail,
+ *                 消费者加锁后 list_splice_init 整条取走
+ *   llist         每个节点一次 llist_add,
+ *                 消费者 llist_del_all 一次交换取走, 再 llist_reverse_order
+ *   llist batch   生产者先在本地串好 BATCH 个节点, 一次 llist_add_batch
+ * 消费者检查每个生产者的节点按顺序到达且一个不少. 输出每秒交付的节点数.
+ *
+ *   bench-llist [最大生产者数, 默认 16] [每个生产者的节点数, 默认 500000]
+ */
+
+#define BATCH 32
+
+enum
+{
+    M_SPIN = 0,
+    M_LLIST,
+    M_LLIST_BATCH,
+    M_COUNT
+};
+
+static const char *ModeNames[] = {"spin+list", "llist", "llist batch"};
+
+typedef struct item item;
+struct item
+{
+    struct llist_node ll;
+    struct list_head lh;
+    int producer;
+    int64_t seq;
+};
+
+typedef struct producer producer;
+struct producer
+{
+    int id;
+    int mode;
+    int64_t nitem;
+    item *items;
+};
+
+static struct spinlock Lock;
+static struct list_head Queue;
+static struct llist_head LQueue;
+static atomic_int Ready;
+static atomic_int Go;
+
+THREAD_MAIN(producerMain)
+{
+    producer *p = (producer *)arg;
+    int64_t i;
+    atomic_int_inc(&Ready);
+    while (!atomic_int_load(&Go))
+        YIELD();
+    for (i = 0; i < p->nitem; i++)
+    {
+        item *it = &p->items[i];
+        it->producer = p->id;
+        it->seq = i;
+        if (p->mode == M_SPIN)
+        {
+            spinlock_acquire(&Lock);
+            list_add_tail(&it->lh, &Queue);
+            spinlock_release(&Lock);
+        }
+        else if (p->mode == M_LLIST)
+        {
+            llist_add(&it->ll, &LQueue);
+        }
+        else if (i % BATCH == BATCH - 1 || i == p->nitem - 1)
+        {
+            /* items[first..i] 按加入顺序的逆序串起来, 和逐个 llist_add 的结果一样 */
+            int64_t first = i - i % BATCH, j;
+            for (j = first + 1; j <= i; j++)
+                p->items[j].ll.next = &p->items[j - 1].ll;
+            llist_add_batch(&p->items[i].ll, &p->items[first].ll, &LQueue);
+        }
+    }
+    return 0;
+}
+
+/* 返回取到的节点数, 顺序不对时返回 -1 */
+static int64_t consume(int mode, int64_t *next)
+{
+    int64_t n = 0;
+    item *it;
+    if (mode == M_SPIN)
+    {
+        struct list_head local;
+        INIT_LIST_HEAD(&local);
+        spinlock_acquire(&Lock);
+        list_splice_init(&Queue, &local);
+        spinlock_release(&Lock);
+        list_for_each_entry(it, item, &local, lh)
+        {
+            if (it->seq != next[it->producer]++)
+                return -1;
+            n++;
+        }
+    }
+    else
+    {
+        struct llist_node *first = llist_del_all(&LQueue);
+        llist_for_each_entry(it, item, llist_reverse_order(first), ll)
+        {
+            if (it->seq != next[it->producer]++)
+                return -1;
+            n++;
+        }
+    }
+    return n;
+}
+
+static int measure(int mode, int nproducer, int64_t nitem)
+{
+    producer *p = (producer *)calloc(nproducer, sizeof(producer));
+    int64_t *next = (int64_t *)calloc(nproducer, sizeof(int64_t));
+    thread_t *th = (thread_t *)calloc(nproducer, sizeof(thread_t));
+    int64_t total = nproducer * nitem, got = 0, rounds = 0, t0, t1;
+    int i, rc = 0;
+    INIT_LIST_HEAD(&Queue);
+    init_llist_head(&LQueue);
+    atomic_int_store(&Ready, 0);
+    atomic_int_store(&Go, 0);
+    for (i = 0; i < nproducer; i++)
+    {
+        p[i].id = i;
+        p[i].mode = mode;
+        p[i].nitem = nitem;
+        p[i].items = (item *)calloc(nitem, sizeof(item));
+        START(th[i], producerMain, &p[i]);
+    }
+    while (atomic_int_load(&Ready) < nproducer)
+        YIELD();
+    t0 = dt_now_precise_ns();
+    atomic_int_store(&Go, 1);
+    while (got < total)
+    {
+        int64_t n = consume(mode, next);
+        if (n < 0)
+        {
+            rc = 1;
+            break;
+        }
+        if (n == 0)
+            YIELD();
+        got += n;
+        rounds += n > 0;
+    }
+    for (i = 0; i < nproducer; i++)
+    {
+        JOIN(th[i]);
+    }
+    t1 = dt_now_precise_ns();
+    if (rc)
+        fprintf(stderr, "%s: items out of order\n", ModeNames[mode]);
+    else if (got != total || !list_empty(&Queue) || !llist_empty(&LQueue))
+    {
+        fprintf(stderr, "%s: got %lld of %lld items\n", ModeNames[mode], (long long)got, (long long)total);
+        rc = 1;
+    }
+    else
+        printf("%-12s %10d %14.0f %10.1f %10.1f\n", ModeNames[mode], nproducer, total * 1e9 / (t1 - t0),
+               (double)(t1 - t0) / total, (double)total / (rounds ? rounds : 1));
+    for (i = 0; i < nproducer; i++)
+        free(p[i].items);
+    free(th);
+    free(next);
+    free(p);
+    return rc;
+}
+
+int main(int argc, char **argv)
+{
+    int nmax = argc > 1 ? atoi(argv[1]) : 16;
+    int64_t nitem = argc > 2 ? atoll(argv[2]) : 500000;
+    spinlock_init(&Lock);
+    printf("# %d cpus, %lld items per producer\n", cpu_count(), (long long)nitem);
+    printf("%-12s %10s %14s %10s %10s\n", "queue", "producers", "items/s", "ns/item", "per grab");
+    for (int n = 1; n <= nmax; n *= 2)
+    {
+        for (int mode = 0; mode < M_COUNT; mode++)
+        {
+            if (measure(mode, n, nitem))
+                return 1;
+        }
+    }
+    spinlock_destroy(&Lock);
+    return 0;
+}
@@ -0,0 +1,276 @@
+#include "mpmcq.h"
+#include "list.h"
+#include "dtclock.h"
+#include "testthread.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+/*
+ * P 个生产者, C 个消费者经队列传递消息, 比较:
+ *   mpmcq        mpmcq_push_wait / mpmcq_pop_wait
+ *   mpmcq batch  每次最多 BATCH 个的批量接口
+ *   mutex+list   互斥锁 + 两个条件变量 + list_head, 容量相同
+ * 消息带入队时间, 消费者记下出队时的延迟, 输出吞吐和延迟分位数.
+ *
+ *   bench-mpmcq [最大线程数(每边), 默认 CPU 数] [消息数, 默认 1000000] [容量, 默认 1024]
+ */
+
+#define BATCH 16
+
+typedef struct msg msg;
+struct msg
+{
+    struct list_head node;
+    int64_t t;
+    int64_t lat;
+};
+
+enum
+{
+    M_MPMCQ = 0,
+    M_MPMCQ_BATCH,
+    M_LOCKED,
+    M_COUNT
+};
+
+static const char *ModeNames[] = {"mpmcq", "mpmcq batch", "mutex+list"};
+
+/* 有界的加锁链表队列 */
+typedef struct lockq lockq;
+struct lockq
+{
+#ifdef _WIN32
+    SRWLOCK lock;
+    CONDITION_VARIABLE notEmpty, notFull;
+#else
+    pthread_mutex_t lock;
+    pthread_cond_t notEmpty, notFull;
+#endif
+    struct list_head items;
+    size_t size, capacity;
+};
+
+static void lockqInit(lockq *q, size_t capacity)
+{
+#ifdef _WIN32
+    InitializeSRWLock(&q->lock);
+    InitializeConditionVariable(&q->notEmpty);
+    InitializeConditionVariable(&q->notFull);
+#else
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->notEmpty, NULL);
+    pthread_cond_init(&q->notFull, NULL);
+#endif
+    INIT_LIST_HEAD(&q->items);
+    q->size = 0;
+    q->capacity = capacity;
+}
+
+static void lockqDestroy(lockq *q)
+{
+#ifndef _WIN32
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->notEmpty);
+    pthread_cond_destroy(&q->notFull);
+#endif
+}
+
+static void lockqPush(lockq *q, msg *m)
+{
+#ifdef _WIN32
+    AcquireSRWLockExclusive(&q->lock);
+    while (q->size >= q->capacity)
+        SleepConditionVariableSRW(&q->notFull, &q->lock, INFINITE, 0);
+    list_add_tail(&m->node, &q->items);
+    q->size++;
+    ReleaseSRWLockExclusive(&q->lock);
+    WakeConditionVariable(&q->notEmpty);
+#else
+    pthread_mutex_lock(&q->lock);
+    while (q->size >= q->capacity)
+        pthread_cond_wait(&q->notFull, &q->lock);
+    list_add_tail(&m->node, &q->items);
+    q->size++;
+    pthread_mutex_unlock(&q->lock);
+    pthread_cond_signal(&q->notEmpty);
+#endif
+}
+
+static msg *lockqPop(lockq *q)
+{
+    msg *m;
+#ifdef _WIN32
+    AcquireSRWLockExclusive(&q->lock);
+    while (q->size == 0)
+        SleepConditionVariableSRW(&q->notEmpty, &q->lock, INFINITE, 0);
+#else
+    pthread_mutex_lock(&q->lock);
+    while (q->size == 0)
+        pthread_cond_wait(&q->notEmpty, &q->lock);
+#endif
+    m = list_entry(q->items.next, msg, node);
+    list_del(&m->node);
+    q->size--;
+#ifdef _WIN32
+    ReleaseSRWLockExclusive(&q->lock);
+    WakeConditionVariable(&q->notFull);
+#else
+    pthread_mutex_unlock(&q->lock);
+    pthread_cond_signal(&q->notFull);
+#endif
+    return m;
+}
+
+typedef struct worker worker;
+struct worker
+{
+    int mode;
+    msg *msgs;
+    int64_t count;
+    struct mpmcq *mq;
+    lockq *lq;
+};
+
+THREAD_MAIN(producerMain)
+{
+    worker *w = (worker *)arg;
+    void *batch[BATCH];
+    int64_t i = 0;
+    while (i < w->count)
+    {
+        int n = 0;
+        switch (w->mode)
+        {
+        case M_MPMCQ:
+            w->msgs[i].t = dt_now_precise_ns();
+            mpmcq_push_wait(w->mq, &w->msgs[i++]);
+            break;
+        case M_MPMCQ_BATCH:
+            while (n < BATCH && i < w->count)
+            {
+                w->msgs[i].t = dt_now_precise_ns();
+                batch[n++] = &w->msgs[i++];
+            }
+            mpmcq_push_batch_wait(w->mq, batch, n);
+            break;
+        default:
+            w->msgs[i].t = dt_now_precise_ns();
+            lockqPush(w->lq, &w->msgs[i++]);
+            break;
+        }
+    }
+    return 0;
+}
+
+THREAD_MAIN(consumerMain)
+{
+    worker *w = (worker *)arg;
+    void *batch[BATCH];
+    for (;;)
+    {
+        int n;
+        if (w->mode == M_MPMCQ)
+            n = (batch[0] = mpmcq_pop_wait(w->mq), 1);
+        else if (w->mode == M_MPMCQ_BATCH)
+            n = mpmcq_pop_batch_wait(w->mq, batch, BATCH);
+        else
+            n = (batch[0] = lockqPop(w->lq), 1);
+        int64_t now = dt_now_precise_ns();
+        for (int i = 0; i < n; i++)
+        {
+            msg *m = (msg *)batch[i];
+            if (m->t < 0)
+            {
+                /* 批量取到的其余退出消息留给别的消费者 */
+                while (++i < n)
+                    mpmcq_push_wait(w->mq, batch[i]);
+                return 0;
+            }
+            m->lat = now - m->t;
+        }
+    }
+}
+
+static int cmpInt64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void run(int mode, int np, int nc, int64_t nmsg, size_t capacity)
+{
+    msg *msgs = (msg *)calloc(nmsg + nc, sizeof(msg));
+    int64_t *lat = (int64_t *)malloc(nmsg * sizeof(int64_t));
+    worker *w = (worker *)calloc(np + nc, sizeof(worker));
+    thread_t *th = (thread_t *)calloc(np + nc, sizeof(thread_t));
+    struct mpmcq mq;
+    lockq lq;
+    int64_t t0, t1, off = 0;
+    int i;
+    mpmcq_init(&mq, capacity);
+    lockqInit(&lq, capacity);
+    t0 = dt_now_precise_ns();
+    for (i = 0; i < np + nc; i++)
+    {
+        w[i].mode = mode;
+        w[i].mq = &mq;
+        w[i].lq = &lq;
+        if (i < np)
+        {
+            w[i].count = nmsg / np + (i < nmsg % np);
+            w[i].msgs = msgs + off;
+            off += w[i].count;
+        }
+        START(th[i], i < np ? producerMain : consumerMain, &w[i]);
+    }
+    for (i = 0; i < np + nc; i++)
+    {
+        if (i == np)
+        {
+            /* 生产者都结束后给每个消费者一个退出消息 (t 为 -1), 它们排在所有消息之后 */
+            for (int k = 0; k < nc; k++)
+            {
+                msg *stop = &msgs[nmsg + k];
+                stop->t = -1;
+                if (mode == M_LOCKED)
+                    lockqPush(&lq, stop);
+                else
+                    mpmcq_push_wait(&mq, stop);
+            }
+        }
+        JOIN(th[i]);
+    }
+    t1 = dt_now_precise_ns();
+    for (int64_t k = 0; k < nmsg; k++)
+        lat[k] = msgs[k].lat;
+    qsort(lat, nmsg, sizeof(int64_t), cmpInt64);
+    printf("%-12s %3d %3d %12.0f %10lld %10lld %10lld\n", ModeNames[mode], np, nc, nmsg * 1e9 / (t1 - t0),
+           (long long)lat[nmsg / 2], (long long)lat[nmsg * 99 / 100], (long long)lat[nmsg * 999 / 1000]);
+    mpmcq_destroy(&mq);
+    lockqDestroy(&lq);
+    free(th);
+    free(w);
+    free(lat);
+    free(msgs);
+}
+
+int main(int argc, char **argv)
+{
+    int nmax = argc > 1 ? atoi(argv[1]) : cpu_count();
+    int64_t nmsg = argc > 2 ? atoll(argv[2]) : 1000000;
+    size_t capacity = argc > 3 ? (size_t)atoll(argv[3]) : 1024;
+    printf("# %d cpus, %lld messages, capacity %zu\n", cpu_count(), (long long)nmsg, capacity);
+    printf("%-12s %3s %3s %12s %10s %10s %10s\n", "queue", "P", "C", "msgs/s", "p50 ns", "p99 ns", "p99.9 ns");
+    for (int mode = 0; mode < M_COUNT; mode++)
+    {
+        for (int n = 1;; n = n * 2 < nmax ? n * 2 : nmax)
+        {
+            run(mode, n, n, nmsg, capacity);
+            if (n >= nmax)
+                break;
+        }
+    }
+    return 0;
+}
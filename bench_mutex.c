@@ -0,0 +1,256 @@
+#include "mutex.h"
+#include "atomic.h"
+#include "dtclock.h"
+#include "testthread.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+/*
+ * mutex.h 和操作系统的锁 (pthread_mutex / pthread_cond, Windows 上是 SRWLOCK / CONDITION_VARIABLE) 比较:
+ *   uncontended   单线程反复加锁解锁, 每次的耗时
+ *   contended     N 个线程抢一个锁, 临界区很短, 总吞吐和每次加锁的平均耗时
+ *   ping-pong     两个线程用锁和条件变量轮流传递一个令牌, 每次往返的耗时
+ *
+ *   bench-mutex [最大线程数, 默认 CPU 数的两倍] [每轮毫秒数, 默认 200]
+ */
+
+#define UNCONTENDED 10000000
+#define ROUNDTRIPS 100000
+#define OUTSIDE 64
+
+enum
+{
+    K_FUTEX = 0,
+    K_OS,
+    K_COUNT
+};
+
+static const char *KindNames[] = {"futex", "os"};
+
+typedef struct oslock oslock;
+struct oslock
+{
+#ifdef _WIN32
+    SRWLOCK lock;
+    CONDITION_VARIABLE cond;
+#else
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+#endif
+};
+
+typedef struct worker worker;
+struct worker
+{
+    int kind;
+    uint64_t ops;
+    uint64_t sink;
+    char pad[64];
+};
+
+static struct mutex Mutex;
+static struct cond Cond;
+static oslock Os;
+static uint64_t Shared;
+static int Token;
+static atomic_int Stop;
+static atomic_int Ready;
+
+static void lockAcquire(int kind)
+{
+    if (kind == K_FUTEX)
+        mutex_acquire(&Mutex);
+    else
+#ifdef _WIN32
+        AcquireSRWLockExclusive(&Os.lock);
+#else
+        pthread_mutex_lock(&Os.lock);
+#endif
+}
+
+static void lockRelease(int kind)
+{
+    if (kind == K_FUTEX)
+        mutex_release(&Mutex);
+    else
+#ifdef _WIN32
+        ReleaseSRWLockExclusive(&Os.lock);
+#else
+        pthread_mutex_unlock(&Os.lock);
+#endif
+}
+
+static void condWait(int kind)
+{
+    if (kind == K_FUTEX)
+        cond_wait(&Cond, &Mutex);
+    else
+#ifdef _WIN32
+        SleepConditionVariableSRW(&Os.cond, &Os.lock, INFINITE, 0);
+#else
+        pthread_cond_wait(&Os.cond, &Os.lock);
+#endif
+}
+
+static void condSignal(int kind)
+{
+    if (kind == K_FUTEX)
+        cond_signal(&Cond);
+    else
+#ifdef _WIN32
+        WakeConditionVariable(&Os.cond);
+#else
+        pthread_cond_signal(&Os.cond);
+#endif
+}
+
+static void uncontended(int kind)
+{
+    int64_t t0 = dt_now_precise_ns(), t1;
+    for (int i = 0; i < UNCONTENDED; i++)
+    {
+        lockAcquire(kind);
+        Shared++;
+        lockRelease(kind);
+    }
+    t1 = dt_now_precise_ns();
+    printf("%-12s %-6s %8d %14.0f %10.2f\n", "uncontended", KindNames[kind], 1, UNCONTENDED * 1e9 / (t1 - t0),
+           (double)(t1 - t0) / UNCONTENDED);
+}
+
+THREAD_MAIN(contendedMain)
+{
+    worker *w = (worker *)arg;
+    uint64_t ops = 0, x = (uintptr_t)arg;
+    atomic_int_inc(&Ready);
+    while (!atomic_int_load_explicit(&Stop, memory_order_relaxed))
+    {
+        lockAcquire(w->kind);
+        Shared++;
+        lockRelease(w->kind);
+        for (int i = 0; i < OUTSIDE; i++)
+            x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+        ops++;
+    }
+    w->sink = x;
+    w->ops = ops;
+    return 0;
+}
+
+static int contended(int kind, int nthread, int ms)
+{
+    worker *w = (worker *)calloc(nthread, sizeof(worker));
+    thread_t *th = (thread_t *)calloc(nthread, sizeof(thread_t));
+    uint64_t total = 0;
+    int64_t t0, t1;
+    int i;
+    Shared = 0;
+    atomic_int_store(&Stop, 0);
+    atomic_int_store(&Ready, 0);
+    for (i = 0; i < nthread; i++)
+    {
+        w[i].kind = kind;
+        START(th[i], contendedMain, &w[i]);
+    }
+    while (atomic_int_load(&Ready) < nthread)
+        SLEEP_MS(1);
+    t0 = dt_now_precise_ns();
+    SLEEP_MS(ms);
+    atomic_int_store(&Stop, 1);
+    for (i = 0; i < nthread; i++)
+    {
+        JOIN(th[i]);
+        total += w[i].ops;
+    }
+    t1 = dt_now_precise_ns();
+    printf("%-12s %-6s %8d %14.0f %10.2f\n", "contended", KindNames[kind], nthread, total * 1e9 / (t1 - t0),
+           (double)(t1 - t0) / (total ? total : 1));
+    free(th);
+    free(w);
+    if (Shared != total)
+    {
+        fprintf(stderr, "%s: lost updates, %llu != %llu\n", KindNames[kind], (unsigned long long)Shared,
+                (unsigned long long)total);
+        return 1;
+    }
+    return 0;
+}
+
+/* Token 为 0 时轮到 ping, 为 1 时轮到 pong */
+static void pass(int kind, int me)
+{
+    lockAcquire(kind);
+    while (Token != me)
+        condWait(kind);
+    Token = !me;
+    lockRelease(kind);
+    condSignal(kind);
+}
+
+THREAD_MAIN(pongMain)
+{
+    int kind = (int)(intptr_t)arg;
+    for (int i = 0; kind >= 0 && i < ROUNDTRIPS; i++)
+        pass(kind, 1);
+    return 0;
+}
+
+/* kind < 0 时只起一个空线程, 不计时 */
+static void pingPong(int kind)
+{
+    thread_t th;
+    int64_t t0, t1;
+    Token = 0;
+    t0 = dt_now_precise_ns();
+    START(th, pongMain, kind);
+    for (int i = 0; kind >= 0 && i < ROUNDTRIPS; i++)
+        pass(kind, 0);
+    JOIN(th);
+    t1 = dt_now_precise_ns();
+    if (kind < 0)
+        return;
+    printf("%-12s %-6s %8d %14.0f %10.2f\n", "ping-pong", KindNames[kind], 2, ROUNDTRIPS * 1e9 / (t1 - t0),
+           (double)(t1 - t0) / ROUNDTRIPS);
+}
+
+int main(int argc, char **argv)
+{
+    int nmax = argc > 1 ? atoi(argv[1]) : 2 * cpu_count();
+    int ms = argc > 2 ? atoi(argv[2]) : 200;
+    int kind, n;
+    mutex_init(&Mutex);
+    cond_init(&Cond);
+#ifdef _WIN32
+    InitializeSRWLock(&Os.lock);
+    InitializeConditionVariable(&Os.cond);
+#else
+    pthread_mutex_init(&Os.lock, NULL);
+    pthread_cond_init(&Os.cond, NULL);
+#endif
+    printf("# %d cpus, struct mutex %d bytes, struct cond %d bytes\n", cpu_count(), (int)sizeof(struct mutex),
+           (int)sizeof(struct cond));
+    printf("%-12s %-6s %8s %14s %10s\n", "test", "lock", "threads", "ops/s", "ns/op");
+    /* glibc 在进程里只有一个线程时加锁不用原子操作, 先起一个线程再比较无竞争的耗时 */
+    pingPong(-1);
+    for (kind = 0; kind < K_COUNT; kind++)
+        uncontended(kind);
+    for (n = 1; n <= nmax; n *= 2)
+    {
+        for (kind = 0; kind < K_COUNT; kind++)
+        {
+            if (contended(kind, n, ms))
+                return 1;
+        }
+    }
+    for (kind = 0; kind < K_COUNT; kind++)
+        pingPong(kind);
+#ifndef _WIN32
+    pthread_mutex_destroy(&Os.lock);
+    pthread_cond_destroy(&Os.cond);
+#endif
+    cond_destroy(&Cond);
+    mutex_destroy(&Mutex);
+    return 0;
+}
@@ -0,0 +1,237 @@
+#include "rcu.h"
+#include "rwlock.h"
+#include "atomic.h"
+#include "dtclock.h"
+#include "testthread.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+/*
+ * 读多写少时读一次共享表的代价: N 个读者线程不停在表里查一个键, 一个写者大约每毫秒整体替换一次表,
+ * 输出读者的总吞吐和每次读的平均耗时:
+ *   rwlock  rwlock_acquire_read 保护, 写者在写锁里换指针, 释放写锁后直接释放旧表
+ *   rcu     普通线程 rcu_read_lock, 写者 rcu_assign_pointer 后 rcu_call 延迟释放
+ *   qsbr    读者 rcu_register_thread, 每读 64 次 rcu_quiescent_state
+ * 最后是单线程无竞争时一次读的耗时.
+ *
+ *   bench-rcu [最大读者线程数, 默认 CPU 数的两倍] [每轮毫秒数, 默认 200]
+ */
+
+#define TABLE_SIZE 256
+#define NREAD 1000000
+
+enum
+{
+    K_RWLOCK = 0,
+    K_RCU,
+    K_QSBR,
+    K_COUNT
+};
+
+static const char *KindNames[] = {"rwlock", "rcu", "qsbr"};
+
+typedef struct table table;
+struct table
+{
+    struct rcu_head rcu;
+    int64_t version;
+    int64_t value[TABLE_SIZE];
+};
+
+typedef struct worker worker;
+struct worker
+{
+    int kind;
+    uint64_t ops;
+    int64_t bad;
+    char pad[64];
+};
+
+static atomic_ptr Table;
+static struct rwlock Lock;
+static atomic_int Stop;
+static atomic_int Ready;
+static atomic_int64 Updates;
+
+static table *newTable(int64_t version)
+{
+    table *t = (table *)malloc(sizeof(table));
+    t->version = version;
+    for (int i = 0; i < TABLE_SIZE; i++)
+        t->value[i] = version + i;
+    return t;
+}
+
+static void freeTable(struct rcu_head *head)
+{
+    free(head);
+}
+
+/* 查一个键, 值和版本不一致时返回 1 */
+static int lookup(const table *t, int key)
+{
+    return t->value[key] != t->version + key;
+}
+
+static int readOnce(int kind, int key)
+{
+    int bad;
+    if (kind == K_RWLOCK)
+    {
+        rwlock_acquire_read(&Lock);
+        bad = lookup((const table *)atomic_ptr_load_explicit(&Table, memory_order_relaxed), key);
+        rwlock_release_read(&Lock);
+    }
+    else
+    {
+        rcu_read_lock();
+        bad = lookup((const table *)rcu_dereference(&Table), key);
+        rcu_read_unlock();
+    }
+    return bad;
+}
+
+THREAD_MAIN(readerMain)
+{
+    worker *w = (worker *)arg;
+    uint64_t ops = 0;
+    int64_t bad = 0;
+    if (w->kind == K_QSBR)
+        rcu_register_thread();
+    atomic_int_inc(&Ready);
+    while (!atomic_int_load_explicit(&Stop, memory_order_relaxed))
+    {
+        /* 每查一次停止标志读 64 次, QSBR 读者在两批之间报告静止状态 */
+        for (int i = 0; i < 64; i++)
+            bad += readOnce(w->kind, (int)((ops + i) % TABLE_SIZE));
+        if (w->kind == K_QSBR)
+            rcu_quiescent_state();
+        ops += 64;
+    }
+    if (w->kind == K_QSBR)
+        rcu_unregister_thread();
+    w->ops = ops;
+    w->bad = bad;
+    return 0;
+}
+
+THREAD_MAIN(writerMain)
+{
+    int kind = (int)(intptr_t)arg;
+    int64_t version = 0;
+    while (!atomic_int_load_explicit(&Stop, memory_order_relaxed))
+    {
+        table *t = newTable(++version), *old;
+        if (kind == K_RWLOCK)
+        {
+            rwlock_acquire_write(&Lock);
+            old = (table *)atomic_ptr_load_explicit(&Table, memory_order_relaxed);
+            atomic_ptr_store_explicit(&Table, t, memory_order_relaxed);
+            rwlock_release_write(&Lock);
+            free(old);
+        }
+        else
+        {
+            old = (table *)atomic_ptr_load(&Table);
+            rcu_assign_pointer(&Table, t);
+            rcu_call(&old->rcu, freeTable);
+        }
+        SLEEP_MS(1);
+    }
+    atomic_int64_store(&Updates, version);
+    return 0;
+}
+
+static int measure(int kind, int nthread, int ms)
+{
+    worker *w = (worker *)calloc(nthread, sizeof(worker));
+    thread_t *th = (thread_t *)calloc(nthread, sizeof(thread_t));
+    thread_t writer;
+    int64_t t0, t1, bad = 0;
+    uint64_t total = 0;
+    int i;
+    atomic_int_store(&Stop, 0);
+    atomic_int_store(&Ready, 0);
+    for (i = 0; i < nthread; i++)
+    {
+        w[i].kind = kind;
+        START(th[i], readerMain, &w[i]);
+    }
+    while (atomic_int_load(&Ready) < nthread)
+        SLEEP_MS(1);
+    START(writer, writerMain, kind);
+    t0 = dt_now_precise_ns();
+    SLEEP_MS(ms);
+    atomic_int_store(&Stop, 1);
+    for (i = 0; i < nthread; i++)
+    {
+        JOIN(th[i]);
+        total += w[i].ops;
+        bad += w[i].bad;
+    }
+    t1 = dt_now_precise_ns();
+    JOIN(writer);
+    printf("%-8s %8d %10lld %14.0f %10.2f\n", KindNames[kind], nthread, (long long)atomic_int64_load(&Updates),
+           total * 1e9 / (t1 - t0), (double)(t1 - t0) / (total ? total : 1));
+    free(th);
+    free(w);
+    if (bad)
+    {
+        fprintf(stderr, "%s: %lld inconsistent reads\n", KindNames[kind], (long long)bad);
+        return 1;
+    }
+    return 0;
+}
+
+static void readCost(void)
+{
+    int64_t t0, t1;
+    int sink = 0, i;
+    for (int kind = 0; kind < K_COUNT; kind++)
+    {
+        if (kind == K_QSBR)
+            rcu_register_thread();
+        t0 = dt_now_precise_ns();
+        for (i = 0; i < NREAD; i++)
+        {
+            sink += readOnce(kind, i % TABLE_SIZE);
+            if (kind == K_QSBR && i % 64 == 63)
+                rcu_quiescent_state();
+        }
+        t1 = dt_now_precise_ns();
+        if (kind == K_QSBR)
+            rcu_unregister_thread();
+        printf("%-20s %10.2f ns\n", KindNames[kind], (double)(t1 - t0) / NREAD);
+    }
+    if (sink == 42)
+        printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+    int nmax = argc > 1 ? atoi(argv[1]) : 2 * cpu_count();
+    int ms = argc > 2 ? atoi(argv[2]) : 200;
+    struct rcu_stats st;
+    rwlock_init(&Lock);
+    atomic_ptr_init(&Table, newTable(0));
+    printf("# %d cpus, table %d bytes, writer replaces the table every 1 ms\n", cpu_count(), (int)sizeof(table));
+    printf("%-8s %8s %10s %14s %10s\n", "kind", "readers", "updates", "reads/s", "ns/read");
+    for (int n = 1; n <= nmax; n *= 2)
+    {
+        for (int kind = 0; kind < K_COUNT; kind++)
+        {
+            if (measure(kind, n, ms))
+                return 1;
+        }
+    }
+    readCost();
+    rcu_barrier();
+    rcu_stats(&st);
+    printf("# rcu: %lld retired, %lld freed, %lld grace periods\n", (long long)st.retired, (long long)st.freed,
+           (long long)st.gp);
+    free(atomic_ptr_load(&Table));
+    rwlock_destroy(&Lock);
+    return 0;
+}
@@ -0,0 +1,156 @@
+#include "rwlock.h"
+#include "atomic.h"
+#include "dtclock.h"
+#include "testthread.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+/*
+ * 读多写少的路由表: 每个线程查表, 按千分比 WRITE 改表.
+ * 输出读写吞吐和读吞吐相对单线程的扩展倍数.
+ * 写者同时改一条记录的两个字段, 读者检查两者一致.
+ * 同一份源码编译成 bench-rwlock (默认实现) 和 bench-rwlock-os (RWLOCK_OS).
+ *
+ *   bench-rwlock [最大线程数, 默认 CPU 数] [写千分比, 默认 1] [每轮毫秒数, 默认 200]
+ */
+
+#ifdef RWLOCK_OS
+#define LOCK_NAME "os"
+#else
+#define LOCK_NAME "brlock"
+#endif
+
+#define NROUTE 256
+
+typedef struct route route;
+struct route
+{
+    uint32_t prefix;
+    uint32_t nexthop;
+};
+
+typedef struct worker worker;
+struct worker
+{
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t torn;
+    uint64_t sink;
+    char pad[64 - 4 * sizeof(uint64_t)];
+};
+
+static struct rwlock Lock;
+static route Table[NROUTE];
+static int WritePermille;
+static atomic_int Stop;
+static atomic_int Ready;
+
+THREAD_MAIN(threadMain)
+{
+    worker *w = (worker *)arg;
+    uint64_t x = (uintptr_t)arg | 1, sink = 0;
+    uint64_t reads = 0, writes = 0, torn = 0;
+    atomic_int_inc(&Ready);
+    while (!atomic_int_load_explicit(&Stop, memory_order_relaxed))
+    {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        if ((int)(x % 1000) < WritePermille)
+        {
+            route *r = &Table[(x >> 20) % NROUTE];
+            rwlock_acquire_write(&Lock);
+            r->prefix++;
+            r->nexthop++;
+            rwlock_release_write(&Lock);
+            writes++;
+        }
+        else
+        {
+            rwlock_acquire_read(&Lock);
+            for (int i = 0; i < 4; i++)
+            {
+                const route *r = &Table[(x >> (8 * i)) % NROUTE];
+                torn += r->prefix != r->nexthop;
+                sink += r->nexthop;
+            }
+            rwlock_release_read(&Lock);
+            reads++;
+        }
+    }
+    w->reads = reads;
+    w->writes = writes;
+    w->torn = torn;
+    w->sink = sink;
+    return 0;
+}
+
+/* 返回读吞吐, 发现读到一半的写返回负数 */
+static double measure(int nthread, int ms, double base)
+{
+    worker *w = (worker *)calloc(nthread, sizeof(worker));
+    thread_t *th = (thread_t *)calloc(nthread, sizeof(thread_t));
+    uint64_t reads = 0, writes = 0, torn = 0;
+    int64_t t0, t1;
+    double rps;
+    int i;
+    atomic_int_store(&Stop, 0);
+    atomic_int_store(&Ready, 0);
+    for (i = 0; i < nthread; i++)
+    {
+        START(th[i], threadMain, &w[i]);
+    }
+    while (atomic_int_load(&Ready) < nthread)
+        SLEEP_MS(1);
+    t0 = dt_now_precise_ns();
+    SLEEP_MS(ms);
+    atomic_int_store(&Stop, 1);
+    for (i = 0; i < nthread; i++)
+    {
+        JOIN(th[i]);
+    }
+    t1 = dt_now_precise_ns();
+    for (i = 0; i < nthread; i++)
+    {
+        reads += w[i].reads;
+        writes += w[i].writes;
+        torn += w[i].torn;
+    }
+    rps = reads * 1e9 / (t1 - t0);
+    printf("%-8s %8d %14.0f %12.0f %8.2fx\n", LOCK_NAME, nthread, rps, writes * 1e9 / (t1 - t0),
+           base > 0 ? rps / base : 1.0);
+    free(th);
+    free(w);
+    if (torn)
+    {
+        fprintf(stderr, "%s: %llu torn reads\n", LOCK_NAME, (unsigned long long)torn);
+        return -1;
+    }
+    return rps;
+}
+
+int main(int argc, char **argv)
+{
+    int nmax = argc > 1 ? atoi(argv[1]) : cpu_count();
+    int ms = argc > 3 ? atoi(argv[3]) : 200;
+    double base = 0;
+    WritePermille = argc > 2 ? atoi(argv[2]) : 1;
+    rwlock_init(&Lock);
+    printf("# %s, %d cpus, %.1f%% writes, struct rwlock %d bytes\n", LOCK_NAME, cpu_count(),
+           WritePermille / 10.0, (int)sizeof(struct rwlock));
+    printf("%-8s %8s %14s %12s %9s\n", "lock", "threads", "reads/s", "writes/s", "scaling");
+    for (int n = 1;; n = n * 2 < nmax ? n * 2 : nmax)
+    {
+        double rps = measure(n, ms, base);
+        if (rps < 0)
+            return 1;
+        if (n == 1)
+            base = rps;
+        if (n >= nmax)
+            break;
+    }
+    rwlock_destroy(&Lock);
+    return 0;
+}
@@ -0,0 +1,185 @@
+#include "seqlock.h"
+#include "rwlock.h"
+#include "spinlock.h"
+#include "dtclock.h"
+#include "testthread.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+/*
+ * 读几个字长的共享记录: seqlock, rwlock(默认实现), spinlock(默认实现)和不加锁的读.
+ * 另有一个写者每 WRITE_US 微秒更新一次. 输出各线程数下的总读吞吐.
+ *
+ *   bench-seqlock [最大线程数, 默认 CPU 数] [每轮毫秒数, 默认 200]
+ */
+
+#define WRITE_US 100
+
+typedef struct snapshot snapshot;
+struct snapshot
+{
+    uint64_t version;
+    int64_t offset;
+    uint64_t count;
+};
+
+SEQLOCK_DEFINE(seq_snapshot, snapshot)
+
+enum
+{
+    M_SEQLOCK = 0,
+    M_RWLOCK,
+    M_SPINLOCK,
+    M_PLAIN, /* 单个 relaxed 原子读, 作为上限参考 */
+    M_COUNT
+};
+
+static const char *ModeNames[] = {"seqlock", "rwlock", "spinlock", "atomic load"};
+
+typedef struct worker worker;
+struct worker
+{
+    int mode;
+    uint64_t reads;
+    uint64_t sink;
+    char pad[64 - 2 * sizeof(uint64_t) - sizeof(int)];
+};
+
+static struct seq_snapshot Seq;
+static struct rwlock Rw;
+static struct spinlock Spin;
+static snapshot Locked;
+static atomic_int64 Plain;
+static atomic_int Stop;
+static atomic_int Ready;
+
+static void writeAll(uint64_t v)
+{
+    snapshot s;
+    s.version = v;
+    s.offset = -(int64_t)v;
+    s.count = v * 3;
+    seq_snapshot_write(&Seq, &s);
+    rwlock_acquire_write(&Rw);
+    Locked = s;
+    rwlock_release_write(&Rw);
+    spinlock_acquire(&Spin);
+    Locked = s;
+    spinlock_release(&Spin);
+    atomic_int64_store_explicit(&Plain, (int64_t)v, memory_order_relaxed);
+}
+
+THREAD_MAIN(readerMain)
+{
+    worker *w = (worker *)arg;
+    uint64_t n = 0, sink = 0;
+    snapshot s;
+    atomic_int_inc(&Ready);
+    while (!atomic_int_load_explicit(&Stop, memory_order_relaxed))
+    {
+        for (int i = 0; i < 64; i++)
+        {
+            switch (w->mode)
+            {
+            case M_SEQLOCK:
+                seq_snapshot_read(&Seq, &s);
+                break;
+            case M_RWLOCK:
+                rwlock_acquire_read(&Rw);
+                s = Locked;
+                rwlock_release_read(&Rw);
+                break;
+            case M_SPINLOCK:
+                spinlock_acquire(&Spin);
+                s = Locked;
+                spinlock_release(&Spin);
+                break;
+            default:
+                s.version = (uint64_t)atomic_int64_load_explicit(&Plain, memory_order_relaxed);
+                s.count = s.version;
+                break;
+            }
+            sink += s.version + s.count;
+        }
+        n += 64;
+    }
+    w->reads = n;
+    w->sink = sink;
+    return 0;
+}
+
+THREAD_MAIN(writerMain)
+{
+    uint64_t v = 0;
+    (void)arg;
+    while (!atomic_int_load_explicit(&Stop, memory_order_relaxed))
+    {
+        writeAll(++v);
+#ifdef _WIN32
+        Sleep(1);
+#else
+        usleep(WRITE_US);
+#endif
+    }
+    return 0;
+}
+
+static double measure(int mode, int nthread, int ms)
+{
+    worker *w = (worker *)calloc(nthread, sizeof(worker));
+    thread_t *th = (thread_t *)calloc(nthread + 1, sizeof(thread_t));
+    uint64_t reads = 0;
+    int64_t t0, t1;
+    int i;
+    atomic_int_store(&Stop, 0);
+    atomic_int_store(&Ready, 0);
+    for (i = 0; i <= nthread; i++)
+    {
+        if (i < nthread)
+            w[i].mode = mode;
+        START(th[i], i < nthread ? readerMain : writerMain, &w[i < nthread ? i : 0]);
+    }
+    while (atomic_int_load(&Ready) < nthread)
+        SLEEP_MS(1);
+    t0 = dt_now_precise_ns();
+    SLEEP_MS(ms);
+    atomic_int_store(&Stop, 1);
+    for (i = 0; i <= nthread; i++)
+    {
+        JOIN(th[i]);
+    }
+    t1 = dt_now_precise_ns();
+    for (i = 0; i < nthread; i++)
+        reads += w[i].reads;
+    free(th);
+    free(w);
+    return reads * 1e9 / (t1 - t0);
+}
+
+int main(int argc, char **argv)
+{
+    int nmax = argc > 1 ? atoi(argv[1]) : cpu_count();
+    int ms = argc > 2 ? atoi(argv[2]) : 200;
+    snapshot s;
+    memset(&s, 0, sizeof(s));
+    seq_snapshot_init(&Seq, &s);
+    rwlock_init(&Rw);
+    spinlock_init(&Spin);
+    printf("# %d cpus, one writer every %d us\n", cpu_count(), WRITE_US);
+    printf("%-12s %8s %14s %10s\n", "reader", "threads", "reads/s", "ns/read");
+    for (int mode = 0; mode < M_COUNT; mode++)
+    {
+        for (int n = 1;; n = n * 2 < nmax ? n * 2 : nmax)
+        {
+            double rps = measure(mode, n, ms);
+            printf("%-12s %8d %14.0f %10.2f\n", ModeNames[mode], n, rps, n * 1e9 / rps);
+            if (n >= nmax)
+                break;
+        }
+    }
+    rwlock_destroy(&Rw);
+    spinlock_destroy(&Spin);
+    return 0;
+}
@@ -0,0 +1,128 @@
+#include "spinlock.h"
+#include "atomic.h"
+#include "dtclock.h"
+#include "testthread.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+/*
+ * 锁竞争测试: N 个线程反复进入一个很短的临界区(几个共享计数器加一),
+ * 临界区外做少量本地计算. 输出总吞吐, 每次加锁的平均耗时和公平性(最少/最多).
+ * 同一份源码按 SPINLOCK_* 宏编译成多个程序, 见 CMakeLists.txt.
+ * bench-spinlock-profile 是定义了 LOCK_PROFILE 的 ttas, 和 bench-spinlock-ttas 对比统计的开销, 最后输出统计.
+ *
+ *   bench-spinlock-ttas [最大线程数, 默认 64] [每轮毫秒数, 默认 200]
+ */
+
+#if defined(SPINLOCK_MUTEX)
+#define LOCK_NAME "mutex"
+#elif defined(SPINLOCK_TICKET)
+#define LOCK_NAME "ticket"
+#elif defined(SPINLOCK_MCS)
+#define LOCK_NAME "mcs"
+#else
+#define LOCK_NAME "ttas"
+#endif
+
+#define NSHARED 4
+#define OUTSIDE 64 /* 两次加锁之间的本地工作量 */
+
+typedef struct worker worker;
+struct worker
+{
+    uint64_t ops;
+    uint64_t sink;
+    char pad[ATOMIC_CACHELINE - 2 * sizeof(uint64_t)];
+};
+
+static struct spinlock Lock;
+static uint64_t Shared[NSHARED];
+static atomic_int Stop;
+static atomic_int Ready;
+
+THREAD_MAIN(threadMain)
+{
+    worker *w = (worker *)arg;
+    uint64_t ops = 0, x = (uintptr_t)arg;
+    atomic_int_inc(&Ready);
+    while (!atomic_int_load_explicit(&Stop, memory_order_relaxed))
+    {
+        spinlock_acquire(&Lock);
+        for (int i = 0; i < NSHARED; i++)
+            Shared[i]++;
+        spinlock_release(&Lock);
+        for (int i = 0; i < OUTSIDE; i++)
+            x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+        ops++;
+    }
+    w->sink = x;
+    w->ops = ops;
+    return 0;
+}
+
+static int measure(int nthread, int ms)
+{
+    worker *w = (worker *)calloc(nthread, sizeof(worker));
+    thread_t *th = (thread_t *)calloc(nthread, sizeof(thread_t));
+    uint64_t total = 0, lo = UINT64_MAX, hi = 0;
+    int64_t t0, t1;
+    int i;
+    memset(Shared, 0, sizeof(Shared));
+    atomic_int_store(&Stop, 0);
+    atomic_int_store(&Ready, 0);
+    for (i = 0; i < nthread; i++)
+    {
+        START(th[i], threadMain, &w[i]);
+    }
+    while (atomic_int_load(&Ready) < nthread)
+        SLEEP_MS(1);
+    t0 = dt_now_precise_ns();
+    SLEEP_MS(ms);
+    atomic_int_store(&Stop, 1);
+    for (i = 0; i < nthread; i++)
+    {
+        JOIN(th[i]);
+    }
+    t1 = dt_now_precise_ns();
+    for (i = 0; i < nthread; i++)
+    {
+        total += w[i].ops;
+        lo = w[i].ops < lo ? w[i].ops : lo;
+        hi = w[i].ops > hi ? w[i].ops : hi;
+    }
+    printf("%-8s %8d %14.0f %10.1f %10.3f\n", LOCK_NAME, nthread, total * 1e9 / (t1 - t0),
+           (double)(t1 - t0) / (total ? total : 1), hi ? (double)lo / hi : 0.0);
+    free(th);
+    free(w);
+    for (i = 0; i < NSHARED; i++)
+    {
+        if (Shared[i] != total)
+        {
+            fprintf(stderr, "%s: lost updates, %llu != %llu\n", LOCK_NAME,
+                    (unsigned long long)Shared[i], (unsigned long long)total);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int nmax = argc > 1 ? atoi(argv[1]) : 64;
+    int ms = argc > 2 ? atoi(argv[2]) : 200;
+    spinlock_init_named(&Lock, "bench");
+    printf("# %s, %d cpus, struct spinlock %d bytes\n", LOCK_NAME, cpu_count(), (int)sizeof(struct spinlock));
+    printf("%-8s %8s %14s %10s %10s\n", "lock", "threads", "ops/s", "ns/op", "min/max");
+    for (int n = 1; n <= nmax; n *= 2)
+    {
+        if (measure(n, ms))
+            return 1;
+    }
+    spinlock_destroy(&Lock);
+#ifdef LOCK_PROFILE
+    lockprof_report(stdout);
+#endif
+    return 0;
+}
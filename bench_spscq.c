@@ -0,0 +1,166 @@
+#include "spscq.h"
+#include "mpmcq.h"
+#include "dtclock.h"
+#include "testthread.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+/*
+ * 一个生产者一个消费者, 比较:
+ *   spscq 16B         16 字节记录, 每条都 release
+ *   spscq 16B batch   16 字节记录, 每 BATCH 条或队列空时 release
+ *   spscq var batch   16 到 256 字节的变长记录, 批量 release
+ *   mpmcq             同样的一对一传递, 元素是预先分配的消息的指针
+ * 记录里带写入时间, 输出吞吐和延迟分位数. 满/空时让出 CPU.
+ *
+ *   bench-spscq [消息数, 默认 2000000] [队列字节数, 默认 65536]
+ */
+
+#define BATCH 32
+
+enum
+{
+    M_FIXED = 0,
+    M_FIXED_BATCH,
+    M_VAR_BATCH,
+    M_MPMCQ,
+    M_COUNT
+};
+
+static const char *ModeNames[] = {"spscq 16B", "spscq 16B batch", "spscq var batch", "mpmcq"};
+
+typedef struct msg msg;
+struct msg
+{
+    int64_t t;
+    int64_t seq;
+};
+
+typedef struct ctx ctx;
+struct ctx
+{
+    int mode;
+    int64_t nmsg;
+    struct spscq sq;
+    struct mpmcq mq;
+    msg *msgs;
+    int64_t *lat;
+};
+
+/* 队列结构按 cache line 对齐, 不从 malloc 分配 */
+static ctx Ctx;
+
+static size_t recordLen(int64_t i)
+{
+    return 16 + (size_t)((uint64_t)i * 2654435761u >> 8) % 241;
+}
+
+THREAD_MAIN(producerMain)
+{
+    ctx *c = (ctx *)arg;
+    for (int64_t i = 0; i < c->nmsg; i++)
+    {
+        if (c->mode == M_MPMCQ)
+        {
+            msg *m = &c->msgs[i];
+            m->seq = i;
+            m->t = dt_now_precise_ns();
+            while (mpmcq_push(&c->mq, m))
+                YIELD();
+            continue;
+        }
+        size_t len = c->mode == M_VAR_BATCH ? recordLen(i) : sizeof(msg);
+        msg *m;
+        while ((m = (msg *)spscq_reserve(&c->sq, len)) == NULL)
+            YIELD();
+        m->seq = i;
+        if (len > sizeof(msg))
+            memset(m + 1, (int)i, len - sizeof(msg));
+        m->t = dt_now_precise_ns();
+        spscq_commit(&c->sq, len);
+    }
+    return 0;
+}
+
+static void consume(ctx *c)
+{
+    int64_t i = 0;
+    while (i < c->nmsg)
+    {
+        int n = 0;
+        if (c->mode == M_MPMCQ)
+        {
+            void *p;
+            if (mpmcq_pop(&c->mq, &p) == 0)
+            {
+                msg *m = (msg *)p;
+                c->lat[m->seq] = dt_now_precise_ns() - m->t;
+                i++;
+                continue;
+            }
+        }
+        else
+        {
+            const msg *m;
+            size_t len;
+            int limit = c->mode == M_FIXED ? 1 : BATCH;
+            while (n < limit && (m = (const msg *)spscq_peek(&c->sq, &len)) != NULL)
+            {
+                c->lat[m->seq] = dt_now_precise_ns() - m->t;
+                n++;
+            }
+            if (n)
+            {
+                spscq_release(&c->sq);
+                i += n;
+                continue;
+            }
+        }
+        YIELD();
+    }
+}
+
+static int cmpInt64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void run(int mode, int64_t nmsg, size_t capacity)
+{
+    ctx *c = &Ctx;
+    thread_t th;
+    int64_t t0, t1;
+    memset(c, 0, sizeof(*c));
+    c->mode = mode;
+    c->nmsg = nmsg;
+    c->lat = (int64_t *)malloc(nmsg * sizeof(int64_t));
+    c->msgs = mode == M_MPMCQ ? (msg *)calloc(nmsg, sizeof(msg)) : NULL;
+    spscq_init(&c->sq, capacity);
+    mpmcq_init(&c->mq, capacity / sizeof(msg));
+    t0 = dt_now_precise_ns();
+    START(th, producerMain, c);
+    consume(c);
+    JOIN(th);
+    t1 = dt_now_precise_ns();
+    qsort(c->lat, nmsg, sizeof(int64_t), cmpInt64);
+    printf("%-16s %12.0f %10lld %10lld %10lld\n", ModeNames[mode], nmsg * 1e9 / (t1 - t0),
+           (long long)c->lat[nmsg / 2], (long long)c->lat[nmsg * 99 / 100], (long long)c->lat[nmsg * 999 / 1000]);
+    spscq_destroy(&c->sq);
+    mpmcq_destroy(&c->mq);
+    free(c->msgs);
+    free(c->lat);
+}
+
+int main(int argc, char **argv)
+{
+    int64_t nmsg = argc > 1 ? atoll(argv[1]) : 2000000;
+    size_t capacity = argc > 2 ? (size_t)atoll(argv[2]) : 65536;
+    printf("# %lld messages, %zu-byte ring\n", (long long)nmsg, capacity);
+    printf("%-16s %12s %10s %10s %10s\n", "queue", "msgs/s", "p50 ns", "p99 ns", "p99.9 ns");
+    for (int mode = 0; mode < M_COUNT; mode++)
+        run(mode, nmsg, capacity);
+    return 0;
+}
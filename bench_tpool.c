@@ -0,0 +1,305 @@
+#include "tpool.h"
+#include "list.h"
+#include "datetime.h"
+#include "dtclock.h"
+#include "testthread.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+/*
+ * 线程池扩展性测试, 每种负载在 1, 2, 4 ... 个线程下各跑一次, 输出耗时和相对单线程的加速比:
+ *   fib            fork/join 递归, 每个任务只做一次加法, 最细的粒度
+ *   for fine       parallel_for, 每个下标几纳秒的计算, grain 256
+ *   for datetime   parallel_for, 每个下标格式化一个时间戳, grain 1024
+ *   submit         外部线程提交 NCOARSE 个任务, 每个格式化 COARSE 个时间戳
+ *   mutex queue    同样的 submit 负载交给互斥锁 + 条件变量 + list_head 的手写线程池
+ *
+ *   bench-tpool [最大线程数, 默认 CPU 数]
+ */
+
+#define FIB_N 27
+#define FINE_N (1 << 22)
+#define DT_N (1 << 18)
+#define NCOARSE 512
+#define COARSE 1024
+
+enum
+{
+    W_FIB = 0,
+    W_FOR_FINE,
+    W_FOR_DT,
+    W_SUBMIT,
+    W_LOCKED,
+    W_COUNT
+};
+
+static const char *WorkNames[] = {"fib", "for fine", "for datetime", "submit", "mutex queue"};
+
+static struct tpool *Pool;
+static dt_fmt *Fmt;
+static int64_t Base = 1700000000LL * 1000000000LL;
+static uint64_t Sink[W_COUNT];
+
+/* 格式化 [begin, end) 号时间戳, 返回输出的总长度 */
+static uint64_t formatRange(int64_t begin, int64_t end)
+{
+    uint64_t total = 0;
+    char buf[64];
+    DateTime d;
+    for (int64_t i = begin; i < end; i++)
+    {
+        dt_from_unix_ns(&d, Base + i * 1234567891LL);
+        total += (uint64_t)dt_fmt_format(Fmt, &d, buf, sizeof(buf));
+    }
+    return total;
+}
+
+typedef struct fib fib;
+struct fib
+{
+    struct tpool_task task;
+    int n;
+    int64_t result;
+};
+
+static void fibTask(void *arg)
+{
+    fib *f = (fib *)arg, a, b;
+    if (f->n < 2)
+    {
+        f->result = f->n;
+        return;
+    }
+    a.n = f->n - 1;
+    b.n = f->n - 2;
+    tpool_task_init(&a.task, fibTask, &a);
+    tpool_fork(Pool, &a.task);
+    fibTask(&b);
+    tpool_join(Pool, &a.task);
+    f->result = a.result + b.result;
+}
+
+static void fineRange(int64_t begin, int64_t end, void *arg)
+{
+    uint64_t x = 0;
+    for (int64_t i = begin; i < end; i++)
+        x += ((uint64_t)i * 0x9e3779b97f4a7c15ULL) >> 17;
+    atomic_int64_fetch_add((atomic_int64 *)arg, (int64_t)x, memory_order_relaxed);
+}
+
+static void dtRange(int64_t begin, int64_t end, void *arg)
+{
+    atomic_int64_fetch_add((atomic_int64 *)arg, (int64_t)formatRange(begin, end), memory_order_relaxed);
+}
+
+typedef struct job job;
+struct job
+{
+    struct tpool_task task;
+    struct list_head node;
+    int64_t index;
+    uint64_t result;
+};
+
+static void jobTask(void *arg)
+{
+    job *j = (job *)arg;
+    j->result = formatRange(j->index * COARSE, (j->index + 1) * COARSE);
+}
+
+/* 手写的线程池: 一个加锁队列, 停止后工作线程取空队列就退出 */
+typedef struct lockpool lockpool;
+struct lockpool
+{
+#ifdef _WIN32
+    SRWLOCK lock;
+    CONDITION_VARIABLE notEmpty;
+#else
+    pthread_mutex_t lock;
+    pthread_cond_t notEmpty;
+#endif
+    thread_t *threads;
+    struct list_head jobs;
+    int nthread;
+    int stop;
+};
+
+static job *lockpoolPop(lockpool *lp)
+{
+    job *j = NULL;
+#ifdef _WIN32
+    AcquireSRWLockExclusive(&lp->lock);
+    while (list_empty(&lp->jobs) && !lp->stop)
+        SleepConditionVariableSRW(&lp->notEmpty, &lp->lock, INFINITE, 0);
+#else
+    pthread_mutex_lock(&lp->lock);
+    while (list_empty(&lp->jobs) && !lp->stop)
+        pthread_cond_wait(&lp->notEmpty, &lp->lock);
+#endif
+    if (!list_empty(&lp->jobs))
+    {
+        j = list_entry(lp->jobs.next, job, node);
+        list_del(&j->node);
+    }
+#ifdef _WIN32
+    ReleaseSRWLockExclusive(&lp->lock);
+#else
+    pthread_mutex_unlock(&lp->lock);
+#endif
+    return j;
+}
+
+static void lockpoolPush(lockpool *lp, job *j)
+{
+#ifdef _WIN32
+    AcquireSRWLockExclusive(&lp->lock);
+    list_add_tail(&j->node, &lp->jobs);
+    ReleaseSRWLockExclusive(&lp->lock);
+    WakeConditionVariable(&lp->notEmpty);
+#else
+    pthread_mutex_lock(&lp->lock);
+    list_add_tail(&j->node, &lp->jobs);
+    pthread_mutex_unlock(&lp->lock);
+    pthread_cond_signal(&lp->notEmpty);
+#endif
+}
+
+THREAD_MAIN(lockpoolMain)
+{
+    lockpool *lp = (lockpool *)arg;
+    job *j;
+    while ((j = lockpoolPop(lp)) != NULL)
+        jobTask(j);
+    return 0;
+}
+
+static void lockpoolStart(lockpool *lp, int nthread)
+{
+#ifdef _WIN32
+    InitializeSRWLock(&lp->lock);
+    InitializeConditionVariable(&lp->notEmpty);
+#else
+    pthread_mutex_init(&lp->lock, NULL);
+    pthread_cond_init(&lp->notEmpty, NULL);
+#endif
+    lp->threads = (thread_t *)calloc(nthread, sizeof(thread_t));
+    INIT_LIST_HEAD(&lp->jobs);
+    lp->nthread = nthread;
+    lp->stop = 0;
+    for (int i = 0; i < nthread; i++)
+    {
+        START(lp->threads[i], lockpoolMain, lp);
+    }
+}
+
+/* 处理完队列里的任务后退出 */
+static void lockpoolStop(lockpool *lp)
+{
+#ifdef _WIN32
+    AcquireSRWLockExclusive(&lp->lock);
+    lp->stop = 1;
+    ReleaseSRWLockExclusive(&lp->lock);
+    WakeAllConditionVariable(&lp->notEmpty);
+#else
+    pthread_mutex_lock(&lp->lock);
+    lp->stop = 1;
+    pthread_mutex_unlock(&lp->lock);
+    pthread_cond_broadcast(&lp->notEmpty);
+#endif
+    for (int i = 0; i < lp->nthread; i++)
+        JOIN(lp->threads[i]);
+#ifndef _WIN32
+    pthread_mutex_destroy(&lp->lock);
+    pthread_cond_destroy(&lp->notEmpty);
+#endif
+    free(lp->threads);
+}
+
+/* 返回耗时纳秒, 结果记到 Sink 里防止被优化掉 */
+static int64_t run(int work, int nthread)
+{
+    job *jobs = (job *)calloc(NCOARSE, sizeof(job));
+    atomic_int64 acc;
+    lockpool lp;
+    int64_t t0, t1;
+    int i;
+    atomic_int64_init(&acc, 0);
+    t0 = dt_now_precise_ns();
+    switch (work)
+    {
+    case W_FIB:
+    {
+        fib f;
+        f.n = FIB_N;
+        tpool_task_init(&f.task, fibTask, &f);
+        tpool_submit(Pool, &f.task);
+        tpool_join(Pool, &f.task);
+        Sink[work] += (uint64_t)f.result;
+        break;
+    }
+    case W_FOR_FINE:
+        tpool_parallel_for(Pool, 0, FINE_N, 256, fineRange, &acc);
+        break;
+    case W_FOR_DT:
+        tpool_parallel_for(Pool, 0, DT_N, 1024, dtRange, &acc);
+        break;
+    case W_SUBMIT:
+        for (i = 0; i < NCOARSE; i++)
+        {
+            jobs[i].index = i;
+            tpool_task_init(&jobs[i].task, jobTask, &jobs[i]);
+            tpool_submit(Pool, &jobs[i].task);
+        }
+        for (i = 0; i < NCOARSE; i++)
+            tpool_join(Pool, &jobs[i].task);
+        break;
+    case W_LOCKED:
+        /* 线程启动不计时, 和 tpool 一样先建好 */
+        lockpoolStart(&lp, nthread);
+        t0 = dt_now_precise_ns();
+        for (i = 0; i < NCOARSE; i++)
+        {
+            jobs[i].index = i;
+            lockpoolPush(&lp, &jobs[i]);
+        }
+        lockpoolStop(&lp);
+        break;
+    }
+    t1 = dt_now_precise_ns();
+    for (i = 0; i < NCOARSE; i++)
+        Sink[work] += jobs[i].result;
+    Sink[work] += (uint64_t)atomic_int64_load(&acc);
+    free(jobs);
+    return t1 - t0;
+}
+
+int main(int argc, char **argv)
+{
+    int nmax = argc > 1 ? atoi(argv[1]) : cpu_count();
+    int64_t base[W_COUNT];
+    Fmt = dt_fmt_compile("%Y-%m-%dT%H:%M:%6fZ");
+    printf("# %d cpus, fib(%d), %d fine, %d datetime, %d x %d coarse\n", cpu_count(), FIB_N, FINE_N, DT_N,
+           NCOARSE, COARSE);
+    printf("%-14s %8s %10s %8s\n", "work", "threads", "ms", "speedup");
+    for (int n = 1; n <= nmax; n *= 2)
+    {
+        Pool = tpool_create(n);
+        for (int work = 0; work < W_COUNT; work++)
+        {
+            int64_t ns = run(work, n);
+            if (n == 1)
+                base[work] = ns;
+            printf("%-14s %8d %10.2f %8.2f\n", WorkNames[work], n, ns / 1e6, (double)base[work] / ns);
+        }
+        tpool_destroy(Pool);
+    }
+    if (Sink[W_SUBMIT] != Sink[W_LOCKED])
+    {
+        fprintf(stderr, "submit and mutex queue results differ\n");
+        return 1;
+    }
+    dt_fmt_free(Fmt);
+    return 0;
+}
@@ -0,0 +1,272 @@
+#ifndef COUNTER_H
+#define COUNTER_H
+
+/*
+ * 分片的统计计数, 多个线程频繁更新时不写同一个 cache line:
+ *   struct counter    int64 计数. 每个线程加到自己的分片上, 分片的绝对值攒到 COUNTER_BATCH
+ *                     才合并进中心计数. counter_read 只读中心计数, 开销和读一个变量一样,
+ *                     线程数不超过 COUNTER_SLOTS 时误差小于 COUNTER_SLOTS * COUNTER_BATCH;
+ *                     counter_read_exact 再加上所有分片, 包含读开始之前完成的全部更新,
+ *                     代价与 COUNTER_SLOTS 成正比.
+ *   struct gauge      可增可减也可以直接设置的当前值 (连接数, 队列长度), 读总是精确的
+ *   struct histogram  按 2 的幂分桶的分布, 每个分片一组桶, 读时汇总
+ * 线程第一次更新时轮流分到一个分片, 线程多于 COUNTER_SLOTS 时共享分片, 结果仍然正确.
+ * 定义 COUNTER_PERCPU 时 Linux 上按当前 CPU 选分片, 适合线程数远多于核数的程序.
+ * 合并和精确读用 seqlock.h 配对. 精确读通常只读共享内存; 连续 4 次被合并打断时
+ * 拿一次合并用的写锁 (对 fold 做一次 CAS) 再读, 保证更新很频繁时也能读完.
+ */
+
+#include "atomic.h"
+#include "seqlock.h"
+#include <stdint.h>
+
+/* 分片数, 必须是 2 的幂, 取不小于更新线程数 (COUNTER_PERCPU 时是核数) 的值效果最好 */
+#ifndef COUNTER_SLOTS
+#define COUNTER_SLOTS 32
+#endif
+
+/* 分片攒到这个绝对值才合并进中心计数 */
+#ifndef COUNTER_BATCH
+#define COUNTER_BATCH 64
+#endif
+
+/* 直方图第 i 格是 [2^i, 2^(i+1)), 第 0 格包含 0 和负数 */
+#define COUNTER_HIST_BUCKETS 64
+
+typedef char counter_slots_power_of_two[(COUNTER_SLOTS & (COUNTER_SLOTS - 1)) == 0 ? 1 : -1];
+
+struct counter_slot {
+    atomic_int64 value;
+    char pad[ATOMIC_CACHELINE - sizeof(atomic_int64)];
+};
+
+struct ATOMIC_CACHELINE_ALIGNED counter {
+    atomic_int64 count;   /* 已合并的部分 */
+    struct seqlock fold;  /* 合并时为奇数 */
+    char pad[ATOMIC_CACHELINE - sizeof(atomic_int64) - sizeof(struct seqlock)];
+    struct counter_slot slot[COUNTER_SLOTS];
+};
+
+struct gauge {
+    struct counter c;
+};
+
+struct ATOMIC_CACHELINE_ALIGNED histogram_slot {
+    atomic_int64 bucket[COUNTER_HIST_BUCKETS];
+    atomic_int64 sum;
+};
+
+struct histogram {
+    struct histogram_slot slot[COUNTER_SLOTS];
+};
+
+struct histogram_stat {
+    int64_t count;
+    int64_t sum;
+    int64_t bucket[COUNTER_HIST_BUCKETS];
+};
+
+#if defined(COUNTER_PERCPU) && defined(__linux__)
+
+extern int sched_getcpu(void);
+
+static inline int
+counter_slot_index(void) {
+    int cpu = sched_getcpu();
+    return cpu < 0 ? 0 : cpu & (COUNTER_SLOTS - 1);
+}
+
+#else
+
+static ATOMIC_THREAD int counter_index = -1;
+static atomic_int counter_next;
+
+/* 每个编译单元各自轮流分配, 同一线程在不同编译单元可能用不同分片, 不影响结果 */
+static inline int
+counter_slot_index(void) {
+    int i = counter_index;
+    if (i < 0)
+        i = counter_index = atomic_int_fetch_add(&counter_next, 1, memory_order_relaxed) & (COUNTER_SLOTS - 1);
+    return i;
+}
+
+#endif
+
+static inline int
+counter_init(struct counter *c) {
+    atomic_int64_init(&c->count, 0);
+    seqlock_init(&c->fold);
+    for (int i = 0; i < COUNTER_SLOTS; i++)
+        atomic_int64_init(&c->slot[i].value, 0);
+    return 0;
+}
+
+static inline int
+counter_destroy(struct counter *c) {
+    (void)c;
+    return 0;
+}
+
+static inline void
+counter_fold(struct counter *c, struct counter_slot *s) {
+    int64_t v;
+    seqlock_write_begin(&c->fold);
+    v = atomic_int64_exchange_explicit(&s->value, 0, memory_order_relaxed);
+    atomic_int64_fetch_add(&c->count, v, memory_order_relaxed);
+    seqlock_write_end(&c->fold);
+}
+
+static inline int
+counter_add(struct counter *c, int64_t v) {
+    struct counter_slot *s = &c->slot[counter_slot_index()];
+    int64_t n = atomic_int64_fetch_add(&s->value, v, memory_order_relaxed) + v;
+    if (n >= COUNTER_BATCH || n <= -COUNTER_BATCH)
+        counter_fold(c, s);
+    return 0;
+}
+
+static inline int
+counter_inc(struct counter *c) {
+    return counter_add(c, 1);
+}
+
+static inline int64_t
+counter_read(struct counter *c) {
+    return atomic_int64_load_explicit(&c->count, memory_order_relaxed);
+}
+
+static inline int64_t
+counter_sum(struct counter *c) {
+    int64_t v = atomic_int64_load_explicit(&c->count, memory_order_relaxed);
+    for (int i = 0; i < COUNTER_SLOTS; i++)
+        v += atomic_int64_load_explicit(&c->slot[i].value, memory_order_relaxed);
+    return v;
+}
+
+/* 更新很频繁时合并也频繁, 重试几次都不成功就挡住合并再读 */
+static inline int64_t
+counter_read_exact(struct counter *c) {
+    int64_t v;
+    for (int retry = 0; retry < 4; retry++) {
+        unsigned seq = seqlock_read_begin(&c->fold);
+        v = counter_sum(c);
+        if (!seqlock_read_retry(&c->fold, seq))
+            return v;
+    }
+    seqlock_write_begin(&c->fold);
+    v = counter_sum(c);
+    seqlock_write_end(&c->fold);
+    return v;
+}
+
+static inline int
+gauge_init(struct gauge *g) {
+    return counter_init(&g->c);
+}
+
+static inline int
+gauge_destroy(struct gauge *g) {
+    return counter_destroy(&g->c);
+}
+
+static inline int
+gauge_add(struct gauge *g, int64_t v) {
+    return counter_add(&g->c, v);
+}
+
+static inline int
+gauge_inc(struct gauge *g) {
+    return counter_add(&g->c, 1);
+}
+
+static inline int
+gauge_dec(struct gauge *g) {
+    return counter_add(&g->c, -1);
+}
+
+/* 和 set 并发的 add 可能算在 set 之前或之后, 但不会丢一半 */
+static inline int
+gauge_set(struct gauge *g, int64_t v) {
+    seqlock_write_begin(&g->c.fold);
+    for (int i = 0; i < COUNTER_SLOTS; i++)
+        v -= atomic_int64_load_explicit(&g->c.slot[i].value, memory_order_relaxed);
+    atomic_int64_store_explicit(&g->c.count, v, memory_order_relaxed);
+    seqlock_write_end(&g->c.fold);
+    return 0;
+}
+
+static inline int64_t
+gauge_read(struct gauge *g) {
+    return counter_read_exact(&g->c);
+}
+
+static inline int
+histogram_init(struct histogram *h) {
+    for (int i = 0; i < COUNTER_SLOTS; i++) {
+        for (int b = 0; b < COUNTER_HIST_BUCKETS; b++)
+            atomic_int64_init(&h->slot[i].bucket[b], 0);
+        atomic_int64_init(&h->slot[i].sum, 0);
+    }
+    return 0;
+}
+
+static inline int
+histogram_destroy(struct histogram *h) {
+    (void)h;
+    return 0;
+}
+
+static inline int
+histogram_bucket(int64_t v) {
+    int b = 0;
+    if (v <= 0)
+        return 0;
+#if defined(__GNUC__) || defined(__clang__)
+    b = 63 - __builtin_clzll((unsigned long long)v);
+#else
+    while (v >>= 1)
+        b++;
+#endif
+    return b;
+}
+
+static inline int
+histogram_record(struct histogram *h, int64_t v) {
+    struct histogram_slot *s = &h->slot[counter_slot_index()];
+    atomic_int64_fetch_add(&s->bucket[histogram_bucket(v)], 1, memory_order_relaxed);
+    atomic_int64_fetch_add(&s->sum, v, memory_order_relaxed);
+    return 0;
+}
+
+/* 各个桶分别读, 和 record 并发时 sum 和桶之间可能差几次记录 */
+static inline int
+histogram_read(struct histogram *h, struct histogram_stat *st) {
+    st->count = st->sum = 0;
+    for (int b = 0; b < COUNTER_HIST_BUCKETS; b++)
+        st->bucket[b] = 0;
+    for (int i = 0; i < COUNTER_SLOTS; i++) {
+        for (int b = 0; b < COUNTER_HIST_BUCKETS; b++)
+            st->bucket[b] += atomic_int64_load_explicit(&h->slot[i].bucket[b], memory_order_relaxed);
+        st->sum += atomic_int64_load_explicit(&h->slot[i].sum, memory_order_relaxed);
+    }
+    for (int b = 0; b < COUNTER_HIST_BUCKETS; b++)
+        st->count += st->bucket[b];
+    return 0;
+}
+
+/* q 分位 (0..1) 所在桶的上界, 没有记录时返回 0 */
+static inline int64_t
+histogram_quantile(const struct histogram_stat *st, double q) {
+    int64_t seen = 0;
+    int b;
+    if (st->count == 0)
+        return 0;
+    for (b = 0; b < COUNTER_HIST_BUCKETS - 1; b++) {
+        seen += st->bucket[b];
+        if ((double)seen >= q * (double)st->count)
+            break;
+    }
+    return b >= 62 ? INT64_MAX : (int64_t)1 << (b + 1);
+}
+
+#endif // COUNTER_H
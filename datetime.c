@@ -1,55 +1,28 @@
+#ifdef USE_LUA
+#include <lua.h>
+#include <lauxlib.h>
+#endif
 #include "datetime.h"
+#include "tzone.h"
+#include "dtclock.h"
+#include "atomic.h"
+#include "threadreg.h"
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
 #include <ctype.h>
 #include <assert.h>
-#ifdef _WIN32
-#include <Windows.h>
-#else
-#include <sys/time.h>
-#endif
 #include <time.h>
 #include <stdio.h>
 
-typedef struct DateTime DateTime;
-struct DateTime
-{
-    int64_t iJD;            /* The julian day number times 86400000 */
-    int Y, M, D;            /* Year, month, and day */
-    int h, m;               /* Hour and minutes */
-    int tz;                 /* Timezone offset in minutes */
-    double s;               /* Seconds */
-    char validJD;           /* True (1) if iJD is valid */
-    char validYMD;          /* True (1) if Y,M,D are valid */
-    char validHMS;          /* True (1) if h,m,s are valid */
-    char nFloor;            /* Days to implement "floor" */
-    unsigned rawS : 1;      /* Raw numeric value stored in s */
-    unsigned isError : 1;   /* An overflow has occurred */
-    unsigned useSubsec : 1; /* Display subsecond precision */
-    unsigned isUtc : 1;     /* Time is known to be UTC */
-    unsigned isLocal : 1;   /* Time is known to be localtime */
-};
-
-static int currentTimeInt64(int64_t *piNow)
+static int currentTimeInt64(int64_t *piNow, int *piNs)
 {
     static const int64_t unixEpoch = 24405875 * (int64_t)8640000;
-    int rc = 0;
-#ifdef _WIN32
-    FILETIME tm;
-    ULARGE_INTEGER ui;
-    GetSystemTimeAsFileTime(&tm);
-    ui.LowPart = tm.dwLowDateTime;
-    ui.HighPart = tm.dwHighDateTime;
-    uint64_t msec = (ui.QuadPart - (uint64_t)(116444736000000000ULL)) / 10000;
-    *piNow = unixEpoch + msec;
-#else
-    struct timeval sNow;
-    (void)gettimeofday(&sNow, 0); /* Cannot fail given valid arguments */
-    *piNow = unixEpoch + 1000 * (int64_t)sNow.tv_sec + sNow.tv_usec / 1000;
-#endif
-    return rc;
+    int64_t ns = dt_now_ns();
+    *piNow = unixEpoch + ns / 1000000;
+    *piNs = (int)(ns % 1000000);
+    return 0;
 }
 
 static void datetimeError(DateTime *p)
@@ -90,11 +63,13 @@ static void computeJD(DateTime *p)
     B = 38 - A + (A / 4);
     X1 = 36525 * (Y + 4716) / 100;
     X2 = 306001 * (M + 1) / 10000;
-    p->iJD = (int64_t)((X1 + X2 + D + B - 1524.5) * 86400000);
+    p->iJD = (int64_t)(X1 + X2 + D + B - 1524) * 86400000 - 43200000;
+    p->iNs = 0;
     p->validJD = 1;
     if (p->validHMS)
     {
-        p->iJD += p->h * 3600000 + p->m * 60000 + (int64_t)(p->s * 1000 + 0.5);
+        p->iJD += p->h * 3600000 + p->m * 60000 + (int64_t)p->s * 1000 + p->ns / 1000000;
+        p->iNs = p->ns % 1000000;
         if (p->tz)
         {
             p->iJD -= p->tz * 60000;
@@ -114,6 +89,30 @@ static int validJulianDay(int64_t iJD)
     return iJD >= 0 && iJD <= INT_464269060799999;
 }
 
+static int64_t floorDiv64(int64_t a, int64_t b)
+{
+    return a >= 0 ? a / b : -((-a + b - 1) / b);
+}
+
+/*
+** Add ms milliseconds and ns nanoseconds (-999999..999999) to iJD/iNs.
+*/
+static void addJD(DateTime *p, int64_t ms, int ns)
+{
+    p->iJD += ms;
+    p->iNs += ns;
+    if (p->iNs < 0)
+    {
+        p->iNs += 1000000;
+        p->iJD--;
+    }
+    else if (p->iNs >= 1000000)
+    {
+        p->iNs -= 1000000;
+        p->iJD++;
+    }
+}
+
 /*
 ** Clear the YMD and HMS and the TZ
 */
@@ -126,7 +125,7 @@ static void clearYMD_HMS_TZ(DateTime *p)
 
 static int setDateTimeToCurrent(DateTime *p)
 {
-    (void)currentTimeInt64(&p->iJD);
+    (void)currentTimeInt64(&p->iJD, &p->iNs);
     if (p->iJD > 0)
     {
         p->validJD = 1;
@@ -141,23 +140,100 @@ static int setDateTimeToCurrent(DateTime *p)
     }
 }
 
+/*
+** Parse a plain decimal [+-]DDD[.FFF] into whole units and a fraction
+** in 1e-9 units, floored so that 0 <= *pFrac < 1000000000.  Return the
+** number of bytes consumed, or 0 if z does not start with such a number
+** or the integer part has more than 18 digits.
+*/
+static int splitDecimal(const char *z, int64_t *pInt, int *pFrac)
+{
+    const char *z0 = z;
+    int neg = 0, nDigit = 0, nFrac = 0;
+    int64_t v = 0;
+    int f = 0;
+    if (*z == '-' || *z == '+')
+        neg = *z++ == '-';
+    while (isdigit((unsigned char)*z))
+    {
+        if (++nDigit > 18)
+            return 0;
+        v = v * 10 + *z++ - '0';
+    }
+    if (*z == '.')
+    {
+        z++;
+        while (isdigit((unsigned char)*z))
+        {
+            if (nFrac < 9)
+            {
+                f = f * 10 + *z - '0';
+                nFrac++;
+            }
+            nDigit++;
+            z++;
+        }
+    }
+    if (nDigit == 0 || *z == 'e' || *z == 'E')
+        return 0;
+    while (nFrac++ < 9)
+        f *= 10;
+    if (neg)
+    {
+        v = -v;
+        if (f)
+        {
+            v--;
+            f = 1000000000 - f;
+        }
+    }
+    *pInt = v;
+    *pFrac = f;
+    return (int)(z - z0);
+}
+
 /*
 ** Input "r" is a numeric quantity which might be a julian day number,
 ** or the number of seconds since 1970.  If the value if r is within
 ** range of a julian day number, install it as such and set validJD.
-** If the value is a valid unix timestamp, put it in p->s and set p->rawS.
+** If the value is a valid unix timestamp, put it in p->rRaw and set
+** p->rawS.  When the text z is a plain decimal it is also kept exactly
+** in iRawS/iRawNs so unix timestamps keep their nanoseconds.
 */
-static void setRawDateNumber(DateTime *p, double r)
+static void setRawDateNumber(DateTime *p, const char *z, double r)
 {
-    p->s = r;
+    int n = splitDecimal(z, &p->iRawS, &p->iRawNs);
+    p->rawExact = n > 0 && z[n] == 0;
+    p->rRaw = r;
     p->rawS = 1;
     if (r >= 0.0 && r < 5373484.5)
     {
         p->iJD = (int64_t)(r * 86400000.0 + 0.5);
+        p->iNs = 0;
         p->validJD = 1;
     }
 }
 
+/*
+** Install the raw number in p as a unix timestamp.
+*/
+static void setRawUnixepoch(DateTime *p)
+{
+    clearYMD_HMS_TZ(p);
+    if (p->rawExact)
+    {
+        p->iJD = (p->iRawS + 21086676 * (int64_t)10000) * 1000 + p->iRawNs / 1000000;
+        p->iNs = p->iRawNs % 1000000;
+    }
+    else
+    {
+        p->iJD = (int64_t)(p->rRaw * 1000.0 + 210866760000000.0 + 0.5);
+        p->iNs = 0;
+    }
+    p->validJD = 1;
+    p->rawS = 0;
+}
+
 /*
 ** Given the YYYY-MM-DD information current in p, determine if there
 ** is day-of-month overflow and set nFloor to the number of days that
@@ -191,12 +267,40 @@ static void computeFloor(DateTime *p)
     }
 }
 
+/*
+** Convert days since 1970-01-01 to the proleptic gregorian calendar and
+** back, in integers only.
+*/
+static void civilFromDays(int64_t days, int *pY, int *pM, int *pD)
+{
+    int64_t z, era, doe, yoe, doy, mp;
+    z = days + 719468; /* Days since 0000-03-01 */
+    era = (z >= 0 ? z : z - 146096) / 146097;
+    doe = z - era * 146097;
+    yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    mp = (5 * doy + 2) / 153;
+    *pD = (int)(doy - (153 * mp + 2) / 5 + 1);
+    *pM = (int)(mp < 10 ? mp + 3 : mp - 9);
+    *pY = (int)(yoe + era * 400 + (*pM <= 2));
+}
+
+static int64_t daysFromCivil(int64_t Y, int M, int D)
+{
+    int64_t era, yoe, doy, doe;
+    Y -= M <= 2;
+    era = (Y >= 0 ? Y : Y - 399) / 400;
+    yoe = Y - era * 400;
+    doy = (153 * (M > 2 ? M - 3 : M + 9) + 2) / 5 + D - 1;
+    doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
 /*
 ** Compute the Year, Month, and Day from the julian day number.
 */
 static void computeYMD(DateTime *p)
 {
-    int Z, alpha, A, B, C, D, E, X1;
     if (p->validYMD)
         return;
     if (!p->validJD)
@@ -212,17 +316,7 @@ static void computeYMD(DateTime *p)
     }
     else
     {
-        Z = (int)((p->iJD + 43200000) / 86400000);
-        alpha = (int)((Z + 32044.75) / 36524.25) - 52;
-        A = Z + 1 + alpha - ((alpha + 100) / 4) + 25;
-        B = A + 1524;
-        C = (int)((B - 122.1) / 365.25);
-        D = (36525 * (C & 32767)) / 100;
-        E = (int)((B - D) / 30.6001);
-        X1 = (int)(30.6001 * E);
-        p->D = B - D - X1;
-        p->M = E < 14 ? E - 1 : E - 13;
-        p->Y = p->M > 2 ? C - 4716 : C - 4715;
+        civilFromDays((p->iJD + 43200000) / 86400000 - 2440588, &p->Y, &p->M, &p->D);
     }
     p->validYMD = 1;
 }
@@ -237,7 +331,8 @@ static void computeHMS(DateTime *p)
         return;
     computeJD(p);
     day_ms = (int)((p->iJD + 43200000) % 86400000);
-    p->s = (day_ms % 60000) / 1000.0;
+    p->s = (day_ms % 60000) / 1000;
+    p->ns = (day_ms % 1000) * 1000000 + p->iNs;
     day_min = day_ms / 60000;
     p->m = day_min % 60;
     p->h = day_min / 60;
@@ -342,15 +437,11 @@ static void autoAdjustDate(DateTime *p)
     {
         p->rawS = 0;
     }
-    else if (p->s >= -21086676 * (int64_t)10000           /* -4713-11-24 12:00:00 */
-             && p->s <= (25340230 * (int64_t)10000) + 799 /*  9999-12-31 23:59:59 */
+    else if (p->rRaw >= -21086676 * (int64_t)10000           /* -4713-11-24 12:00:00 */
+             && p->rRaw <= (25340230 * (int64_t)10000) + 799 /*  9999-12-31 23:59:59 */
     )
     {
-        double r = p->s * 1000.0 + 210866760000000.0;
-        clearYMD_HMS_TZ(p);
-        p->iJD = (int64_t)(r + 0.5);
-        p->validJD = 1;
-        p->rawS = 0;
+        setRawUnixepoch(p);
     }
 }
 
@@ -418,14 +509,15 @@ zulu_time:
 /*
 ** Parse times of the form HH:MM or HH:MM:SS or HH:MM:SS.FFFF.
 ** The HH, MM, and SS must each be exactly 2 digits.  The
-** fractional seconds FFFF can be one or more digits.
+** fractional seconds FFFF can be one or more digits, digits past
+** the nanosecond are ignored.
 **
 ** Return 1 if there is a parsing error and 0 on success.
 */
 static int parseHhMmSs(const char *zDate, DateTime *p)
 {
     int h, m, s;
-    double ms = 0.0;
+    int ns = 0;
     if (getDigits(zDate, "20c:20e", &h, &m) != 2)
     {
         return 1;
@@ -441,15 +533,16 @@ static int parseHhMmSs(const char *zDate, DateTime *p)
         zDate += 2;
         if (*zDate == '.' && isdigit(zDate[1]))
         {
-            double rScale = 1.0;
+            int nDigit = 0;
             zDate++;
             while (isdigit(*zDate))
             {
-                ms = ms * 10.0 + *zDate - '0';
-                rScale *= 10.0;
+                if (nDigit++ < 9)
+                    ns = ns * 10 + *zDate - '0';
                 zDate++;
             }
-            ms /= rScale;
+            while (nDigit++ < 9)
+                ns *= 10;
         }
     }
     else
@@ -461,7 +554,8 @@ static int parseHhMmSs(const char *zDate, DateTime *p)
     p->validHMS = 1;
     p->h = h;
     p->m = m;
-    p->s = s + ms;
+    p->s = s;
+    p->ns = ns;
     if (parseTimezone(zDate, p))
         return 1;
     return 0;
@@ -559,7 +653,7 @@ static int parseDateOrTime(const char *zDate, DateTime *p)
     }
     else if (atoF(zDate, &r) > 0)
     {
-        setRawDateNumber(p, r);
+        setRawDateNumber(p, zDate, r);
         return 0;
     }
     else if ((strcmp(zDate, "subsec") == 0 || strcmp(zDate, "subsecond") == 0))
@@ -570,66 +664,55 @@ static int parseDateOrTime(const char *zDate, DateTime *p)
     return 1;
 }
 
-static int osLocaltime(time_t *t, struct tm *pTm)
+/*
+** Shift the UTC time in p to the wall clock time of zone pZone (or the
+** process local zone if pZone is NULL).  The zone tables cover every
+** year, so no mapping into the 1970-2037 range is needed.
+*/
+static int toLocaltime(DateTime *p, const tzone *pZone)
 {
-    struct tm *pX;
-    pX = localtime(t);
-    if (pX)
-    {
-        *pTm = *pX;
-        return 0;
-    }
-    return 1;
+    int64_t t;
+    if (pZone == NULL)
+        pZone = tzone_local();
+    computeJD(p);
+    if (p->isError)
+        return 1;
+    t = p->iJD / 1000 - 21086676 * (int64_t)10000;
+    p->iJD += (int64_t)tzone_offset(pZone, t, NULL, NULL) * 1000;
+    clearYMD_HMS_TZ(p);
+    computeYMD_HMS(p);
+    p->validJD = 1;
+    p->rawS = 0;
+    p->isError = 0;
+    p->pZone = pZone;
+    return 0;
 }
 
-static int toLocaltime(DateTime *p)
+/*
+** Convert the local time in p, in zone p->pZone, back to UTC.
+*/
+static int toUtc(DateTime *p)
 {
-    time_t t;
-    struct tm sLocal;
-    int iYearDiff;
-
-    /* Initialize the contents of sLocal to avoid a compiler warning. */
-    memset(&sLocal, 0, sizeof(sLocal));
-
+    int64_t t;
+    const tzone *pZone = p->pZone ? p->pZone : tzone_local();
+    int useSubsec = p->useSubsec;
+    int nSubsec = p->nSubsec;
+    int iNs;
     computeJD(p);
-    if (p->iJD < 2108667600 * (int64_t)100000    /* 1970-01-01 */
-        || p->iJD > 2130141456 * (int64_t)100000 /* 2038-01-18 */
-    )
-    {
-        /* EVIDENCE-OF: R-55269-29598 The localtime_r() C function normally only
-        ** works for years between 1970 and 2037. For dates outside this range,
-        ** SQLite attempts to map the year into an equivalent year within this
-        ** range, do the calculation, then map the year back.
-        */
-        DateTime x = *p;
-        computeYMD_HMS(&x);
-        iYearDiff = (2000 + x.Y % 4) - x.Y;
-        x.Y += iYearDiff;
-        x.validJD = 0;
-        computeJD(&x);
-        t = (time_t)(x.iJD / 1000 - 21086676 * (int64_t)10000);
-    }
-    else
-    {
-        iYearDiff = 0;
-        t = (time_t)(p->iJD / 1000 - 21086676 * (int64_t)10000);
-    }
-    if (osLocaltime(&t, &sLocal))
-    {
+    if (p->isError)
         return 1;
-    }
-    p->Y = sLocal.tm_year + 1900 - iYearDiff;
-    p->M = sLocal.tm_mon + 1;
-    p->D = sLocal.tm_mday;
-    p->h = sLocal.tm_hour;
-    p->m = sLocal.tm_min;
-    p->s = sLocal.tm_sec + (p->iJD % 1000) * 0.001;
-    p->validYMD = 1;
-    p->validHMS = 1;
-    p->validJD = 0;
-    p->rawS = 0;
-    p->tz = 0;
-    p->isError = 0;
+    t = p->iJD / 1000 - 21086676 * (int64_t)10000;
+    t = tzone_to_utc(pZone, t);
+    t = (t + 21086676 * (int64_t)10000) * 1000 + p->iJD % 1000;
+    iNs = p->iNs;
+    memset(p, 0, sizeof(*p));
+    p->iJD = t;
+    p->iNs = iNs;
+    p->nSubsec = nSubsec;
+    p->validJD = 1;
+    p->isUtc = 1;
+    p->isLocal = 0;
+    p->useSubsec = useSubsec;
     return 0;
 }
 
@@ -669,6 +752,7 @@ static const struct
 **     unixepoch
 **     auto
 **     localtime
+**     tz:NAME
 **     utc
 **     subsec
 **     subsecond
@@ -772,7 +856,7 @@ static int parseModifier(
         */
         if (strcmp(z, "localtime") == 0)
         {
-            rc = p->isLocal ? 0 : toLocaltime(p);
+            rc = p->isLocal ? 0 : toLocaltime(p, NULL);
             p->isUtc = 0;
             p->isLocal = 1;
         }
@@ -790,48 +874,38 @@ static int parseModifier(
         {
             if (idx > 1)
                 return 1; /* IMP: R-49255-55373 */
-            r = p->s * 1000.0 + 210866760000000.0;
+            r = p->rRaw * 1000.0 + 210866760000000.0;
             if (r >= 0.0 && r < 464269060800000.0)
             {
-                clearYMD_HMS_TZ(p);
-                p->iJD = (int64_t)(r + 0.5);
-                p->validJD = 1;
-                p->rawS = 0;
+                setRawUnixepoch(p);
                 rc = 0;
             }
         }
         else if (strcmp(z, "utc") == 0)
         {
-            if (p->isUtc == 0)
-            {
-                int64_t iOrigJD; /* Original localtime */
-                int64_t iGuess;  /* Guess at the corresponding utc time */
-                int cnt = 0;     /* Safety to prevent infinite loop */
-                int64_t iErr;    /* Guess is off by this much */
-
-                computeJD(p);
-                iGuess = iOrigJD = p->iJD;
-                iErr = 0;
-                do
-                {
-                    DateTime new;
-                    memset(&new, 0, sizeof(new));
-                    iGuess -= iErr;
-                    new.iJD = iGuess;
-                    new.validJD = 1;
-                    rc = toLocaltime(&new);
-                    if (rc)
-                        return rc;
-                    computeJD(&new);
-                    iErr = new.iJD - iOrigJD;
-                } while (iErr && cnt++ < 3);
-                memset(p, 0, sizeof(*p));
-                p->iJD = iGuess;
-                p->validJD = 1;
-                p->isUtc = 1;
-                p->isLocal = 0;
-            }
-            rc = 0;
+            rc = p->isUtc ? 0 : toUtc(p);
+        }
+        break;
+    }
+    case 't':
+    {
+        /*
+        **    tz:NAME
+        **
+        ** Show the time in the named zone, for example "tz:Asia/Shanghai".
+        ** A value that is already local to some zone is first taken back
+        ** to UTC.
+        */
+        if (strncmp(z, "tz:", 3) == 0)
+        {
+            const tzone *pZone = tzone_get(z + 3);
+            if (pZone == NULL)
+                break;
+            if (p->isLocal && toUtc(p))
+                break;
+            rc = toLocaltime(p, pZone);
+            p->isUtc = 0;
+            p->isLocal = 1;
         }
         break;
     }
@@ -870,9 +944,10 @@ static int parseModifier(
         **
         **    subsecond
         **    subsec
+        **    subsec:N
         **
         ** Show subsecond precision in the output of datetime() and
-        ** unixepoch() and strftime('%s').
+        ** unixepoch() and strftime('%s'), with N = 3, 6 or 9 digits.
         */
         if (strncmp(z, "start of ", 9) != 0)
         {
@@ -881,6 +956,12 @@ static int parseModifier(
                 p->useSubsec = 1;
                 rc = 0;
             }
+            else if (strncmp(z, "subsec:", 7) == 0 && (z[7] == '3' || z[7] == '6' || z[7] == '9') && z[8] == 0)
+            {
+                p->useSubsec = 1;
+                p->nSubsec = z[7] - '0';
+                rc = 0;
+            }
             break;
         }
         if (!p->validJD && !p->validYMD && !p->validHMS)
@@ -889,7 +970,8 @@ static int parseModifier(
         computeYMD(p);
         p->validHMS = 1;
         p->h = p->m = 0;
-        p->s = 0.0;
+        p->s = 0;
+        p->ns = 0;
         p->rawS = 0;
         p->tz = 0;
         p->validJD = 0;
@@ -927,6 +1009,7 @@ static int parseModifier(
         int i;
         int Y, M, D, h, m, x;
         const char *z2 = z;
+        const char *zNum = z;
         char z0 = z[0];
         for (n = 1; z[n]; n++)
         {
@@ -1017,6 +1100,7 @@ static int parseModifier(
 
             DateTime tx;
             int64_t day;
+            int ns;
             if (!isdigit(*z2))
                 z2++;
             memset(&tx, 0, sizeof(tx));
@@ -1026,11 +1110,15 @@ static int parseModifier(
             tx.iJD -= 43200000;
             day = tx.iJD / 86400000;
             tx.iJD -= day * 86400000;
+            ns = tx.iNs;
             if (z0 == '-')
+            {
                 tx.iJD = -tx.iJD;
+                ns = -ns;
+            }
             computeJD(p);
             clearYMD_HMS_TZ(p);
-            p->iJD += tx.iJD;
+            addJD(p, tx.iJD, ns);
             rc = 0;
             break;
         }
@@ -1055,6 +1143,18 @@ static int parseModifier(
             {
                 switch (i)
                 {
+                case 0:
+                { /* Whole and fractional seconds are added exactly */
+                    int64_t iS;
+                    int iFrac;
+                    if (r > -9e9 && r < 9e9 && splitDecimal(zNum, &iS, &iFrac) > 0)
+                    {
+                        computeJD(p);
+                        addJD(p, iS * 1000 + iFrac / 1000000, iFrac % 1000000);
+                        r = 0.0;
+                    }
+                    break;
+                }
                 case 4:
                 { /* Special processing to add months */
                     assert(strcmp(aXformType[4].zName, "month") == 0);
@@ -1120,19 +1220,24 @@ static int valueIsNumber(const char *v)
     return 1;
 }
 
-static int isDate(int argc, char *argv[], DateTime *p)
+static int isDate(int argc, const char *const *argv, DateTime *p)
 {
     int n;
     const char *z;
+    memset(p, 0, sizeof(*p));
     if (argc == 0)
     {
         return setDateTimeToCurrent(p);
     }
+    if (argv[0] == NULL)
+    {
+        return 1;
+    }
     if (valueIsNumber(argv[0]))
     {
-        setRawDateNumber(p, strtod(argv[0], NULL));
+        setRawDateNumber(p, argv[0], strtod(argv[0], NULL));
     }
-    else if (!argv[0] || parseDateOrTime(argv[0], p))
+    else if (parseDateOrTime(argv[0], p))
     {
         return 1;
     }
@@ -1140,8 +1245,10 @@ static int isDate(int argc, char *argv[], DateTime *p)
     for (int i = 1; i < argc; i++)
     {
         z = argv[i];
+        if (z == NULL)
+            return 1;
         n = strlen(z);
-        if (argv[i] == NULL || parseModifier(z, n, p, i))
+        if (parseModifier(z, n, p, i))
             return 1;
     }
     computeJD(p);
@@ -1157,244 +1264,530 @@ static int isDate(int argc, char *argv[], DateTime *p)
     return 0;
 }
 
-double dt_julianday(int argc, ...)
+int dt_parse(DateTime *p, int argc, const char *const *argv)
 {
-    va_list ap;
-    char *argv[32];
-    DateTime x;
-    va_start(ap, argc);
-    for (int i = 0; i < argc; i++)
-    {
-        argv[i] = va_arg(ap, char *);
-    }
-    va_end(ap);
-    if (isDate(argc, argv, &x) == 0)
+    return isDate(argc, argv, p);
+}
+
+int dt_from_unix(DateTime *p, int64_t sec, int nsec)
+{
+    memset(p, 0, sizeof(*p));
+    sec += floorDiv64(nsec, 1000000000);
+    nsec -= (int)floorDiv64(nsec, 1000000000) * 1000000000;
+    if (sec < -21086676 * (int64_t)10000 || sec > (25340230 * (int64_t)10000) + 799)
     {
-        computeJD(&x);
-        return (double)x.iJD / 86400000.0;
+        p->isError = 1;
+        return 1;
     }
-    return 0.0;
+    p->iJD = (sec + 21086676 * (int64_t)10000) * 1000 + nsec / 1000000;
+    p->iNs = nsec % 1000000;
+    p->validJD = 1;
+    p->isUtc = 1;
+    return 0;
 }
 
-const char *dt_datetime(int argc, ...)
+int dt_from_unix_ns(DateTime *p, int64_t ns)
 {
-    DateTime x;
-    va_list ap;
-    char *argv[32];
-    va_start(ap, argc);
-    for (int i = 0; i < argc; i++)
+    int64_t sec = floorDiv64(ns, 1000000000);
+    return dt_from_unix(p, sec, (int)(ns - sec * 1000000000));
+}
+
+int dt_to_unix(const DateTime *p, int64_t *pSec, int *pNsec)
+{
+    DateTime x = *p;
+    int64_t ms;
+    computeJD(&x);
+    if (x.isError || !validJulianDay(x.iJD))
+        return 1;
+    ms = x.iJD - 21086676 * (int64_t)10000000;
+    *pSec = floorDiv64(ms, 1000);
+    *pNsec = (int)(ms - *pSec * 1000) * 1000000 + x.iNs;
+    return 0;
+}
+
+int dt_to_unix_ns(const DateTime *p, int64_t *pNs)
+{
+    int64_t sec;
+    int nsec;
+    if (dt_to_unix(p, &sec, &nsec))
+        return 1;
+    if (sec < -9223372036LL || sec > 9223372035LL)
+        return 1;
+    *pNs = sec * 1000000000 + nsec;
+    return 0;
+}
+
+/*
+** Time bucketing on unix integers.  The fixed units reduce to a floor
+** modulo step; the calendar units go through the civil day number of the
+** local time.  A zone offset only needs to be looked up again when a
+** boundary falls on the other side of a transition.
+*/
+int dt_bucket_init(dt_bucket *b, int n, int unit, const struct tzone *pZone, int64_t res)
+{
+    static const int64_t aSec[] = {1, 60, 3600};
+    memset(b, 0, sizeof(*b));
+    if (n <= 0 || res <= 0 || unit < DT_UNIT_SECOND || unit > DT_UNIT_YEAR)
+        return 1;
+    if (unit <= DT_UNIT_HOUR)
     {
-        argv[i] = va_arg(ap, char *);
+        if (n > INT64_MAX / aSec[unit] / res)
+            return 1;
+        b->step = n * aSec[unit] * res;
     }
-    va_end(ap);
-    if (isDate(argc, argv, &x) == 0)
-    {
-        int Y, s;
-        static __declspec(thread) char zBuf[32];
-        computeYMD_HMS(&x);
-        Y = x.Y;
-        if (Y < 0)
-            Y = -Y;
-        zBuf[1] = '0' + (Y / 1000) % 10;
-        zBuf[2] = '0' + (Y / 100) % 10;
-        zBuf[3] = '0' + (Y / 10) % 10;
-        zBuf[4] = '0' + (Y) % 10;
-        zBuf[5] = '-';
-        zBuf[6] = '0' + (x.M / 10) % 10;
-        zBuf[7] = '0' + (x.M) % 10;
-        zBuf[8] = '-';
-        zBuf[9] = '0' + (x.D / 10) % 10;
-        zBuf[10] = '0' + (x.D) % 10;
-        zBuf[11] = ' ';
-        zBuf[12] = '0' + (x.h / 10) % 10;
-        zBuf[13] = '0' + (x.h) % 10;
-        zBuf[14] = ':';
-        zBuf[15] = '0' + (x.m / 10) % 10;
-        zBuf[16] = '0' + (x.m) % 10;
-        zBuf[17] = ':';
-        if (x.useSubsec)
-        {
-            s = (int)(1000.0 * x.s + 0.5);
-            zBuf[18] = '0' + (s / 10000) % 10;
-            zBuf[19] = '0' + (s / 1000) % 10;
-            zBuf[20] = '.';
-            zBuf[21] = '0' + (s / 100) % 10;
-            zBuf[22] = '0' + (s / 10) % 10;
-            zBuf[23] = '0' + (s) % 10;
-            zBuf[24] = 0;
-        }
-        else
-        {
-            s = (int)x.s;
-            zBuf[18] = '0' + (s / 10) % 10;
-            zBuf[19] = '0' + (s) % 10;
-            zBuf[20] = 0;
-        }
-        if (x.Y < 0)
-        {
-            zBuf[0] = '-';
-            return zBuf;
-        }
-        else
+    b->unit = unit;
+    b->n = n;
+    b->res = res;
+    b->pZone = pZone;
+    return 0;
+}
+
+/*
+** Convert local seconds to unix seconds.  off is the offset of a nearby
+** instant and is tried first.
+*/
+static int64_t bucketToUtc(const dt_bucket *b, int64_t local, int32_t off)
+{
+    if (b->pZone == NULL)
+        return local;
+    if (tzone_offset(b->pZone, local - off, NULL, NULL) == off)
+        return local - off;
+    return tzone_to_utc(b->pZone, local);
+}
+
+/*
+** Return the bucket holding t and store the start of the next one in
+** *pNext.
+*/
+static int64_t bucketCalc(const dt_bucket *b, int64_t t, int64_t *pNext)
+{
+    int64_t sec = floorDiv64(t, b->res);
+    int32_t off = b->pZone ? tzone_offset(b->pZone, sec, NULL, NULL) : 0;
+    int64_t local = sec + off, days, lo, hi;
+    int Y, M, D;
+    switch (b->unit)
+    {
+    case DT_UNIT_SECOND:
+    case DT_UNIT_MINUTE:
+    case DT_UNIT_HOUR:
+    {
+        int64_t lt = t + (int64_t)off * b->res, sub;
+        lt -= lt - floorDiv64(lt, b->step) * b->step;
+        if (b->pZone == NULL)
         {
-            return &zBuf[1];
+            *pNext = lt + b->step;
+            return lt;
         }
+        sec = floorDiv64(lt, b->res);
+        sub = lt - sec * b->res;
+        lo = bucketToUtc(b, sec, off) * b->res + sub;
+        lt += b->step;
+        sec = floorDiv64(lt, b->res);
+        sub = lt - sec * b->res;
+        *pNext = bucketToUtc(b, sec, off) * b->res + sub;
+        return lo;
+    }
+    case DT_UNIT_DAY:
+    {
+        days = floorDiv64(local, 86400);
+        days -= days - floorDiv64(days, b->n) * b->n;
+        lo = days;
+        hi = days + b->n;
+        break;
+    }
+    case DT_UNIT_WEEK:
+    {
+        /* 1969-12-29 was a Monday, 3 days before the epoch */
+        int64_t w = floorDiv64(floorDiv64(local, 86400) + 3, 7);
+        w -= w - floorDiv64(w, b->n) * b->n;
+        lo = w * 7 - 3;
+        hi = lo + (int64_t)b->n * 7;
+        break;
     }
-    return NULL;
+    default:
+    {
+        int64_t m, n = b->unit == DT_UNIT_YEAR ? (int64_t)b->n * 12 : b->n;
+        civilFromDays(floorDiv64(local, 86400), &Y, &M, &D);
+        m = (int64_t)Y * 12 + M - 1;
+        m -= m - floorDiv64(m, n) * n;
+        lo = daysFromCivil(floorDiv64(m, 12), (int)(m - floorDiv64(m, 12) * 12) + 1, 1);
+        m += n;
+        hi = daysFromCivil(floorDiv64(m, 12), (int)(m - floorDiv64(m, 12) * 12) + 1, 1);
+        break;
+    }
+    }
+    *pNext = bucketToUtc(b, hi * 86400, off) * b->res;
+    return bucketToUtc(b, lo * 86400, off) * b->res;
 }
 
-int64_t dt_unixepoch(int argc, ...)
+int64_t dt_bucket_floor(const dt_bucket *b, int64_t t)
 {
-    va_list ap;
-    char *argv[32];
-    DateTime x;
-    va_start(ap, argc);
-    for (int i = 0; i < argc; i++)
-    {
-        argv[i] = va_arg(ap, char *);
-    }
-    va_end(ap);
-    if (isDate(argc, argv, &x) == 0)
+    int64_t next;
+    if (b->step && b->pZone == NULL)
+        return t - (t - floorDiv64(t, b->step) * b->step);
+    return bucketCalc(b, t, &next);
+}
+
+int64_t dt_bucket_ceil(const dt_bucket *b, int64_t t)
+{
+    int64_t next, lo;
+    if (b->step && b->pZone == NULL)
     {
-        computeJD(&x);
-        return x.iJD / 1000 - 21086676 * (int64_t)10000;
+        lo = t - (t - floorDiv64(t, b->step) * b->step);
+        return lo == t ? t : lo + b->step;
     }
-    return 0;
+    lo = bucketCalc(b, t, &next);
+    return lo == t ? t : next;
 }
 
-const char *dt_date(int argc, ...)
+void dt_bucket_floor_array(const dt_bucket *b, const int64_t *in, int64_t *out, int count)
 {
-    DateTime x;
-    va_list ap;
-    char *argv[32];
-    va_start(ap, argc);
-    for (int i = 0; i < argc; i++)
+    int64_t lo = 0, hi = 0;
+    if (b->step && b->pZone == NULL)
     {
-        argv[i] = va_arg(ap, char *);
+        for (int i = 0; i < count; i++)
+            out[i] = in[i] - (in[i] - floorDiv64(in[i], b->step) * b->step);
+        return;
     }
-    va_end(ap);
-    if (isDate(argc, argv, &x) == 0)
-    {
-        int Y;
-        static __declspec(thread) char zBuf[16];
-        computeYMD(&x);
-        Y = x.Y;
-        if (Y < 0)
-            Y = -Y;
-        zBuf[1] = '0' + (Y / 1000) % 10;
-        zBuf[2] = '0' + (Y / 100) % 10;
-        zBuf[3] = '0' + (Y / 10) % 10;
-        zBuf[4] = '0' + (Y) % 10;
-        zBuf[5] = '-';
-        zBuf[6] = '0' + (x.M / 10) % 10;
-        zBuf[7] = '0' + (x.M) % 10;
-        zBuf[8] = '-';
-        zBuf[9] = '0' + (x.D / 10) % 10;
-        zBuf[10] = '0' + (x.D) % 10;
-        zBuf[11] = 0;
-        if (x.Y < 0)
-        {
-            zBuf[0] = '-';
-            return zBuf;
-        }
-        else
-        {
-            return &zBuf[1];
-        }
+    for (int i = 0; i < count; i++)
+    {
+        int64_t t = in[i];
+        if (t < lo || t >= hi)
+            lo = bucketCalc(b, t, &hi);
+        out[i] = lo;
     }
-    return NULL;
 }
 
-const char *dt_time(int argc, ...)
+void dt_bucket_ceil_array(const dt_bucket *b, const int64_t *in, int64_t *out, int count)
 {
-    DateTime x;
-    va_list ap;
-    char *argv[32];
-    va_start(ap, argc);
-    for (int i = 0; i < argc; i++)
+    int64_t lo = 0, hi = 0;
+    for (int i = 0; i < count; i++)
     {
-        argv[i] = va_arg(ap, char *);
-    }
-    va_end(ap);
-    if (isDate(argc, argv, &x) == 0)
-    {
-        int s, n;
-        static __declspec(thread) char zBuf[16];
-        computeHMS(&x);
-        zBuf[0] = '0' + (x.h / 10) % 10;
-        zBuf[1] = '0' + (x.h) % 10;
-        zBuf[2] = ':';
-        zBuf[3] = '0' + (x.m / 10) % 10;
-        zBuf[4] = '0' + (x.m) % 10;
-        zBuf[5] = ':';
-        if (x.useSubsec)
-        {
-            s = (int)(1000.0 * x.s + 0.5);
-            zBuf[6] = '0' + (s / 10000) % 10;
-            zBuf[7] = '0' + (s / 1000) % 10;
-            zBuf[8] = '.';
-            zBuf[9] = '0' + (s / 100) % 10;
-            zBuf[10] = '0' + (s / 10) % 10;
-            zBuf[11] = '0' + (s) % 10;
-            zBuf[12] = 0;
-            n = 12;
-        }
-        else
+        int64_t t = in[i];
+        if (t < lo || t >= hi)
         {
-            s = (int)x.s;
-            zBuf[6] = '0' + (s / 10) % 10;
-            zBuf[7] = '0' + (s) % 10;
-            zBuf[8] = 0;
-            n = 8;
+            if (b->step && b->pZone == NULL)
+            {
+                lo = t - (t - floorDiv64(t, b->step) * b->step);
+                hi = lo + b->step;
+            }
+            else
+            {
+                lo = bucketCalc(b, t, &hi);
+            }
         }
-        return zBuf;
+        out[i] = lo == t ? t : hi;
     }
-    return NULL;
 }
 
 /*
-** timediff(DATE1, DATE2)
-**
-** Return the amount of time that must be added to DATE2 in order to
-** convert it into DATE2.  The time difference format is:
-**
-**     +YYYY-MM-DD HH:MM:SS.SSS
-**
-** The initial "+" becomes "-" if DATE1 occurs before DATE2.  For
-** date/time values A and B, the following invariant should hold:
-**
-**     datetime(A) == (datetime(B, timediff(A,B))
-**
-** Both DATE arguments must be either a julian day number, or an
-** ISO-8601 string.  The unix timestamps are not supported by this
-** routine.
+** Copy len bytes of z to the caller buffer the way snprintf would.
 */
-const char *dt_timediff(int argc, ...)
+static int dtOut(char *buf, int n, const char *z, int len)
 {
-    char sign;
-    int Y, M;
-    DateTime d1, d2;
-    va_list ap;
-    char *argv[32];
-    static __declspec(thread) char sres[32];
-    sres[0] = 0;
-    if (argc < 2)
-        return NULL;
-    va_start(ap, argc);
+    if (n > 0)
+    {
+        int nCopy = len < n - 1 ? len : n - 1;
+        memcpy(buf, z, nCopy);
+        buf[nCopy] = 0;
+    }
+    return len;
+}
+
+/*
+** Gather the varargs of the text API into argv.
+*/
+static int collectArgs(const char **argv, int argc, va_list ap)
+{
+    if (argc < 0 || argc > DT_MAX_ARGS)
+        return 1;
     for (int i = 0; i < argc; i++)
     {
-        argv[i] = va_arg(ap, char *);
+        argv[i] = va_arg(ap, const char *);
     }
+    return 0;
+}
+
+double dt_julianday(int argc, ...)
+{
+    va_list ap;
+    const char *argv[DT_MAX_ARGS];
+    DateTime x;
+    int rc;
+    va_start(ap, argc);
+    rc = collectArgs(argv, argc, ap);
     va_end(ap);
-    if (isDate(1, &argv[0], &d1))
+    if (rc == 0 && isDate(argc, argv, &x) == 0)
+    {
+        computeJD(&x);
+        return (double)x.iJD / 86400000.0;
+    }
+    return 0.0;
+}
+
+static char *put2(char *z, int v)
+{
+    z[0] = '0' + (v / 10) % 10;
+    z[1] = '0' + v % 10;
+    return z + 2;
+}
+
+/*
+** Write v the way printf("%0Nd") or printf("%Nd") would.
+*/
+static char *putInt(char *z, int64_t v, int width, char pad)
+{
+    char zTmp[24];
+    int n = 0, neg = v < 0;
+    uint64_t u = neg ? (uint64_t)0 - (uint64_t)v : (uint64_t)v;
+    do
+    {
+        zTmp[n++] = '0' + (char)(u % 10);
+        u /= 10;
+    } while (u);
+    width -= n + neg;
+    if (pad == ' ')
+        while (width-- > 0)
+            *z++ = ' ';
+    if (neg)
+        *z++ = '-';
+    while (width-- > 0)
+        *z++ = '0';
+    while (n)
+        *z++ = zTmp[--n];
+    return z;
+}
+
+/*
+** Write "." and the leading nDigit digits of the nanoseconds ns.
+*/
+static char *putFrac(char *z, int ns, int nDigit)
+{
+    int i;
+    for (i = 9; i > nDigit; i--)
+        ns /= 10;
+    z[0] = '.';
+    for (i = nDigit; i > 0; i--)
+    {
+        z[i] = '0' + ns % 10;
+        ns /= 10;
+    }
+    return z + 1 + nDigit;
+}
+
+/*
+** Write "SS.FFF" for x, with x->nSubsec (default 3) fraction digits.
+*/
+static char *putSubsec(char *z, const DateTime *x)
+{
+    z[0] = '0' + (x->s / 10) % 10;
+    z[1] = '0' + x->s % 10;
+    return putFrac(z + 2, x->ns, x->nSubsec ? x->nSubsec : 3);
+}
+
+int dt_datetime_r(char *buf, int n, int argc, const char *const *argv)
+{
+    DateTime x;
+    int Y, s, len;
+    char zBuf[40];
+    if (isDate(argc, argv, &x))
+        return -1;
+    computeYMD_HMS(&x);
+    Y = x.Y;
+    if (Y < 0)
+        Y = -Y;
+    zBuf[1] = '0' + (Y / 1000) % 10;
+    zBuf[2] = '0' + (Y / 100) % 10;
+    zBuf[3] = '0' + (Y / 10) % 10;
+    zBuf[4] = '0' + (Y) % 10;
+    zBuf[5] = '-';
+    zBuf[6] = '0' + (x.M / 10) % 10;
+    zBuf[7] = '0' + (x.M) % 10;
+    zBuf[8] = '-';
+    zBuf[9] = '0' + (x.D / 10) % 10;
+    zBuf[10] = '0' + (x.D) % 10;
+    zBuf[11] = ' ';
+    zBuf[12] = '0' + (x.h / 10) % 10;
+    zBuf[13] = '0' + (x.h) % 10;
+    zBuf[14] = ':';
+    zBuf[15] = '0' + (x.m / 10) % 10;
+    zBuf[16] = '0' + (x.m) % 10;
+    zBuf[17] = ':';
+    if (x.useSubsec)
+    {
+        len = (int)(putSubsec(&zBuf[18], &x) - zBuf);
+    }
+    else
+    {
+        s = x.s;
+        zBuf[18] = '0' + (s / 10) % 10;
+        zBuf[19] = '0' + (s) % 10;
+        len = 20;
+    }
+    if (x.Y < 0)
+    {
+        zBuf[0] = '-';
+        return dtOut(buf, n, zBuf, len);
+    }
+    return dtOut(buf, n, &zBuf[1], len - 1);
+}
+
+const char *dt_datetime(int argc, ...)
+{
+    static ATOMIC_THREAD char zBuf[40];
+    const char *argv[DT_MAX_ARGS];
+    va_list ap;
+    int rc;
+    va_start(ap, argc);
+    rc = collectArgs(argv, argc, ap);
+    va_end(ap);
+    if (rc || dt_datetime_r(zBuf, sizeof(zBuf), argc, argv) < 0)
         return NULL;
-    if (isDate(1, &argv[1], &d2))
+    return zBuf;
+}
+
+int64_t dt_unixepoch(int argc, ...)
+{
+    va_list ap;
+    const char *argv[DT_MAX_ARGS];
+    DateTime x;
+    int rc;
+    va_start(ap, argc);
+    rc = collectArgs(argv, argc, ap);
+    va_end(ap);
+    if (rc == 0 && isDate(argc, argv, &x) == 0)
+    {
+        computeJD(&x);
+        return x.iJD / 1000 - 21086676 * (int64_t)10000;
+    }
+    return 0;
+}
+
+/*
+** Like dt_unixepoch() but in nanoseconds.  The range is limited to
+** what an int64_t holds, years 1678 to 2261.
+*/
+int64_t dt_unixepoch_ns(int argc, ...)
+{
+    va_list ap;
+    const char *argv[DT_MAX_ARGS];
+    DateTime x;
+    int64_t ns;
+    int rc;
+    va_start(ap, argc);
+    rc = collectArgs(argv, argc, ap);
+    va_end(ap);
+    if (rc == 0 && isDate(argc, argv, &x) == 0 && dt_to_unix_ns(&x, &ns) == 0)
+        return ns;
+    return 0;
+}
+
+int dt_date_r(char *buf, int n, int argc, const char *const *argv)
+{
+    DateTime x;
+    int Y;
+    char zBuf[16];
+    if (isDate(argc, argv, &x))
+        return -1;
+    computeYMD(&x);
+    Y = x.Y;
+    if (Y < 0)
+        Y = -Y;
+    zBuf[1] = '0' + (Y / 1000) % 10;
+    zBuf[2] = '0' + (Y / 100) % 10;
+    zBuf[3] = '0' + (Y / 10) % 10;
+    zBuf[4] = '0' + (Y) % 10;
+    zBuf[5] = '-';
+    zBuf[6] = '0' + (x.M / 10) % 10;
+    zBuf[7] = '0' + (x.M) % 10;
+    zBuf[8] = '-';
+    zBuf[9] = '0' + (x.D / 10) % 10;
+    zBuf[10] = '0' + (x.D) % 10;
+    if (x.Y < 0)
+    {
+        zBuf[0] = '-';
+        return dtOut(buf, n, zBuf, 11);
+    }
+    return dtOut(buf, n, &zBuf[1], 10);
+}
+
+const char *dt_date(int argc, ...)
+{
+    static ATOMIC_THREAD char zBuf[16];
+    const char *argv[DT_MAX_ARGS];
+    va_list ap;
+    int rc;
+    va_start(ap, argc);
+    rc = collectArgs(argv, argc, ap);
+    va_end(ap);
+    if (rc || dt_date_r(zBuf, sizeof(zBuf), argc, argv) < 0)
+        return NULL;
+    return zBuf;
+}
+
+int dt_time_r(char *buf, int n, int argc, const char *const *argv)
+{
+    DateTime x;
+    int s, len;
+    char zBuf[24];
+    if (isDate(argc, argv, &x))
+        return -1;
+    computeHMS(&x);
+    zBuf[0] = '0' + (x.h / 10) % 10;
+    zBuf[1] = '0' + (x.h) % 10;
+    zBuf[2] = ':';
+    zBuf[3] = '0' + (x.m / 10) % 10;
+    zBuf[4] = '0' + (x.m) % 10;
+    zBuf[5] = ':';
+    if (x.useSubsec)
+    {
+        len = (int)(putSubsec(&zBuf[6], &x) - zBuf);
+    }
+    else
+    {
+        s = x.s;
+        zBuf[6] = '0' + (s / 10) % 10;
+        zBuf[7] = '0' + (s) % 10;
+        len = 8;
+    }
+    return dtOut(buf, n, zBuf, len);
+}
+
+const char *dt_time(int argc, ...)
+{
+    static ATOMIC_THREAD char zBuf[24];
+    const char *argv[DT_MAX_ARGS];
+    va_list ap;
+    int rc;
+    va_start(ap, argc);
+    rc = collectArgs(argv, argc, ap);
+    va_end(ap);
+    if (rc || dt_time_r(zBuf, sizeof(zBuf), argc, argv) < 0)
         return NULL;
+    return zBuf;
+}
+
+/*
+** Calendar difference A - B, the way timediff() defines it: B is moved
+** by whole months (keeping its day of month and time) as close to A as
+** possible without passing it, and the rest is counted in days and
+** nanoseconds.  All components of the result carry the same sign.
+*/
+int dt_diff(dt_duration *pDur, const DateTime *pA, const DateTime *pB)
+{
+    int Y, M, sign;
+    int64_t ms;
+    int ns;
+    DateTime d1 = *pA, d2 = *pB;
+    computeJD(&d1);
+    computeJD(&d2);
+    if (d1.isError || d2.isError)
+        return 1;
     computeYMD_HMS(&d1);
     computeYMD_HMS(&d2);
-    if (d1.iJD >= d2.iJD)
+    if (d1.iJD > d2.iJD || (d1.iJD == d2.iJD && d1.iNs >= d2.iNs))
     {
-        sign = '+';
+        sign = 1;
         Y = d1.Y - d2.Y;
         if (Y)
         {
@@ -1414,7 +1807,7 @@ const char *dt_timediff(int argc, ...)
             d2.validJD = 0;
             computeJD(&d2);
         }
-        while (d1.iJD < d2.iJD)
+        while (d1.iJD < d2.iJD || (d1.iJD == d2.iJD && d1.iNs < d2.iNs))
         {
             M--;
             if (M < 0)
@@ -1431,12 +1824,12 @@ const char *dt_timediff(int argc, ...)
             d2.validJD = 0;
             computeJD(&d2);
         }
-        d1.iJD -= d2.iJD;
-        d1.iJD += (uint64_t)1486995408 * (uint64_t)100000;
+        ms = d1.iJD - d2.iJD;
+        ns = d1.iNs - d2.iNs;
     }
     else /* d1<d2 */
     {
-        sign = '-';
+        sign = -1;
         Y = d2.Y - d1.Y;
         if (Y)
         {
@@ -1456,7 +1849,7 @@ const char *dt_timediff(int argc, ...)
             d2.validJD = 0;
             computeJD(&d2);
         }
-        while (d1.iJD > d2.iJD)
+        while (d1.iJD > d2.iJD || (d1.iJD == d2.iJD && d1.iNs > d2.iNs))
         {
             M--;
             if (M < 0)
@@ -1473,62 +1866,238 @@ const char *dt_timediff(int argc, ...)
             d2.validJD = 0;
             computeJD(&d2);
         }
-        d1.iJD = d2.iJD - d1.iJD;
-        d1.iJD += (uint64_t)1486995408 * (uint64_t)100000;
+        ms = d2.iJD - d1.iJD;
+        ns = d2.iNs - d1.iNs;
     }
-    clearYMD_HMS_TZ(&d1);
-    computeYMD_HMS(&d1);
-    sprintf(sres, "%c%04d-%02d-%02d %02d:%02d:%06.3f", sign, Y, M, d1.D - 1, d1.h, d1.m, d1.s);
-    return sres;
+    if (ns < 0)
+    {
+        ns += 1000000;
+        ms--;
+    }
+    pDur->months = sign * (Y * 12 + M);
+    pDur->days = sign * (int32_t)(ms / 86400000);
+    pDur->ns = sign * ((ms % 86400000) * 1000000 + ns);
+    return 0;
 }
 
-typedef struct dt_str dt_str;
-struct dt_str
+int dt_diff_ns(const DateTime *pA, const DateTime *pB, int64_t *pNs)
 {
-    int m;
-    int l;
-    char d[128];
-};
+    DateTime d1 = *pA, d2 = *pB;
+    int64_t ms;
+    computeJD(&d1);
+    computeJD(&d2);
+    if (d1.isError || d2.isError)
+        return 1;
+    ms = d1.iJD - d2.iJD;
+    if (ms > INT64_MAX / 1000000 - 1 || ms < INT64_MIN / 1000000 + 1)
+        return 1;
+    *pNs = ms * 1000000 + d1.iNs - d2.iNs;
+    return 0;
+}
+
+int dt_cmp(const DateTime *pA, const DateTime *pB)
+{
+    DateTime d1 = *pA, d2 = *pB;
+    computeJD(&d1);
+    computeJD(&d2);
+    if (d1.iJD != d2.iJD)
+        return d1.iJD < d2.iJD ? -1 : 1;
+    if (d1.iNs != d2.iNs)
+        return d1.iNs < d2.iNs ? -1 : 1;
+    return 0;
+}
+
+/*
+** Add the months first (a day of month past the end rolls into the next
+** month, as with the "+N months" modifier), then the days and the time.
+*/
+int dt_add(DateTime *p, const dt_duration *pDur)
+{
+    int64_t ms = pDur->ns / 1000000;
+    int ns = (int)(pDur->ns % 1000000);
+    computeJD(p);
+    if (p->isError)
+        return 1;
+    if (pDur->months)
+    {
+        int x;
+        computeYMD_HMS(p);
+        x = (int)(pDur->months / 12);
+        p->Y += x;
+        p->M += pDur->months - x * 12;
+        x = p->M > 0 ? (p->M - 1) / 12 : (p->M - 12) / 12;
+        p->Y += x;
+        p->M -= x * 12;
+        p->validJD = 0;
+        computeJD(p);
+        if (p->isError)
+            return 1;
+    }
+    clearYMD_HMS_TZ(p);
+    addJD(p, (int64_t)pDur->days * 86400000 + ms, ns);
+    p->rawS = 0;
+    if (!validJulianDay(p->iJD))
+    {
+        datetimeError(p);
+        return 1;
+    }
+    return 0;
+}
 
-static void strInit(dt_str *str)
+int dt_sub(DateTime *p, const dt_duration *pDur)
 {
-    str->m = 128;
-    str->l = 0;
+    dt_duration d;
+    d.months = -pDur->months;
+    d.days = -pDur->days;
+    d.ns = -pDur->ns;
+    return dt_add(p, &d);
 }
 
-static void strAppend(dt_str *str, const char *ss, int n)
+void dt_duration_add(dt_duration *pOut, const dt_duration *pA, const dt_duration *pB)
 {
-    int free = str->m - str->l - 1;
-    if (n > free)
-        n = free;
-    memcpy(str->d, ss, n);
-    str->l += n;
-    str->d[str->l] = 0;
+    pOut->months = pA->months + pB->months;
+    pOut->days = pA->days + pB->days;
+    pOut->ns = pA->ns + pB->ns;
 }
 
-static void strAppendF(dt_str *str, const char *fmt, ...)
+void dt_duration_sub(dt_duration *pOut, const dt_duration *pA, const dt_duration *pB)
 {
-    va_list ap;
-    va_start(ap, fmt);
-    int n = vsnprintf(&str->d[str->l], str->m - str->l - 1, fmt, ap);
-    va_end(ap);
+    pOut->months = pA->months - pB->months;
+    pOut->days = pA->days - pB->days;
+    pOut->ns = pA->ns - pB->ns;
+}
+
+int dt_duration_cmp(const dt_duration *pA, const dt_duration *pB)
+{
+    if (pA->months != pB->months)
+        return pA->months < pB->months ? -1 : 1;
+    if (pA->days != pB->days)
+        return pA->days < pB->days ? -1 : 1;
+    if (pA->ns != pB->ns)
+        return pA->ns < pB->ns ? -1 : 1;
+    return 0;
+}
+
+/*
+** Format as "+YYYY-MM-DD HH:MM:SS.SSS", with nine fraction digits when
+** the duration is not a whole number of milliseconds.  Return values
+** follow snprintf.
+*/
+int dt_duration_format(const dt_duration *pDur, char *buf, int n)
+{
+    char z[48], *p = z;
+    int sign = pDur->months < 0 || pDur->days < 0 || pDur->ns < 0;
+    int64_t months = pDur->months, days = pDur->days, ns = pDur->ns, sec;
+    int len;
+    if (sign)
+    {
+        months = -months;
+        days = -days;
+        ns = -ns;
+    }
+    if (months < 0 || days < 0 || ns < 0)
+        return -1; /* Mixed signs */
+    days += ns / ((int64_t)86400 * 1000000000);
+    ns %= (int64_t)86400 * 1000000000;
+    if (months > 9999 * 12 + 11 || days > 99)
+        return -1;
+    sec = ns / 1000000000;
+    *p++ = sign ? '-' : '+';
+    p = putInt(p, months / 12, 4, '0');
+    *p++ = '-';
+    p = put2(p, (int)(months % 12));
+    *p++ = '-';
+    p = put2(p, (int)days);
+    *p++ = ' ';
+    p = put2(p, (int)(sec / 3600));
+    *p++ = ':';
+    p = put2(p, (int)(sec / 60 % 60));
+    *p++ = ':';
+    p = put2(p, (int)(sec % 60));
+    ns %= 1000000000;
+    p = putFrac(p, (int)ns, ns % 1000000 ? 9 : 3);
+    len = (int)(p - z);
     if (n > 0)
     {
-        str->l += n;
+        int nCopy = len < n - 1 ? len : n - 1;
+        memcpy(buf, z, nCopy);
+        buf[nCopy] = 0;
     }
-    str->d[str->l] = 0;
+    return len;
 }
 
-static void strAppendChar(dt_str *str, int n, char c)
+/*
+** timediff(DATE1, DATE2)
+**
+** Return the amount of time that must be added to DATE2 in order to
+** convert it into DATE2.  The time difference format is:
+**
+**     +YYYY-MM-DD HH:MM:SS.SSS
+**
+** The initial "+" becomes "-" if DATE1 occurs before DATE2.  For
+** date/time values A and B, the following invariant should hold:
+**
+**     datetime(A) == (datetime(B, timediff(A,B))
+**
+** Both DATE arguments must be either a julian day number, or an
+** ISO-8601 string.  The unix timestamps are not supported by this
+** routine.  See dt_diff() for the same without text.
+*/
+int dt_timediff_r(char *buf, int n, int argc, const char *const *argv)
 {
-    if (str->l + n + 1 <= str->m)
-    {
-        while (n--)
-        {
-            str->d[str->l++] = c;
-        }
-        str->d[str->l] = 0;
+    DateTime d1, d2;
+    dt_duration dur;
+    if (argc < 2)
+        return -1;
+    if (isDate(1, &argv[0], &d1))
+        return -1;
+    if (isDate(1, &argv[1], &d2))
+        return -1;
+    if (dt_diff(&dur, &d1, &d2))
+        return -1;
+    return dt_duration_format(&dur, buf, n);
+}
+
+const char *dt_timediff(int argc, ...)
+{
+    static ATOMIC_THREAD char sres[48];
+    const char *argv[DT_MAX_ARGS];
+    va_list ap;
+    int rc;
+    va_start(ap, argc);
+    rc = collectArgs(argv, argc, ap);
+    va_end(ap);
+    if (rc || dt_timediff_r(sres, sizeof(sres), argc, argv) < 0)
+        return NULL;
+    return sres;
+}
+
+typedef struct dt_str dt_str;
+struct dt_str
+{
+    int m;
+    int l;
+    char *d;
+};
+
+/*
+** Make room for at least n more bytes plus the terminator.
+*/
+static int strReserve(dt_str *str, int n)
+{
+    if (str->l + n + 1 > str->m)
+    {
+        int m = str->m ? str->m : 128;
+        char *d;
+        while (m < str->l + n + 1)
+            m *= 2;
+        d = (char *)realloc(str->d, m);
+        if (d == NULL)
+            return 1;
+        str->d = d;
+        str->m = m;
     }
+    return 0;
 }
 
 /*
@@ -1582,238 +2151,1707 @@ static int daysAfterSunday(DateTime *pDate)
 }
 
 /*
-**    strftime( FORMAT, TIMESTRING, MOD, MOD, ...)
-**
-** Return a string described by FORMAT.  Conversions as follows:
-**
-**   %d  day of month  01-31
-**   %e  day of month  1-31
-**   %f  ** fractional seconds  SS.SSS
-**   %F  ISO date.  YYYY-MM-DD
-**   %G  ISO year corresponding to %V 0000-9999.
-**   %g  2-digit ISO year corresponding to %V 00-99
-**   %H  hour 00-24
-**   %k  hour  0-24  (leading zero converted to space)
-**   %I  hour 01-12
-**   %j  day of year 001-366
-**   %J  ** julian day number
-**   %l  hour  1-12  (leading zero converted to space)
-**   %m  month 01-12
-**   %M  minute 00-59
-**   %p  "am" or "pm"
-**   %P  "AM" or "PM"
-**   %R  time as HH:MM
-**   %s  seconds since 1970-01-01
-**   %S  seconds 00-59
-**   %T  time as HH:MM:SS
-**   %u  day of week 1-7  Monday==1, Sunday==7
-**   %w  day of week 0-6  Sunday==0, Monday==1
-**   %U  week of year 00-53  (First Sunday is start of week 01)
-**   %V  week of year 01-53  (First week containing Thursday is week 01)
-**   %W  week of year 00-53  (First Monday is start of week 01)
-**   %Y  year 0000-9999
-**   %%  %
+** A compiled strftime format.  Literal text between conversions is
+** gathered into zLit once, so formatting is a walk over aOp that copies
+** literal segments and writes digits directly.
 */
-const char *dt_strftime(const char *zFmt, int argc, ...)
+typedef struct dt_fmtop dt_fmtop;
+struct dt_fmtop
 {
-    DateTime x;
-    size_t i, j;
-    static __declspec(thread) dt_str sRes;
-    va_list ap;
-    char *argv[32];
-    va_start(ap, argc);
-    for (int i = 0; i < argc; i++)
+    char op;      /* Conversion character, or 0 for a literal segment */
+    uint16_t len; /* Literal length, or fraction digits of %f */
+    int off;      /* Literal offset in zLit */
+};
+
+struct dt_fmt
+{
+    int nOp;
+    int nMax; /* Upper bound of the output length, excluding the terminator */
+    dt_fmtop *aOp;
+    char *zLit;
+    int64_t iGen;  /* Unique per compiled program, keys the per-thread cache */
+};
+
+/* Last program generation handed out; addresses are reused after dt_fmt_free */
+static atomic_int64 FmtGen;
+
+/*
+** Maximum output width of each conversion character, 0 if unsupported.
+*/
+static int fmtWidth(char c)
+{
+    switch (c)
     {
-        argv[i] = va_arg(ap, char *);
-    }
-    va_end(ap);
-    if (argc == 0)
+    case 'd': case 'e': case 'H': case 'k': case 'I': case 'l':
+    case 'm': case 'M': case 'p': case 'P': case 'S': case 'U':
+    case 'V': case 'W':
+        return 2;
+    case 'u': case 'w': case '%':
+        return 1;
+    case 'g': case 'j':
+        return 3;
+    case 'G': case 'Y': case 'R':
+        return 5;
+    case 'f':
+        return 12;
+    case 'T':
+        return 8;
+    case 'F':
+        return 11;
+    case 's':
+        return 30;
+    case 'J':
+        return 24;
+    default:
+        return 0;
+    }
+}
+
+dt_fmt *dt_fmt_compile(const char *zFmt)
+{
+    int nOp = 0, nLit = 0, nRun = 0, i;
+    dt_fmt *f;
+    char *mem;
+    if (zFmt == NULL)
         return NULL;
-    if (zFmt == 0 || isDate(argc, argv, &x))
+    /*
+    ** First pass: validate and size the program.  Every conversion may be
+    ** followed by a literal op, and a literal run longer than 0xffff bytes
+    ** is split into one more op per 0xffff bytes.
+    */
+    for (i = 0; zFmt[i]; i++)
+    {
+        if (zFmt[i] == '%')
+        {
+            i++;
+            if ((zFmt[i] == '3' || zFmt[i] == '6' || zFmt[i] == '9') && zFmt[i + 1] == 'f')
+                i++;
+            if (fmtWidth(zFmt[i]) == 0)
+                return NULL;
+            if (zFmt[i] != '%')
+            {
+                nOp += 2;
+                nRun = 0;
+                continue;
+            }
+        }
+        if (nRun == 0xffff)
+        {
+            nOp++;
+            nRun = 0;
+        }
+        nRun++;
+        nLit++;
+    }
+    nOp++;
+    mem = (char *)malloc(sizeof(dt_fmt) + nOp * sizeof(dt_fmtop) + nLit + 1);
+    if (mem == NULL)
         return NULL;
-    strInit(&sRes);
-    computeJD(&x);
-    computeYMD_HMS(&x);
-    for (i = j = 0; zFmt[i]; i++)
+    f = (dt_fmt *)mem;
+    f->aOp = (dt_fmtop *)(mem + sizeof(dt_fmt));
+    f->zLit = (char *)(f->aOp + nOp);
+    f->nOp = 0;
+    f->nMax = 0;
+    f->iGen = atomic_int64_fetch_add(&FmtGen, 1, memory_order_relaxed) + 1;
+    nLit = 0;
+    for (i = 0; zFmt[i]; i++)
+    {
+        char c = zFmt[i];
+        dt_fmtop *op;
+        if (c == '%')
+        {
+            int nDigit = 3;
+            c = zFmt[++i];
+            if (c >= '3' && c <= '9')
+            {
+                nDigit = c - '0';
+                c = zFmt[++i];
+            }
+            if (c != '%')
+            {
+                op = &f->aOp[f->nOp++];
+                op->op = c;
+                op->len = c == 'f' ? nDigit : 0;
+                op->off = 0;
+                f->nMax += c == 'f' ? 3 + nDigit : fmtWidth(c);
+                continue;
+            }
+        }
+        /* Extend the previous literal segment, or start a new one */
+        op = f->nOp > 0 ? &f->aOp[f->nOp - 1] : NULL;
+        if (op == NULL || op->op != 0 || op->len == 0xffff)
+        {
+            op = &f->aOp[f->nOp++];
+            op->op = 0;
+            op->len = 0;
+            op->off = nLit;
+        }
+        f->zLit[nLit++] = c;
+        op->len++;
+        f->nMax++;
+    }
+    f->zLit[nLit] = 0;
+    return f;
+}
+
+void dt_fmt_free(dt_fmt *f)
+{
+    free(f);
+}
+
+/*
+** Run program f against x, which must have valid JD, YMD and HMS.
+** The output buffer must hold f->nMax bytes.  If aPos is not NULL the
+** output offset of every op is written to it.
+*/
+static char *fmtExec(const dt_fmt *f, DateTime *x, char *z, int *aPos)
+{
+    char *z0 = z;
+    for (int i = 0; i < f->nOp; i++)
     {
-        char cf;
-        if (zFmt[i] != '%')
-            continue;
-        if (j < i)
-            strAppend(&sRes, zFmt + j, (int)(i - j));
-        i++;
-        j = i + 1;
-        cf = zFmt[i];
-        switch (cf)
-        {
-        case 'd': /* Fall thru */
+        const dt_fmtop *op = &f->aOp[i];
+        if (aPos)
+            aPos[i] = (int)(z - z0);
+        switch (op->op)
+        {
+        case 0:
+        {
+            memcpy(z, f->zLit + op->off, op->len);
+            z += op->len;
+            break;
+        }
+        case 'd':
+        {
+            z = put2(z, x->D);
+            break;
+        }
         case 'e':
         {
-            strAppendF(&sRes, cf == 'd' ? "%02d" : "%2d", x.D);
+            z = putInt(z, x->D, 2, ' ');
             break;
         }
         case 'f':
-        { /* Fractional seconds.  (Non-standard) */
-            double s = x.s;
-            if (s > 59.999)
-                s = 59.999;
-            strAppendF(&sRes, "%06.3f", s);
+        { /* Fractional seconds, %f %6f %9f.  (Non-standard) */
+            z = put2(z, x->s);
+            z = putFrac(z, x->ns, op->len);
             break;
         }
         case 'F':
         {
-            strAppendF(&sRes, "%04d-%02d-%02d", x.Y, x.M, x.D);
+            z = putInt(z, x->Y, 4, '0');
+            *z++ = '-';
+            z = put2(z, x->M);
+            *z++ = '-';
+            z = put2(z, x->D);
             break;
         }
         case 'G': /* Fall thru */
         case 'g':
         {
-            DateTime y = x;
-            assert(y.validJD);
+            DateTime y = *x;
             /* Move y so that it is the Thursday in the same week as x */
-            y.iJD += (3 - daysAfterMonday(&x)) * 86400000;
+            y.iJD += (3 - daysAfterMonday(x)) * 86400000;
             y.validYMD = 0;
             computeYMD(&y);
-            if (cf == 'g')
-            {
-                strAppendF(&sRes, "%02d", y.Y % 100);
-            }
+            if (op->op == 'g')
+                z = putInt(z, y.Y % 100, 2, '0');
             else
-            {
-                strAppendF(&sRes, "%04d", y.Y);
-            }
+                z = putInt(z, y.Y, 4, '0');
             break;
         }
         case 'H':
+        {
+            z = put2(z, x->h);
+            break;
+        }
         case 'k':
         {
-            strAppendF(&sRes, cf == 'H' ? "%02d" : "%2d", x.h);
+            z = putInt(z, x->h, 2, ' ');
             break;
         }
         case 'I': /* Fall thru */
         case 'l':
         {
-            int h = x.h;
+            int h = x->h;
             if (h > 12)
                 h -= 12;
             if (h == 0)
                 h = 12;
-            strAppendF(&sRes, cf == 'I' ? "%02d" : "%2d", h);
+            z = op->op == 'I' ? put2(z, h) : putInt(z, h, 2, ' ');
             break;
         }
         case 'j':
         { /* Day of year.  Jan01==1, Jan02==2, and so forth */
-            strAppendF(&sRes, "%03d", daysAfterJan01(&x) + 1);
+            z = putInt(z, daysAfterJan01(x) + 1, 3, '0');
             break;
         }
         case 'J':
         { /* Julian day number.  (Non-standard) */
-            strAppendF(&sRes, "%.16g", x.iJD / 86400000.0);
+            z += snprintf(z, 25, "%.16g", x->iJD / 86400000.0);
             break;
         }
         case 'm':
         {
-            strAppendF(&sRes, "%02d", x.M);
+            z = put2(z, x->M);
             break;
         }
         case 'M':
         {
-            strAppendF(&sRes, "%02d", x.m);
+            z = put2(z, x->m);
             break;
         }
         case 'p': /* Fall thru */
         case 'P':
         {
-            if (x.h >= 12)
-            {
-                strAppend(&sRes, cf == 'p' ? "PM" : "pm", 2);
-            }
+            if (x->h >= 12)
+                memcpy(z, op->op == 'p' ? "PM" : "pm", 2);
             else
-            {
-                strAppend(&sRes, cf == 'p' ? "AM" : "am", 2);
-            }
+                memcpy(z, op->op == 'p' ? "AM" : "am", 2);
+            z += 2;
             break;
         }
         case 'R':
         {
-            strAppendF(&sRes, "%02d:%02d", x.h, x.m);
+            z = put2(z, x->h);
+            *z++ = ':';
+            z = put2(z, x->m);
             break;
         }
         case 's':
         {
-            if (x.useSubsec)
+            if (x->useSubsec)
             {
-                strAppendF(&sRes, "%.3f",
-                           (x.iJD - 21086676 * (int64_t)10000000) / 1000.0);
+                int64_t iMs = x->iJD - 21086676 * (int64_t)10000000;
+                int iNs = x->iNs;
+                if (iMs < 0)
+                {
+                    *z++ = '-';
+                    iMs = -iMs;
+                    if (iNs)
+                    {
+                        iMs--;
+                        iNs = 1000000 - iNs;
+                    }
+                }
+                z = putInt(z, iMs / 1000, 1, '0');
+                z = putFrac(z, (int)(iMs % 1000) * 1000000 + iNs, x->nSubsec ? x->nSubsec : 3);
             }
             else
             {
-                int64_t iS = (int64_t)(x.iJD / 1000 - 21086676 * (int64_t)10000);
-                strAppendF(&sRes, "%lld", iS);
+                z = putInt(z, x->iJD / 1000 - 21086676 * (int64_t)10000, 1, '0');
             }
             break;
         }
         case 'S':
         {
-            strAppendF(&sRes, "%02d", (int)x.s);
+            z = put2(z, x->s);
             break;
         }
         case 'T':
         {
-            strAppendF(&sRes, "%02d:%02d:%02d", x.h, x.m, (int)x.s);
+            z = put2(z, x->h);
+            *z++ = ':';
+            z = put2(z, x->m);
+            *z++ = ':';
+            z = put2(z, x->s);
             break;
         }
         case 'u': /* Day of week.  1 to 7.  Monday==1, Sunday==7 */
         case 'w':
         { /* Day of week.  0 to 6.  Sunday==0, Monday==1 */
-            char c = (char)daysAfterSunday(&x) + '0';
-            if (c == '0' && cf == 'u')
+            char c = (char)daysAfterSunday(x) + '0';
+            if (c == '0' && op->op == 'u')
                 c = '7';
-            strAppendChar(&sRes, 1, c);
+            *z++ = c;
             break;
         }
         case 'U':
         { /* Week num. 00-53. First Sun of the year is week 01 */
-            strAppendF(&sRes, "%02d",
-                       (daysAfterJan01(&x) - daysAfterSunday(&x) + 7) / 7);
+            z = put2(z, (daysAfterJan01(x) - daysAfterSunday(x) + 7) / 7);
             break;
         }
         case 'V':
         { /* Week num. 01-53. First week with a Thur is week 01 */
-            DateTime y = x;
+            DateTime y = *x;
             /* Adjust y so that is the Thursday in the same week as x */
-            assert(y.validJD);
-            y.iJD += (3 - daysAfterMonday(&x)) * 86400000;
+            y.iJD += (3 - daysAfterMonday(x)) * 86400000;
             y.validYMD = 0;
             computeYMD(&y);
-            strAppendF(&sRes, "%02d", daysAfterJan01(&y) / 7 + 1);
+            z = put2(z, daysAfterJan01(&y) / 7 + 1);
             break;
         }
         case 'W':
         { /* Week num. 00-53. First Mon of the year is week 01 */
-            strAppendF(&sRes, "%02d",
-                       (daysAfterJan01(&x) - daysAfterMonday(&x) + 7) / 7);
+            z = put2(z, (daysAfterJan01(x) - daysAfterMonday(x) + 7) / 7);
             break;
         }
         case 'Y':
         {
-            strAppendF(&sRes, "%04d", x.Y);
+            z = putInt(z, x->Y, 4, '0');
             break;
         }
-        case '%':
+        }
+    }
+    return z;
+}
+
+int dt_fmt_format(const dt_fmt *f, const DateTime *p, char *buf, int n)
+{
+    DateTime x = *p;
+    char zTmp[256];
+    char *zOut;
+    int len;
+    if (f == NULL)
+        return -1;
+    computeJD(&x);
+    computeYMD_HMS(&x);
+    if (x.isError)
+        return -1;
+    if (n > f->nMax)
+    {
+        len = (int)(fmtExec(f, &x, buf, NULL) - buf);
+        buf[len] = 0;
+        return len;
+    }
+    /* The caller buffer may be too small, format aside and truncate */
+    zOut = f->nMax <= (int)sizeof(zTmp) ? zTmp : (char *)malloc(f->nMax);
+    if (zOut == NULL)
+        return -1;
+    len = (int)(fmtExec(f, &x, zOut, NULL) - zOut);
+    if (n > 0)
+    {
+        int nCopy = len < n - 1 ? len : n - 1;
+        memcpy(buf, zOut, nCopy);
+        buf[nCopy] = 0;
+    }
+    if (zOut != zTmp)
+        free(zOut);
+    return len;
+}
+
+/*
+** Per-thread cache of formatted timestamps.  Each entry holds the output
+** of one program for one minute (or one second when the program prints
+** the epoch seconds), plus where the seconds and milliseconds digits sit
+** in it.  A hit copies the text and rewrites those digits only.
+*/
+#define FMT_CACHE_SLOTS 4
+#define FMT_CACHE_TEXT 128
+#define FMT_CACHE_PATCH 8
+
+typedef struct dt_fmtcache dt_fmtcache;
+struct dt_fmtcache
+{
+    int64_t iGen;     /* dt_fmt.iGen of the program, 0 if empty */
+    const struct tzone *pZone;
+    int64_t iMinute;  /* UTC minutes since 1970 */
+    int iSec;         /* Second within iMinute the text was built for */
+    char perMinute;   /* True if any second of iMinute may reuse the text */
+    char nPatch;
+    int len;
+    struct
+    {
+        uint16_t pos;
+        char nDigit;  /* 2 for the seconds, else fraction digits after the '.' */
+    } aPatch[FMT_CACHE_PATCH];
+    char z[FMT_CACHE_TEXT];
+};
+
+static ATOMIC_THREAD dt_fmtcache aFmtCache[FMT_CACHE_SLOTS];
+static ATOMIC_THREAD uint64_t nFmtHit;
+static ATOMIC_THREAD uint64_t nFmtMiss;
+
+/*
+** Rebuild cache entry c for program f at time iSec/nsec.  Return 0 if
+** the result may be cached.
+*/
+static int fmtCacheFill(dt_fmtcache *c, const dt_fmt *f, const struct tzone *pZone,
+                        int64_t iSec, int nsec)
+{
+    DateTime x;
+    int aPos[2 * FMT_CACHE_TEXT + 1];
+    int32_t off = 0;
+    memset(&x, 0, sizeof(x));
+    c->iGen = 0;
+    if (f->nMax > FMT_CACHE_TEXT || f->nOp > (int)(sizeof(aPos) / sizeof(aPos[0])))
+        return 1;
+    if (pZone)
+        off = tzone_offset(pZone, iSec, NULL, NULL);
+    x.iJD = (iSec + off + 21086676 * (int64_t)10000) * 1000 + nsec / 1000000;
+    x.iNs = nsec % 1000000;
+    x.validJD = 1;
+    if (!validJulianDay(x.iJD))
+        return 1;
+    computeYMD_HMS(&x);
+    c->len = (int)(fmtExec(f, &x, c->z, aPos) - c->z);
+    c->pZone = pZone;
+    c->iMinute = floorDiv64(iSec, 60);
+    c->iSec = (int)(iSec - c->iMinute * 60);
+    c->perMinute = off % 60 == 0;
+    if (pZone && c->perMinute)
+    {
+        int64_t t0 = c->iMinute * 60;
+        c->perMinute = tzone_offset(pZone, t0, NULL, NULL) == off &&
+                       tzone_offset(pZone, t0 + 59, NULL, NULL) == off;
+    }
+    c->nPatch = 0;
+    for (int i = 0; i < f->nOp; i++)
+    {
+        int pos = aPos[i];
+        switch (f->aOp[i].op)
         {
-            strAppendChar(&sRes, 1, '%');
+        case 'J':
+            return 1;
+        case 's':
+            c->perMinute = 0;
             break;
+        case 'T':
+            pos += 6; /* Fall thru */
+        case 'S':
+        case 'f':
+            if (c->nPatch + 2 > FMT_CACHE_PATCH)
+                return 1;
+            c->aPatch[(int)c->nPatch].pos = (uint16_t)pos;
+            c->aPatch[(int)c->nPatch++].nDigit = 2;
+            if (f->aOp[i].op == 'f')
+            {
+                c->aPatch[(int)c->nPatch].pos = (uint16_t)(pos + 2);
+                c->aPatch[(int)c->nPatch++].nDigit = (char)f->aOp[i].len;
+            }
+            break;
+        }
+    }
+    c->iGen = f->iGen;
+    return 0;
+}
+
+int dt_fmt_cached(const dt_fmt *f, const struct tzone *pZone, int64_t ns, char *buf, int n)
+{
+    int64_t iSec = floorDiv64(ns, 1000000000);
+    int nsec = (int)(ns - iSec * 1000000000);
+    int64_t iMinute = floorDiv64(iSec, 60);
+    int sec = (int)(iSec - iMinute * 60);
+    dt_fmtcache *c = &aFmtCache[((uintptr_t)f >> 4) % FMT_CACHE_SLOTS];
+    char zTmp[FMT_CACHE_TEXT + 1];
+    char *z;
+    int len;
+    if (f == NULL)
+        return -1;
+    if (c->iGen == f->iGen && c->pZone == pZone && c->iMinute == iMinute && (c->perMinute || c->iSec == sec))
+    {
+        nFmtHit++;
+    }
+    else
+    {
+        nFmtMiss++;
+        if (fmtCacheFill(c, f, pZone, iSec, nsec))
+        {
+            DateTime x;
+            int32_t off = pZone ? tzone_offset(pZone, iSec, NULL, NULL) : 0;
+            memset(&x, 0, sizeof(x));
+            x.iJD = (iSec + off + 21086676 * (int64_t)10000) * 1000 + nsec / 1000000;
+            x.iNs = nsec % 1000000;
+            x.validJD = 1;
+            return dt_fmt_format(f, &x, buf, n);
         }
-        default:
+    }
+    len = c->len;
+    z = n > len ? buf : zTmp;
+    memcpy(z, c->z, len);
+    z[len] = 0;
+    for (int i = 0; i < c->nPatch; i++)
+    {
+        int pos = c->aPatch[i].pos;
+        if (c->aPatch[i].nDigit != 2)
+        {
+            putFrac(&z[pos], nsec, c->aPatch[i].nDigit);
+        }
+        else if (c->perMinute)
         {
-            strInit(&sRes);
+            put2(&z[pos], sec);
+        }
+    }
+    if (z != buf && n > 0)
+    {
+        memcpy(buf, z, n - 1);
+        buf[n - 1] = 0;
+    }
+    return len;
+}
+
+int dt_fmt_now(const dt_fmt *f, const struct tzone *pZone, char *buf, int n)
+{
+    return dt_fmt_cached(f, pZone, dt_now_ns(), buf, n);
+}
+
+void dt_fmt_cache_stats(uint64_t *pHit, uint64_t *pMiss)
+{
+    if (pHit)
+        *pHit = nFmtHit;
+    if (pMiss)
+        *pMiss = nFmtMiss;
+}
+
+/*
+**    strftime( FORMAT, TIMESTRING, MOD, MOD, ...)
+**
+** Return a string described by FORMAT.  Conversions as follows:
+**
+**   %d  day of month  01-31
+**   %e  day of month  1-31
+**   %f  ** fractional seconds  SS.SSS, %6f and %9f for SS.SSSSSS and SS.SSSSSSSSS
+**   %F  ISO date.  YYYY-MM-DD
+**   %G  ISO year corresponding to %V 0000-9999.
+**   %g  2-digit ISO year corresponding to %V 00-99
+**   %H  hour 00-24
+**   %k  hour  0-24  (leading zero converted to space)
+**   %I  hour 01-12
+**   %j  day of year 001-366
+**   %J  ** julian day number
+**   %l  hour  1-12  (leading zero converted to space)
+**   %m  month 01-12
+**   %M  minute 00-59
+**   %p  "AM" or "PM"
+**   %P  "am" or "pm"
+**   %R  time as HH:MM
+**   %s  seconds since 1970-01-01
+**   %S  seconds 00-59
+**   %T  time as HH:MM:SS
+**   %u  day of week 1-7  Monday==1, Sunday==7
+**   %w  day of week 0-6  Sunday==0, Monday==1
+**   %U  week of year 00-53  (First Sunday is start of week 01)
+**   %V  week of year 01-53  (First week containing Thursday is week 01)
+**   %W  week of year 00-53  (First Monday is start of week 01)
+**   %Y  year 0000-9999
+**   %%  %
+**
+** The compiled program for the most recent format is kept per thread,
+** and the result lives in a per-thread buffer that grows as needed.
+** dt_strftime_r() writes to the caller's buffer instead.
+*/
+typedef struct dt_strftime_state dt_strftime_state;
+struct dt_strftime_state
+{
+    struct threadreg_node node;
+    dt_str sFmt;      /* Text of pFmt */
+    dt_fmt *pFmt;
+    dt_str sRes;      /* Result of dt_strftime() */
+};
+
+static ATOMIC_THREAD dt_strftime_state *Strftime;
+
+/*
+** Free the buffers of an exiting thread.  The record itself stays in the
+** registry for the next thread.
+*/
+static void strftimeExit(void)
+{
+    dt_strftime_state *me = Strftime;
+    if (me == NULL)
+        return;
+    dt_fmt_free(me->pFmt);
+    free(me->sFmt.d);
+    free(me->sRes.d);
+    memset(&me->sFmt, 0, sizeof(me->sFmt));
+    memset(&me->sRes, 0, sizeof(me->sRes));
+    me->pFmt = NULL;
+    Strftime = NULL;
+    threadreg_release(&me->node);
+}
+
+static struct threadreg StrftimeRegistry = THREADREG_INIT(sizeof(dt_strftime_state), NULL, strftimeExit);
+
+static dt_strftime_state *strftimeState(void)
+{
+    dt_strftime_state *me = Strftime;
+    if (me == NULL)
+        me = Strftime = (dt_strftime_state *)threadreg_claim(&StrftimeRegistry);
+    return me;
+}
+
+/*
+** Return the compiled program for zFmt, reusing this thread's last one
+** when the format has not changed.
+*/
+static const dt_fmt *strftimeProgram(dt_strftime_state *me, const char *zFmt)
+{
+    int n;
+    if (me->pFmt == NULL || strcmp(me->sFmt.d, zFmt) != 0)
+    {
+        n = (int)strlen(zFmt);
+        dt_fmt_free(me->pFmt);
+        me->pFmt = NULL;
+        me->sFmt.l = 0;
+        if (strReserve(&me->sFmt, n))
             return NULL;
+        memcpy(me->sFmt.d, zFmt, n + 1);
+        me->pFmt = dt_fmt_compile(zFmt);
+    }
+    return me->pFmt;
+}
+
+int dt_strftime_r(char *buf, int n, const char *zFmt, int argc, const char *const *argv)
+{
+    DateTime x;
+    const dt_fmt *f;
+    if (argc == 0 || zFmt == 0 || isDate(argc, argv, &x))
+        return -1;
+    f = strftimeProgram(strftimeState(), zFmt);
+    if (f == NULL)
+        return -1;
+    return dt_fmt_format(f, &x, buf, n);
+}
+
+const char *dt_strftime(const char *zFmt, int argc, ...)
+{
+    DateTime x;
+    const dt_fmt *f;
+    dt_strftime_state *me;
+    va_list ap;
+    const char *argv[DT_MAX_ARGS];
+    int n, rc;
+    va_start(ap, argc);
+    rc = collectArgs(argv, argc, ap);
+    va_end(ap);
+    if (rc || argc == 0)
+        return NULL;
+    if (zFmt == 0 || isDate(argc, argv, &x))
+        return NULL;
+    me = strftimeState();
+    f = strftimeProgram(me, zFmt);
+    if (f == NULL)
+        return NULL;
+    me->sRes.l = 0;
+    if (strReserve(&me->sRes, f->nMax))
+        return NULL;
+    n = dt_fmt_format(f, &x, me->sRes.d, me->sRes.m);
+    if (n < 0)
+        return NULL;
+    me->sRes.l = n;
+    return me->sRes.d;
+}
+
+/*
+** A compiled strptime-style pattern.  Conversions:
+**
+**   %Y  year, up to 4 digits         %y  2-digit year, 69-99 is 19xx
+**   %m  month 1-12                   %b %h %B  month name, any case
+**   %d  day of month 1-31            %e  same, may be space padded
+**   %j  day of year 1-366            %a %A  weekday name, ignored
+**   %H  hour 0-23                    %I  hour 1-12, with %p
+**   %M  minute 0-59                  %p  AM or PM, any case
+**   %S  seconds 0-60                 %f  seconds with optional .fraction
+**   %s  seconds since 1970, optional .fraction
+**   %z  +hhmm, +hh:mm, +hh, Z, UT, UTC or GMT
+**   %T  %H:%M:%S     %R  %H:%M     %F  %Y-%m-%d
+**   %n %t and white space match zero or more white space characters
+**   %%  a literal %
+**
+** Numbers take as many digits as the conversion allows, so patterns
+** without separators such as "%Y%m%d%H%M%S" work.  Other characters
+** must match exactly.
+*/
+typedef struct dt_scanop dt_scanop;
+struct dt_scanop
+{
+    char op;      /* Conversion character, ' ' for white space, 0 for a literal */
+    uint16_t len; /* Literal length */
+    int off;      /* Literal offset in zLit */
+};
+
+struct dt_scan
+{
+    int nOp;
+    dt_scanop *aOp;
+    char *zLit;
+};
+
+static const char *const azMonthName[] = {
+    "January", "February", "March", "April", "May", "June", "July",
+    "August", "September", "October", "November", "December",
+};
+
+static const char *const azDayName[] = {
+    "Sunday", "Monday", "Tuesday", "Wednesday", "Thursday", "Friday", "Saturday",
+};
+
+/*
+** Expand the composite conversions.  Return NULL for an unsupported one.
+*/
+static const char *scanExpand(char c)
+{
+    switch (c)
+    {
+    case 'T':
+        return "%H:%M:%S";
+    case 'R':
+        return "%H:%M";
+    case 'F':
+        return "%Y-%m-%d";
+    case 'Y': case 'y': case 'm': case 'b': case 'h': case 'B': case 'd':
+    case 'e': case 'j': case 'a': case 'A': case 'H': case 'I': case 'M':
+    case 'p': case 'S': case 'f': case 's': case 'z': case 'n': case 't':
+    case '%':
+        return "";
+    default:
+        return NULL;
+    }
+}
+
+/*
+** Append the ops for zFmt to s, or only count them when s->aOp is NULL.
+** Return 1 on an unsupported conversion.
+*/
+static int scanBuild(dt_scan *s, const char *zFmt, int *pnLit)
+{
+    for (int i = 0; zFmt[i]; i++)
+    {
+        char c = zFmt[i];
+        dt_scanop *op;
+        if (c == '%')
+        {
+            const char *zSub;
+            c = zFmt[++i];
+            zSub = scanExpand(c);
+            if (zSub == NULL)
+                return 1;
+            if (*zSub)
+            {
+                if (scanBuild(s, zSub, pnLit))
+                    return 1;
+                continue;
+            }
+            if (c == 'n' || c == 't')
+                c = ' ';
+        }
+        else if (isspace((unsigned char)c))
+        {
+            c = ' ';
+        }
+        else
+        {
+            c = 0;
+        }
+        if (c == ' ' && s->aOp && s->nOp > 0 && s->aOp[s->nOp - 1].op == ' ')
+            continue; /* Runs of white space match as one */
+        if (c != 0 && c != '%')
+        {
+            if (s->aOp)
+            {
+                op = &s->aOp[s->nOp];
+                op->op = c;
+                op->len = 0;
+                op->off = 0;
+            }
+            s->nOp++;
+            continue;
+        }
+        c = zFmt[i];
+        /* Literal character, extend the previous literal segment */
+        if (s->aOp)
+        {
+            op = s->nOp > 0 ? &s->aOp[s->nOp - 1] : NULL;
+            if (op == NULL || op->op != 0 || op->len == 0xffff)
+            {
+                op = &s->aOp[s->nOp++];
+                op->op = 0;
+                op->len = 0;
+                op->off = *pnLit;
+            }
+            s->zLit[*pnLit] = c;
+            op->len++;
         }
+        else
+        {
+            s->nOp++;
         }
+        (*pnLit)++;
+    }
+    return 0;
+}
+
+dt_scan *dt_scan_compile(const char *zFmt)
+{
+    dt_scan *s, tmp;
+    int nLit = 0;
+    char *mem;
+    if (zFmt == NULL)
+        return NULL;
+    memset(&tmp, 0, sizeof(tmp));
+    if (scanBuild(&tmp, zFmt, &nLit))
+        return NULL;
+    mem = (char *)malloc(sizeof(dt_scan) + tmp.nOp * sizeof(dt_scanop) + nLit + 1);
+    if (mem == NULL)
+        return NULL;
+    s = (dt_scan *)mem;
+    s->aOp = (dt_scanop *)(mem + sizeof(dt_scan));
+    s->zLit = (char *)(s->aOp + tmp.nOp);
+    s->nOp = 0;
+    nLit = 0;
+    scanBuild(s, zFmt, &nLit);
+    s->zLit[nLit] = 0;
+    return s;
+}
+
+void dt_scan_free(dt_scan *s)
+{
+    free(s);
+}
+
+/*
+** Read 1 to nMax digits.  Return the number of digits, 0 if none.
+*/
+static int scanNum(const char *z, int nMax, int *pVal)
+{
+    int n = 0, v = 0;
+    while (n < nMax && isdigit((unsigned char)z[n]))
+    {
+        v = v * 10 + z[n] - '0';
+        n++;
     }
-    if (j < i)
-        strAppend(&sRes, zFmt + j, (int)(i - j));
+    *pVal = v;
+    return n;
+}
 
-    return sRes.d;
-}
\ No newline at end of file
+/*
+** Read an optional ".fraction" into nanoseconds.  Return bytes consumed.
+*/
+static int scanFrac(const char *z, int *pNs)
+{
+    int n = 1, ns = 0, nDigit = 0;
+    if (z[0] != '.' || !isdigit((unsigned char)z[1]))
+    {
+        *pNs = 0;
+        return 0;
+    }
+    while (isdigit((unsigned char)z[n]))
+    {
+        if (nDigit++ < 9)
+            ns = ns * 10 + z[n] - '0';
+        n++;
+    }
+    while (nDigit++ < 9)
+        ns *= 10;
+    *pNs = ns;
+    return n;
+}
+
+/*
+** Match a name from az, either its first three letters or all of it.
+** zKey holds the lower case three letter prefixes of az.  Return bytes
+** consumed and the index in *pIdx, or 0.
+*/
+static int scanName(const char *z, const char *const *az, const char *zKey, int *pIdx)
+{
+    char k0, k1, k2;
+    if (!isalpha((unsigned char)z[0]) || !isalpha((unsigned char)z[1]) || !isalpha((unsigned char)z[2]))
+        return 0;
+    k0 = z[0] | 0x20;
+    k1 = z[1] | 0x20;
+    k2 = z[2] | 0x20;
+    for (int i = 0; zKey[i * 3]; i++)
+    {
+        if (zKey[i * 3] == k0 && zKey[i * 3 + 1] == k1 && zKey[i * 3 + 2] == k2)
+        {
+            const char *zName = az[i];
+            int n = 3;
+            while (zName[n] && (z[n] | 0x20) == zName[n])
+                n++;
+            *pIdx = i;
+            return zName[n] ? 3 : n;
+        }
+    }
+    return 0;
+}
+
+int dt_scan_parse(const dt_scan *s, const char *z, DateTime *p)
+{
+    const char *z0 = z;
+    int Y = 2000, M = 1, D = 1, h = 0, m = 0, sec = 0, ns = 0, tz = 0;
+    int yday = 0, pm = -1, hasHMS = 0, hasTz = 0, hasUnix = 0;
+    int64_t iUnix = 0;
+    int n = 0, v;
+    if (s == NULL || z == NULL)
+        return -1;
+    for (int i = 0; i < s->nOp; i++)
+    {
+        const dt_scanop *op = &s->aOp[i];
+        switch (op->op)
+        {
+        case 0:
+        {
+            if (strncmp(z, s->zLit + op->off, op->len) != 0)
+                return -1;
+            z += op->len;
+            continue;
+        }
+        case ' ':
+        {
+            while (isspace((unsigned char)*z))
+                z++;
+            continue;
+        }
+        case 'Y':
+        {
+            int neg = *z == '-';
+            n = scanNum(z + neg, 4, &Y);
+            if (n == 0)
+                return -1;
+            if (neg)
+                Y = -Y;
+            z += n + neg;
+            continue;
+        }
+        case 'y':
+        {
+            n = scanNum(z, 2, &v);
+            if (n == 0)
+                return -1;
+            Y = v < 69 ? 2000 + v : 1900 + v;
+            break;
+        }
+        case 'm':
+        {
+            n = scanNum(z, 2, &M);
+            if (n == 0 || M < 1 || M > 12)
+                return -1;
+            break;
+        }
+        case 'b': case 'h': case 'B':
+        {
+            n = scanName(z, azMonthName, "janfebmaraprmayjunjulaugsepoctnovdec", &M);
+            if (n == 0)
+                return -1;
+            M++;
+            break;
+        }
+        case 'e':
+        {
+            if (*z == ' ')
+                z++;
+        } /* Fall thru */
+        case 'd':
+        {
+            n = scanNum(z, 2, &D);
+            if (n == 0 || D < 1 || D > 31)
+                return -1;
+            break;
+        }
+        case 'j':
+        {
+            n = scanNum(z, 3, &yday);
+            if (n == 0 || yday < 1 || yday > 366)
+                return -1;
+            break;
+        }
+        case 'a': case 'A':
+        {
+            n = scanName(z, azDayName, "sunmontuewedthufrisat", &v);
+            if (n == 0)
+                return -1;
+            break;
+        }
+        case 'H':
+        {
+            n = scanNum(z, 2, &h);
+            if (n == 0 || h > 23)
+                return -1;
+            hasHMS = 1;
+            break;
+        }
+        case 'I':
+        {
+            n = scanNum(z, 2, &h);
+            if (n == 0 || h < 1 || h > 12)
+                return -1;
+            hasHMS = 1;
+            break;
+        }
+        case 'p':
+        {
+            char c0 = (char)tolower((unsigned char)z[0]);
+            if ((c0 != 'a' && c0 != 'p') || tolower((unsigned char)z[1]) != 'm')
+                return -1;
+            pm = c0 == 'p';
+            n = 2;
+            break;
+        }
+        case 'M':
+        {
+            n = scanNum(z, 2, &m);
+            if (n == 0 || m > 59)
+                return -1;
+            hasHMS = 1;
+            break;
+        }
+        case 'S':
+        case 'f':
+        {
+            n = scanNum(z, 2, &sec);
+            if (n == 0 || sec > 60)
+                return -1;
+            if (op->op == 'f')
+                n += scanFrac(z + n, &ns);
+            hasHMS = 1;
+            break;
+        }
+        case 's':
+        {
+            int neg = *z == '-', nDigit = 0;
+            iUnix = 0;
+            while (isdigit((unsigned char)z[neg + nDigit]) && nDigit < 12)
+                iUnix = iUnix * 10 + z[neg + nDigit++] - '0';
+            if (nDigit == 0)
+                return -1;
+            n = neg + nDigit;
+            n += scanFrac(z + n, &ns);
+            if (neg)
+            {
+                iUnix = -iUnix;
+                if (ns)
+                {
+                    iUnix--;
+                    ns = 1000000000 - ns;
+                }
+            }
+            hasUnix = 1;
+            break;
+        }
+        case 'z':
+        {
+            if (*z == '+' || *z == '-')
+            {
+                int hh, mm = 0;
+                if (scanNum(z + 1, 2, &hh) != 2)
+                    return -1;
+                n = 3;
+                if (z[n] == ':')
+                    n++;
+                if (scanNum(z + n, 2, &mm) == 2)
+                    n += 2;
+                else if (z[n - 1] == ':')
+                    return -1;
+                if (hh > 23 || mm > 59)
+                    return -1;
+                tz = (hh * 60 + mm) * (*z == '-' ? -1 : 1);
+            }
+            else if (*z == 'Z' || *z == 'z')
+            {
+                n = 1;
+                tz = 0;
+            }
+            else if (strncmp(z, "UTC", 3) == 0 || strncmp(z, "GMT", 3) == 0)
+            {
+                n = 3;
+                tz = 0;
+            }
+            else if (strncmp(z, "UT", 2) == 0)
+            {
+                n = 2;
+                tz = 0;
+            }
+            else
+            {
+                return -1;
+            }
+            hasTz = 1;
+            break;
+        }
+        }
+        z += n;
+    }
+    memset(p, 0, sizeof(*p));
+    if (hasUnix)
+    {
+        if (dt_from_unix(p, iUnix, ns))
+            return -1;
+        return (int)(z - z0);
+    }
+    if (yday)
+    {
+        civilFromDays(daysFromCivil(Y, 1, 1) + yday - 1, &Y, &M, &D);
+    }
+    if (pm >= 0)
+    {
+        if (h == 12)
+            h = 0;
+        if (pm)
+            h += 12;
+    }
+    p->Y = Y;
+    p->M = M;
+    p->D = D;
+    p->validYMD = 1;
+    p->h = h;
+    p->m = m;
+    p->s = sec;
+    p->ns = ns;
+    p->validHMS = hasHMS;
+    p->tz = tz;
+    if (hasTz)
+    {
+        p->isUtc = 1;
+        p->isLocal = 0;
+    }
+    computeJD(p);
+    if (p->isError || !validJulianDay(p->iJD))
+        return -1;
+    clearYMD_HMS_TZ(p); /* Day of month overflow rolls forward */
+    return (int)(z - z0);
+}
+
+#ifdef USE_LUA
+
+/*
+** Lua module.  A datetime userdata holds a DateTime normalized to its
+** julian day, so methods and metamethods never go through text unless
+** a string is asked for.  Durations are a second userdata type.
+*/
+#define LDT_DATETIME "datetime"
+#define LDT_DURATION "datetime.duration"
+#define LDT_FMT "datetime.fmt"
+#define LDT_SCAN "datetime.scan"
+#define LDT_FMTCACHE "datetime.fmtcache"
+#define LDT_FMTCACHE_MAX 64
+
+static DateTime *ldtPush(lua_State *L, const DateTime *p)
+{
+    DateTime *u = (DateTime *)lua_newuserdata(L, sizeof(DateTime));
+    *u = *p;
+    computeJD(u);
+    clearYMD_HMS_TZ(u);
+    u->rawS = 0;
+    luaL_setmetatable(L, LDT_DATETIME);
+    return u;
+}
+
+static dt_duration *ldtPushDuration(lua_State *L, const dt_duration *d)
+{
+    dt_duration *u = (dt_duration *)lua_newuserdata(L, sizeof(dt_duration));
+    *u = *d;
+    luaL_setmetatable(L, LDT_DURATION);
+    return u;
+}
+
+#define ldtCheck(L, i) ((DateTime *)luaL_checkudata(L, i, LDT_DATETIME))
+#define ldtCheckDuration(L, i) ((dt_duration *)luaL_checkudata(L, i, LDT_DURATION))
+
+/*
+** Apply the modifiers at stack index 2 and above to p, which is already
+** a parsed value.
+*/
+static int ldtModify(lua_State *L, DateTime *p)
+{
+    int top = lua_gettop(L);
+    for (int i = 2; i <= top; i++)
+    {
+        size_t n;
+        const char *z = luaL_checklstring(L, i, &n);
+        if (parseModifier(z, (int)n, p, i))
+            return 1;
+    }
+    computeJD(p);
+    return p->isError || !validJulianDay(p->iJD);
+}
+
+/* datetime.new([text [, modifier ...]]), "now" without arguments */
+static int ldtNew(lua_State *L)
+{
+    DateTime x;
+    const char *argv[DT_MAX_ARGS];
+    int argc = lua_gettop(L);
+    luaL_argcheck(L, argc <= DT_MAX_ARGS, DT_MAX_ARGS + 1, "too many modifiers");
+    for (int i = 0; i < argc; i++)
+        argv[i] = luaL_checkstring(L, i + 1);
+    if (isDate(argc, argv, &x))
+        return 0;
+    ldtPush(L, &x);
+    return 1;
+}
+
+/* datetime.unix(sec [, nsec]) */
+static int ldtUnix(lua_State *L)
+{
+    DateTime x;
+    if (dt_from_unix(&x, (int64_t)luaL_checknumber(L, 1), (int)luaL_optinteger(L, 2, 0)))
+        return 0;
+    ldtPush(L, &x);
+    return 1;
+}
+
+/* datetime.duration(months, days, ns) */
+static int ldtDurationNew(lua_State *L)
+{
+    dt_duration d;
+    d.months = (int32_t)luaL_optinteger(L, 1, 0);
+    d.days = (int32_t)luaL_optinteger(L, 2, 0);
+    d.ns = (int64_t)luaL_optnumber(L, 3, 0);
+    ldtPushDuration(L, &d);
+    return 1;
+}
+
+/*
+** Compiled format for the string at iFmt, kept in a registry table keyed
+** by the format text.  The number of entries is kept at key 0.  Once it
+** reaches LDT_FMTCACHE_MAX the whole table is replaced by an empty one,
+** so a script that builds format strings on the fly does not grow the
+** state without bound.  Formatters already handed out hold their own
+** reference, and the returned program stays referenced by the current
+** table until the next ldtFormat call.
+*/
+static dt_fmt *ldtFormat(lua_State *L, int iFmt)
+{
+    dt_fmt **pp;
+    int n;
+    lua_getfield(L, LUA_REGISTRYINDEX, LDT_FMTCACHE);
+    lua_pushvalue(L, iFmt);
+    lua_rawget(L, -2);
+    pp = (dt_fmt **)lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    if (pp == NULL)
+    {
+        lua_rawgeti(L, -1, 0);
+        n = (int)lua_tointeger(L, -1);
+        lua_pop(L, 1);
+        if (n >= LDT_FMTCACHE_MAX)
+        {
+            lua_pop(L, 1);
+            lua_newtable(L);
+            lua_pushvalue(L, -1);
+            lua_setfield(L, LUA_REGISTRYINDEX, LDT_FMTCACHE);
+            n = 0;
+        }
+        pp = (dt_fmt **)lua_newuserdata(L, sizeof(dt_fmt *));
+        *pp = dt_fmt_compile(luaL_checkstring(L, iFmt));
+        luaL_setmetatable(L, LDT_FMT);
+        if (*pp == NULL)
+            luaL_argerror(L, iFmt, "invalid format");
+        lua_pushvalue(L, iFmt);
+        lua_pushvalue(L, -2);
+        lua_rawset(L, -4);
+        lua_pushinteger(L, n + 1);
+        lua_rawseti(L, -3, 0);
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+    return *pp;
+}
+
+static int ldtPushFormatted(lua_State *L, const dt_fmt *f, const DateTime *p)
+{
+    char zBuf[256];
+    int n = dt_fmt_format(f, p, zBuf, sizeof(zBuf));
+    if (n < 0)
+        return 0;
+    if (n < (int)sizeof(zBuf))
+    {
+        lua_pushlstring(L, zBuf, n);
+    }
+    else
+    {
+        /* Scratch userdata rather than luaL_prepbuffsize, which LuaJIT lacks */
+        char *z = (char *)lua_newuserdata(L, n + 1);
+        dt_fmt_format(f, p, z, n + 1);
+        lua_pushlstring(L, z, n);
+        lua_remove(L, -2);
+    }
+    return 1;
+}
+
+/* t:format(fmt) */
+static int ldtFormatMethod(lua_State *L)
+{
+    DateTime *p = ldtCheck(L, 1);
+    luaL_checkstring(L, 2);
+    return ldtPushFormatted(L, ldtFormat(L, 2), p);
+}
+
+/* t:datetime(), t:date(), t:time() */
+static int ldtText(lua_State *L, const char *zFmt)
+{
+    DateTime *p = ldtCheck(L, 1);
+    lua_pushstring(L, zFmt);
+    return ldtPushFormatted(L, ldtFormat(L, lua_gettop(L)), p);
+}
+
+static int ldtDatetime(lua_State *L)
+{
+    DateTime *p = ldtCheck(L, 1);
+    if (p->useSubsec)
+        return ldtText(L, p->nSubsec == 9 ? "%F %H:%M:%9f" : p->nSubsec == 6 ? "%F %H:%M:%6f" : "%F %H:%M:%f");
+    return ldtText(L, "%F %T");
+}
+
+static int ldtDate(lua_State *L)
+{
+    return ldtText(L, "%F");
+}
+
+static int ldtTime(lua_State *L)
+{
+    DateTime *p = ldtCheck(L, 1);
+    if (p->useSubsec)
+        return ldtText(L, p->nSubsec == 9 ? "%H:%M:%9f" : p->nSubsec == 6 ? "%H:%M:%6f" : "%H:%M:%f");
+    return ldtText(L, "%T");
+}
+
+/* t:modify(modifier, ...) returns a new value, t is unchanged */
+static int ldtModifyMethod(lua_State *L)
+{
+    DateTime x = *ldtCheck(L, 1);
+    if (ldtModify(L, &x))
+        return 0;
+    ldtPush(L, &x);
+    return 1;
+}
+
+/* t:unix() returns seconds and nanoseconds */
+static int ldtUnixMethod(lua_State *L)
+{
+    int64_t sec;
+    int nsec;
+    if (dt_to_unix(ldtCheck(L, 1), &sec, &nsec))
+        return 0;
+    lua_pushnumber(L, (lua_Number)sec);
+    lua_pushinteger(L, nsec);
+    return 2;
+}
+
+static int ldtJulianday(lua_State *L)
+{
+    DateTime *p = ldtCheck(L, 1);
+    lua_pushnumber(L, p->iJD / 86400000.0);
+    return 1;
+}
+
+/* t:bucket(n, unit [, zone]), unit is "second" ... "year" */
+static int ldtBucket(lua_State *L)
+{
+    static const char *const azUnit[] = {"second", "minute", "hour", "day", "week", "month", "year", NULL};
+    DateTime *p = ldtCheck(L, 1);
+    int n = (int)luaL_checkinteger(L, 2);
+    int unit = luaL_checkoption(L, 3, NULL, azUnit);
+    const char *zZone = luaL_optstring(L, 4, NULL);
+    const struct tzone *pZone = zZone ? tzone_get(zZone) : NULL;
+    int64_t sec, t;
+    int nsec;
+    dt_bucket b;
+    DateTime x;
+    if (zZone && pZone == NULL)
+        return luaL_argerror(L, 4, "unknown zone");
+    if (dt_bucket_init(&b, n, unit, pZone, 1000000000) || dt_to_unix(p, &sec, &nsec))
+        return 0;
+    if (sec <= -9223372036LL || sec >= 9223372036LL)
+        return 0;
+    t = dt_bucket_floor(&b, sec * 1000000000 + nsec);
+    if (dt_from_unix_ns(&x, t))
+        return 0;
+    x.useSubsec = p->useSubsec;
+    x.nSubsec = p->nSubsec;
+    ldtPush(L, &x);
+    return 1;
+}
+
+static const char *const azField[] = {"year", "month", "day", "hour", "minute", "second", "nanosecond", NULL};
+
+/* Methods first, then the calendar fields */
+static int ldtIndex(lua_State *L)
+{
+    DateTime x = *ldtCheck(L, 1);
+    int i;
+    lua_getmetatable(L, 1);
+    lua_getfield(L, -1, "__methods");
+    lua_pushvalue(L, 2);
+    lua_rawget(L, -2);
+    if (!lua_isnil(L, -1))
+        return 1;
+    lua_pop(L, 3);
+    for (i = 0; azField[i]; i++)
+        if (lua_type(L, 2) == LUA_TSTRING && strcmp(lua_tostring(L, 2), azField[i]) == 0)
+            break;
+    if (azField[i] == NULL)
+        return 0;
+    computeYMD_HMS(&x);
+    switch (i)
+    {
+    case 0: lua_pushinteger(L, x.Y); break;
+    case 1: lua_pushinteger(L, x.M); break;
+    case 2: lua_pushinteger(L, x.D); break;
+    case 3: lua_pushinteger(L, x.h); break;
+    case 4: lua_pushinteger(L, x.m); break;
+    case 5: lua_pushinteger(L, x.s); break;
+    default: lua_pushinteger(L, x.ns); break;
+    }
+    return 1;
+}
+
+static int ldtEq(lua_State *L)
+{
+    lua_pushboolean(L, dt_cmp(ldtCheck(L, 1), ldtCheck(L, 2)) == 0);
+    return 1;
+}
+
+static int ldtLt(lua_State *L)
+{
+    lua_pushboolean(L, dt_cmp(ldtCheck(L, 1), ldtCheck(L, 2)) < 0);
+    return 1;
+}
+
+static int ldtLe(lua_State *L)
+{
+    lua_pushboolean(L, dt_cmp(ldtCheck(L, 1), ldtCheck(L, 2)) <= 0);
+    return 1;
+}
+
+/*
+** t + duration, duration + t, t + seconds.  Durations add to each
+** other as well.
+*/
+static int ldtAdd(lua_State *L)
+{
+    DateTime x;
+    dt_duration d;
+    int iTime = luaL_testudata(L, 1, LDT_DATETIME) ? 1 : 2;
+    int iOther = 3 - iTime;
+    if (!luaL_testudata(L, iTime, LDT_DATETIME))
+    {
+        dt_duration_add(&d, ldtCheckDuration(L, 1), ldtCheckDuration(L, 2));
+        ldtPushDuration(L, &d);
+        return 1;
+    }
+    x = *ldtCheck(L, iTime);
+    if (lua_type(L, iOther) == LUA_TNUMBER)
+    {
+        lua_Number r = lua_tonumber(L, iOther);
+        d.months = 0;
+        d.days = 0;
+        d.ns = (int64_t)(r * 1e9 + (r < 0 ? -0.5 : 0.5));
+    }
+    else
+    {
+        d = *ldtCheckDuration(L, iOther);
+    }
+    if (dt_add(&x, &d))
+        return 0;
+    ldtPush(L, &x);
+    return 1;
+}
+
+/*
+** t - t gives the dt_diff() duration, t - duration and t - seconds
+** give a datetime.
+*/
+static int ldtSub(lua_State *L)
+{
+    dt_duration d;
+    DateTime x;
+    if (luaL_testudata(L, 2, LDT_DATETIME))
+    {
+        if (dt_diff(&d, ldtCheck(L, 1), ldtCheck(L, 2)))
+            return 0;
+        ldtPushDuration(L, &d);
+        return 1;
+    }
+    if (!luaL_testudata(L, 1, LDT_DATETIME))
+    {
+        dt_duration_sub(&d, ldtCheckDuration(L, 1), ldtCheckDuration(L, 2));
+        ldtPushDuration(L, &d);
+        return 1;
+    }
+    x = *ldtCheck(L, 1);
+    if (lua_type(L, 2) == LUA_TNUMBER)
+    {
+        lua_Number r = lua_tonumber(L, 2);
+        d.months = 0;
+        d.days = 0;
+        d.ns = (int64_t)(r * 1e9 + (r < 0 ? -0.5 : 0.5));
+    }
+    else
+    {
+        d = *ldtCheckDuration(L, 2);
+    }
+    if (dt_sub(&x, &d))
+        return 0;
+    ldtPush(L, &x);
+    return 1;
+}
+
+static int ldtToString(lua_State *L)
+{
+    return ldtDatetime(L);
+}
+
+static int ldtDurationIndex(lua_State *L)
+{
+    dt_duration *d = ldtCheckDuration(L, 1);
+    const char *z = luaL_checkstring(L, 2);
+    if (strcmp(z, "months") == 0)
+        lua_pushinteger(L, d->months);
+    else if (strcmp(z, "days") == 0)
+        lua_pushinteger(L, d->days);
+    else if (strcmp(z, "ns") == 0)
+        lua_pushnumber(L, (lua_Number)d->ns);
+    else
+        return 0;
+    return 1;
+}
+
+static int ldtDurationToString(lua_State *L)
+{
+    char zBuf[48];
+    int n = dt_duration_format(ldtCheckDuration(L, 1), zBuf, sizeof(zBuf));
+    if (n < 0)
+        return 0;
+    lua_pushlstring(L, zBuf, n);
+    return 1;
+}
+
+static int ldtDurationEq(lua_State *L)
+{
+    lua_pushboolean(L, dt_duration_cmp(ldtCheckDuration(L, 1), ldtCheckDuration(L, 2)) == 0);
+    return 1;
+}
+
+static int ldtDurationLt(lua_State *L)
+{
+    lua_pushboolean(L, dt_duration_cmp(ldtCheckDuration(L, 1), ldtCheckDuration(L, 2)) < 0);
+    return 1;
+}
+
+static int ldtDurationLe(lua_State *L)
+{
+    lua_pushboolean(L, dt_duration_cmp(ldtCheckDuration(L, 1), ldtCheckDuration(L, 2)) <= 0);
+    return 1;
+}
+
+static int ldtDurationUnm(lua_State *L)
+{
+    dt_duration d = *ldtCheckDuration(L, 1);
+    d.months = -d.months;
+    d.days = -d.days;
+    d.ns = -d.ns;
+    ldtPushDuration(L, &d);
+    return 1;
+}
+
+/* datetime.formatter(fmt) returns a callable: f(t) -> string */
+static int ldtFormatter(lua_State *L)
+{
+    luaL_checkstring(L, 1);
+    ldtFormat(L, 1);
+    lua_getfield(L, LUA_REGISTRYINDEX, LDT_FMTCACHE);
+    lua_pushvalue(L, 1);
+    lua_rawget(L, -2);
+    return 1;
+}
+
+static int ldtFmtCall(lua_State *L)
+{
+    dt_fmt **pp = (dt_fmt **)luaL_checkudata(L, 1, LDT_FMT);
+    return ldtPushFormatted(L, *pp, ldtCheck(L, 2));
+}
+
+static int ldtFmtGc(lua_State *L)
+{
+    dt_fmt **pp = (dt_fmt **)luaL_checkudata(L, 1, LDT_FMT);
+    dt_fmt_free(*pp);
+    *pp = NULL;
+    return 0;
+}
+
+/* datetime.scanner(pattern) returns a callable: s(text) -> datetime or nil */
+static int ldtScanner(lua_State *L)
+{
+    dt_scan **pp = (dt_scan **)lua_newuserdata(L, sizeof(dt_scan *));
+    *pp = dt_scan_compile(luaL_checkstring(L, 1));
+    luaL_setmetatable(L, LDT_SCAN);
+    if (*pp == NULL)
+        return luaL_argerror(L, 1, "invalid pattern");
+    return 1;
+}
+
+static int ldtScanCall(lua_State *L)
+{
+    dt_scan **pp = (dt_scan **)luaL_checkudata(L, 1, LDT_SCAN);
+    DateTime x;
+    if (dt_scan_parse(*pp, luaL_checkstring(L, 2), &x) < 0)
+        return 0;
+    ldtPush(L, &x);
+    return 1;
+}
+
+static int ldtScanGc(lua_State *L)
+{
+    dt_scan **pp = (dt_scan **)luaL_checkudata(L, 1, LDT_SCAN);
+    dt_scan_free(*pp);
+    *pp = NULL;
+    return 0;
+}
+
+int luaopen_datetime(lua_State *L)
+{
+    static const luaL_Reg f[] = {
+        {"new", ldtNew},
+        {"unix", ldtUnix},
+        {"duration", ldtDurationNew},
+        {"formatter", ldtFormatter},
+        {"scanner", ldtScanner},
+        {NULL, NULL}};
+    static const luaL_Reg m[] = {
+        {"format", ldtFormatMethod},
+        {"datetime", ldtDatetime},
+        {"date", ldtDate},
+        {"time", ldtTime},
+        {"modify", ldtModifyMethod},
+        {"unix", ldtUnixMethod},
+        {"julianday", ldtJulianday},
+        {"bucket", ldtBucket},
+        {NULL, NULL}};
+    static const luaL_Reg mt[] = {
+        {"__index", ldtIndex},
+        {"__eq", ldtEq},
+        {"__lt", ldtLt},
+        {"__le", ldtLe},
+        {"__add", ldtAdd},
+        {"__sub", ldtSub},
+        {"__tostring", ldtToString},
+        {NULL, NULL}};
+    static const luaL_Reg dmt[] = {
+        {"__index", ldtDurationIndex},
+        {"__eq", ldtDurationEq},
+        {"__lt", ldtDurationLt},
+        {"__le", ldtDurationLe},
+        {"__add", ldtAdd},
+        {"__sub", ldtSub},
+        {"__unm", ldtDurationUnm},
+        {"__tostring", ldtDurationToString},
+        {NULL, NULL}};
+    luaL_newmetatable(L, LDT_DATETIME);
+    luaL_setfuncs(L, mt, 0);
+    lua_newtable(L);
+    luaL_setfuncs(L, m, 0);
+    lua_setfield(L, -2, "__methods");
+    lua_pop(L, 1);
+    luaL_newmetatable(L, LDT_DURATION);
+    luaL_setfuncs(L, dmt, 0);
+    lua_pop(L, 1);
+    luaL_newmetatable(L, LDT_FMT);
+    lua_pushcfunction(L, ldtFmtCall);
+    lua_setfield(L, -2, "__call");
+    lua_pushcfunction(L, ldtFmtGc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+    luaL_newmetatable(L, LDT_SCAN);
+    lua_pushcfunction(L, ldtScanCall);
+    lua_setfield(L, -2, "__call");
+    lua_pushcfunction(L, ldtScanGc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+    lua_newtable(L);
+    lua_setfield(L, LUA_REGISTRYINDEX, LDT_FMTCACHE);
+    lua_newtable(L);
+    luaL_setfuncs(L, f, 0);
+    return 1;
+}
+
+#endif
@@ -1,4 +1,5 @@
 #ifndef TJ_DATETIME_H
+#define TJ_DATETIME_H
 
 /*
  * sqlite3中的日期函数
@@ -11,16 +12,188 @@
 extern "C" {
 #endif
 
+typedef struct DateTime DateTime;
+struct DateTime
+{
+    int64_t iJD;                /* The julian day number times 86400000 */
+    int iNs;                    /* Nanoseconds beyond the millisecond of iJD, 0..999999 */
+    int Y, M, D;                /* Year, month, and day */
+    int h, m;                   /* Hour and minutes */
+    int tz;                     /* Timezone offset in minutes */
+    int s;                      /* Whole seconds */
+    int ns;                     /* Nanoseconds within the second */
+    double rRaw;                /* Raw numeric value */
+    int64_t iRawS;              /* rRaw as whole units, valid if rawExact */
+    int iRawNs;                 /* Fraction of iRawS in 1e-9 units, 0..999999999 */
+    const struct tzone *pZone;  /* Zone of a localtime value, NULL for the process zone */
+    char validJD;               /* True (1) if iJD is valid */
+    char validYMD;              /* True (1) if Y,M,D are valid */
+    char validHMS;              /* True (1) if h,m,s are valid */
+    char nFloor;                /* Days to implement "floor" */
+    char nSubsec;               /* Subsecond digits to display, 3, 6 or 9 */
+    unsigned rawS : 1;          /* Raw numeric value stored in rRaw */
+    unsigned rawExact : 1;      /* iRawS/iRawNs hold rRaw without rounding */
+    unsigned isError : 1;       /* An overflow has occurred */
+    unsigned useSubsec : 1;     /* Display subsecond precision */
+    unsigned isUtc : 1;         /* Time is known to be UTC */
+    unsigned isLocal : 1;       /* Time is known to be localtime */
+};
+
+/*
+ * 变参接口, 参数为时间值加修饰符, 最多 DT_MAX_ARGS 个, 超出返回 NULL/0.
+ * 返回的字符串位于线程局部缓冲区, 在同一线程下次调用同一函数前有效.
+ */
+#define DT_MAX_ARGS 32
+
 const char* dt_time(int argc, ...);
 const char* dt_datetime(int argc, ...);
 const char* dt_date(int argc, ...);
 int64_t dt_unixepoch(int argc, ...);
+int64_t dt_unixepoch_ns(int argc, ...);
 double dt_julianday(int argc, ...);
 const char* dt_timediff(int argc, ...);
 const char* dt_strftime(const char* zFmt, int argc, ...);
 
+/*
+ * 可重入版本, 写入调用方的缓冲区, 返回值与 snprintf 一致, 失败返回 -1.
+ */
+int dt_datetime_r(char* buf, int n, int argc, const char* const* argv);
+int dt_date_r(char* buf, int n, int argc, const char* const* argv);
+int dt_time_r(char* buf, int n, int argc, const char* const* argv);
+int dt_timediff_r(char* buf, int n, int argc, const char* const* argv);
+int dt_strftime_r(char* buf, int n, const char* zFmt, int argc, const char* const* argv);
+
+/* 解析时间串和修饰符, 与 dt_datetime 等的参数相同, 成功返回 0 */
+int dt_parse(DateTime* p, int argc, const char* const* argv);
+
+/* unix 纪元秒/纳秒与 DateTime 互转, 不经过字符串. 超出范围返回 1 */
+int dt_from_unix(DateTime* p, int64_t sec, int nsec);
+int dt_from_unix_ns(DateTime* p, int64_t ns);
+int dt_to_unix(const DateTime* p, int64_t* pSec, int* pNsec);
+int dt_to_unix_ns(const DateTime* p, int64_t* pNs);
+
+/*
+ * 时间间隔: 日历月数 + 天数 + 纳秒, 各分量同号.
+ * dt_diff 与 dt_timediff 的语义相同, 满足 dt_add(B, dt_diff(A, B)) == A;
+ * dt_diff_ns 是两个时刻之间的精确纳秒数, 超出 int64 时返回 1.
+ * dt_duration_cmp 按 (months, days, ns) 依次比较, 适用于 dt_diff 的结果.
+ * dt_duration_format 输出 "+YYYY-MM-DD HH:MM:SS.SSS", 返回值与 snprintf 一致.
+ */
+typedef struct dt_duration dt_duration;
+struct dt_duration
+{
+    int32_t months;
+    int32_t days;
+    int64_t ns;
+};
+
+int dt_diff(dt_duration* pDur, const DateTime* pA, const DateTime* pB);
+int dt_diff_ns(const DateTime* pA, const DateTime* pB, int64_t* pNs);
+int dt_cmp(const DateTime* pA, const DateTime* pB);
+int dt_add(DateTime* p, const dt_duration* pDur);
+int dt_sub(DateTime* p, const dt_duration* pDur);
+void dt_duration_add(dt_duration* pOut, const dt_duration* pA, const dt_duration* pB);
+void dt_duration_sub(dt_duration* pOut, const dt_duration* pA, const dt_duration* pB);
+int dt_duration_cmp(const dt_duration* pA, const dt_duration* pB);
+int dt_duration_format(const dt_duration* pDur, char* buf, int n);
+
+/*
+ * 时间分桶, 对 unix 纪元整数做 floor/ceil, 不经过字符串.
+ * res 为输入每秒的单位数: 1 秒, 1000 毫秒, 1000000000 纳秒.
+ * 秒/分/小时按 n 个单位等宽分桶, 天/周/月/年按日历对齐,
+ * 周从周一开始. pZone 不为 NULL 时按该时区的本地时间对齐, 结果仍是 unix 时间.
+ */
+enum
+{
+    DT_UNIT_SECOND = 0,
+    DT_UNIT_MINUTE,
+    DT_UNIT_HOUR,
+    DT_UNIT_DAY,
+    DT_UNIT_WEEK,
+    DT_UNIT_MONTH,
+    DT_UNIT_YEAR,
+};
+
+typedef struct dt_bucket dt_bucket;
+struct dt_bucket
+{
+    int unit;
+    int n;
+    int64_t res;
+    int64_t step;                /* 等宽分桶的宽度, 以输入单位计, 日历单位为 0 */
+    const struct tzone* pZone;
+};
+
+int dt_bucket_init(dt_bucket* b, int n, int unit, const struct tzone* pZone, int64_t res);
+int64_t dt_bucket_floor(const dt_bucket* b, int64_t t);
+int64_t dt_bucket_ceil(const dt_bucket* b, int64_t t);
+/* 批量版本, in 与 out 可以相同. 输入有序时相邻元素复用同一个桶 */
+void dt_bucket_floor_array(const dt_bucket* b, const int64_t* in, int64_t* out, int count);
+void dt_bucket_ceil_array(const dt_bucket* b, const int64_t* in, int64_t* out, int count);
+
+/*
+ * 预编译的 strftime 格式, 支持的转换与 dt_strftime 相同, %6f %9f 输出微秒/纳秒.
+ * dt_fmt_format 的返回值与 snprintf 一致: 完整输出的长度, 格式化失败返回 -1.
+ */
+typedef struct dt_fmt dt_fmt;
+
+dt_fmt* dt_fmt_compile(const char* zFmt);
+void dt_fmt_free(dt_fmt* f);
+int dt_fmt_format(const dt_fmt* f, const DateTime* p, char* buf, int n);
+
+/*
+ * 预编译的 strptime 风格解析, 例如 "%d/%b/%Y:%H:%M:%S %z".
+ * 支持的转换见 datetime.c 中 dt_scan 的注释. 解析时不分配内存,
+ * 成功返回消耗的字节数, 失败返回 -1.
+ */
+typedef struct dt_scan dt_scan;
+
+dt_scan* dt_scan_compile(const char* zFmt);
+void dt_scan_free(dt_scan* s);
+int dt_scan_parse(const dt_scan* s, const char* z, DateTime* p);
+
+/*
+ * 按 unix 纳秒格式化, 结果按线程缓存到分钟(含 %s 时到秒),
+ * 命中时只改写秒和毫秒位. pZone 为 NULL 表示 UTC.
+ */
+int dt_fmt_cached(const dt_fmt* f, const struct tzone* pZone, int64_t ns, char* buf, int n);
+int dt_fmt_now(const dt_fmt* f, const struct tzone* pZone, char* buf, int n);
+/* 当前线程的缓存命中/未命中次数 */
+void dt_fmt_cache_stats(uint64_t* pHit, uint64_t* pMiss);
+
+#ifdef USE_LUA
+
+/*
+ * Lua 模块, require "datetime". 需要 Lua 5.2+ 或 LuaJIT 2.1 的 luaL_setfuncs 等接口.
+ * datetime.new(text, mod...) / datetime.unix(sec, nsec) 返回 datetime 对象:
+ *   t:modify(mod...) t:format(fmt) t:datetime() t:date() t:time() t:unix() t:julianday()
+ *   t:bucket(n, unit, zone) t.year .. t.nanosecond, 比较运算, t + 秒数/duration, t1 - t2 得到 duration
+ * datetime.formatter(fmt) / datetime.scanner(pattern) 返回预编译的可调用对象.
+ * t:format(fmt) 按格式串缓存编译结果, 超过 64 个不同的格式串时整个缓存清空重来.
+ */
+int luaopen_datetime(lua_State*);
+
+#endif
+
 #ifdef __cplusplus
 };
+
+/* 追加到 YString 或 std::string 等提供 append(const char*, n) 的字符串 */
+template <class S>
+inline S& dt_fmt_append(S& out, const dt_fmt* f, const DateTime* p)
+{
+    char buf[256];
+    int n = dt_fmt_format(f, p, buf, sizeof(buf));
+    if (n < (int)sizeof(buf)) {
+        if (n > 0) out.append(buf, n);
+        return out;
+    }
+    char* big = new char[n + 1];
+    dt_fmt_format(f, p, big, n + 1);
+    out.append(big, n);
+    delete[] big;
+    return out;
+}
 #endif
 
 #endif
@@ -0,0 +1,274 @@
+#include "dtclock.h"
+#include "atomic.h"
+#include <stdint.h>
+#include <stdlib.h>
+#ifdef _WIN32
+#include <Windows.h>
+#include <intrin.h>
+#else
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#include <cpuid.h>
+#endif
+#endif
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64)
+#define DT_HAVE_TSC 1
+#endif
+
+/*
+** TSC calibration.  ns = ns0 + ((tsc - tsc0) * mult) >> 32
+*/
+/* TickerState; a thread moves it to TICKER_BUSY before touching TickerThread */
+enum
+{
+    TICKER_STOPPED,
+    TICKER_BUSY,
+    TICKER_RUNNING,
+};
+
+typedef struct tsc_calib tsc_calib;
+struct tsc_calib
+{
+    uint64_t tsc0;
+    int64_t ns0;
+    uint64_t mult;
+};
+
+static atomic_int ClockSource;
+static atomic_ptr TscCalib;
+static atomic_int64 CachedNow;
+static atomic_int TickerStop;
+static int TickerInterval;
+static atomic_int TickerState;  /* TICKER_STOPPED, TICKER_BUSY or TICKER_RUNNING */
+#ifdef _WIN32
+static HANDLE TickerThread;
+#else
+static pthread_t TickerThread;
+#endif
+
+#ifdef _WIN32
+static int64_t fileTimeNs(const FILETIME *ft)
+{
+    ULARGE_INTEGER ui;
+    ui.LowPart = ft->dwLowDateTime;
+    ui.HighPart = ft->dwHighDateTime;
+    return (int64_t)(ui.QuadPart - 116444736000000000ULL) * 100;
+}
+#endif
+
+int64_t dt_now_precise_ns(void)
+{
+#ifdef _WIN32
+    FILETIME ft;
+    GetSystemTimePreciseAsFileTime(&ft);
+    return fileTimeNs(&ft);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+int64_t dt_now_coarse_ns(void)
+{
+#ifdef _WIN32
+    FILETIME ft;
+    GetSystemTimeAsFileTime(&ft);
+    return fileTimeNs(&ft);
+#elif defined(CLOCK_REALTIME_COARSE)
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+    return dt_now_precise_ns();
+#endif
+}
+
+int64_t dt_now_cached_ns(void)
+{
+    int64_t ns = atomic_int64_load_explicit(&CachedNow, memory_order_relaxed);
+    return ns ? ns : dt_now_coarse_ns();
+}
+
+#ifdef DT_HAVE_TSC
+static uint64_t mulShift32(uint64_t a, uint64_t b)
+{
+#ifdef _MSC_VER
+    uint64_t hi, lo = _umul128(a, b, &hi);
+    return (hi << 32) | (lo >> 32);
+#else
+    return (uint64_t)(((unsigned __int128)a * b) >> 32);
+#endif
+}
+#endif
+
+int64_t dt_now_tsc_ns(void)
+{
+#ifdef DT_HAVE_TSC
+    const tsc_calib *c = (const tsc_calib *)atomic_ptr_load_explicit(&TscCalib, memory_order_acquire);
+    if (c)
+        return c->ns0 + (int64_t)mulShift32(__rdtsc() - c->tsc0, c->mult);
+#endif
+    return dt_now_precise_ns();
+}
+
+int dt_clock_calibrate_tsc(void)
+{
+#ifdef DT_HAVE_TSC
+    tsc_calib *c;
+    uint64_t t0, t1;
+    int64_t n0, n1;
+#ifdef _WIN32
+    int info[4];
+    __cpuid(info, 0x80000007);
+    if (!(info[3] & (1 << 8)))
+        return 1;
+#else
+    unsigned a, b, cx, d;
+    if (!__get_cpuid(0x80000007, &a, &b, &cx, &d) || !(d & (1 << 8)))
+        return 1;
+#endif
+    if (atomic_ptr_load(&TscCalib))
+        return 0;
+    t0 = __rdtsc();
+    n0 = dt_now_precise_ns();
+    do
+    {
+        n1 = dt_now_precise_ns();
+    } while (n1 - n0 < 20000000);
+    t1 = __rdtsc();
+    if (t1 <= t0)
+        return 1;
+    c = (tsc_calib *)malloc(sizeof(*c));
+    if (c == NULL)
+        return 1;
+    c->tsc0 = t1;
+    c->ns0 = n1;
+    c->mult = (uint64_t)((((double)(n1 - n0)) * 4294967296.0) / (double)(t1 - t0));
+    if (!atomic_ptr_cas(&TscCalib, NULL, c))
+        free(c);
+    return 0;
+#else
+    return 1;
+#endif
+}
+
+int dt_clock_set_source(int source)
+{
+    if (source < DT_CLOCK_PRECISE || source > DT_CLOCK_TSC)
+        return 1;
+    atomic_int_store(&ClockSource, source);
+    return 0;
+}
+
+int dt_clock_source(void)
+{
+    return atomic_int_load(&ClockSource);
+}
+
+int64_t dt_now_ns(void)
+{
+    switch (atomic_int_load_explicit(&ClockSource, memory_order_relaxed))
+    {
+    case DT_CLOCK_COARSE:
+        return dt_now_coarse_ns();
+    case DT_CLOCK_CACHED:
+        return dt_now_cached_ns();
+    case DT_CLOCK_TSC:
+        return dt_now_tsc_ns();
+    default:
+        return dt_now_precise_ns();
+    }
+}
+
+int64_t dt_now_ms(void)
+{
+    return dt_now_ns() / 1000000;
+}
+
+int64_t dt_now_unixepoch(void)
+{
+    return dt_now_ns() / 1000000000;
+}
+
+#ifdef _WIN32
+static DWORD WINAPI tickerMain(LPVOID arg)
+#else
+static void *tickerMain(void *arg)
+#endif
+{
+    (void)arg;
+    while (!atomic_int_load(&TickerStop))
+    {
+        atomic_int64_store_explicit(&CachedNow, dt_now_precise_ns(), memory_order_relaxed);
+#ifdef _WIN32
+        Sleep(TickerInterval / 1000 ? TickerInterval / 1000 : 1);
+#else
+        usleep(TickerInterval);
+#endif
+    }
+    atomic_int64_store_explicit(&CachedNow, 0, memory_order_relaxed);
+    return 0;
+}
+
+static void tickerWait(void)
+{
+#ifdef _WIN32
+    Sleep(1);
+#else
+    usleep(1000);
+#endif
+}
+
+/*
+** Starting and stopping claim TickerState with a CAS, so concurrent calls
+** create at most one thread; a call that finds another one in progress
+** waits for it to finish.
+*/
+int dt_clock_start_ticker(int interval_us)
+{
+    while (!atomic_int_cas(&TickerState, TICKER_STOPPED, TICKER_BUSY))
+    {
+        if (atomic_int_load(&TickerState) == TICKER_RUNNING)
+            return 0;
+        tickerWait();
+    }
+    TickerInterval = interval_us > 0 ? interval_us : 1000;
+    atomic_int_store(&TickerStop, 0);
+    atomic_int64_store_explicit(&CachedNow, dt_now_precise_ns(), memory_order_relaxed);
+#ifdef _WIN32
+    TickerThread = CreateThread(NULL, 0, tickerMain, NULL, 0, NULL);
+    if (TickerThread == NULL)
+#else
+    if (pthread_create(&TickerThread, NULL, tickerMain, NULL))
+#endif
+    {
+        atomic_int64_store_explicit(&CachedNow, 0, memory_order_relaxed);
+        atomic_int_store(&TickerState, TICKER_STOPPED);
+        return 1;
+    }
+    atomic_int_store(&TickerState, TICKER_RUNNING);
+    return 0;
+}
+
+void dt_clock_stop_ticker(void)
+{
+    while (!atomic_int_cas(&TickerState, TICKER_RUNNING, TICKER_BUSY))
+    {
+        if (atomic_int_load(&TickerState) == TICKER_STOPPED)
+            return;
+        tickerWait();
+    }
+    atomic_int_store(&TickerStop, 1);
+#ifdef _WIN32
+    WaitForSingleObject(TickerThread, INFINITE);
+    CloseHandle(TickerThread);
+#else
+    pthread_join(TickerThread, NULL);
+#endif
+    atomic_int_store(&TickerState, TICKER_STOPPED);
+}
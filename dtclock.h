@@ -0,0 +1,49 @@
+#ifndef TJ_DTCLOCK_H
+#define TJ_DTCLOCK_H
+
+/*
+ * 时钟源
+ *
+ * dt_now_* 直接返回 unix 纪元以来的时间, 不做任何字符串解析.
+ * datetime 中的 "now" 使用 dt_clock_set_source 选定的时钟源.
+ */
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum
+{
+    DT_CLOCK_PRECISE = 0, /* clock_gettime(CLOCK_REALTIME), vDSO, 纳秒 */
+    DT_CLOCK_COARSE,      /* CLOCK_REALTIME_COARSE, 精度为一个内核 tick */
+    DT_CLOCK_CACHED,      /* 后台线程定期刷新的时间, 未启动时退化为 COARSE */
+    DT_CLOCK_TSC,         /* 按墙上时钟校准的 TSC, 未校准时退化为 PRECISE */
+};
+
+int dt_clock_set_source(int source);
+int dt_clock_source(void);
+
+/* 启动/停止刷新 DT_CLOCK_CACHED 的后台线程, interval_us 为刷新间隔 */
+int dt_clock_start_ticker(int interval_us);
+void dt_clock_stop_ticker(void);
+
+/* 校准 TSC, 要求 CPU 支持 invariant TSC, 成功返回 0 */
+int dt_clock_calibrate_tsc(void);
+
+int64_t dt_now_precise_ns(void);
+int64_t dt_now_coarse_ns(void);
+int64_t dt_now_cached_ns(void);
+int64_t dt_now_tsc_ns(void);
+
+/* 使用当前时钟源 */
+int64_t dt_now_ns(void);
+int64_t dt_now_ms(void);
+int64_t dt_now_unixepoch(void);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
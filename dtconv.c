@@ -0,0 +1,543 @@
+#include "dtconv.h"
+#include "datetime.h"
+#include "tzone.h"
+#include "dtclock.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#define CONV_CHUNK (4 << 20)
+#define CONV_FIELD 128 /* Longest timestamp field accepted */
+#define CONV_OUTPUT 64 /* Formatted text expected to fit, retried if longer */
+
+#ifdef _WIN32
+typedef SRWLOCK conv_mutex;
+typedef CONDITION_VARIABLE conv_cond;
+typedef HANDLE conv_thread;
+#define convMutexInit(m) InitializeSRWLock(m)
+#define convMutexDestroy(m) ((void)(m))
+#define convLock(m) AcquireSRWLockExclusive(m)
+#define convUnlock(m) ReleaseSRWLockExclusive(m)
+#define convCondInit(c) InitializeConditionVariable(c)
+#define convCondDestroy(c) ((void)(c))
+#define convWait(c, m) SleepConditionVariableSRW(c, m, INFINITE, 0)
+#define convBroadcast(c) WakeAllConditionVariable(c)
+#else
+typedef pthread_mutex_t conv_mutex;
+typedef pthread_cond_t conv_cond;
+typedef pthread_t conv_thread;
+#define convMutexInit(m) pthread_mutex_init(m, NULL)
+#define convMutexDestroy(m) pthread_mutex_destroy(m)
+#define convLock(m) pthread_mutex_lock(m)
+#define convUnlock(m) pthread_mutex_unlock(m)
+#define convCondInit(c) pthread_cond_init(c, NULL)
+#define convCondDestroy(c) pthread_cond_destroy(c)
+#define convWait(c, m) pthread_cond_wait(c, m)
+#define convBroadcast(c) pthread_cond_broadcast(c)
+#endif
+
+/*
+** A range of whole lines of the input and the converted text for it.
+*/
+typedef struct conv_chunk conv_chunk;
+struct conv_chunk
+{
+    const char *zBeg;
+    const char *zEnd;
+    char *zOut;
+    size_t nOut;
+    size_t nAlloc;
+    uint64_t nRow;
+    uint64_t nErr;
+    int isDone;
+    int isOom;
+};
+
+/*
+** Shared state of one conversion.  Workers claim chunks in order but
+** never run more than nWindow chunks ahead of the writer, which bounds
+** the memory held by converted text that is waiting to be written.
+*/
+typedef struct conv_job conv_job;
+struct conv_job
+{
+    dt_conv_opts o;
+    dt_scan *pScan;
+    dt_fmt *pFmt;
+    conv_chunk *aChunk;
+    int nChunk;
+    int iNext;    /* Next chunk to claim */
+    int nWritten; /* Chunks already written out */
+    int nWindow;
+    int isAbort;
+    conv_mutex mutex;
+    conv_cond cond;
+};
+
+static int cpuCount(void)
+{
+#ifdef _WIN32
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    return (int)si.dwNumberOfProcessors;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+#endif
+}
+
+/*
+** Make room for n more bytes of output in c.  Return 0 on success.
+*/
+static int chunkReserve(conv_chunk *c, size_t n)
+{
+    char *z;
+    size_t m;
+    if (c->nOut + n <= c->nAlloc)
+        return 0;
+    m = c->nAlloc ? c->nAlloc : 4096;
+    while (m < c->nOut + n)
+        m *= 2;
+    z = (char *)realloc(c->zOut, m);
+    if (z == NULL)
+    {
+        c->isOom = 1;
+        return 1;
+    }
+    c->zOut = z;
+    c->nAlloc = m;
+    return 0;
+}
+
+static int chunkAppend(conv_chunk *c, const char *z, size_t n)
+{
+    if (chunkReserve(c, n))
+        return 1;
+    memcpy(c->zOut + c->nOut, z, n);
+    c->nOut += n;
+    return 0;
+}
+
+/*
+** Find field iCol of the line [z, zEnd).  A field that starts with a
+** double quote runs to the matching quote, "" being an escaped quote.
+** Store the field text, without the quotes, in *pzBeg and *pzEnd.
+** Return 1 if the line has fewer fields.
+*/
+static int findField(const char *z, const char *zEnd, char cDelim, int iCol,
+                     const char **pzBeg, const char **pzEnd)
+{
+    for (;;)
+    {
+        const char *zField = z;
+        const char *zText = z;
+        const char *zTextEnd = NULL;
+        if (z < zEnd && *z == '"')
+        {
+            zText = ++z;
+            while (z < zEnd)
+            {
+                if (*z == '"')
+                {
+                    if (z + 1 < zEnd && z[1] == '"')
+                    {
+                        z += 2;
+                        continue;
+                    }
+                    break;
+                }
+                z++;
+            }
+            zTextEnd = z;
+        }
+        if (z < zEnd)
+            z = (const char *)memchr(z, cDelim, zEnd - z);
+        if (z == NULL)
+            z = zEnd;
+        if (zText == zField)
+            zTextEnd = z;
+        if (iCol-- == 0)
+        {
+            *pzBeg = zText;
+            *pzEnd = zTextEnd;
+            return 0;
+        }
+        if (z == zEnd)
+            return 1;
+        z++;
+    }
+}
+
+/*
+** Parse the timestamp [z, zEnd) into unix nanoseconds.  Return 0 on
+** success.
+*/
+static int parseStamp(const conv_job *p, const char *z, const char *zEnd, int64_t *pNs)
+{
+    char zBuf[CONV_FIELD];
+    DateTime x;
+    int64_t sec;
+    int nsec;
+    int n = (int)(zEnd - z);
+    if (n <= 0 || n >= CONV_FIELD)
+        return 1;
+    memcpy(zBuf, z, n);
+    zBuf[n] = 0;
+    if (p->pScan)
+    {
+        if (dt_scan_parse(p->pScan, zBuf, &x) != n)
+            return 1;
+    }
+    else
+    {
+        const char *argv[1];
+        argv[0] = zBuf;
+        if (dt_parse(&x, 1, argv))
+            return 1;
+    }
+    if (dt_to_unix(&x, &sec, &nsec))
+        return 1;
+    /* An explicit offset or "Z" in the field wins over in_zone */
+    if (p->o.in_zone && !x.isUtc)
+        sec = tzone_to_utc(p->o.in_zone, sec);
+    /* dt_fmt_cached() takes int64 nanoseconds, years 1678..2261 */
+    if (sec < -INT64_MAX / 1000000000 + 1 || sec > INT64_MAX / 1000000000 - 1)
+        return 1;
+    *pNs = sec * 1000000000 + nsec;
+    return 0;
+}
+
+/*
+** Append the formatted form of ns to the output of c.
+*/
+static int emitStamp(const conv_job *p, conv_chunk *c, int64_t ns)
+{
+    int n;
+    if (chunkReserve(c, CONV_OUTPUT))
+        return 1;
+    n = dt_fmt_cached(p->pFmt, p->o.out_zone, ns, c->zOut + c->nOut, CONV_OUTPUT);
+    if (n < 0)
+        return 1;
+    if (n >= CONV_OUTPUT)
+    {
+        if (chunkReserve(c, n + 1))
+            return 1;
+        dt_fmt_cached(p->pFmt, p->o.out_zone, ns, c->zOut + c->nOut, n + 1);
+    }
+    c->nOut += n;
+    return 0;
+}
+
+/*
+** Convert one line, [z, zEnd) without its newline.  Lines that do not
+** convert are copied unchanged.
+*/
+static void convertLine(const conv_job *p, conv_chunk *c, const char *z, const char *zEnd)
+{
+    const char *zLineEnd = zEnd;
+    const char *zBeg, *zFieldEnd;
+    size_t nOut;
+    int64_t ns;
+    if (z == zEnd)
+        return;
+    c->nRow++;
+    if (zEnd[-1] == '\r')
+        zLineEnd--;
+    if (findField(z, zLineEnd, p->o.delim, p->o.column, &zBeg, &zFieldEnd) ||
+        parseStamp(p, zBeg, zFieldEnd, &ns))
+    {
+        c->nErr++;
+        chunkAppend(c, z, zEnd - z);
+        return;
+    }
+    nOut = c->nOut;
+    if (p->o.mode == DT_CONV_APPEND)
+    {
+        chunkAppend(c, z, zLineEnd - z);
+        chunkAppend(c, &p->o.delim, 1);
+    }
+    else
+    {
+        chunkAppend(c, z, zBeg - z);
+    }
+    if (emitStamp(p, c, ns))
+    {
+        c->nOut = nOut;
+        c->nErr++;
+        chunkAppend(c, z, zEnd - z);
+        return;
+    }
+    if (p->o.mode == DT_CONV_APPEND)
+        chunkAppend(c, zLineEnd, zEnd - zLineEnd);
+    else
+        chunkAppend(c, zFieldEnd, zEnd - zFieldEnd);
+}
+
+static void convertChunk(const conv_job *p, conv_chunk *c)
+{
+    const char *z = c->zBeg;
+    /* Most conversions change the length of a line only a little */
+    chunkReserve(c, (c->zEnd - c->zBeg) + (c->zEnd - c->zBeg) / 4);
+    while (z < c->zEnd && !c->isOom)
+    {
+        const char *zNl = (const char *)memchr(z, '\n', c->zEnd - z);
+        const char *zEnd = zNl ? zNl : c->zEnd;
+        convertLine(p, c, z, zEnd);
+        if (zNl)
+            chunkAppend(c, "\n", 1);
+        z = zEnd + 1;
+    }
+}
+
+#ifdef _WIN32
+static DWORD WINAPI workerMain(LPVOID arg)
+#else
+static void *workerMain(void *arg)
+#endif
+{
+    conv_job *p = (conv_job *)arg;
+    for (;;)
+    {
+        int i;
+        convLock(&p->mutex);
+        while (!p->isAbort && p->iNext < p->nChunk && p->iNext >= p->nWritten + p->nWindow)
+            convWait(&p->cond, &p->mutex);
+        if (p->isAbort || p->iNext >= p->nChunk)
+        {
+            convUnlock(&p->mutex);
+            break;
+        }
+        i = p->iNext++;
+        convUnlock(&p->mutex);
+        convertChunk(p, &p->aChunk[i]);
+        convLock(&p->mutex);
+        p->aChunk[i].isDone = 1;
+        convBroadcast(&p->cond);
+        convUnlock(&p->mutex);
+    }
+    return 0;
+}
+
+/*
+** Split [z, zEnd) at line boundaries into chunks of about nChunk bytes.
+*/
+static int splitChunks(conv_job *p, const char *z, const char *zEnd, size_t nChunk)
+{
+    int n = 0;
+    size_t nAlloc = (size_t)((zEnd - z) / nChunk) + 1;
+    p->aChunk = (conv_chunk *)calloc(nAlloc, sizeof(conv_chunk));
+    if (p->aChunk == NULL)
+        return 1;
+    while (z < zEnd)
+    {
+        const char *zNext = z + ((size_t)(zEnd - z) > nChunk ? nChunk : (size_t)(zEnd - z));
+        if (zNext < zEnd)
+        {
+            zNext = (const char *)memchr(zNext, '\n', zEnd - zNext);
+            zNext = zNext ? zNext + 1 : zEnd;
+        }
+        p->aChunk[n].zBeg = z;
+        p->aChunk[n].zEnd = zNext;
+        n++;
+        z = zNext;
+    }
+    p->nChunk = n;
+    return 0;
+}
+
+int dt_conv_buffer(const char *data, size_t len, FILE *out, const dt_conv_opts *o, dt_conv_stats *st)
+{
+    conv_job job;
+    conv_thread *aThread;
+    const char *z = data, *zEnd = data + len;
+    int64_t t0 = dt_now_precise_ns();
+    int i, nThread, rc = 0;
+    memset(&job, 0, sizeof(job));
+    job.o = *o;
+    if (job.o.delim == 0)
+        job.o.delim = ',';
+    if (job.o.column < 0 || job.o.delim == '"' || job.o.delim == '\n')
+        return 1;
+    if (job.o.chunk == 0)
+        job.o.chunk = CONV_CHUNK;
+    job.pFmt = dt_fmt_compile(job.o.out_fmt ? job.o.out_fmt : "%Y-%m-%d %H:%M:%S");
+    if (job.pFmt == NULL)
+        return 1;
+    if (job.o.in_fmt && (job.pScan = dt_scan_compile(job.o.in_fmt)) == NULL)
+    {
+        dt_fmt_free(job.pFmt);
+        return 1;
+    }
+    for (i = 0; i < job.o.header && z < zEnd; i++)
+    {
+        const char *zNl = (const char *)memchr(z, '\n', zEnd - z);
+        z = zNl ? zNl + 1 : zEnd;
+    }
+    if (z > data && fwrite(data, 1, z - data, out) != (size_t)(z - data))
+        rc = 1;
+    if (rc == 0 && splitChunks(&job, z, zEnd, job.o.chunk))
+        rc = 1;
+    nThread = job.o.threads > 0 ? job.o.threads : cpuCount();
+    if (nThread > job.nChunk)
+        nThread = job.nChunk;
+    job.nWindow = nThread * 4;
+    aThread = (conv_thread *)calloc(nThread ? nThread : 1, sizeof(conv_thread));
+    if (aThread == NULL)
+        rc = 1;
+    if (rc == 0)
+    {
+        convMutexInit(&job.mutex);
+        convCondInit(&job.cond);
+        for (i = 0; i < nThread; i++)
+        {
+#ifdef _WIN32
+            aThread[i] = CreateThread(NULL, 0, workerMain, &job, 0, NULL);
+            if (aThread[i] == NULL)
+#else
+            if (pthread_create(&aThread[i], NULL, workerMain, &job))
+#endif
+                break;
+        }
+        if (i < nThread)
+        {
+            /* Run with the threads that did start, or stop if none did */
+            nThread = i;
+            if (nThread == 0)
+                rc = 1;
+        }
+        for (i = 0; i < job.nChunk && rc == 0; i++)
+        {
+            conv_chunk *c = &job.aChunk[i];
+            convLock(&job.mutex);
+            while (!c->isDone)
+                convWait(&job.cond, &job.mutex);
+            convUnlock(&job.mutex);
+            if (c->isOom || fwrite(c->zOut, 1, c->nOut, out) != c->nOut)
+                rc = 1;
+            free(c->zOut);
+            c->zOut = NULL;
+            if (st)
+            {
+                st->rows += c->nRow;
+                st->errors += c->nErr;
+            }
+            convLock(&job.mutex);
+            job.nWritten++;
+            convBroadcast(&job.cond);
+            convUnlock(&job.mutex);
+        }
+        convLock(&job.mutex);
+        job.isAbort = 1;
+        convBroadcast(&job.cond);
+        convUnlock(&job.mutex);
+        for (i = 0; i < nThread; i++)
+        {
+#ifdef _WIN32
+            WaitForSingleObject(aThread[i], INFINITE);
+            CloseHandle(aThread[i]);
+#else
+            pthread_join(aThread[i], NULL);
+#endif
+        }
+        for (i = 0; i < job.nChunk; i++)
+            free(job.aChunk[i].zOut);
+        convCondDestroy(&job.cond);
+        convMutexDestroy(&job.mutex);
+    }
+    free(aThread);
+    free(job.aChunk);
+    dt_scan_free(job.pScan);
+    dt_fmt_free(job.pFmt);
+    if (st)
+    {
+        st->bytes += len;
+        st->ns += dt_now_precise_ns() - t0;
+        st->threads = nThread;
+    }
+    return rc;
+}
+
+int dt_conv_file(const char *zIn, const char *zOut, const dt_conv_opts *o, dt_conv_stats *st)
+{
+    FILE *out;
+    const char *data = NULL;
+    size_t len = 0;
+    int rc;
+#ifdef _WIN32
+    HANDLE hFile, hMap = NULL;
+    LARGE_INTEGER size;
+    hFile = CreateFileA(zIn, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                        FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return 1;
+    if (!GetFileSizeEx(hFile, &size) || (uint64_t)size.QuadPart > (size_t)-1)
+    {
+        CloseHandle(hFile);
+        return 1;
+    }
+    len = (size_t)size.QuadPart;
+    if (len)
+    {
+        hMap = CreateFileMappingA(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+        data = hMap ? (const char *)MapViewOfFile(hMap, FILE_MAP_READ, 0, 0, 0) : NULL;
+        if (data == NULL)
+        {
+            if (hMap)
+                CloseHandle(hMap);
+            CloseHandle(hFile);
+            return 1;
+        }
+    }
+#else
+    struct stat sb;
+    int fd = open(zIn, O_RDONLY);
+    if (fd < 0)
+        return 1;
+    if (fstat(fd, &sb) || (uint64_t)sb.st_size > (size_t)-1)
+    {
+        close(fd);
+        return 1;
+    }
+    len = (size_t)sb.st_size;
+    if (len)
+    {
+        void *pMap = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (pMap == MAP_FAILED)
+        {
+            close(fd);
+            return 1;
+        }
+        madvise(pMap, len, MADV_SEQUENTIAL);
+        data = (const char *)pMap;
+    }
+#endif
+    out = zOut ? fopen(zOut, "wb") : stdout;
+    rc = out == NULL || dt_conv_buffer(data ? data : "", len, out, o, st);
+    if (out && fflush(out))
+        rc = 1;
+    if (out && out != stdout && fclose(out))
+        rc = 1;
+#ifdef _WIN32
+    if (data)
+    {
+        UnmapViewOfFile(data);
+        CloseHandle(hMap);
+    }
+    CloseHandle(hFile);
+#else
+    if (data)
+        munmap((void *)data, len);
+    close(fd);
+#endif
+    return rc;
+}
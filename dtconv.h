@@ -0,0 +1,63 @@
+#ifndef TJ_DTCONV_H
+#define TJ_DTCONV_H
+
+/*
+ * 时间戳列转换
+ *
+ * 把 CSV/日志文件中某一列的时间戳重新格式化(或转换时区, 或追加一列).
+ * 输入用 mmap 映射, 按行边界切块, 多个线程并行解析和格式化,
+ * 输出按块的顺序拼接, 与单线程处理的结果逐字节相同.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct tzone;
+
+enum
+{
+    DT_CONV_REPLACE = 0, /* 用转换结果替换原字段 */
+    DT_CONV_APPEND,      /* 保留原字段, 在行尾追加一列 */
+};
+
+typedef struct dt_conv_opts dt_conv_opts;
+struct dt_conv_opts
+{
+    int column;                   /* 时间戳所在的字段, 从 0 开始 */
+    char delim;                   /* 字段分隔符, 0 表示 ',', 以 '"' 开头的字段可以包含分隔符 */
+    int mode;                     /* DT_CONV_REPLACE 或 DT_CONV_APPEND */
+    int header;                   /* 开头原样输出的行数 */
+    const char *in_fmt;           /* dt_scan 模式, NULL 时按 dt_datetime 的规则解析(ISO 文本, unix 数字等) */
+    const char *out_fmt;          /* dt_fmt 格式, NULL 为 "%Y-%m-%d %H:%M:%S", 追加 epoch 列用 "%s" */
+    const struct tzone *in_zone;  /* 不带偏移的输入按该时区的本地时间解析, 带偏移或 Z 的字段不受影响; NULL 表示 UTC */
+    const struct tzone *out_zone; /* 输出时区, NULL 为 UTC */
+    int threads;                  /* 工作线程数, 0 为 CPU 数 */
+    size_t chunk;                 /* 每块的字节数, 0 为 4MB */
+};
+
+typedef struct dt_conv_stats dt_conv_stats;
+struct dt_conv_stats
+{
+    uint64_t rows;   /* 处理的行数, 不含 header */
+    uint64_t errors; /* 字段缺失或无法解析的行数, 这些行原样输出 */
+    uint64_t bytes;  /* 输入字节数 */
+    int64_t ns;      /* 耗时 */
+    int threads;
+};
+
+/* 转换内存中的数据写到 out. 成功返回 0, 参数错误或写失败返回 1 */
+int dt_conv_buffer(const char *data, size_t len, FILE *out, const dt_conv_opts *o, dt_conv_stats *st);
+
+/* 映射 zIn 并转换, zOut 为 NULL 时写到 stdout */
+int dt_conv_file(const char *zIn, const char *zOut, const dt_conv_opts *o, dt_conv_stats *st);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
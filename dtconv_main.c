@@ -0,0 +1,85 @@
+#include "dtconv.h"
+#include "tzone.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *Usage =
+    "usage: dtconv [options] input [output]\n"
+    "  -c N        timestamp column, 0 based (0)\n"
+    "  -d C        field delimiter, \\t for tab (,)\n"
+    "  -i FMT      input pattern for dt_scan, default ISO text or unix number\n"
+    "  -o FMT      output format (%%Y-%%m-%%d %%H:%%M:%%S)\n"
+    "  -z ZONE     input is local time in ZONE\n"
+    "  -Z ZONE     output in ZONE (UTC)\n"
+    "  -a          append the result as a new column instead of replacing\n"
+    "  -H N        copy the first N lines unchanged (0)\n"
+    "  -j N        worker threads, 0 for the number of CPUs (0)\n";
+
+static const tzone *zoneArg(const char *z)
+{
+    const tzone *p = tzone_get(z);
+    if (p == NULL)
+    {
+        fprintf(stderr, "dtconv: unknown zone %s\n", z);
+        exit(2);
+    }
+    return p;
+}
+
+int main(int argc, char **argv)
+{
+    dt_conv_opts o;
+    dt_conv_stats st;
+    const char *zIn = NULL, *zOut = NULL;
+    double sec;
+    int i;
+    memset(&o, 0, sizeof(o));
+    memset(&st, 0, sizeof(st));
+    for (i = 1; i < argc; i++)
+    {
+        const char *z = argv[i];
+        if (z[0] == '-' && z[1] && z[2] == 0 && strchr("cdiozZHj", z[1]))
+        {
+            const char *v = i + 1 < argc ? argv[++i] : NULL;
+            if (v == NULL)
+                break;
+            switch (z[1])
+            {
+            case 'c': o.column = atoi(v); break;
+            case 'd': o.delim = strcmp(v, "\\t") == 0 ? '\t' : v[0]; break;
+            case 'i': o.in_fmt = v; break;
+            case 'o': o.out_fmt = v; break;
+            case 'z': o.in_zone = zoneArg(v); break;
+            case 'Z': o.out_zone = zoneArg(v); break;
+            case 'H': o.header = atoi(v); break;
+            case 'j': o.threads = atoi(v); break;
+            }
+        }
+        else if (strcmp(z, "-a") == 0)
+            o.mode = DT_CONV_APPEND;
+        else if (z[0] == '-' && z[1])
+            break;
+        else if (zIn == NULL)
+            zIn = z;
+        else if (zOut == NULL)
+            zOut = z;
+        else
+            break;
+    }
+    if (i < argc || zIn == NULL)
+    {
+        fputs(Usage, stderr);
+        return 2;
+    }
+    if (dt_conv_file(zIn, zOut, &o, &st))
+    {
+        fprintf(stderr, "dtconv: failed to convert %s\n", zIn);
+        return 1;
+    }
+    sec = st.ns > 0 ? st.ns / 1e9 : 1e-9;
+    fprintf(stderr, "%llu rows, %llu errors, %d threads, %.3f s, %.0f rows/s, %.1f MB/s\n",
+            (unsigned long long)st.rows, (unsigned long long)st.errors, st.threads, sec,
+            st.rows / sec, st.bytes / sec / (1 << 20));
+    return 0;
+}
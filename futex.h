@@ -0,0 +1,124 @@
+#ifndef FUTEX_H
+#define FUTEX_H
+
+/*
+ * 在一个 32 位原子整数上睡眠和唤醒, 用来在自旋之后挂起线程.
+ *   futex_wait(addr, expected, ms)  *addr 仍等于 expected 时睡眠, 直到被唤醒或超时(ms < 0 不超时)
+ *   futex_wake(addr, n)             唤醒最多 n 个在 addr 上等待的线程
+ *   futex_wake_all(addr)
+ * futex_wait 可能假唤醒, 调用者总是在循环里重新检查条件.
+ * futex_wait 超时返回 1, 其他情况返回 0.
+ * Linux 用 futex 系统调用, Windows 用 WaitOnAddress (MSVC 由下面的 #pragma 链接 Synchronization.lib,
+ * MinGW 需要 -lsynchronization, CMakeLists.txt 已经加上),
+ * 其他平台退化为短暂睡眠后重新检查.
+ */
+
+#include "atomic.h"
+#include <limits.h>
+
+#if defined(_MSC_VER) || defined(__MINGW32__) || defined(__MINGW64__)
+
+#include <windows.h>
+#ifdef _MSC_VER
+#pragma comment(lib, "Synchronization.lib")
+#endif
+
+static inline int
+futex_wait(atomic_int *addr, int expected, int ms) {
+    if (WaitOnAddress((volatile VOID *)addr, &expected, sizeof(int), ms < 0 ? INFINITE : (DWORD)ms))
+        return 0;
+    return GetLastError() == ERROR_TIMEOUT;
+}
+
+static inline void
+futex_wake(atomic_int *addr, int n) {
+    if (n == 1)
+        WakeByAddressSingle((PVOID)addr);
+    else
+        WakeByAddressAll((PVOID)addr);
+}
+
+#elif defined(__linux__)
+
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+static inline int
+futex_wait(atomic_int *addr, int expected, int ms) {
+    struct timespec ts, *pts = NULL;
+    if (ms >= 0) {
+        ts.tv_sec = ms / 1000;
+        ts.tv_nsec = (long)(ms % 1000) * 1000000;
+        pts = &ts;
+    }
+    if (syscall(SYS_futex, (int *)addr, FUTEX_WAIT_PRIVATE, expected, pts, NULL, 0) == -1)
+        return errno == ETIMEDOUT;
+    return 0;
+}
+
+static inline void
+futex_wake(atomic_int *addr, int n) {
+    syscall(SYS_futex, (int *)addr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
+#else
+
+#include <time.h>
+
+/* 没有可用的等待原语, 每次最多睡 50 微秒后返回, 由调用者重新检查 */
+static inline int
+futex_wait(atomic_int *addr, int expected, int ms) {
+    struct timespec ts = {0, 50000};
+    if (atomic_int_load_explicit(addr, memory_order_relaxed) != expected)
+        return 0;
+    if (ms == 0)
+        return 1;
+    nanosleep(&ts, NULL);
+    return 0;
+}
+
+static inline void
+futex_wake(atomic_int *addr, int n) {
+    (void)addr;
+    (void)n;
+}
+
+#endif
+
+static inline void
+futex_wake_all(atomic_int *addr) {
+    futex_wake(addr, INT_MAX);
+}
+
+/*
+ * 事件计数, 用于 "条件不满足就睡眠" 而不丢失唤醒:
+ *   等待者: key = futex_ec_prepare(ec); 检查条件; 仍不满足则 futex_ec_wait(ec, key)
+ *   通知者: 以 seq_cst 原子操作改变条件后调用 futex_ec_notify(ec)
+ * 最低位表示有等待者, 其余位是通知次数. 没有等待者时 notify 只是一次读,
+ * 有等待者时由第一个通知者清掉标志并唤醒全部等待者, 之后的通知不再进入内核.
+ */
+static inline int
+futex_ec_prepare(atomic_int *ec) {
+    return atomic_int_fetch_or(ec, 1, memory_order_seq_cst) | 1;
+}
+
+static inline void
+futex_ec_wait(atomic_int *ec, int key) {
+    futex_wait(ec, key, -1);
+}
+
+static inline void
+futex_ec_notify(atomic_int *ec) {
+    int s = atomic_int_load(ec);
+    while (s & 1) {
+        if (atomic_int_cmpxchg_weak(ec, &s, (int)(((unsigned)s + 2) & ~1u), memory_order_relaxed)) {
+            futex_wake_all(ec);
+            return;
+        }
+    }
+}
+
+#endif // FUTEX_H
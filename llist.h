@@ -0,0 +1,200 @@
+#ifndef __LLIST_H
+#define __LLIST_H
+
+/*
+ * Lock-less NULL terminated single linked list, modelled on the Linux
+ * Kernel's include/linux/llist.h and built on atomic.h.
+ *
+ * Any number of producers may llist_add()/llist_add_batch() concurrently
+ * without a lock.  A consumer takes the whole list with llist_del_all(),
+ * a single atomic exchange, and walks it without further synchronization.
+ * Entries come out newest first; llist_reverse_order() restores the order
+ * in which they were added.
+ *
+ * llist_del_first() may run concurrently with adders, but only one thread
+ * may delete entries that way at a time (otherwise ABA), and it must not
+ * race with llist_del_all().  Nodes taken off the list must not be freed
+ * while another deleter may still be reading them.
+ */
+
+#include "atomic.h"
+#include <stddef.h>
+
+struct llist_node {
+	struct llist_node *next;
+};
+
+struct llist_head {
+	atomic_ptr first;
+};
+
+/**
+ * init_llist_head - initialize lock-less list head
+ * @list:	the head for your lock-less list
+ */
+static inline void init_llist_head(struct llist_head *list)
+{
+	atomic_ptr_init(&list->first, NULL);
+}
+
+/**
+ * llist_entry - get the struct of this entry
+ * @ptr:	the &struct llist_node pointer.
+ * @type:	the type of the struct this is embedded in.
+ * @member:	the name of the llist_node within the struct.
+ */
+#define llist_entry(ptr, type, member) \
+	((type *)((char *)(ptr)-(ptrdiff_t)(&((type *)0)->member)))
+
+/**
+ * llist_for_each - iterate over a detached lock-less list
+ * @pos:	the &struct llist_node to use as a loop cursor.
+ * @node:	the first entry of the list, as returned by llist_del_all().
+ */
+#define llist_for_each(pos, node) \
+	for ((pos) = (node); (pos); (pos) = (pos)->next)
+
+/**
+ * llist_for_each_safe - iterate over a detached list safe against removal
+ * @pos:	the &struct llist_node to use as a loop cursor.
+ * @n:		another &struct llist_node to use as temporary storage.
+ * @node:	the first entry of the list.
+ */
+#define llist_for_each_safe(pos, n, node) \
+	for ((pos) = (node); (pos) && ((n) = (pos)->next, 1); (pos) = (n))
+
+/* container of @node, or NULL when @node is NULL; @node is evaluated once */
+static inline void *__llist_entry_or_null(struct llist_node *node, size_t offset)
+{
+	return node ? (char *)node - offset : NULL;
+}
+
+/**
+ * llist_for_each_entry - iterate over a detached list of given type
+ * @pos:	the type * to use as a loop cursor.
+ * @pos_type:	the type of the struct @pos points to.
+ * @node:	the first entry of the list.
+ * @member:	the name of the llist_node within the struct.
+ */
+#define llist_for_each_entry(pos, pos_type, node, member)			\
+	for ((pos) = (pos_type *)__llist_entry_or_null((node),			\
+				offsetof(pos_type, member));			\
+	     (pos);								\
+	     (pos) = (pos_type *)__llist_entry_or_null((pos)->member.next,	\
+				offsetof(pos_type, member)))
+
+/**
+ * llist_for_each_entry_safe - iterate over a detached list of given type,
+ *			       safe against removal (e.g. freeing) of the entry
+ * @pos:	the type * to use as a loop cursor.
+ * @pos_type:	the type of the struct @pos points to.
+ * @n:		another struct llist_node * to use as temporary storage.
+ * @node:	the first entry of the list.
+ * @member:	the name of the llist_node within the struct.
+ */
+#define llist_for_each_entry_safe(pos, pos_type, n, node, member)		\
+	for ((pos) = (pos_type *)__llist_entry_or_null((node),			\
+				offsetof(pos_type, member));			\
+	     (pos) && ((n) = (pos)->member.next, 1);				\
+	     (pos) = (pos_type *)__llist_entry_or_null((n),			\
+				offsetof(pos_type, member)))
+
+/**
+ * llist_empty - tests whether a lock-less list is empty
+ * @head:	the list to test
+ *
+ * The answer may be stale by the time the caller looks at it.
+ */
+static inline int llist_empty(struct llist_head *head)
+{
+	return atomic_ptr_load_explicit(&head->first, memory_order_relaxed) == NULL;
+}
+
+/**
+ * llist_add_batch - add several linked entries in batch
+ * @new_first:	first entry in batch to be added
+ * @new_last:	last entry in batch to be added
+ * @head:	the head for your lock-less list
+ *
+ * The entries between @new_first and @new_last must already be linked
+ * through ->next.  Returns whether the list was empty before adding.
+ */
+static inline int llist_add_batch(struct llist_node *new_first,
+				  struct llist_node *new_last,
+				  struct llist_head *head)
+{
+	void *first = atomic_ptr_load_explicit(&head->first, memory_order_relaxed);
+
+	do {
+		new_last->next = (struct llist_node *)first;
+	} while (!atomic_ptr_cmpxchg_weak(&head->first, &first, new_first,
+					  memory_order_release));
+	return first == NULL;
+}
+
+/**
+ * llist_add - add a new entry
+ * @newnode:	new entry to be added
+ * @head:	the head for your lock-less list
+ *
+ * Returns whether the list was empty before adding, so a producer can
+ * tell whether the consumer needs a wakeup.
+ */
+static inline int llist_add(struct llist_node *newnode, struct llist_head *head)
+{
+	return llist_add_batch(newnode, newnode, head);
+}
+
+/**
+ * llist_del_all - delete all entries from lock-less list
+ * @head:	the head of lock-less list to delete all entries
+ *
+ * Returns the first entry of the detached list, newest first, or NULL.
+ */
+static inline struct llist_node *llist_del_all(struct llist_head *head)
+{
+	if (llist_empty(head))
+		return NULL;
+	return (struct llist_node *)atomic_ptr_exchange_explicit(&head->first, NULL,
+								 memory_order_acquire);
+}
+
+/**
+ * llist_del_first - delete the first entry of lock-less list
+ * @head:	the head for your lock-less list
+ *
+ * Only one thread at a time may call this, see the note at the top.
+ */
+static inline struct llist_node *llist_del_first(struct llist_head *head)
+{
+	void *first = atomic_ptr_load_explicit(&head->first, memory_order_acquire);
+
+	do {
+		if (first == NULL)
+			return NULL;
+	} while (!atomic_ptr_cmpxchg_weak(&head->first, &first,
+					  ((struct llist_node *)first)->next,
+					  memory_order_acquire));
+	return (struct llist_node *)first;
+}
+
+/**
+ * llist_reverse_order - reverse order of a detached llist chain
+ * @head:	first item of the list to be reversed
+ *
+ * Returns the new first item, which is the entry added earliest.
+ */
+static inline struct llist_node *llist_reverse_order(struct llist_node *head)
+{
+	struct llist_node *new_head = NULL;
+
+	while (head) {
+		struct llist_node *tmp = head;
+		head = head->next;
+		tmp->next = new_head;
+		new_head = tmp;
+	}
+	return new_head;
+}
+
+#endif
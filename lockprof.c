@@ -0,0 +1,267 @@
+#include "lockprof.h"
+#include "atomic.h"
+#include "threadreg.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+** Statistics of one lock as seen by one thread.  Only the owning thread
+** writes the counters, so they are bumped with a plain load and store
+** instead of a locked read-modify-write; lockprof_snapshot() reads them
+** relaxed and may see a lock a few events behind.
+*/
+typedef struct lockprof_counts lockprof_counts;
+struct lockprof_counts
+{
+    atomic_int64 acquires;
+    atomic_int64 contended;
+    atomic_int64 wait;
+    atomic_int64 hold;
+    atomic_int64 waitHist[LOCKPROF_BUCKETS];
+    atomic_int64 holdHist[LOCKPROF_BUCKETS];
+};
+
+/*
+** One record per thread, kept in a threadreg.h registry.  A record
+** released by an exiting thread is reused by the next thread that needs
+** one, which simply keeps adding to its counters.
+*/
+typedef struct lockprof_record lockprof_record;
+struct lockprof_record
+{
+    struct threadreg_node node;
+    atomic_ptr counts[LOCKPROF_MAX];    /* lockprof_counts, allocated on first use */
+    int depth;
+    struct
+    {
+        int id;
+        uint64_t since;
+    } held[LOCKPROF_DEPTH];             /* locks held by the owner, innermost last */
+};
+
+typedef struct lockprof_site lockprof_site;
+struct lockprof_site
+{
+    char name[LOCKPROF_NAME];
+    const char *kind;
+    atomic_int ready;
+};
+
+static lockprof_site Sites[LOCKPROF_MAX];
+static atomic_int NSites;
+static ATOMIC_THREAD lockprof_record *Self;
+
+static void threadExit(void);
+
+static void initRecord(struct threadreg_node *node)
+{
+    lockprof_record *r = (lockprof_record *)node;
+    for (int i = 0; i < LOCKPROF_MAX; i++)
+        atomic_ptr_init(&r->counts[i], NULL);
+}
+
+static struct threadreg Registry = THREADREG_INIT(sizeof(lockprof_record), initRecord, threadExit);
+
+static lockprof_record *self(void)
+{
+    lockprof_record *r = Self;
+    if (r == NULL)
+        r = Self = (lockprof_record *)threadreg_claim(&Registry);
+    return r;
+}
+
+static void threadExit(void)
+{
+    lockprof_record *me = Self;
+    if (me == NULL)
+        return;
+    me->depth = 0;
+    Self = NULL;
+    threadreg_release(&me->node);
+}
+
+static lockprof_counts *countsOf(lockprof_record *me, int id)
+{
+    lockprof_counts *c = (lockprof_counts *)atomic_ptr_load_explicit(&me->counts[id], memory_order_relaxed);
+    if (c)
+        return c;
+    c = (lockprof_counts *)calloc(1, sizeof(lockprof_counts));
+    if (c == NULL)
+        abort();
+    atomic_ptr_store_explicit(&me->counts[id], c, memory_order_release);
+    return c;
+}
+
+static void bump(atomic_int64 *a, int64_t v)
+{
+    atomic_int64_store_explicit(a, atomic_int64_load_explicit(a, memory_order_relaxed) + v, memory_order_relaxed);
+}
+
+static int bucketOf(uint64_t v)
+{
+    int b = 0;
+#if defined(__GNUC__) || defined(__clang__)
+    if (v)
+        b = 63 - __builtin_clzll(v);
+#else
+    while (v >>= 1)
+        b++;
+#endif
+    return b < LOCKPROF_BUCKETS ? b : LOCKPROF_BUCKETS - 1;
+}
+
+int lockprof_register(const char *kind, const char *name)
+{
+    int id = atomic_int_fetch_add(&NSites, 1, memory_order_relaxed);
+    lockprof_site *s;
+    if (id >= LOCKPROF_MAX)
+        return -1;
+    s = &Sites[id];
+    if (name)
+        snprintf(s->name, sizeof(s->name), "%s", name);
+    else
+        snprintf(s->name, sizeof(s->name), "%s#%d", kind, id);
+    s->kind = kind;
+    atomic_int_store_explicit(&s->ready, 1, memory_order_release);
+    return id;
+}
+
+/*
+** An uncontended acquire records a wait of 0 and reuses start as the
+** beginning of the hold, saving a cycle counter read on the fast path.
+*/
+void lockprof_acquired(int id, int contended, uint64_t start)
+{
+    uint64_t now = contended ? lockprof_cycles() : start, wait = now > start ? now - start : 0;
+    lockprof_record *me;
+    lockprof_counts *c;
+    if (id < 0)
+        return;
+    me = self();
+    c = countsOf(me, id);
+    bump(&c->acquires, 1);
+    if (contended)
+        bump(&c->contended, 1);
+    bump(&c->wait, (int64_t)wait);
+    bump(&c->waitHist[bucketOf(wait)], 1);
+    if (me->depth < LOCKPROF_DEPTH)
+    {
+        me->held[me->depth].id = id;
+        me->held[me->depth].since = now;
+        me->depth++;
+    }
+}
+
+void lockprof_released(int id)
+{
+    uint64_t now = lockprof_cycles(), hold;
+    lockprof_record *me = Self;
+    lockprof_counts *c;
+    int i;
+    if (id < 0 || me == NULL)
+        return;
+    /* Locks are usually released innermost first, search from the top. */
+    for (i = me->depth - 1; i >= 0 && me->held[i].id != id; i--)
+        ;
+    if (i < 0)
+        return;
+    hold = now > me->held[i].since ? now - me->held[i].since : 0;
+    memmove(&me->held[i], &me->held[i + 1], (me->depth - i - 1) * sizeof(me->held[0]));
+    me->depth--;
+    c = countsOf(me, id);
+    bump(&c->hold, (int64_t)hold);
+    bump(&c->holdHist[bucketOf(hold)], 1);
+}
+
+static int cmpWait(const void *a, const void *b)
+{
+    const struct lockprof_stat *x = (const struct lockprof_stat *)a, *y = (const struct lockprof_stat *)b;
+    if (x->wait != y->wait)
+        return x->wait > y->wait ? -1 : 1;
+    return x->id - y->id;
+}
+
+int lockprof_snapshot(struct lockprof_stat *out, int max)
+{
+    int n = atomic_int_load(&NSites), count = 0;
+    struct lockprof_stat *all;
+    if (n > LOCKPROF_MAX)
+        n = LOCKPROF_MAX;
+    if (n == 0 || max <= 0)
+        return 0;
+    all = (struct lockprof_stat *)calloc(n, sizeof(struct lockprof_stat));
+    if (all == NULL)
+        return 0;
+    for (int id = 0; id < n; id++)
+    {
+        struct lockprof_stat *st = &all[count];
+        if (!atomic_int_load_explicit(&Sites[id].ready, memory_order_acquire))
+            continue;
+        memcpy(st->name, Sites[id].name, sizeof(st->name));
+        st->kind = Sites[id].kind;
+        st->id = id;
+        for (lockprof_record *r = (lockprof_record *)threadreg_first(&Registry); r; r = (lockprof_record *)r->node.next)
+        {
+            lockprof_counts *c = (lockprof_counts *)atomic_ptr_load_explicit(&r->counts[id], memory_order_acquire);
+            if (c == NULL)
+                continue;
+            st->acquires += atomic_int64_load_explicit(&c->acquires, memory_order_relaxed);
+            st->contended += atomic_int64_load_explicit(&c->contended, memory_order_relaxed);
+            st->wait += atomic_int64_load_explicit(&c->wait, memory_order_relaxed);
+            st->hold += atomic_int64_load_explicit(&c->hold, memory_order_relaxed);
+            for (int b = 0; b < LOCKPROF_BUCKETS; b++)
+            {
+                st->wait_hist[b] += atomic_int64_load_explicit(&c->waitHist[b], memory_order_relaxed);
+                st->hold_hist[b] += atomic_int64_load_explicit(&c->holdHist[b], memory_order_relaxed);
+            }
+        }
+        count++;
+    }
+    qsort(all, count, sizeof(struct lockprof_stat), cmpWait);
+    if (count > max)
+        count = max;
+    memcpy(out, all, count * sizeof(struct lockprof_stat));
+    free(all);
+    return count;
+}
+
+uint64_t lockprof_quantile(const int64_t *hist, double q)
+{
+    int64_t total = 0, seen = 0;
+    double target;
+    int b;
+    for (b = 0; b < LOCKPROF_BUCKETS; b++)
+        total += hist[b];
+    if (total == 0)
+        return 0;
+    target = q * (double)total;
+    for (b = 0; b < LOCKPROF_BUCKETS - 1; b++)
+    {
+        seen += hist[b];
+        if ((double)seen >= target)
+            break;
+    }
+    return (uint64_t)1 << (b + 1);
+}
+
+void lockprof_report(FILE *out)
+{
+    struct lockprof_stat *st = (struct lockprof_stat *)calloc(LOCKPROF_MAX, sizeof(struct lockprof_stat));
+    int n;
+    if (st == NULL)
+        return;
+    n = lockprof_snapshot(st, LOCKPROF_MAX);
+    fprintf(out, "%-24s %-12s %12s %7s %14s %10s %10s %10s %10s\n", "lock", "kind", "acquires", "cont%",
+            "wait cycles", "wait avg", "wait p99", "hold avg", "hold p99");
+    for (int i = 0; i < n; i++)
+    {
+        int64_t a = st[i].acquires;
+        if (a == 0)
+            continue;
+        fprintf(out, "%-24s %-12s %12lld %7.2f %14lld %10lld %10llu %10lld %10llu\n", st[i].name, st[i].kind,
+                (long long)a, 100.0 * st[i].contended / a, (long long)st[i].wait, (long long)(st[i].wait / a),
+                (unsigned long long)lockprof_quantile(st[i].wait_hist, 0.99), (long long)(st[i].hold / a),
+                (unsigned long long)lockprof_quantile(st[i].hold_hist, 0.99));
+    }
+    free(st);
+}
@@ -0,0 +1,94 @@
+#ifndef LOCKPROF_H
+#define LOCKPROF_H
+
+/*
+ * 锁竞争统计, 编译时定义 LOCK_PROFILE 后 spinlock.h 和 rwlock.h 自动接入, 需要链接 lockprof.
+ * 不定义时锁的结构和函数与原来完全一样, 没有任何额外开销.
+ *
+ * 每个锁在 spinlock_init_named / rwlock_init_named 时登记一个名字 (不带名字的 init 显示为 kind#id),
+ * 记录加锁次数, 有竞争的加锁次数, 等待时间和持有时间的直方图, 单位是 CPU 周期计数
+ * (x86 的 TSC, ARM64 的 cntvct, 其他平台退化为纳秒). rwlock 的读和写分开统计.
+ * 计数写在每个线程自己的缓冲里, 加锁路径上没有共享写; lockprof_snapshot 读的时候才汇总.
+ * 线程退出后缓冲留给下一个线程继续累加, 统计不会丢失.
+ * 最多登记 LOCKPROF_MAX 个锁, 超过的锁不统计. 锁销毁后统计保留.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#elif defined(_WIN32)
+#include <windows.h>
+#elif !defined(__aarch64__)
+#include <time.h>
+#endif
+
+#ifndef LOCKPROF_MAX
+#define LOCKPROF_MAX 1024
+#endif
+
+/* 一个线程同时持有的锁不超过这个数时才能统计持有时间 */
+#ifndef LOCKPROF_DEPTH
+#define LOCKPROF_DEPTH 16
+#endif
+
+/* 直方图第 i 格是 [2^i, 2^(i+1)) 个周期, 第 0 格包含 0, 最后一格包含更长的 */
+#define LOCKPROF_BUCKETS 40
+#define LOCKPROF_NAME 48
+
+struct lockprof_stat {
+    char name[LOCKPROF_NAME];
+    const char *kind; /* "spinlock", "rwlock.read", "rwlock.write" */
+    int id;
+    int64_t acquires;
+    int64_t contended; /* 第一次尝试没拿到锁的次数 */
+    int64_t wait;      /* 等待的总周期数 */
+    int64_t hold;      /* 持有的总周期数 */
+    int64_t wait_hist[LOCKPROF_BUCKETS];
+    int64_t hold_hist[LOCKPROF_BUCKETS];
+};
+
+static inline uint64_t
+lockprof_cycles(void) {
+#if (defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))) || defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#elif defined(__aarch64__)
+    uint64_t v;
+    __asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(v));
+    return v;
+#elif defined(_WIN32)
+    LARGE_INTEGER v;
+    QueryPerformanceCounter(&v);
+    return (uint64_t)v.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* 登记一个锁, 返回 id, 登记满了返回 -1. name 为 NULL 时用 kind#id, 名字会被复制 */
+int lockprof_register(const char *kind, const char *name);
+/* 拿到锁之后调用, start 是开始加锁时的 lockprof_cycles(), 没有竞争时等待记为 0 */
+void lockprof_acquired(int id, int contended, uint64_t start);
+/* 释放锁之前调用, 记录持有时间 */
+void lockprof_released(int id);
+
+/* 汇总所有线程的统计, 按等待总时间从大到小排序, 最多写 max 个, 返回写入的个数 */
+int lockprof_snapshot(struct lockprof_stat *out, int max);
+/* 直方图中 q 分位 (0..1) 所在格的上界 */
+uint64_t lockprof_quantile(const int64_t *hist, double q);
+/* 把 lockprof_snapshot 的结果输出成表格, 没有加过锁的不输出 */
+void lockprof_report(FILE *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // LOCKPROF_H
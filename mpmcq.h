@@ -0,0 +1,209 @@
+#ifndef MPMCQ_H
+#define MPMCQ_H
+
+/*
+ * 有界多生产者多消费者队列 (Vyukov), 元素是指针.
+ * 每个槽位有一个序号: 等于位置 pos 时可写, 等于 pos + 1 时可读, 读完置为 pos + 容量.
+ * 生产者和消费者各用一次 CAS 占位置, 不同位置的读写互不干扰.
+ * 入队位置, 出队位置和两个等待者的事件计数各占一个 cache line.
+ *
+ *   mpmcq_push / mpmcq_pop              不阻塞, 满/空时返回 1
+ *   mpmcq_push_batch / mpmcq_pop_batch  一次 CAS 占连续的多个位置, 返回实际个数
+ *   mpmcq_push_wait / mpmcq_pop_wait    满/空时先自旋, 再在 futex 上睡眠
+ * 所有入队/出队操作都会唤醒对方的等待者, 阻塞和不阻塞的接口可以混用.
+ */
+
+#include "atomic.h"
+#include "futex.h"
+#include <stdlib.h>
+
+/* 睡眠之前的自旋次数 */
+#ifndef MPMCQ_SPIN
+#define MPMCQ_SPIN 256
+#endif
+
+struct mpmcq_cell {
+    atomic_int64 seq;
+    void *data;
+};
+
+/* 一组等待者的事件计数, 见 futex.h */
+struct mpmcq_waiters {
+    atomic_int ec;
+    char pad[ATOMIC_CACHELINE - sizeof(atomic_int)];
+};
+
+struct ATOMIC_CACHELINE_ALIGNED mpmcq {
+    struct mpmcq_cell *cells;
+    int64_t mask;
+    char pad0[ATOMIC_CACHELINE - sizeof(struct mpmcq_cell *) - sizeof(int64_t)];
+    atomic_int64 tail; /* 下一个入队位置 */
+    char pad1[ATOMIC_CACHELINE - sizeof(atomic_int64)];
+    atomic_int64 head; /* 下一个出队位置 */
+    char pad2[ATOMIC_CACHELINE - sizeof(atomic_int64)];
+    struct mpmcq_waiters producers; /* 等队列不满 */
+    struct mpmcq_waiters consumers; /* 等队列不空 */
+};
+
+/* capacity 向上取 2 的幂, 至少为 2. 成功返回 0 */
+static inline int
+mpmcq_init(struct mpmcq *q, size_t capacity) {
+    size_t n = 2;
+    while (n < capacity)
+        n <<= 1;
+    q->cells = (struct mpmcq_cell *)malloc(n * sizeof(struct mpmcq_cell));
+    if (q->cells == NULL)
+        return -1;
+    for (size_t i = 0; i < n; i++) {
+        atomic_int64_init(&q->cells[i].seq, (int64_t)i);
+        q->cells[i].data = NULL;
+    }
+    q->mask = (int64_t)n - 1;
+    atomic_int64_init(&q->tail, 0);
+    atomic_int64_init(&q->head, 0);
+    atomic_int_init(&q->producers.ec, 0);
+    atomic_int_init(&q->consumers.ec, 0);
+    return 0;
+}
+
+static inline void
+mpmcq_destroy(struct mpmcq *q) {
+    free(q->cells);
+    q->cells = NULL;
+}
+
+static inline size_t
+mpmcq_capacity(struct mpmcq *q) {
+    return (size_t)q->mask + 1;
+}
+
+/* 近似的元素个数, 并发修改时只作参考 */
+static inline size_t
+mpmcq_size(struct mpmcq *q) {
+    int64_t n = atomic_int64_load_explicit(&q->tail, memory_order_relaxed) -
+                atomic_int64_load_explicit(&q->head, memory_order_relaxed);
+    return n < 0 ? 0 : (size_t)n;
+}
+
+/* 最多占 n 个连续的位置, 返回起始位置和个数 */
+static inline int
+mpmcq_claim(struct mpmcq *q, atomic_int64 *pos, int64_t ready, int n, int64_t *start) {
+    int64_t p = atomic_int64_load_explicit(pos, memory_order_relaxed);
+    for (;;) {
+        int k = 0;
+        while (k < n) {
+            struct mpmcq_cell *cell = &q->cells[(p + k) & q->mask];
+            if (atomic_int64_load_explicit(&cell->seq, memory_order_acquire) != p + k + ready)
+                break;
+            k++;
+        }
+        if (k == 0) {
+            /* 槽位落后于 p 说明满/空; 否则别的线程已经越过 p, 重读位置 */
+            struct mpmcq_cell *cell = &q->cells[p & q->mask];
+            int64_t diff = atomic_int64_load_explicit(&cell->seq, memory_order_acquire) - (p + ready);
+            if (diff < 0)
+                return 0;
+            p = atomic_int64_load_explicit(pos, memory_order_relaxed);
+            continue;
+        }
+        if (atomic_int64_cmpxchg_weak(pos, &p, p + k, memory_order_seq_cst)) {
+            *start = p;
+            return k;
+        }
+    }
+}
+
+static inline int
+mpmcq_push_batch(struct mpmcq *q, void *const *data, int n) {
+    int64_t p;
+    int k = mpmcq_claim(q, &q->tail, 0, n, &p);
+    for (int i = 0; i < k; i++) {
+        struct mpmcq_cell *cell = &q->cells[(p + i) & q->mask];
+        cell->data = data[i];
+        atomic_int64_store_explicit(&cell->seq, p + i + 1, memory_order_release);
+    }
+    if (k)
+        futex_ec_notify(&q->consumers.ec);
+    return k;
+}
+
+static inline int
+mpmcq_pop_batch(struct mpmcq *q, void **data, int n) {
+    int64_t p;
+    int k = mpmcq_claim(q, &q->head, 1, n, &p);
+    for (int i = 0; i < k; i++) {
+        struct mpmcq_cell *cell = &q->cells[(p + i) & q->mask];
+        data[i] = cell->data;
+        atomic_int64_store_explicit(&cell->seq, p + i + q->mask + 1, memory_order_release);
+    }
+    if (k)
+        futex_ec_notify(&q->producers.ec);
+    return k;
+}
+
+static inline int
+mpmcq_push(struct mpmcq *q, void *data) {
+    return !mpmcq_push_batch(q, &data, 1);
+}
+
+static inline int
+mpmcq_pop(struct mpmcq *q, void **data) {
+    return !mpmcq_pop_batch(q, data, 1);
+}
+
+/*
+ * 等到队列不满 (want_space) 或不空. 占位置的 CAS 是 seq_cst, 所以登记之后读到的位置
+ * 要么已经包含对方的操作, 要么对方的 notify 能看到登记. 位置已经前进但槽位还没写完时
+ * 不睡眠, 由调用者重试.
+ */
+static inline void
+mpmcq_park(struct mpmcq *q, struct mpmcq_waiters *w, int want_space) {
+    int key = futex_ec_prepare(&w->ec);
+    int64_t used = atomic_int64_load(&q->tail) - atomic_int64_load(&q->head);
+    if (want_space ? used > q->mask : used <= 0)
+        futex_ec_wait(&w->ec, key);
+}
+
+static inline int
+mpmcq_push_batch_wait(struct mpmcq *q, void *const *data, int n) {
+    int done = 0, spin = 0;
+    while (done < n) {
+        int k = mpmcq_push_batch(q, data + done, n - done);
+        if (k) {
+            done += k;
+            spin = 0;
+        } else if (++spin < MPMCQ_SPIN) {
+            atomic_pause();
+        } else {
+            mpmcq_park(q, &q->producers, 1);
+        }
+    }
+    return done;
+}
+
+/* 至少取到一个元素才返回, 返回个数 */
+static inline int
+mpmcq_pop_batch_wait(struct mpmcq *q, void **data, int n) {
+    int spin = 0, k;
+    while ((k = mpmcq_pop_batch(q, data, n)) == 0) {
+        if (++spin < MPMCQ_SPIN)
+            atomic_pause();
+        else
+            mpmcq_park(q, &q->consumers, 0);
+    }
+    return k;
+}
+
+static inline void
+mpmcq_push_wait(struct mpmcq *q, void *data) {
+    mpmcq_push_batch_wait(q, &data, 1);
+}
+
+static inline void *
+mpmcq_pop_wait(struct mpmcq *q) {
+    void *data;
+    mpmcq_pop_batch_wait(q, &data, 1);
+    return data;
+}
+
+#endif // MPMCQ_H
@@ -0,0 +1,281 @@
+#ifndef MUTEX_H
+#define MUTEX_H
+
+/*
+ * 在 futex.h 上实现的睡眠锁和同步原语, 不依赖 pthread 对象:
+ *   struct mutex      一个 32 位字: 0 空闲, 1 持有, 2 持有且可能有线程在睡眠.
+ *                     无竞争时加锁是一次 CAS, 解锁是一次交换, 没有等待者时不进内核.
+ *                     抢不到先自旋 MUTEX_SPIN 次, 已经有线程在睡眠时不再自旋.
+ *   struct cond       条件变量, 配合 struct mutex 使用, 可能假唤醒
+ *   struct event      一次性事件, set 之后所有等待者和以后的 wait 都立即返回
+ *   struct semaphore  计数信号量
+ * 和 spinlock.h 一样, 函数返回 0 表示成功, *_try 失败返回 1, *_timedwait 超时返回 1.
+ * ms < 0 表示不超时.
+ */
+
+#include "atomic.h"
+#include "futex.h"
+#if defined(_MSC_VER) || defined(__MINGW32__) || defined(__MINGW64__)
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+/* 睡眠之前的自旋次数 */
+#ifndef MUTEX_SPIN
+#define MUTEX_SPIN 100
+#endif
+
+#define MUTEX_UNLOCKED 0
+#define MUTEX_LOCKED 1
+#define MUTEX_CONTENDED 2
+
+struct mutex {
+    atomic_int state;
+};
+
+struct cond {
+    atomic_int seq;     /* 每次 signal/broadcast 加一, 等待者在上面睡眠 */
+    atomic_int waiters; /* 没有等待者时 signal 不进内核 */
+};
+
+struct event {
+    atomic_int state; /* 0 未触发, 1 已触发, 2 未触发且有等待者 */
+};
+
+struct semaphore {
+    atomic_int count;
+    atomic_int waiters;
+};
+
+/* 单调时钟的毫秒数, 用于计算超时的剩余时间 */
+static inline int64_t
+mutex_clock_ms(void) {
+#if defined(_MSC_VER) || defined(__MINGW32__) || defined(__MINGW64__)
+    return (int64_t)GetTickCount64();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
+/* 到 deadline 还剩的毫秒数, deadline < 0 表示不超时 */
+static inline int
+mutex_remain_ms(int64_t deadline) {
+    int64_t left;
+    if (deadline < 0)
+        return -1;
+    left = deadline - mutex_clock_ms();
+    return left > 0 ? (int)left : 0;
+}
+
+static inline int64_t
+mutex_deadline(int ms) {
+    return ms < 0 ? -1 : mutex_clock_ms() + ms;
+}
+
+static inline int
+mutex_init(struct mutex *m) {
+    atomic_int_init(&m->state, MUTEX_UNLOCKED);
+    return 0;
+}
+
+static inline int
+mutex_destroy(struct mutex *m) {
+    (void)m;
+    return 0;
+}
+
+/* 标记为有等待者并睡眠, 直到拿到锁. 醒来后不知道是否还有别的等待者, 保持 2 */
+static inline void
+mutex_acquire_contended(struct mutex *m) {
+    while (atomic_int_exchange_explicit(&m->state, MUTEX_CONTENDED, memory_order_acquire) != MUTEX_UNLOCKED)
+        futex_wait(&m->state, MUTEX_CONTENDED, -1);
+}
+
+static inline void
+mutex_acquire_slow(struct mutex *m) {
+    for (int i = 0; i < MUTEX_SPIN; i++) {
+        int s = atomic_int_load_explicit(&m->state, memory_order_relaxed);
+        if (s == MUTEX_CONTENDED)
+            break;
+        if (s == MUTEX_UNLOCKED &&
+            atomic_int_cmpxchg(&m->state, MUTEX_UNLOCKED, MUTEX_LOCKED, memory_order_acquire) == MUTEX_UNLOCKED)
+            return;
+        atomic_pause();
+    }
+    mutex_acquire_contended(m);
+}
+
+static inline int
+mutex_acquire(struct mutex *m) {
+    if (atomic_int_cmpxchg(&m->state, MUTEX_UNLOCKED, MUTEX_LOCKED, memory_order_acquire) != MUTEX_UNLOCKED)
+        mutex_acquire_slow(m);
+    return 0;
+}
+
+static inline int
+mutex_try(struct mutex *m) {
+    if (atomic_int_load_explicit(&m->state, memory_order_relaxed) != MUTEX_UNLOCKED)
+        return 1;
+    return atomic_int_cmpxchg(&m->state, MUTEX_UNLOCKED, MUTEX_LOCKED, memory_order_acquire) != MUTEX_UNLOCKED;
+}
+
+static inline int
+mutex_release(struct mutex *m) {
+    if (atomic_int_exchange_explicit(&m->state, MUTEX_UNLOCKED, memory_order_release) == MUTEX_CONTENDED)
+        futex_wake(&m->state, 1);
+    return 0;
+}
+
+static inline int
+cond_init(struct cond *c) {
+    atomic_int_init(&c->seq, 0);
+    atomic_int_init(&c->waiters, 0);
+    return 0;
+}
+
+static inline int
+cond_destroy(struct cond *c) {
+    (void)c;
+    return 0;
+}
+
+/*
+ * 先登记等待者再读序号, 通知者先改序号再查等待者, 两边都是 seq_cst:
+ * 要么通知者看到等待者, 要么等待者读到新序号, futex_wait 立即返回.
+ */
+static inline int
+cond_timedwait(struct cond *c, struct mutex *m, int ms) {
+    int seq, timeout;
+    atomic_int_fetch_add(&c->waiters, 1, memory_order_seq_cst);
+    seq = atomic_int_load(&c->seq);
+    mutex_release(m);
+    timeout = futex_wait(&c->seq, seq, ms);
+    atomic_int_fetch_sub(&c->waiters, 1, memory_order_relaxed);
+    mutex_acquire_contended(m);
+    return timeout;
+}
+
+static inline int
+cond_wait(struct cond *c, struct mutex *m) {
+    cond_timedwait(c, m, -1);
+    return 0;
+}
+
+static inline int
+cond_signal(struct cond *c) {
+    atomic_int_fetch_add(&c->seq, 1, memory_order_seq_cst);
+    if (atomic_int_load(&c->waiters))
+        futex_wake(&c->seq, 1);
+    return 0;
+}
+
+static inline int
+cond_broadcast(struct cond *c) {
+    atomic_int_fetch_add(&c->seq, 1, memory_order_seq_cst);
+    if (atomic_int_load(&c->waiters))
+        futex_wake_all(&c->seq);
+    return 0;
+}
+
+static inline int
+event_init(struct event *e) {
+    atomic_int_init(&e->state, 0);
+    return 0;
+}
+
+static inline int
+event_destroy(struct event *e) {
+    (void)e;
+    return 0;
+}
+
+static inline int
+event_is_set(struct event *e) {
+    return atomic_int_load_explicit(&e->state, memory_order_acquire) == 1;
+}
+
+static inline int
+event_set(struct event *e) {
+    if (atomic_int_exchange_explicit(&e->state, 1, memory_order_release) == 2)
+        futex_wake_all(&e->state);
+    return 0;
+}
+
+static inline int
+event_timedwait(struct event *e, int ms) {
+    int64_t deadline = mutex_deadline(ms);
+    for (;;) {
+        int s = atomic_int_load_explicit(&e->state, memory_order_acquire);
+        if (s == 1)
+            return 0;
+        if (s == 0 && atomic_int_cmpxchg(&e->state, 0, 2, memory_order_relaxed) != 0)
+            continue;
+        if (futex_wait(&e->state, 2, mutex_remain_ms(deadline)) && !event_is_set(e))
+            return 1;
+    }
+}
+
+static inline int
+event_wait(struct event *e) {
+    return event_timedwait(e, -1);
+}
+
+static inline int
+semaphore_init(struct semaphore *s, int count) {
+    atomic_int_init(&s->count, count);
+    atomic_int_init(&s->waiters, 0);
+    return 0;
+}
+
+static inline int
+semaphore_destroy(struct semaphore *s) {
+    (void)s;
+    return 0;
+}
+
+static inline int
+semaphore_try(struct semaphore *s) {
+    int c = atomic_int_load_explicit(&s->count, memory_order_relaxed);
+    while (c > 0) {
+        if (atomic_int_cmpxchg_weak(&s->count, &c, c - 1, memory_order_acquire))
+            return 0;
+    }
+    return 1;
+}
+
+/* 等待者和 semaphore_post 的配对同 cond_timedwait */
+static inline int
+semaphore_timedwait(struct semaphore *s, int ms) {
+    int64_t deadline = mutex_deadline(ms);
+    for (;;) {
+        int timeout;
+        for (int i = 0; i < MUTEX_SPIN; i++) {
+            if (semaphore_try(s) == 0)
+                return 0;
+            atomic_pause();
+        }
+        atomic_int_fetch_add(&s->waiters, 1, memory_order_seq_cst);
+        timeout = futex_wait(&s->count, 0, mutex_remain_ms(deadline));
+        atomic_int_fetch_sub(&s->waiters, 1, memory_order_relaxed);
+        if (timeout)
+            return semaphore_try(s);
+    }
+}
+
+static inline int
+semaphore_wait(struct semaphore *s) {
+    return semaphore_timedwait(s, -1);
+}
+
+static inline int
+semaphore_post(struct semaphore *s, int n) {
+    atomic_int_fetch_add(&s->count, n, memory_order_seq_cst);
+    if (atomic_int_load(&s->waiters))
+        futex_wake(&s->count, n);
+    return 0;
+}
+
+#endif // MUTEX_H
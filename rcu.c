@@ -0,0 +1,331 @@
+#include "rcu.h"
+#include "threadreg.h"
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <sched.h>
+#endif
+
+/*
+** One record per registered thread, kept in a threadreg.h registry.
+** ctr is the only field other threads read on the hot path: 0 while the
+** thread is outside any section (or offline), and (gp << 1) | 1 with the
+** grace period number it observed when it entered its section or last
+** reported a quiescent state.
+*/
+typedef struct rcu_record rcu_record;
+struct rcu_record
+{
+    struct threadreg_node node;
+    atomic_int64 ctr;
+    char pad[ATOMIC_CACHELINE - sizeof(atomic_int64)];
+    atomic_int qsbr;            /* registered with rcu_register_thread() */
+    int depth;                  /* rcu_read_lock nesting */
+    int online;                 /* QSBR thread is online */
+    struct rcu_head *list;      /* callbacks waiting for a grace period, newest first */
+    int count;
+    atomic_int64 retired;
+    atomic_int64 freed;
+};
+
+static atomic_int64 Gp;         /* grace period number */
+static atomic_ptr Orphans;      /* callbacks left behind by exited threads */
+static ATOMIC_THREAD rcu_record *Self;
+
+static void reclaim(rcu_record *me);
+
+#ifdef _WIN32
+static void yield(void)
+{
+    SwitchToThread();
+}
+#else
+static void yield(void)
+{
+    sched_yield();
+}
+#endif
+
+static void initRecord(struct threadreg_node *node)
+{
+    rcu_record *r = (rcu_record *)node;
+    atomic_int64_init(&r->ctr, 0);
+    atomic_int_init(&r->qsbr, 0);
+    atomic_int64_init(&r->retired, 0);
+    atomic_int64_init(&r->freed, 0);
+}
+
+static struct threadreg Registry = THREADREG_INIT(sizeof(rcu_record), initRecord, rcu_thread_exit);
+
+static rcu_record *self(void)
+{
+    rcu_record *r = Self;
+    if (r == NULL)
+        r = Self = (rcu_record *)threadreg_claim(&Registry);
+    return r;
+}
+
+/*
+** Announce the current grace period.  A seq_cst swap, so the pointer
+** loads that follow cannot move above it: either a writer scanning the
+** records sees the announcement, or this thread sees the writer's new
+** pointer.
+*/
+static void announce(rcu_record *me)
+{
+    int64_t g = atomic_int64_load_explicit(&Gp, memory_order_relaxed);
+    atomic_int64_exchange(&me->ctr, (g << 1) | 1);
+}
+
+static int isQsbr(rcu_record *me)
+{
+    return atomic_int_load_explicit(&me->qsbr, memory_order_relaxed);
+}
+
+void rcu_read_lock(void)
+{
+    rcu_record *me = self();
+    if (me->depth++ == 0 && !isQsbr(me))
+        announce(me);
+}
+
+void rcu_read_unlock(void)
+{
+    rcu_record *me = Self;
+    if (--me->depth == 0 && !isQsbr(me))
+        atomic_int64_store_explicit(&me->ctr, 0, memory_order_release);
+}
+
+void rcu_register_thread(void)
+{
+    rcu_record *me = self();
+    atomic_int_store_explicit(&me->qsbr, 1, memory_order_relaxed);
+    me->online = 1;
+    announce(me);
+}
+
+void rcu_unregister_thread(void)
+{
+    rcu_record *me = self();
+    atomic_int_store_explicit(&me->qsbr, 0, memory_order_relaxed);
+    me->online = 0;
+    atomic_int64_store_explicit(&me->ctr, 0, memory_order_release);
+}
+
+/*
+** The common case, no grace period started since the last report, is a
+** single load.  Reading a newer number seq_cst orders the pointer loads
+** that follow after everything the writer unlinked before bumping Gp.
+*/
+void rcu_quiescent_state(void)
+{
+    rcu_record *me = self();
+    int64_t c;
+    if (!me->online)
+        return;
+    if (me->count >= RCU_BATCH)
+    {
+        /* Quiescent, so offline while reclaiming: our own announcement would hold back our own callbacks. */
+        atomic_int64_store_explicit(&me->ctr, 0, memory_order_release);
+        reclaim(me);
+        announce(me);
+        return;
+    }
+    c = (atomic_int64_load(&Gp) << 1) | 1;
+    if (atomic_int64_load_explicit(&me->ctr, memory_order_relaxed) != c)
+        atomic_int64_store(&me->ctr, c);
+}
+
+void rcu_thread_offline(void)
+{
+    rcu_record *me = self();
+    if (!me->online)
+        return;
+    me->online = 0;
+    atomic_int64_store_explicit(&me->ctr, 0, memory_order_release);
+}
+
+void rcu_thread_online(void)
+{
+    rcu_record *me = self();
+    if (me->online || !isQsbr(me))
+        return;
+    me->online = 1;
+    announce(me);
+}
+
+/* Smallest grace period announced by any thread, INT64_MAX when none is inside. */
+static int64_t oldestReader(void)
+{
+    int64_t min = INT64_MAX;
+    for (rcu_record *r = (rcu_record *)threadreg_first(&Registry); r; r = (rcu_record *)r->node.next)
+    {
+        int64_t c = atomic_int64_load(&r->ctr);
+        if (c && (c >> 1) < min)
+            min = c >> 1;
+    }
+    return min;
+}
+
+/* Wait until every thread is outside, or has announced target or later. */
+static void waitFor(int64_t target)
+{
+    for (rcu_record *r = (rcu_record *)threadreg_first(&Registry); r; r = (rcu_record *)r->node.next)
+    {
+        for (int spin = 0;; spin++)
+        {
+            int64_t c = atomic_int64_load(&r->ctr);
+            if (c == 0 || (c >> 1) >= target)
+                break;
+            if (spin < 128)
+                atomic_pause();
+            else
+                yield();
+        }
+    }
+}
+
+/*
+** A QSBR thread waiting for a grace period would wait for itself; it
+** holds no references here (that is the caller's contract), so it goes
+** offline for the duration.
+*/
+static void waitGracePeriod(rcu_record *me, int64_t target)
+{
+    int online = me->online;
+    if (online)
+        rcu_thread_offline();
+    waitFor(target);
+    if (online)
+        rcu_thread_online();
+}
+
+/* Take over callbacks left by exited threads. */
+static void adopt(rcu_record *me)
+{
+    struct rcu_head *h;
+    if (atomic_ptr_load_explicit(&Orphans, memory_order_relaxed) == NULL)
+        return;
+    h = (struct rcu_head *)atomic_ptr_exchange_explicit(&Orphans, NULL, memory_order_acquire);
+    while (h)
+    {
+        struct rcu_head *next = h->next;
+        h->next = me->list;
+        me->list = h;
+        me->count++;
+        h = next;
+    }
+}
+
+/*
+** A callback queued in grace period g was unlinked before Gp moved past
+** g, so once every thread inside a section announces a later number, or
+** none is inside, nobody can still hold it.  Starting a new grace period
+** here is what lets readers announce a later number at all.
+*/
+static void reclaim(rcu_record *me)
+{
+    struct rcu_head **pp, *h;
+    int64_t min, freed = 0;
+    adopt(me);
+    if (me->list == NULL)
+        return;
+    atomic_int64_fetch_add(&Gp, 1, memory_order_seq_cst);
+    min = oldestReader();
+    pp = &me->list;
+    while ((h = *pp) != NULL)
+    {
+        if (h->gp >= min)
+        {
+            pp = &h->next;
+            continue;
+        }
+        *pp = h->next;
+        me->count--;
+        h->fn(h);
+        freed++;
+    }
+    atomic_int64_fetch_add(&me->freed, freed, memory_order_relaxed);
+}
+
+void rcu_synchronize(void)
+{
+    rcu_record *me = self();
+    waitGracePeriod(me, atomic_int64_fetch_add(&Gp, 1, memory_order_seq_cst) + 1);
+}
+
+void rcu_call(struct rcu_head *head, rcu_fn fn)
+{
+    rcu_record *me = self();
+    head->fn = fn;
+    head->gp = atomic_int64_load(&Gp);
+    head->next = me->list;
+    me->list = head;
+    atomic_int64_fetch_add(&me->retired, 1, memory_order_relaxed);
+    if (++me->count % RCU_BATCH)
+        return;
+    /* Outside a section a regular thread may wait; a QSBR thread frees them in rcu_quiescent_state(). */
+    if (me->count >= 4 * RCU_BATCH && me->depth == 0 && !isQsbr(me))
+        waitFor(atomic_int64_fetch_add(&Gp, 1, memory_order_seq_cst) + 1);
+    reclaim(me);
+}
+
+void rcu_barrier(void)
+{
+    rcu_record *me = self();
+    /* Callbacks may queue more callbacks, give them a few rounds. */
+    for (int i = 0; i < 3; i++)
+    {
+        adopt(me);
+        if (me->list == NULL)
+            break;
+        waitGracePeriod(me, atomic_int64_fetch_add(&Gp, 1, memory_order_seq_cst) + 1);
+        reclaim(me);
+    }
+}
+
+void rcu_thread_exit(void)
+{
+    rcu_record *me = Self;
+    void *head;
+    if (me == NULL)
+        return;
+    me->depth = 0;
+    me->online = 0;
+    atomic_int_store_explicit(&me->qsbr, 0, memory_order_relaxed);
+    atomic_int64_store_explicit(&me->ctr, 0, memory_order_release);
+    if (me->list)
+        reclaim(me);
+    if (me->list)
+    {
+        struct rcu_head *last = me->list;
+        while (last->next)
+            last = last->next;
+        head = atomic_ptr_load_explicit(&Orphans, memory_order_relaxed);
+        do
+        {
+            last->next = (struct rcu_head *)head;
+        } while (!atomic_ptr_cmpxchg_weak(&Orphans, &head, me->list, memory_order_release));
+    }
+    me->list = NULL;
+    me->count = 0;
+    Self = NULL;
+    threadreg_release(&me->node);
+}
+
+void rcu_stats(struct rcu_stats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    for (rcu_record *r = (rcu_record *)threadreg_first(&Registry); r; r = (rcu_record *)r->node.next)
+    {
+        int inUse = atomic_int_load_explicit(&r->node.inUse, memory_order_relaxed);
+        stats->retired += atomic_int64_load_explicit(&r->retired, memory_order_relaxed);
+        stats->freed += atomic_int64_load_explicit(&r->freed, memory_order_relaxed);
+        stats->threads += inUse;
+        stats->qsbr += inUse && atomic_int_load_explicit(&r->qsbr, memory_order_relaxed);
+    }
+    stats->pending = stats->retired - stats->freed;
+    stats->gp = atomic_int64_load(&Gp);
+}
@@ -0,0 +1,84 @@
+#ifndef RCU_H
+#define RCU_H
+
+/*
+ * 读-复制-更新 (RCU), 用于读者很多, 偶尔整体替换的只读结构 (路由表, 关键词集合):
+ *   读者  rcu_read_lock(); p = rcu_dereference(&src); ... rcu_read_unlock();
+ *   写者  复制出新版本, rcu_assign_pointer(&src, q), 旧版本交给 rcu_call 延迟释放,
+ *         或 rcu_synchronize() 等所有读者离开后自己释放.
+ * 宽限期 (grace period): 写者替换之后, 每个线程都离开过读临界区 (或经过一次静止状态) 为止.
+ *
+ * 两种读者线程, 可以混用:
+ *   普通线程  不需要登记, rcu_read_lock 写一次自己的 cache line, 和 smr.h 的纪元一样便宜.
+ *   QSBR 线程 rcu_register_thread 之后 rcu_read_lock/unlock 不写内存, 但线程必须在不持有
+ *             任何 RCU 指针时定期调用 rcu_quiescent_state (工作线程每处理完一个任务),
+ *             长时间阻塞前调用 rcu_thread_offline, 回来后 rcu_thread_online.
+ *             QSBR 线程长时间不报告静止状态, 宽限期就一直不结束, 回收会停下来.
+ *
+ * 读临界区里不能调用 rcu_synchronize 和 rcu_barrier. 读临界区可以嵌套.
+ * rcu_call 的回调先进每个线程自己的列表, 攒够 RCU_BATCH 个才检查一次宽限期, 不阻塞;
+ * 普通线程在读临界区外积压到 4 * RCU_BATCH 个时 rcu_call 会等一个宽限期,
+ * QSBR 线程在 rcu_quiescent_state 里回收. 线程退出时剩下的回调交给其他线程.
+ */
+
+#include "atomic.h"
+#include <stdint.h>
+
+#ifndef RCU_BATCH
+#define RCU_BATCH 64
+#endif
+
+struct rcu_head;
+typedef void (*rcu_fn)(struct rcu_head *head);
+
+struct rcu_head {
+    struct rcu_head *next;
+    rcu_fn fn;
+    int64_t gp;
+};
+
+struct rcu_stats {
+    int64_t retired; /* 累计 rcu_call 的个数 */
+    int64_t freed;   /* 累计执行的回调个数 */
+    int64_t pending; /* 还没执行的回调个数 */
+    int64_t gp;      /* 当前宽限期序号 */
+    int threads;     /* 已注册的线程数 */
+    int qsbr;        /* 其中 QSBR 线程数 */
+};
+
+/* 读写 RCU 保护的指针, seq_cst, 和读临界区的登记构成配对 */
+#define rcu_dereference(src) atomic_ptr_load(src)
+#define rcu_assign_pointer(dst, p) atomic_ptr_store(dst, p)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void rcu_read_lock(void);
+void rcu_read_unlock(void);
+
+/* 当前线程改为 QSBR 线程并上线 */
+void rcu_register_thread(void);
+/* 改回普通线程, 不能在读临界区里调用 */
+void rcu_unregister_thread(void);
+/* QSBR 线程报告静止状态: 之前读到的 RCU 指针都不再使用 */
+void rcu_quiescent_state(void);
+void rcu_thread_offline(void);
+void rcu_thread_online(void);
+
+/* 等一个宽限期: 返回时, 调用之前开始的读临界区都已结束 */
+void rcu_synchronize(void);
+/* 一个宽限期之后调用 fn(head) */
+void rcu_call(struct rcu_head *head, rcu_fn fn);
+/* 等宽限期, 执行当前线程和已退出线程留下的全部回调, 用于程序结束前 */
+void rcu_barrier(void);
+/* 线程退出时自动调用, 也可以提前调用 */
+void rcu_thread_exit(void);
+
+void rcu_stats(struct rcu_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // RCU_H
@@ -1,88 +1,400 @@
-#ifndef RWLOCK_H
-#define RWLOCK_H
-
-#if defined(_MSC_VER) || defined(__MINGW32__) || defined(__MINGW64__)
-
-#include <windows.h>
-
-struct rwlock {
-    SRWLOCK rw;
-};
-
-static inline int
-rwlock_init(struct rwlock *lock) {
-    InitializeSRWLock(&lock->rw);
-    return 0;
-}
-
-static inline int
-rwlock_destroy(struct rwlock *lock) {
-    (void)lock;
-    return 0;
-}
-
-static inline int
-rwlock_acquire_read(struct rwlock *lock) {
-    AcquireSRWLockShared(&lock->rw);
-    return 0;
-}
-
-static inline int
-rwlock_acquire_write(struct rwlock *lock) {
-    AcquireSRWLockExclusive(&lock->rw);
-    return 0;
-}
-
-static inline int
-rwlock_release_read(struct rwlock *lock) {
-    ReleaseSRWLockShared(&lock->rw);
-    return 0;
-}
-
-static inline int
-rwlock_release_write(struct rwlock *lock) {
-    ReleaseSRWLockExclusive(&lock->rw);
-    return 0;
-}
-
-#else
-
-#include <pthread.h>
-
-struct rwlock {
-    pthread_rwlock_t rw;
-};
-
-static inline int
-rwlock_init(struct rwlock *lock) {
-    return pthread_rwlock_init(&lock->rw);
-}
-
-static inline int
-rwlock_destroy(struct rwlock *lock) {
-    return pthread_rwlock_destroy(&lock->rw);
-}
-
-static inline int
-rwlock_acquire_read(struct rwlock *lock) {
-    return pthread_rwlock_rdlock(&lock->rw);
-}
-
-static inline int
-rwlock_acquire_write(struct rwlock *lock) {
-    return pthread_rwlock_wrlock(&lock->rw);
-}
-
-static inline int
-rwlock_release_read(struct rwlock *lock) {
-    return pthread_rwlock_unlock(&lock->rw);
-}
-
-static inline int
-rwlock_release_write(struct rwlock *lock) {
-    return pthread_rwlock_unlock(&lock->rw);
-}
-
-#endif
-
-#endif // RWLOCK_H
+#ifndef RWLOCK_H
+#define RWLOCK_H
+
+/*
+ * 读写锁, 默认是 brlock 风格的读者可扩展实现:
+ * 读者按线程 id 散列到 RWLOCK_SLOTS 个独占 cache line 的计数器之一,
+ * 不同线程读加锁不写同一个 cache line. 写者先取中心互斥锁, 置写标志,
+ * 再等所有计数器归零; 写标志置位后新读者在中心锁上睡眠等待, 写者优先.
+ * 适合读多写少的数据, 写加锁的代价与 RWLOCK_SLOTS 成正比.
+ * 定义 RWLOCK_OS 使用操作系统的读写锁 (SRWLOCK / pthread_rwlock).
+ * rwlock_try_read / rwlock_try_write 成功返回 0.
+ * rwlock_init_named 给锁起名字, 定义 LOCK_PROFILE 时用于 lockprof.h 的统计, 读和写分开记录.
+ */
+
+#ifdef LOCK_PROFILE
+/* 下面的实现改名为 *_raw, 文件末尾用带统计的同名函数包一层 */
+#include "lockprof.h"
+#define rwlock rwlock_raw
+#define rwlock_init rwlock_init_raw
+#define rwlock_destroy rwlock_destroy_raw
+#define rwlock_acquire_read rwlock_acquire_read_raw
+#define rwlock_acquire_write rwlock_acquire_write_raw
+#define rwlock_release_read rwlock_release_read_raw
+#define rwlock_release_write rwlock_release_write_raw
+#define rwlock_try_read rwlock_try_read_raw
+#define rwlock_try_write rwlock_try_write_raw
+#endif
+
+#if defined(RWLOCK_OS) && (defined(_MSC_VER) || defined(__MINGW32__) || defined(__MINGW64__))
+
+#include <windows.h>
+
+struct rwlock {
+    SRWLOCK rw;
+};
+
+static inline int
+rwlock_init(struct rwlock *lock) {
+    InitializeSRWLock(&lock->rw);
+    return 0;
+}
+
+static inline int
+rwlock_destroy(struct rwlock *lock) {
+    (void)lock;
+    return 0;
+}
+
+static inline int
+rwlock_acquire_read(struct rwlock *lock) {
+    AcquireSRWLockShared(&lock->rw);
+    return 0;
+}
+
+static inline int
+rwlock_acquire_write(struct rwlock *lock) {
+    AcquireSRWLockExclusive(&lock->rw);
+    return 0;
+}
+
+static inline int
+rwlock_release_read(struct rwlock *lock) {
+    ReleaseSRWLockShared(&lock->rw);
+    return 0;
+}
+
+static inline int
+rwlock_release_write(struct rwlock *lock) {
+    ReleaseSRWLockExclusive(&lock->rw);
+    return 0;
+}
+
+static inline int
+rwlock_try_read(struct rwlock *lock) {
+    return !TryAcquireSRWLockShared(&lock->rw);
+}
+
+static inline int
+rwlock_try_write(struct rwlock *lock) {
+    return !TryAcquireSRWLockExclusive(&lock->rw);
+}
+
+#elif defined(RWLOCK_OS)
+
+#include <pthread.h>
+
+struct rwlock {
+    pthread_rwlock_t rw;
+};
+
+static inline int
+rwlock_init(struct rwlock *lock) {
+    return pthread_rwlock_init(&lock->rw, NULL);
+}
+
+static inline int
+rwlock_destroy(struct rwlock *lock) {
+    return pthread_rwlock_destroy(&lock->rw);
+}
+
+static inline int
+rwlock_acquire_read(struct rwlock *lock) {
+    return pthread_rwlock_rdlock(&lock->rw);
+}
+
+static inline int
+rwlock_acquire_write(struct rwlock *lock) {
+    return pthread_rwlock_wrlock(&lock->rw);
+}
+
+static inline int
+rwlock_release_read(struct rwlock *lock) {
+    return pthread_rwlock_unlock(&lock->rw);
+}
+
+static inline int
+rwlock_release_write(struct rwlock *lock) {
+    return pthread_rwlock_unlock(&lock->rw);
+}
+
+static inline int
+rwlock_try_read(struct rwlock *lock) {
+    return pthread_rwlock_tryrdlock(&lock->rw);
+}
+
+static inline int
+rwlock_try_write(struct rwlock *lock) {
+    return pthread_rwlock_trywrlock(&lock->rw);
+}
+
+#else
+
+#include "atomic.h"
+#if defined(_MSC_VER) || defined(__MINGW32__) || defined(__MINGW64__)
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+/* 读者计数器个数, 取不小于读线程数的 2 的幂效果最好 */
+#ifndef RWLOCK_SLOTS
+#define RWLOCK_SLOTS 32
+#endif
+
+struct rwlock_slot {
+    atomic_int readers;
+    char pad[ATOMIC_CACHELINE - sizeof(atomic_int)];
+};
+
+struct ATOMIC_CACHELINE_ALIGNED rwlock {
+    atomic_int writer; /* 有写者持有或等待读者退出 */
+#if defined(_MSC_VER) || defined(__MINGW32__) || defined(__MINGW64__)
+    SRWLOCK wlock;
+#else
+    pthread_mutex_t wlock;
+#endif
+    struct rwlock_slot slot[RWLOCK_SLOTS];
+};
+
+/* 同一线程每次得到同一个计数器, 不依赖线程局部变量, 跨编译单元也一致 */
+static inline struct rwlock_slot *
+rwlock_slot_self(struct rwlock *lock) {
+#if defined(_MSC_VER) || defined(__MINGW32__) || defined(__MINGW64__)
+    uint64_t id = GetCurrentThreadId();
+#else
+    uint64_t id = (uint64_t)(uintptr_t)pthread_self();
+#endif
+    id *= 0x9e3779b97f4a7c15ULL;
+    return &lock->slot[(id >> 40) % RWLOCK_SLOTS];
+}
+
+static inline void
+rwlock_wlock(struct rwlock *lock) {
+#if defined(_MSC_VER) || defined(__MINGW32__) || defined(__MINGW64__)
+    AcquireSRWLockExclusive(&lock->wlock);
+#else
+    pthread_mutex_lock(&lock->wlock);
+#endif
+}
+
+static inline int
+rwlock_wtrylock(struct rwlock *lock) {
+#if defined(_MSC_VER) || defined(__MINGW32__) || defined(__MINGW64__)
+    return !TryAcquireSRWLockExclusive(&lock->wlock);
+#else
+    return pthread_mutex_trylock(&lock->wlock);
+#endif
+}
+
+static inline void
+rwlock_wunlock(struct rwlock *lock) {
+#if defined(_MSC_VER) || defined(__MINGW32__) || defined(__MINGW64__)
+    ReleaseSRWLockExclusive(&lock->wlock);
+#else
+    pthread_mutex_unlock(&lock->wlock);
+#endif
+}
+
+static inline int
+rwlock_init(struct rwlock *lock) {
+    atomic_int_init(&lock->writer, 0);
+    for (int i = 0; i < RWLOCK_SLOTS; i++)
+        atomic_int_init(&lock->slot[i].readers, 0);
+#if defined(_MSC_VER) || defined(__MINGW32__) || defined(__MINGW64__)
+    InitializeSRWLock(&lock->wlock);
+    return 0;
+#else
+    return pthread_mutex_init(&lock->wlock, NULL);
+#endif
+}
+
+static inline int
+rwlock_destroy(struct rwlock *lock) {
+#if defined(_MSC_VER) || defined(__MINGW32__) || defined(__MINGW64__)
+    (void)lock;
+    return 0;
+#else
+    return pthread_mutex_destroy(&lock->wlock);
+#endif
+}
+
+static inline int
+rwlock_acquire_read(struct rwlock *lock) {
+    struct rwlock_slot *slot = rwlock_slot_self(lock);
+    for (;;) {
+        if (!atomic_int_load_explicit(&lock->writer, memory_order_relaxed)) {
+            /* 与写者的 "置标志, 查计数器" 构成 Dekker 式配对, 需要 seq_cst */
+            atomic_int_fetch_add(&slot->readers, 1, memory_order_seq_cst);
+            if (!atomic_int_load(&lock->writer))
+                return 0;
+            atomic_int_fetch_sub(&slot->readers, 1, memory_order_release);
+        }
+        /* 写者持有中心锁, 在上面睡眠等它离开 */
+        rwlock_wlock(lock);
+        rwlock_wunlock(lock);
+    }
+}
+
+static inline int
+rwlock_release_read(struct rwlock *lock) {
+    atomic_int_fetch_sub(&rwlock_slot_self(lock)->readers, 1, memory_order_release);
+    return 0;
+}
+
+static inline int
+rwlock_acquire_write(struct rwlock *lock) {
+    rwlock_wlock(lock);
+    atomic_int_store(&lock->writer, 1);
+    for (int i = 0; i < RWLOCK_SLOTS; i++) {
+        int spin = 0;
+        while (atomic_int_load(&lock->slot[i].readers)) {
+            if (++spin < 1024) {
+                atomic_pause();
+                continue;
+            }
+#if defined(_MSC_VER) || defined(__MINGW32__) || defined(__MINGW64__)
+            SwitchToThread();
+#else
+            sched_yield();
+#endif
+        }
+    }
+    return 0;
+}
+
+static inline int
+rwlock_release_write(struct rwlock *lock) {
+    atomic_int_store_explicit(&lock->writer, 0, memory_order_release);
+    rwlock_wunlock(lock);
+    return 0;
+}
+
+static inline int
+rwlock_try_read(struct rwlock *lock) {
+    struct rwlock_slot *slot = rwlock_slot_self(lock);
+    if (atomic_int_load_explicit(&lock->writer, memory_order_relaxed))
+        return 1;
+    atomic_int_fetch_add(&slot->readers, 1, memory_order_seq_cst);
+    if (!atomic_int_load(&lock->writer))
+        return 0;
+    atomic_int_fetch_sub(&slot->readers, 1, memory_order_release);
+    return 1;
+}
+
+/* 有读者时撤销写标志; 在这期间被挡住的读者睡在中心锁上, 解锁后重试 */
+static inline int
+rwlock_try_write(struct rwlock *lock) {
+    if (rwlock_wtrylock(lock))
+        return 1;
+    atomic_int_store(&lock->writer, 1);
+    for (int i = 0; i < RWLOCK_SLOTS; i++) {
+        if (atomic_int_load(&lock->slot[i].readers)) {
+            atomic_int_store_explicit(&lock->writer, 0, memory_order_release);
+            rwlock_wunlock(lock);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+#endif
+
+#ifdef LOCK_PROFILE
+
+#undef rwlock
+#undef rwlock_init
+#undef rwlock_destroy
+#undef rwlock_acquire_read
+#undef rwlock_acquire_write
+#undef rwlock_release_read
+#undef rwlock_release_write
+#undef rwlock_try_read
+#undef rwlock_try_write
+
+struct rwlock {
+    struct rwlock_raw raw;
+    int prof_read; /* lockprof 的 id, 读和写各一个 */
+    int prof_write;
+};
+
+static inline int
+rwlock_init_named(struct rwlock *lock, const char *name) {
+    lock->prof_read = lockprof_register("rwlock.read", name);
+    lock->prof_write = lockprof_register("rwlock.write", name);
+    return rwlock_init_raw(&lock->raw);
+}
+
+static inline int
+rwlock_init(struct rwlock *lock) {
+    return rwlock_init_named(lock, NULL);
+}
+
+static inline int
+rwlock_destroy(struct rwlock *lock) {
+    return rwlock_destroy_raw(&lock->raw);
+}
+
+/* 先试一次, 失败才算有竞争 */
+static inline int
+rwlock_acquire_read(struct rwlock *lock) {
+    uint64_t start = lockprof_cycles();
+    int contended = rwlock_try_read_raw(&lock->raw) != 0, r = 0;
+    if (contended)
+        r = rwlock_acquire_read_raw(&lock->raw);
+    lockprof_acquired(lock->prof_read, contended, start);
+    return r;
+}
+
+static inline int
+rwlock_acquire_write(struct rwlock *lock) {
+    uint64_t start = lockprof_cycles();
+    int contended = rwlock_try_write_raw(&lock->raw) != 0, r = 0;
+    if (contended)
+        r = rwlock_acquire_write_raw(&lock->raw);
+    lockprof_acquired(lock->prof_write, contended, start);
+    return r;
+}
+
+static inline int
+rwlock_release_read(struct rwlock *lock) {
+    lockprof_released(lock->prof_read);
+    return rwlock_release_read_raw(&lock->raw);
+}
+
+static inline int
+rwlock_release_write(struct rwlock *lock) {
+    lockprof_released(lock->prof_write);
+    return rwlock_release_write_raw(&lock->raw);
+}
+
+static inline int
+rwlock_try_read(struct rwlock *lock) {
+    uint64_t start = lockprof_cycles();
+    int r = rwlock_try_read_raw(&lock->raw);
+    if (r == 0)
+        lockprof_acquired(lock->prof_read, 0, start);
+    return r;
+}
+
+static inline int
+rwlock_try_write(struct rwlock *lock) {
+    uint64_t start = lockprof_cycles();
+    int r = rwlock_try_write_raw(&lock->raw);
+    if (r == 0)
+        lockprof_acquired(lock->prof_write, 0, start);
+    return r;
+}
+
+#else
+
+static inline int
+rwlock_init_named(struct rwlock *lock, const char *name) {
+    (void)name;
+    return rwlock_init(lock);
+}
+
+#endif
+
+#endif // RWLOCK_H
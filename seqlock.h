@@ -0,0 +1,124 @@
+#ifndef SEQLOCK_H
+#define SEQLOCK_H
+
+/*
+ * 顺序锁, 适合几个字长, 读远多于写的数据(配置版本, 时钟偏移, 计数快照).
+ * 读者不写任何共享内存: 读序号, 读数据, 再读序号, 两次相同且为偶数即一致,
+ * 否则重试. 写者把序号改为奇数, 写数据, 再改回偶数, 多个写者之间用 CAS 互斥.
+ * 数据按 64 位字用 relaxed 原子操作读写, 读写并发不构成数据竞争.
+ *
+ * SEQLOCK_DEFINE(name, type) 定义 struct name 和
+ *   name_init(p, &v) name_read(p, &out) name_write(p, &v)
+ * type 应为不含指针所有权的普通结构体, 读者可能读到之后被丢弃的中间值.
+ */
+
+#include "atomic.h"
+#include <string.h>
+
+struct seqlock {
+    atomic_int seq; /* 按无符号数回绕 */
+};
+
+static inline void
+seqlock_init(struct seqlock *sl) {
+    atomic_int_init(&sl->seq, 0);
+}
+
+static inline unsigned
+seqlock_read_begin(struct seqlock *sl) {
+    unsigned seq;
+    while ((seq = (unsigned)atomic_int_load_explicit(&sl->seq, memory_order_acquire)) & 1)
+        atomic_pause();
+    return seq;
+}
+
+/* 读到的数据需要丢弃并重试时返回非 0 */
+static inline int
+seqlock_read_retry(struct seqlock *sl, unsigned seq) {
+    atomic_fence(memory_order_acquire);
+    return (unsigned)atomic_int_load_explicit(&sl->seq, memory_order_relaxed) != seq;
+}
+
+static inline void
+seqlock_write_begin(struct seqlock *sl) {
+    int seq = atomic_int_load_explicit(&sl->seq, memory_order_relaxed);
+    for (;;) {
+        if (seq & 1) {
+            atomic_pause();
+            seq = atomic_int_load_explicit(&sl->seq, memory_order_relaxed);
+        } else if (atomic_int_cmpxchg_weak(&sl->seq, &seq, (int)((unsigned)seq + 1), memory_order_relaxed)) {
+            break;
+        }
+    }
+    /* 之后的数据写不能排到奇数序号之前 */
+    atomic_fence(memory_order_release);
+}
+
+static inline void
+seqlock_write_end(struct seqlock *sl) {
+    unsigned seq = (unsigned)atomic_int_load_explicit(&sl->seq, memory_order_relaxed);
+    atomic_int_store_explicit(&sl->seq, (int)(seq + 1), memory_order_release);
+}
+
+/* 按字拷贝 n 字节, 字数为 (n + 7) / 8 */
+static inline void
+seqlock_load(atomic_int64 *src, void *dst, size_t n) {
+    unsigned char *d = (unsigned char *)dst;
+    for (; n >= 8; n -= 8, d += 8) {
+        int64_t w = atomic_int64_load_explicit(src++, memory_order_relaxed);
+        memcpy(d, &w, 8);
+    }
+    if (n) {
+        int64_t w = atomic_int64_load_explicit(src, memory_order_relaxed);
+        memcpy(d, &w, n);
+    }
+}
+
+static inline void
+seqlock_store(atomic_int64 *dst, const void *src, size_t n) {
+    const unsigned char *s = (const unsigned char *)src;
+    for (; n >= 8; n -= 8, s += 8) {
+        int64_t w;
+        memcpy(&w, s, 8);
+        atomic_int64_store_explicit(dst++, w, memory_order_relaxed);
+    }
+    if (n) {
+        int64_t w = 0;
+        memcpy(&w, s, n);
+        atomic_int64_store_explicit(dst, w, memory_order_relaxed);
+    }
+}
+
+#define SEQLOCK_WORDS(type) ((sizeof(type) + 7) / 8)
+
+#define SEQLOCK_DEFINE(name, type)                                          \
+    struct name {                                                           \
+        struct seqlock lock;                                                \
+        atomic_int64 data[SEQLOCK_WORDS(type)];                             \
+    };                                                                      \
+                                                                            \
+    static inline void                                                      \
+    name##_init(struct name *p, const type *v) {                            \
+        seqlock_init(&p->lock);                                             \
+        for (size_t i = 0; i < SEQLOCK_WORDS(type); i++)                    \
+            atomic_int64_init(&p->data[i], 0);                              \
+        seqlock_store(p->data, v, sizeof(type));                            \
+    }                                                                       \
+                                                                            \
+    static inline void                                                      \
+    name##_read(struct name *p, type *out) {                                \
+        unsigned seq;                                                       \
+        do {                                                                \
+            seq = seqlock_read_begin(&p->lock);                             \
+            seqlock_load(p->data, out, sizeof(type));                       \
+        } while (seqlock_read_retry(&p->lock, seq));                        \
+    }                                                                       \
+                                                                            \
+    static inline void                                                      \
+    name##_write(struct name *p, const type *v) {                           \
+        seqlock_write_begin(&p->lock);                                      \
+        seqlock_store(p->data, v, sizeof(type));                            \
+        seqlock_write_end(&p->lock);                                        \
+    }
+
+#endif // SEQLOCK_H
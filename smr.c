@@ -0,0 +1,311 @@
+#include "smr.h"
+#include "threadreg.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+** One record per registered thread, kept in a threadreg.h registry.
+** The hazard slots and the announced epoch are read by every scanning
+** thread, everything after them is private to the owner except the
+** counters, which smr_stats() reads.
+*/
+typedef struct smr_record smr_record;
+struct smr_record
+{
+    struct threadreg_node node;
+    atomic_ptr hp[SMR_HAZARDS];
+    atomic_int64 epoch;         /* (global << 1) | 1 inside a section, 0 outside */
+    char pad[ATOMIC_CACHELINE];
+    int depth;                  /* smr_epoch_enter nesting */
+    struct smr_node *hpList;    /* retired, waiting for hazard scan */
+    int hpCount;
+    struct smr_node *epList;    /* retired, waiting for two epochs */
+    int epCount;
+    uintptr_t *scratch;         /* hazard snapshot for scans */
+    int scratchCap;
+    atomic_int64 retired;
+    atomic_int64 freed;
+    atomic_int64 scans;
+};
+
+static atomic_int64 Epoch;      /* global epoch */
+static atomic_ptr HpOrphans;    /* nodes left behind by exited threads */
+static atomic_ptr EpOrphans;
+static ATOMIC_THREAD smr_record *Self;
+
+static void initRecord(struct threadreg_node *node)
+{
+    smr_record *r = (smr_record *)node;
+    for (int i = 0; i < SMR_HAZARDS; i++)
+        atomic_ptr_init(&r->hp[i], NULL);
+    atomic_int64_init(&r->epoch, 0);
+    atomic_int64_init(&r->retired, 0);
+    atomic_int64_init(&r->freed, 0);
+    atomic_int64_init(&r->scans, 0);
+}
+
+static struct threadreg Registry = THREADREG_INIT(sizeof(smr_record), initRecord, smr_thread_exit);
+
+/*
+** Return the calling thread's record, claiming a free one or appending
+** a new one on first use.
+*/
+static smr_record *self(void)
+{
+    smr_record *r = Self;
+    if (r == NULL)
+        r = Self = (smr_record *)threadreg_claim(&Registry);
+    return r;
+}
+
+static void pushList(atomic_ptr *stack, struct smr_node *first)
+{
+    struct smr_node *last = first;
+    void *head;
+    while (last->next)
+        last = last->next;
+    head = atomic_ptr_load_explicit(stack, memory_order_relaxed);
+    do
+    {
+        last->next = (struct smr_node *)head;
+    } while (!atomic_ptr_cmpxchg_weak(stack, &head, first, memory_order_release));
+}
+
+/* Take over nodes left by exited threads. */
+static void adopt(atomic_ptr *stack, struct smr_node **list, int *count)
+{
+    struct smr_node *n;
+    if (atomic_ptr_load_explicit(stack, memory_order_relaxed) == NULL)
+        return;
+    n = (struct smr_node *)atomic_ptr_exchange_explicit(stack, NULL, memory_order_acquire);
+    while (n)
+    {
+        struct smr_node *next = n->next;
+        n->next = *list;
+        *list = n;
+        (*count)++;
+        n = next;
+    }
+}
+
+static int cmpPtr(const void *a, const void *b)
+{
+    uintptr_t x = *(const uintptr_t *)a, y = *(const uintptr_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/*
+** Free every retired node that no hazard slot points at.  The slots are
+** read seq_cst, pairing with the seq_cst store and reload in
+** smr_hp_protect(): a reader either sees the node already unlinked, or
+** its slot is visible here.
+*/
+static void scanHazards(smr_record *me)
+{
+    struct smr_node **pp, *n;
+    int nhp = 0;
+    int64_t freed = 0;
+    adopt(&HpOrphans, &me->hpList, &me->hpCount);
+    for (smr_record *r = (smr_record *)threadreg_first(&Registry); r; r = (smr_record *)r->node.next)
+    {
+        for (int i = 0; i < SMR_HAZARDS; i++)
+        {
+            uintptr_t p = (uintptr_t)atomic_ptr_load(&r->hp[i]);
+            if (p == 0)
+                continue;
+            if (nhp == me->scratchCap)
+            {
+                int cap = me->scratchCap ? me->scratchCap * 2 : 64;
+                uintptr_t *s = (uintptr_t *)realloc(me->scratch, cap * sizeof(uintptr_t));
+                if (s == NULL)
+                    return;
+                me->scratch = s;
+                me->scratchCap = cap;
+            }
+            me->scratch[nhp++] = p;
+        }
+    }
+    if (nhp)
+        qsort(me->scratch, nhp, sizeof(uintptr_t), cmpPtr);
+    pp = &me->hpList;
+    while ((n = *pp) != NULL)
+    {
+        uintptr_t key = (uintptr_t)n;
+        if (nhp && bsearch(&key, me->scratch, nhp, sizeof(uintptr_t), cmpPtr))
+        {
+            pp = &n->next;
+            continue;
+        }
+        *pp = n->next;
+        me->hpCount--;
+        n->fn(n);
+        freed++;
+    }
+    atomic_int64_fetch_add(&me->scans, 1, memory_order_relaxed);
+    atomic_int64_fetch_add(&me->freed, freed, memory_order_relaxed);
+}
+
+/*
+** Advance the global epoch if every thread inside a section has seen
+** the current one.  Returns the (possibly new) global epoch.  The
+** announcements are read seq_cst to pair with smr_epoch_enter(), and
+** reading a 0 left by smr_epoch_exit() orders that thread's section
+** before anything freed afterwards.
+*/
+static int64_t tryAdvance(void)
+{
+    int64_t e = atomic_int64_load(&Epoch);
+    for (smr_record *r = (smr_record *)threadreg_first(&Registry); r; r = (smr_record *)r->node.next)
+    {
+        int64_t local = atomic_int64_load(&r->epoch);
+        if ((local & 1) && (local >> 1) != e)
+            return e;
+    }
+    if (atomic_int64_cmpxchg(&Epoch, e, e + 1, memory_order_release) == e)
+        return e + 1;
+    return atomic_int64_load(&Epoch);
+}
+
+/*
+** A node retired in epoch e was unlinked before any thread could enter
+** e + 1, so once the global epoch reaches e + 2 every thread that might
+** still hold it has left its section.
+*/
+static void reclaimEpochs(smr_record *me)
+{
+    struct smr_node **pp, *n;
+    int64_t e, freed = 0;
+    adopt(&EpOrphans, &me->epList, &me->epCount);
+    e = tryAdvance();
+    pp = &me->epList;
+    while ((n = *pp) != NULL)
+    {
+        if (n->epoch + 2 > e)
+        {
+            pp = &n->next;
+            continue;
+        }
+        *pp = n->next;
+        me->epCount--;
+        n->fn(n);
+        freed++;
+    }
+    atomic_int64_fetch_add(&me->scans, 1, memory_order_relaxed);
+    atomic_int64_fetch_add(&me->freed, freed, memory_order_relaxed);
+}
+
+void *smr_hp_protect(int i, atomic_ptr *src)
+{
+    smr_record *me = self();
+    void *p = atomic_ptr_load_explicit(src, memory_order_relaxed);
+    for (;;)
+    {
+        void *q;
+        atomic_ptr_store(&me->hp[i], p);
+        q = atomic_ptr_load(src);
+        if (q == p)
+            return p;
+        p = q;
+    }
+}
+
+void smr_hp_set(int i, void *p)
+{
+    atomic_ptr_store(&self()->hp[i], p);
+}
+
+void smr_hp_clear(int i)
+{
+    atomic_ptr_store_explicit(&self()->hp[i], NULL, memory_order_release);
+}
+
+void smr_hp_retire(struct smr_node *node, smr_free_fn fn)
+{
+    smr_record *me = self();
+    node->fn = fn;
+    node->next = me->hpList;
+    me->hpList = node;
+    atomic_int64_fetch_add(&me->retired, 1, memory_order_relaxed);
+    /* The threshold grows with the number of hazards, so a scan frees at least SMR_BATCH nodes. */
+    if (++me->hpCount >= SMR_BATCH + me->scratchCap)
+        scanHazards(me);
+}
+
+void smr_epoch_enter(void)
+{
+    smr_record *me = self();
+    if (me->depth++ == 0)
+    {
+        /* A seq_cst swap, so later reads cannot move above the announcement. */
+        int64_t e = atomic_int64_load_explicit(&Epoch, memory_order_relaxed);
+        atomic_int64_exchange(&me->epoch, (e << 1) | 1);
+    }
+}
+
+void smr_epoch_exit(void)
+{
+    smr_record *me = Self;
+    if (--me->depth == 0)
+        atomic_int64_store_explicit(&me->epoch, 0, memory_order_release);
+}
+
+void smr_epoch_retire(struct smr_node *node, smr_free_fn fn)
+{
+    smr_record *me = self();
+    node->fn = fn;
+    node->epoch = atomic_int64_load(&Epoch);
+    node->next = me->epList;
+    me->epList = node;
+    atomic_int64_fetch_add(&me->retired, 1, memory_order_relaxed);
+    if (++me->epCount >= SMR_BATCH)
+        reclaimEpochs(me);
+}
+
+void smr_flush(void)
+{
+    smr_record *me = self();
+    scanHazards(me);
+    /* With no other thread inside a section, two advances free everything. */
+    for (int i = 0; i < 3 && (me->epList || atomic_ptr_load(&EpOrphans)); i++)
+        reclaimEpochs(me);
+}
+
+void smr_thread_exit(void)
+{
+    smr_record *me = Self;
+    if (me == NULL)
+        return;
+    for (int i = 0; i < SMR_HAZARDS; i++)
+        atomic_ptr_store_explicit(&me->hp[i], NULL, memory_order_release);
+    me->depth = 0;
+    atomic_int64_store_explicit(&me->epoch, 0, memory_order_release);
+    if (me->hpList)
+        scanHazards(me);
+    if (me->epList)
+        reclaimEpochs(me);
+    if (me->hpList)
+        pushList(&HpOrphans, me->hpList);
+    if (me->epList)
+        pushList(&EpOrphans, me->epList);
+    me->hpList = me->epList = NULL;
+    me->hpCount = me->epCount = 0;
+    free(me->scratch);
+    me->scratch = NULL;
+    me->scratchCap = 0;
+    Self = NULL;
+    threadreg_release(&me->node);
+}
+
+void smr_stats(struct smr_stats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    for (smr_record *r = (smr_record *)threadreg_first(&Registry); r; r = (smr_record *)r->node.next)
+    {
+        stats->retired += atomic_int64_load_explicit(&r->retired, memory_order_relaxed);
+        stats->freed += atomic_int64_load_explicit(&r->freed, memory_order_relaxed);
+        stats->scans += atomic_int64_load_explicit(&r->scans, memory_order_relaxed);
+        stats->threads += atomic_int_load_explicit(&r->node.inUse, memory_order_relaxed);
+    }
+    stats->pending = stats->retired - stats->freed;
+    stats->epoch = atomic_int64_load(&Epoch);
+}
@@ -0,0 +1,79 @@
+#ifndef SMR_H
+#define SMR_H
+
+/*
+ * 无锁结构的内存回收, 两种方式可以混用:
+ *
+ * 危险指针 (hazard pointer): 读者把将要访问的节点登记在自己的槽位里,
+ *   p = smr_hp_protect(i, &src); ... smr_hp_clear(i);
+ *   摘下节点的线程调用 smr_hp_retire, 节点在没有任何槽位指向它时释放.
+ *   每个线程 SMR_HAZARDS 个槽位, 待回收的节点数有上界.
+ *
+ * 纪元 (epoch): 读者把访问包在 smr_epoch_enter / smr_epoch_exit 之间(可嵌套),
+ *   摘下的节点用 smr_epoch_retire, 等所有线程都离开过摘下时的纪元后释放.
+ *   读端只有一次写自己的 cache line, 比危险指针便宜, 但有线程长时间停在
+ *   临界区里时回收会停下来.
+ *
+ * 节点内嵌 struct smr_node, 回收时调用 retire 时给的 fn, 不额外分配内存.
+ * 待回收节点先进每个线程自己的列表, 攒够 SMR_BATCH 个才扫描一次.
+ * 线程第一次调用时自动注册, 退出时剩下的节点交给其他线程回收.
+ */
+
+#include "atomic.h"
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef SMR_HAZARDS
+#define SMR_HAZARDS 4
+#endif
+
+/* 每个线程攒够这么多待回收节点才扫描一次 */
+#ifndef SMR_BATCH
+#define SMR_BATCH 64
+#endif
+
+struct smr_node;
+typedef void (*smr_free_fn)(struct smr_node *node);
+
+struct smr_node {
+    struct smr_node *next;
+    smr_free_fn fn;
+    int64_t epoch;
+};
+
+struct smr_stats {
+    int64_t retired; /* 累计 retire 的节点数 */
+    int64_t freed;   /* 累计释放的节点数 */
+    int64_t pending; /* 还没释放的节点数 */
+    int64_t scans;   /* 扫描次数 */
+    int64_t epoch;   /* 当前全局纪元 */
+    int threads;     /* 已注册的线程数 */
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* 读 src 并登记到第 i 个槽位, 返回时保证读到的节点没有被释放 */
+void *smr_hp_protect(int i, atomic_ptr *src);
+/* 登记一个已经由其他方式保证有效的指针 */
+void smr_hp_set(int i, void *p);
+void smr_hp_clear(int i);
+void smr_hp_retire(struct smr_node *node, smr_free_fn fn);
+
+void smr_epoch_enter(void);
+void smr_epoch_exit(void);
+void smr_epoch_retire(struct smr_node *node, smr_free_fn fn);
+
+/* 尽量释放当前线程和已退出线程留下的节点, 用于空闲时和程序结束前 */
+void smr_flush(void);
+/* 线程退出时自动调用, 也可以提前调用 */
+void smr_thread_exit(void);
+
+void smr_stats(struct smr_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // SMR_H
@@ -1,75 +1,365 @@
-#ifndef SPINLOCK_H
-#define SPINLOCK_H
-
-#if defined(_MSC_VER) || defined(__MINGW32__) || defined(__MINGW64__)
-
-#include <windows.h>
-
-struct spinlock {
-    SRWLOCK lock;
-};
-
-static inline int
-spinlock_init(struct spinlock *sp) {
-    InitializeSRWLock(&sp->lock);
-    return 0;
-}
-
-static inline int
-spinlock_destroy(struct spinlock *sp) {
-    return 0;
-}
-
-static inline int
-spinlock_acquire(struct spinlock *sp) {
-    AcquireSRWLockExclusive(&sp->lock);
-    return 0;
-}
-
-static inline int
-spinlock_release(struct spinlock *sp) {
-    ReleaseSRWLockExclusive(&sp->lock);
-    return 0;
-}
-
-static inline int
-spinlock_try(struct spinlock *sp) {
-    return !TryAcquireSRWLockExclusive(&sp->lock);
-}
-
-#else
-
-#include <pthread.h>
-
-struct spinlock {
-    pthread_mutex_t mutex;
-};
-
-static inline int
-spinlock_init(struct spinlock *lock) {
-    return pthread_mutex_init(&lock->mutex, NULL);
-}
-
-static inline int
-spinlock_destroy(struct spinlock *lock) {
-    return pthread_mutex_destroy(&lock->mutex);
-}
-
-static inline int
-spinlock_acquire(struct spinlock *lock) {
-    return pthread_mutex_lock(&lock->mutex);
-}
-
-static inline int
-spinlock_release(struct spinlock *lock) {
-    return pthread_mutex_unlock(&lock->mutex);
-}
-
-static inline int
-spinlock_try(struct spinlock *lock) {
-    return pthread_mutex_trylock(&lock->mutex);
-}
-
-#endif
-
-#endif // SPINLOCK_H
+#ifndef SPINLOCK_H
+#define SPINLOCK_H
+
+/*
+ * 自旋锁, 编译时用宏选择实现, 接口相同:
+ *   SPINLOCK_TTAS    默认, test-and-test-and-set, pause 加指数退避
+ *   SPINLOCK_TICKET  票据锁, 按到达顺序获得, 公平
+ *   SPINLOCK_MCS     队列锁, 每个线程在自己的节点上自旋, 适合高竞争
+ *   SPINLOCK_MUTEX   操作系统互斥锁 (SRWLOCK / pthread_mutex), 竞争时睡眠
+ * 每种 struct spinlock 都不超过一个 cache line. spinlock_try 成功返回 0.
+ * spinlock_init_named 给锁起名字, 定义 LOCK_PROFILE 时用于 lockprof.h 的统计, 否则等同 spinlock_init.
+ */
+
+#if !defined(SPINLOCK_TTAS) && !defined(SPINLOCK_TICKET) && !defined(SPINLOCK_MCS) && !defined(SPINLOCK_MUTEX)
+#define SPINLOCK_TTAS
+#endif
+
+#include "atomic.h"
+
+#ifdef LOCK_PROFILE
+/* 下面的实现改名为 *_raw, 文件末尾用带统计的同名函数包一层 */
+#include "lockprof.h"
+#define spinlock spinlock_raw
+#define spinlock_init spinlock_init_raw
+#define spinlock_destroy spinlock_destroy_raw
+#define spinlock_acquire spinlock_acquire_raw
+#define spinlock_release spinlock_release_raw
+#define spinlock_try spinlock_try_raw
+#endif
+
+#if defined(SPINLOCK_MUTEX) && (defined(_MSC_VER) || defined(__MINGW32__) || defined(__MINGW64__))
+
+#include <windows.h>
+
+struct spinlock {
+    SRWLOCK lock;
+};
+
+static inline int
+spinlock_init(struct spinlock *sp) {
+    InitializeSRWLock(&sp->lock);
+    return 0;
+}
+
+static inline int
+spinlock_destroy(struct spinlock *sp) {
+    return 0;
+}
+
+static inline int
+spinlock_acquire(struct spinlock *sp) {
+    AcquireSRWLockExclusive(&sp->lock);
+    return 0;
+}
+
+static inline int
+spinlock_release(struct spinlock *sp) {
+    ReleaseSRWLockExclusive(&sp->lock);
+    return 0;
+}
+
+static inline int
+spinlock_try(struct spinlock *sp) {
+    return !TryAcquireSRWLockExclusive(&sp->lock);
+}
+
+#elif defined(SPINLOCK_MUTEX)
+
+#include <pthread.h>
+
+struct spinlock {
+    pthread_mutex_t mutex;
+};
+
+static inline int
+spinlock_init(struct spinlock *lock) {
+    return pthread_mutex_init(&lock->mutex, NULL);
+}
+
+static inline int
+spinlock_destroy(struct spinlock *lock) {
+    return pthread_mutex_destroy(&lock->mutex);
+}
+
+static inline int
+spinlock_acquire(struct spinlock *lock) {
+    return pthread_mutex_lock(&lock->mutex);
+}
+
+static inline int
+spinlock_release(struct spinlock *lock) {
+    return pthread_mutex_unlock(&lock->mutex);
+}
+
+static inline int
+spinlock_try(struct spinlock *lock) {
+    return pthread_mutex_trylock(&lock->mutex);
+}
+
+#elif defined(SPINLOCK_TTAS)
+
+/* 两次抢锁失败之间最多等待的 pause 次数 */
+#ifndef SPINLOCK_BACKOFF_MAX
+#define SPINLOCK_BACKOFF_MAX 1024
+#endif
+
+struct spinlock {
+    atomic_int lock;
+};
+
+static inline int
+spinlock_init(struct spinlock *lock) {
+    atomic_int_init(&lock->lock, 0);
+    return 0;
+}
+
+static inline int
+spinlock_destroy(struct spinlock *lock) {
+    (void)lock;
+    return 0;
+}
+
+static inline int
+spinlock_acquire(struct spinlock *lock) {
+    int backoff = 1;
+    while (atomic_int_exchange_explicit(&lock->lock, 1, memory_order_acquire)) {
+        /* 只读等待, 锁所在的 cache line 保持共享状态 */
+        while (atomic_int_load_explicit(&lock->lock, memory_order_relaxed))
+            atomic_pause();
+        for (int i = 0; i < backoff; i++)
+            atomic_pause();
+        if (backoff < SPINLOCK_BACKOFF_MAX)
+            backoff <<= 1;
+    }
+    return 0;
+}
+
+static inline int
+spinlock_release(struct spinlock *lock) {
+    atomic_int_store_explicit(&lock->lock, 0, memory_order_release);
+    return 0;
+}
+
+static inline int
+spinlock_try(struct spinlock *lock) {
+    if (atomic_int_load_explicit(&lock->lock, memory_order_relaxed))
+        return 1;
+    return atomic_int_exchange_explicit(&lock->lock, 1, memory_order_acquire);
+}
+
+#elif defined(SPINLOCK_TICKET)
+
+struct spinlock {
+    atomic_int next;  /* 下一个发出的票号, 按无符号数回绕 */
+    atomic_int owner; /* 当前持有锁的票号 */
+};
+
+static inline int
+spinlock_init(struct spinlock *lock) {
+    atomic_int_init(&lock->next, 0);
+    atomic_int_init(&lock->owner, 0);
+    return 0;
+}
+
+static inline int
+spinlock_destroy(struct spinlock *lock) {
+    (void)lock;
+    return 0;
+}
+
+static inline int
+spinlock_acquire(struct spinlock *lock) {
+    unsigned ticket = (unsigned)atomic_int_fetch_add(&lock->next, 1, memory_order_relaxed);
+    for (;;) {
+        unsigned ahead = ticket - (unsigned)atomic_int_load_explicit(&lock->owner, memory_order_acquire);
+        if (ahead == 0)
+            return 0;
+        /* 按前面排队的人数退避 */
+        for (unsigned i = 0; i < ahead * 16; i++)
+            atomic_pause();
+    }
+}
+
+static inline int
+spinlock_release(struct spinlock *lock) {
+    unsigned owner = (unsigned)atomic_int_load_explicit(&lock->owner, memory_order_relaxed);
+    atomic_int_store_explicit(&lock->owner, (int)(owner + 1), memory_order_release);
+    return 0;
+}
+
+static inline int
+spinlock_try(struct spinlock *lock) {
+    int owner = atomic_int_load_explicit(&lock->owner, memory_order_relaxed);
+    return atomic_int_cmpxchg(&lock->next, owner, (int)((unsigned)owner + 1), memory_order_acquire) != owner;
+}
+
+#elif defined(SPINLOCK_MCS)
+
+#include <stdlib.h>
+
+/*
+ * 节点取自线程局部的节点池, 持有锁期间记录在锁里, 所以接口不需要传节点.
+ * 一个线程同时持有的 MCS 锁不能超过 SPINLOCK_MCS_DEPTH 个.
+ */
+#ifndef SPINLOCK_MCS_DEPTH
+#define SPINLOCK_MCS_DEPTH 16
+#endif
+
+struct spinlock_node {
+    atomic_ptr next;
+    atomic_int locked;
+    int busy;
+};
+
+struct spinlock {
+    atomic_ptr tail;             /* 队尾节点, 空闲时为 NULL */
+    struct spinlock_node *owner; /* 持有者的节点, 只有持有者读写 */
+};
+
+static ATOMIC_THREAD struct spinlock_node spinlock_nodes[SPINLOCK_MCS_DEPTH];
+
+static inline struct spinlock_node *
+spinlock_node_get(void) {
+    for (int i = 0; i < SPINLOCK_MCS_DEPTH; i++) {
+        struct spinlock_node *node = &spinlock_nodes[i];
+        if (!node->busy) {
+            node->busy = 1;
+            atomic_ptr_store_explicit(&node->next, NULL, memory_order_relaxed);
+            atomic_int_store_explicit(&node->locked, 1, memory_order_relaxed);
+            return node;
+        }
+    }
+    abort();
+}
+
+static inline int
+spinlock_init(struct spinlock *lock) {
+    atomic_ptr_init(&lock->tail, NULL);
+    lock->owner = NULL;
+    return 0;
+}
+
+static inline int
+spinlock_destroy(struct spinlock *lock) {
+    (void)lock;
+    return 0;
+}
+
+static inline int
+spinlock_acquire(struct spinlock *lock) {
+    struct spinlock_node *node = spinlock_node_get();
+    struct spinlock_node *prev = (struct spinlock_node *)atomic_ptr_exchange_explicit(
+        &lock->tail, node, memory_order_acq_rel);
+    if (prev) {
+        atomic_ptr_store_explicit(&prev->next, node, memory_order_release);
+        while (atomic_int_load_explicit(&node->locked, memory_order_acquire))
+            atomic_pause();
+    }
+    lock->owner = node;
+    return 0;
+}
+
+static inline int
+spinlock_release(struct spinlock *lock) {
+    struct spinlock_node *node = lock->owner;
+    struct spinlock_node *next = (struct spinlock_node *)atomic_ptr_load_explicit(&node->next, memory_order_acquire);
+    if (next == NULL) {
+        if (atomic_ptr_cmpxchg(&lock->tail, node, NULL, memory_order_release) == node) {
+            node->busy = 0;
+            return 0;
+        }
+        /* 后继已经入队, 等它把自己挂到 next 上 */
+        while ((next = (struct spinlock_node *)atomic_ptr_load_explicit(&node->next, memory_order_acquire)) == NULL)
+            atomic_pause();
+    }
+    atomic_int_store_explicit(&next->locked, 0, memory_order_release);
+    node->busy = 0;
+    return 0;
+}
+
+static inline int
+spinlock_try(struct spinlock *lock) {
+    struct spinlock_node *node;
+    if (atomic_ptr_load_explicit(&lock->tail, memory_order_relaxed))
+        return 1;
+    node = spinlock_node_get();
+    if (atomic_ptr_cmpxchg(&lock->tail, NULL, node, memory_order_acquire) != NULL) {
+        node->busy = 0;
+        return 1;
+    }
+    lock->owner = node;
+    return 0;
+}
+
+#endif
+
+#ifdef LOCK_PROFILE
+
+#undef spinlock
+#undef spinlock_init
+#undef spinlock_destroy
+#undef spinlock_acquire
+#undef spinlock_release
+#undef spinlock_try
+
+struct spinlock {
+    struct spinlock_raw raw;
+    int prof; /* lockprof 的 id */
+};
+
+static inline int
+spinlock_init_named(struct spinlock *lock, const char *name) {
+    lock->prof = lockprof_register("spinlock", name);
+    return spinlock_init_raw(&lock->raw);
+}
+
+static inline int
+spinlock_init(struct spinlock *lock) {
+    return spinlock_init_named(lock, NULL);
+}
+
+static inline int
+spinlock_destroy(struct spinlock *lock) {
+    return spinlock_destroy_raw(&lock->raw);
+}
+
+/* 先试一次, 失败才算有竞争 */
+static inline int
+spinlock_acquire(struct spinlock *lock) {
+    uint64_t start = lockprof_cycles();
+    int contended = spinlock_try_raw(&lock->raw) != 0, r = 0;
+    if (contended)
+        r = spinlock_acquire_raw(&lock->raw);
+    lockprof_acquired(lock->prof, contended, start);
+    return r;
+}
+
+static inline int
+spinlock_release(struct spinlock *lock) {
+    lockprof_released(lock->prof);
+    return spinlock_release_raw(&lock->raw);
+}
+
+static inline int
+spinlock_try(struct spinlock *lock) {
+    uint64_t start = lockprof_cycles();
+    int r = spinlock_try_raw(&lock->raw);
+    if (r == 0)
+        lockprof_acquired(lock->prof, 0, start);
+    return r;
+}
+
+#else
+
+static inline int
+spinlock_init_named(struct spinlock *lock, const char *name) {
+    (void)name;
+    return spinlock_init(lock);
+}
+
+#endif
+
+typedef char spinlock_fits_cacheline[sizeof(struct spinlock) <= ATOMIC_CACHELINE ? 1 : -1];
+
+#endif // SPINLOCK_H
@@ -0,0 +1,141 @@
+#ifndef SPSCQ_H
+#define SPSCQ_H
+
+/*
+ * 单生产者单消费者的字节环形队列, 记录变长, 数据在队列里原地读写, 不拷贝.
+ *   生产者: p = spscq_reserve(q, n) 取得 n 字节的连续空间, 写入后 spscq_commit(q, len) 发布,
+ *           len 可以小于 n. 空间不足时 reserve 返回 NULL.
+ *   消费者: p = spscq_peek(q, &len) 依次取下一条记录, 没有时返回 NULL;
+ *           spscq_release(q) 一次归还已经 peek 过的全部记录的空间.
+ * 两边都只在缓存的对方位置显示满/空时才去读共享位置, 平时不碰对方写的 cache line.
+ * 记录前有 8 字节的长度头, 按 8 字节对齐; 放不下时在缓冲区末尾写回绕标记, 从头开始.
+ * 单条记录最长 spscq_max_record(q) = 容量 / 2 - 8 字节.
+ */
+
+#include "atomic.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#define SPSCQ_WRAP 0xffffffffu
+
+struct ATOMIC_CACHELINE_ALIGNED spscq {
+    unsigned char *buf;
+    int64_t mask;
+    char pad0[ATOMIC_CACHELINE - sizeof(unsigned char *) - sizeof(int64_t)];
+    atomic_int64 tail; /* 已发布的写位置, 生产者写 */
+    char pad1[ATOMIC_CACHELINE - sizeof(atomic_int64)];
+    atomic_int64 head; /* 已归还的读位置, 消费者写 */
+    char pad2[ATOMIC_CACHELINE - sizeof(atomic_int64)];
+    /* 生产者私有 */
+    int64_t wpos;       /* 已发布的写位置 */
+    int64_t wrec;       /* reserve 得到的记录位置 */
+    int64_t head_cache; /* 最近读到的 head */
+    char pad3[ATOMIC_CACHELINE - 3 * sizeof(int64_t)];
+    /* 消费者私有 */
+    int64_t rpos;       /* 下一条要 peek 的记录 */
+    int64_t tail_cache; /* 最近读到的 tail */
+    char pad4[ATOMIC_CACHELINE - 2 * sizeof(int64_t)];
+};
+
+static inline int64_t
+spscq_align(int64_t n) {
+    return (n + 7) & ~(int64_t)7;
+}
+
+/* capacity 向上取 2 的幂, 至少 64 字节. 成功返回 0 */
+static inline int
+spscq_init(struct spscq *q, size_t capacity) {
+    size_t n = 64;
+    while (n < capacity)
+        n <<= 1;
+    q->buf = (unsigned char *)malloc(n);
+    if (q->buf == NULL)
+        return -1;
+    q->mask = (int64_t)n - 1;
+    atomic_int64_init(&q->tail, 0);
+    atomic_int64_init(&q->head, 0);
+    q->wpos = q->wrec = q->head_cache = 0;
+    q->rpos = q->tail_cache = 0;
+    return 0;
+}
+
+static inline void
+spscq_destroy(struct spscq *q) {
+    free(q->buf);
+    q->buf = NULL;
+}
+
+static inline size_t
+spscq_max_record(struct spscq *q) {
+    return (size_t)(q->mask + 1) / 2 - 8;
+}
+
+static inline void *
+spscq_reserve(struct spscq *q, size_t n) {
+    int64_t size = q->mask + 1, off = q->wpos & q->mask;
+    int64_t need = 8 + spscq_align((int64_t)n), skip = 0;
+    if (n > spscq_max_record(q))
+        return NULL;
+    if (need > size - off)
+        skip = size - off;
+    if (q->wpos + skip + need - q->head_cache > size) {
+        q->head_cache = atomic_int64_load_explicit(&q->head, memory_order_acquire);
+        if (q->wpos + skip + need - q->head_cache > size)
+            return NULL;
+    }
+    if (skip) {
+        *(uint32_t *)(q->buf + off) = SPSCQ_WRAP;
+        off = 0;
+    }
+    q->wrec = q->wpos + skip;
+    return q->buf + off + 8;
+}
+
+/* 发布最近一次 reserve 的记录, 长度 len 不超过 reserve 时的 n */
+static inline void
+spscq_commit(struct spscq *q, size_t len) {
+    *(uint32_t *)(q->buf + (q->wrec & q->mask)) = (uint32_t)len;
+    q->wpos = q->wrec + 8 + spscq_align((int64_t)len);
+    atomic_int64_store_explicit(&q->tail, q->wpos, memory_order_release);
+}
+
+static inline const void *
+spscq_peek(struct spscq *q, size_t *len) {
+    for (;;) {
+        const unsigned char *p;
+        uint32_t n;
+        if (q->rpos == q->tail_cache) {
+            q->tail_cache = atomic_int64_load_explicit(&q->tail, memory_order_acquire);
+            if (q->rpos == q->tail_cache)
+                return NULL;
+        }
+        p = q->buf + (q->rpos & q->mask);
+        n = *(const uint32_t *)p;
+        if (n == SPSCQ_WRAP) {
+            q->rpos += q->mask + 1 - (q->rpos & q->mask);
+            continue;
+        }
+        *len = n;
+        q->rpos += 8 + spscq_align(n);
+        return p + 8;
+    }
+}
+
+static inline void
+spscq_release(struct spscq *q) {
+    atomic_int64_store_explicit(&q->head, q->rpos, memory_order_release);
+}
+
+/* 拷贝写入一条记录, 空间不足返回 1 */
+static inline int
+spscq_push(struct spscq *q, const void *data, size_t len) {
+    void *p = spscq_reserve(q, len);
+    if (p == NULL)
+        return 1;
+    memcpy(p, data, len);
+    spscq_commit(q, len);
+    return 0;
+}
+
+#endif // SPSCQ_H
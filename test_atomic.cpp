@@ -0,0 +1,141 @@
+#include "atomic.h"
+#include <cstdio>
+#include <cassert>
+#include <thread>
+#include <vector>
+
+static void test_int()
+{
+    atomic_int a;
+    atomic_int_init(&a, 5);
+    assert(atomic_int_load(&a) == 5 && "init");
+    assert(atomic_int_inc(&a) == 6 && "inc returns new value");
+    assert(atomic_int_dec(&a) == 5 && "dec returns new value");
+    assert(atomic_int_fetch_add(&a, 3, memory_order_relaxed) == 5 && "fetch_add returns old value");
+    assert(atomic_int_fetch_sub(&a, 1, memory_order_release) == 8 && "fetch_sub returns old value");
+    assert(atomic_int_fetch_or(&a, 0x10, memory_order_relaxed) == 7 && "fetch_or");
+    assert(atomic_int_fetch_and(&a, 0x13, memory_order_relaxed) == 0x17 && "fetch_and");
+    assert(atomic_int_load_explicit(&a, memory_order_acquire) == 0x13 && "load_explicit");
+    assert(atomic_int_exchange(&a, 1) == 0x13 && "exchange");
+    assert(atomic_int_exchange_explicit(&a, 2, memory_order_acq_rel) == 1 && "exchange_explicit");
+    atomic_int_store_explicit(&a, 9, memory_order_release);
+    assert(atomic_int_cas(&a, 9, 10) && atomic_int_load(&a) == 10 && "cas success");
+    assert(!atomic_int_cas(&a, 9, 11) && atomic_int_load(&a) == 10 && "cas failure");
+    assert(atomic_int_cmpxchg(&a, 10, 12, memory_order_acq_rel) == 10 && "cmpxchg returns expected on success");
+    assert(atomic_int_cmpxchg(&a, 10, 13, memory_order_release) == 12 && "cmpxchg returns observed on failure");
+    assert(atomic_int_load(&a) == 12 && "failed cmpxchg leaves value");
+    int v = 11;
+    while (!atomic_int_cmpxchg_weak(&a, &v, v + 1, memory_order_relaxed))
+        ;
+    assert(v == 12 && atomic_int_load(&a) == 13 && "cmpxchg_weak loop updates expected");
+}
+
+static void test_int64()
+{
+    atomic_int64 a;
+    int64_t big = (int64_t)1 << 40;
+    atomic_int64_init(&a, big);
+    assert(atomic_int64_load(&a) == big && "64-bit init");
+    assert(atomic_int64_fetch_add(&a, big, memory_order_relaxed) == big && "64-bit fetch_add");
+    assert(atomic_int64_load_explicit(&a, memory_order_relaxed) == 2 * big && "no truncation");
+    assert(atomic_int64_inc(&a) == 2 * big + 1 && "64-bit inc");
+    atomic_int64_store(&a, -1);
+    assert(atomic_int64_cmpxchg(&a, 0, 1, memory_order_seq_cst) == -1 && "64-bit cmpxchg failure");
+    assert(atomic_int64_cas(&a, -1, big) && atomic_int64_load(&a) == big && "64-bit cas");
+}
+
+static void test_ptr()
+{
+    int x = 0, y = 0;
+    atomic_ptr p;
+    atomic_ptr_init(&p, &x);
+    assert(atomic_ptr_load(&p) == &x && "ptr init");
+    assert(atomic_ptr_exchange(&p, &y) == &x && "ptr exchange");
+    assert(atomic_ptr_exchange_explicit(&p, &x, memory_order_acq_rel) == &y && "ptr exchange_explicit");
+    assert(atomic_ptr_cas(&p, &x, &y) && atomic_ptr_load(&p) == &y && "ptr cas success");
+    assert(!atomic_ptr_cas(&p, &x, NULL) && "ptr cas failure");
+    assert(atomic_ptr_cmpxchg(&p, &x, NULL, memory_order_acq_rel) == &y && "ptr cmpxchg observed");
+    void *e = &x;
+    assert(!atomic_ptr_cmpxchg_weak(&p, &e, &x, memory_order_relaxed) && e == &y && "ptr cmpxchg_weak observed");
+    /* int 至少 4 字节对齐, 低两位可以做标记 */
+    assert(atomic_ptr_fetch_or(&p, 1, memory_order_relaxed) == &y && "ptr fetch_or");
+    assert((uintptr_t)atomic_ptr_load_explicit(&p, memory_order_acquire) == ((uintptr_t)&y | 1) && "ptr tagged");
+    atomic_ptr_fetch_and(&p, ~(uintptr_t)1, memory_order_relaxed);
+    assert(atomic_ptr_load(&p) == &y && "ptr untagged");
+    atomic_ptr_store_explicit(&p, NULL, memory_order_release);
+    assert(atomic_ptr_load(&p) == NULL && "ptr store");
+}
+
+static void test_pair()
+{
+    atomic_pair p, e, d;
+    assert((uintptr_t)&p % (2 * sizeof(uintptr_t)) == 0 && "pair alignment");
+    atomic_pair_init(&p, 1, 2);
+    e.lo = 1, e.hi = 2;
+    d.lo = 3, d.hi = 4;
+    assert(atomic_pair_cas(&p, &e, d) && "pair cas success");
+    e.lo = 1, e.hi = 2;
+    assert(!atomic_pair_cas(&p, &e, d) && "pair cas failure");
+    assert(e.lo == 3 && e.hi == 4 && "pair cas writes back observed value");
+    e.lo = 3, e.hi = 5;
+    assert(!atomic_pair_cas(&p, &e, d) && "pair cas compares both words");
+    e = atomic_pair_load(&p);
+    assert(e.lo == 3 && e.hi == 4 && "pair load");
+}
+
+/* 两个字一起递增, 任何时刻读到的两个字都应相等 */
+static void test_pair_threads()
+{
+    const int nthread = 4, nloop = 20000;
+    atomic_pair p;
+    std::vector<std::thread> th;
+    atomic_pair_init(&p, 0, 0);
+    for (int t = 0; t < nthread; t++)
+    {
+        th.emplace_back([&p, nloop] {
+            atomic_pair e = atomic_pair_load(&p);
+            for (int i = 0; i < nloop; i++)
+            {
+                atomic_pair d;
+                do
+                {
+                    assert(e.lo == e.hi && "torn pair");
+                    d.lo = e.lo + 1, d.hi = e.hi + 1;
+                } while (!atomic_pair_cas(&p, &e, d));
+                e = d;
+            }
+        });
+    }
+    for (auto &t : th)
+        t.join();
+    atomic_pair v = atomic_pair_load(&p);
+    assert(v.lo == (uintptr_t)nthread * nloop && v.hi == v.lo && "pair cas lost updates");
+}
+
+static void test_counter_threads()
+{
+    const int nthread = 4, nloop = 100000;
+    atomic_int64 c;
+    std::vector<std::thread> th;
+    atomic_int64_init(&c, 0);
+    for (int t = 0; t < nthread; t++)
+        th.emplace_back([&c, nloop] {
+            for (int i = 0; i < nloop; i++)
+                atomic_int64_fetch_add(&c, 1, memory_order_relaxed);
+        });
+    for (auto &t : th)
+        t.join();
+    assert(atomic_int64_load(&c) == (int64_t)nthread * nloop && "relaxed fetch_add lost updates");
+}
+
+int main()
+{
+    test_int();
+    test_int64();
+    test_ptr();
+    test_pair();
+    test_pair_threads();
+    test_counter_threads();
+    printf("atomic: all tests passed\n");
+    return 0;
+}
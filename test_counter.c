@@ -0,0 +1,105 @@
+#include "counter.h"
+#include "testthread.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+
+/*
+ * 压力测试:
+ *   counter    多个线程只加不减, 同时读: 精确读单调不减, 近似读不超过之后的精确读,
+ *              也不比之前的精确读少 COUNTER_SLOTS * COUNTER_BATCH 以上; 结束后精确读等于总数
+ *   counter    正负混合, 包括超过 COUNTER_BATCH 的单次更新, 结束后总和一致
+ *   gauge      每个线程加一再减一, 并发读在 [0, NTHREAD] 之间, 结束后为 0, 再检查 set
+ *   histogram  每个线程记录 0..NOPS-1, 计数, 总和, 每个桶的个数和分位数
+ */
+
+#define NTHREAD 4
+#define NOPS 200000
+
+static struct counter Requests, Bytes;
+static struct gauge Inflight;
+static struct histogram Latency;
+static atomic_int Running;
+
+/* 第 i 次给 Bytes 加的值, 有正有负, 每 1000 次有一次超过 COUNTER_BATCH */
+static int64_t delta(int i)
+{
+	return i % 1000 == 0 ? 10 * COUNTER_BATCH : (int64_t)(i % 7) - 3;
+}
+
+THREAD_MAIN(updateMain)
+{
+	(void)arg;
+	for (int i = 0; i < NOPS; i++)
+	{
+		counter_inc(&Requests);
+		counter_add(&Bytes, delta(i));
+		gauge_inc(&Inflight);
+		histogram_record(&Latency, i);
+		gauge_dec(&Inflight);
+	}
+	atomic_int_dec(&Running);
+	return 0;
+}
+
+int main()
+{
+	thread_t th[NTHREAD];
+	struct histogram_stat st;
+	int64_t last = 0, expect = 0, reads = 0;
+	int i;
+
+	counter_init(&Requests);
+	counter_init(&Bytes);
+	gauge_init(&Inflight);
+	histogram_init(&Latency);
+	assert(counter_read(&Requests) == 0 && counter_read_exact(&Requests) == 0 && "starts at 0");
+
+	atomic_int_store(&Running, NTHREAD);
+	for (i = 0; i < NTHREAD; i++)
+		START(th[i], updateMain, 0);
+	while (atomic_int_load(&Running) > 0)
+	{
+		int64_t approx = counter_read(&Requests), exact = counter_read_exact(&Requests), g = gauge_read(&Inflight);
+		assert(exact >= last && "exact read is monotonic");
+		assert(approx <= exact && "approx read lags behind");
+		assert(approx > last - COUNTER_SLOTS * COUNTER_BATCH && "approx error is bounded");
+		assert(g >= 0 && g <= NTHREAD && "gauge within in-flight bounds");
+		last = exact;
+		reads++;
+	}
+	for (i = 0; i < NTHREAD; i++)
+		JOIN(th[i]);
+
+	assert(counter_read_exact(&Requests) == (int64_t)NTHREAD * NOPS && "no increment lost");
+	assert(counter_read_exact(&Requests) - counter_read(&Requests) < COUNTER_SLOTS * COUNTER_BATCH && "approx close");
+	for (i = 0; i < NOPS; i++)
+		expect += delta(i);
+	assert(counter_read_exact(&Bytes) == NTHREAD * expect && "signed sum");
+
+	assert(gauge_read(&Inflight) == 0 && "gauge back to 0");
+	gauge_set(&Inflight, 100);
+	assert(gauge_read(&Inflight) == 100 && "gauge set");
+	gauge_add(&Inflight, -30);
+	gauge_inc(&Inflight);
+	assert(gauge_read(&Inflight) == 71 && "gauge add after set");
+
+	histogram_read(&Latency, &st);
+	assert(st.count == (int64_t)NTHREAD * NOPS && "histogram count");
+	assert(st.sum == (int64_t)NTHREAD * NOPS * (NOPS - 1) / 2 && "histogram sum");
+	assert(st.bucket[0] == 2 * NTHREAD && "0 and 1 share bucket 0");
+	for (int b = 1; ((int64_t)1 << (b + 1)) <= NOPS; b++)
+		assert(st.bucket[b] == NTHREAD * ((int64_t)1 << b) && "power-of-two buckets");
+	assert(histogram_quantile(&st, 0.5) >= NOPS / 2 && histogram_quantile(&st, 0.5) <= 2 * NOPS && "median bucket");
+	assert(histogram_quantile(&st, 0.0) == 1 << 1 && "lowest bucket");
+
+	printf("counter: %lld requests, %lld concurrent reads\n", (long long)counter_read_exact(&Requests),
+	       (long long)reads);
+	histogram_destroy(&Latency);
+	gauge_destroy(&Inflight);
+	counter_destroy(&Bytes);
+	counter_destroy(&Requests);
+	return 0;
+}
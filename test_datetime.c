@@ -1,14 +1,294 @@
 #include "datetime.h"
+#include "dtclock.h"
+#include "dtconv.h"
+#include "tzone.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <assert.h>
 
 int main()
 {
-    assert(dt_unixepoch(1,"now") == time(NULL) && "unixepoch invalid");
+    assert(llabs(dt_unixepoch(1,"now") - time(NULL)) <= 1 && "unixepoch invalid");
 	assert(dt_julianday(1, "2000-01-01") == 2451544.5);
 	assert(dt_julianday(1, "1970-01-01") == 2440587.5);
 	assert(dt_julianday(1, "1910-04-20") == 2418781.5);
 	assert(dt_julianday(1, "abc") == 0.0);
+
+	assert(strcmp(dt_datetime(2, "2024-07-01 00:00:00", "tz:Asia/Shanghai"), "2024-07-01 08:00:00") == 0 && "tz fixed offset");
+	assert(strcmp(dt_datetime(2, "2024-01-01 00:00:00", "tz:America/New_York"), "2023-12-31 19:00:00") == 0 && "tz standard time");
+	assert(strcmp(dt_datetime(2, "2024-07-01 00:00:00", "tz:America/New_York"), "2024-06-30 20:00:00") == 0 && "tz daylight time");
+	assert(strcmp(dt_datetime(2, "2150-07-01 00:00:00", "tz:America/New_York"), "2150-06-30 20:00:00") == 0 && "tz footer rule");
+	assert(strcmp(dt_datetime(2, "2024-07-01 00:00:00", "tz:EST5EDT,M3.2.0,M11.1.0"), "2024-06-30 20:00:00") == 0 && "tz posix rule");
+	assert(strcmp(dt_datetime(3, "2024-07-01 00:00:00", "tz:America/New_York", "utc"), "2024-07-01 00:00:00") == 0 && "tz to utc");
+	assert(strcmp(dt_datetime(3, "2024-07-01 00:00:00", "tz:America/New_York", "tz:Asia/Tokyo"), "2024-07-01 09:00:00") == 0 && "tz to tz");
+	assert(dt_datetime(2, "2024-07-01 00:00:00", "tz:No/Such_Zone") == NULL && "tz unknown zone");
+	assert(dt_datetime(2, "2024-07-01 00:00:00", "tz:No/Such_Zone") == NULL && "tz unknown zone cached");
+	{
+		/* 缓存过的未知名字, 注册数据之后可以取到 */
+		static char data[65536];
+		FILE *f = fopen("/usr/share/zoneinfo/Asia/Tokyo", "rb");
+		size_t n = f ? fread(data, 1, sizeof(data), f) : 0;
+		if (f)
+			fclose(f);
+		if (n > 0)
+		{
+			int rc = tzone_load_data("No/Such_Zone", data, n);
+			assert(rc == 0 && "tz load after miss");
+			assert(strcmp(dt_datetime(2, "2024-07-01 00:00:00", "tz:No/Such_Zone"), "2024-07-01 09:00:00") == 0 && "tz miss replaced");
+		}
+	}
+
+	{
+		/* 和 time() 比较允许差一秒: 两次读之间可能跨过秒边界, 缓存时钟还可能落后一个 tick */
+		int rc;
+		assert(llabs(dt_now_unixepoch() - time(NULL)) <= 1 && "dt_now_unixepoch invalid");
+		rc = dt_clock_set_source(DT_CLOCK_COARSE);
+		assert(rc == 0 && "coarse source");
+		assert(dt_now_ns() - dt_now_precise_ns() < 100000000 && "coarse clock drift");
+		rc = dt_clock_start_ticker(1000);
+		assert(rc == 0 && "start ticker");
+		rc = dt_clock_set_source(DT_CLOCK_CACHED);
+		assert(rc == 0 && "cached source");
+		assert(llabs(dt_unixepoch(1, "now") - time(NULL)) <= 1 && "cached now invalid");
+		dt_clock_stop_ticker();
+		if (dt_clock_calibrate_tsc() == 0)
+		{
+			rc = dt_clock_set_source(DT_CLOCK_TSC);
+			assert(rc == 0 && "tsc source");
+			assert(llabs(dt_now_ns() - dt_now_precise_ns()) < 1000000 && "tsc clock drift");
+		}
+		dt_clock_set_source(DT_CLOCK_PRECISE);
+	}
+
+	{
+		DateTime x;
+		char buf[16];
+		const char *argv[] = {"2024-03-05 07:08:09.123"};
+		dt_fmt *f = dt_fmt_compile("%Y/%m/%d %H:%M:%f %j %% %s");
+		assert(f && dt_parse(&x, 1, argv) == 0);
+		assert(dt_fmt_format(f, &x, buf, sizeof(buf)) == 40 && "fmt length");
+		assert(strcmp(buf, "2024/03/05 07:0") == 0 && "fmt truncate");
+		assert(strcmp(dt_strftime("%Y/%m/%d %H:%M:%f %j %% %s", 1, argv[0]), "2024/03/05 07:08:09.123 065 % 1709622489") == 0 && "strftime");
+		assert(dt_fmt_compile("%Q") == NULL && "fmt invalid");
+		dt_fmt_free(f);
+	}
+	{
+		char buf[64];
+		uint64_t hit, miss;
+		dt_fmt *f = dt_fmt_compile("%Y-%m-%d %H:%M:%f");
+		dt_fmt_cached(f, NULL, (int64_t)1700000000123 * 1000000, buf, sizeof(buf));
+		assert(strcmp(buf, "2023-11-14 22:13:20.123") == 0 && "fmt cached miss");
+		dt_fmt_cached(f, NULL, (int64_t)1700000019456 * 1000000, buf, sizeof(buf));
+		assert(strcmp(buf, "2023-11-14 22:13:39.456") == 0 && "fmt cached hit");
+		dt_fmt_cached(f, tzone_get("Asia/Shanghai"), (int64_t)1700000019456 * 1000000, buf, sizeof(buf));
+		assert(strcmp(buf, "2023-11-15 06:13:39.456") == 0 && "fmt cached zone");
+		dt_fmt_cache_stats(&hit, &miss);
+		assert(hit == 1 && miss == 2 && "fmt cache stats");
+		dt_fmt_free(f);
+	}
+	{
+		/* 释放后 malloc 往往把同一地址给下一个程序, 缓存不能把旧程序的文本给它 */
+		char buf[64];
+		dt_fmt *f = dt_fmt_compile("%Y-%m-%d %H:%M:%S");
+		dt_fmt_cached(f, NULL, (int64_t)1709622489 * 1000000000, buf, sizeof(buf));
+		assert(strcmp(buf, "2024-03-05 07:08:09") == 0 && "fmt cached before free");
+		dt_fmt_free(f);
+		f = dt_fmt_compile("%H:%M:%S %d/%m/%Y");
+		dt_fmt_cached(f, NULL, (int64_t)1709622490 * 1000000000, buf, sizeof(buf));
+		assert(strcmp(buf, "07:08:10 05/03/2024") == 0 && "fmt cached after free");
+		dt_fmt_free(f);
+	}
+	{
+		/* 超过 0xffff 的字面量分成几段, 编译时要把多出来的段算进去 */
+		enum { N = 140000 };
+		char *zFmt = malloc(N + 4), *out = malloc(N + 8);
+		DateTime x;
+		const char *argv[] = {"2024-03-05"};
+		dt_fmt *f;
+		int n, i;
+		memset(zFmt, 'x', N);
+		strcpy(zFmt + N, "%Y");
+		f = dt_fmt_compile(zFmt);
+		assert(f && dt_parse(&x, 1, argv) == 0 && "fmt long literal compile");
+		n = dt_fmt_format(f, &x, out, N + 8);
+		assert(n == N + 4 && "fmt long literal length");
+		for (i = 0; i < N && out[i] == 'x'; i++)
+			;
+		assert(i == N && strcmp(out + N, "2024") == 0 && "fmt long literal");
+		dt_fmt_free(f);
+		free(zFmt);
+		free(out);
+	}
+	{
+		char buf[64];
+		DateTime x;
+		int64_t sec;
+		int nsec;
+		dt_fmt *f = dt_fmt_compile("%H:%M:%9f|%6f|%f");
+		assert(strcmp(dt_datetime(2, "2024-03-05 07:08:09.123456789", "subsec:9"), "2024-03-05 07:08:09.123456789") == 0 && "ns parse");
+		assert(strcmp(dt_time(2, "07:08:09.123456789", "subsec:6"), "07:08:09.123456") == 0 && "us time");
+		assert(strcmp(dt_datetime(3, "1709622489.000000001", "unixepoch", "subsec:9"), "2024-03-05 07:08:09.000000001") == 0 && "ns unixepoch");
+		assert(strcmp(dt_datetime(3, "2024-03-05 07:08:09.999999999", "+0.000000001 seconds", "subsec:9"), "2024-03-05 07:08:10.000000000") == 0 && "ns add");
+		assert(strcmp(dt_datetime(3, "2024-03-05 07:08:09", "-00:00:00.000000500", "subsec:9"), "2024-03-05 07:08:08.999999500") == 0 && "ns sub");
+		assert(strcmp(dt_timediff(2, "2024-03-05 07:08:09.000000500", "2024-03-05 07:08:09"), "+0000-00-00 00:00:00.000000500") == 0 && "ns timediff");
+		assert(strcmp(dt_strftime("%s", 3, "1709622489.5", "unixepoch", "subsec:6"), "1709622489.500000") == 0 && "ns %s");
+		assert(dt_unixepoch_ns(1, "2024-03-05 07:08:09.123456789") == 1709622489123456789LL && "unixepoch_ns");
+		assert(dt_from_unix_ns(&x, -1) == 0 && dt_to_unix(&x, &sec, &nsec) == 0 && sec == -1 && nsec == 999999999 && "from/to unix");
+		assert(dt_fmt_format(f, &x, buf, sizeof(buf)) > 0 && strcmp(buf, "23:59:59.999999999|59.999999|59.999") == 0 && "fmt %9f");
+		dt_fmt_cached(f, NULL, 1709622489123456789LL, buf, sizeof(buf));
+		dt_fmt_cached(f, NULL, 1709622490000000042LL, buf, sizeof(buf));
+		assert(strcmp(buf, "07:08:10.000000042|10.000000|10.000") == 0 && "fmt cached %9f");
+		dt_fmt_free(f);
+	}
+	{
+		dt_bucket b;
+		int64_t in[3] = {1709622489, 1709622540, 1709625600}, out[3];
+		const struct tzone *ny = tzone_get("America/New_York");
+		int rc;
+		rc = dt_bucket_init(&b, 5, DT_UNIT_MINUTE, NULL, 1);
+		assert(rc == 0 && "bucket init minute");
+		assert(dt_bucket_floor(&b, 1709622489) == 1709622300 && "bucket 5 minutes");
+		assert(dt_bucket_ceil(&b, 1709622489) == 1709622600 && dt_bucket_ceil(&b, 1709622600) == 1709622600 && "bucket ceil");
+		rc = dt_bucket_init(&b, 1, DT_UNIT_HOUR, tzone_get("Asia/Kolkata"), 1000);
+		assert(rc == 0 && "bucket init hour");
+		assert(dt_bucket_floor(&b, 1709622489123LL) == 1709620200000LL && "bucket hour half offset");
+		rc = dt_bucket_init(&b, 1, DT_UNIT_DAY, ny, 1);
+		assert(rc == 0 && "bucket init day");
+		assert(dt_bucket_floor(&b, 1709622489) == dt_unixepoch(5, "1709622489", "unixepoch", "tz:America/New_York", "start of day", "utc") && "bucket day zone");
+		rc = dt_bucket_init(&b, 1, DT_UNIT_WEEK, NULL, 1);
+		assert(rc == 0 && "bucket init week");
+		assert(dt_bucket_floor(&b, 1709622489) == dt_unixepoch(1, "2024-03-04") && "bucket week");
+		rc = dt_bucket_init(&b, 3, DT_UNIT_MONTH, NULL, 1);
+		assert(rc == 0 && "bucket init quarter");
+		dt_bucket_floor_array(&b, in, out, 3);
+		assert(out[0] == dt_unixepoch(1, "2024-01-01") && out[2] == out[0] && "bucket quarter array");
+		rc = dt_bucket_init(&b, 0, DT_UNIT_DAY, NULL, 1);
+		assert(rc != 0 && "bucket invalid");
+	}
+	{
+		DateTime a, b;
+		dt_duration d, e;
+		int64_t ns;
+		char buf[48];
+		const char *argv[1];
+		int rc;
+		argv[0] = "2024-03-31 10:00:00.5";
+		rc = dt_parse(&a, 1, argv);
+		assert(rc == 0 && "diff parse a");
+		argv[0] = "2023-01-30 12:30:00";
+		rc = dt_parse(&b, 1, argv);
+		assert(rc == 0 && "diff parse b");
+		rc = dt_diff(&d, &a, &b);
+		assert(rc == 0 && d.months == 14 && d.days == 0 && d.ns == (int64_t)77400500 * 1000000 && "diff");
+		rc = dt_duration_format(&d, buf, sizeof(buf));
+		assert(rc == 24 && strcmp(buf, dt_timediff(2, "2024-03-31 10:00:00.5", "2023-01-30 12:30:00")) == 0 && "diff format");
+		rc = dt_add(&b, &d);
+		assert(rc == 0 && dt_cmp(&a, &b) == 0 && "diff add");
+		rc = dt_sub(&b, &d);
+		assert(rc == 0 && dt_cmp(&a, &b) > 0 && "diff sub");
+		rc = dt_diff(&e, &b, &a);
+		assert(rc == 0 && e.months < 0 && e.ns < 0 && dt_duration_cmp(&e, &d) < 0 && "diff negative");
+		rc = dt_diff_ns(&a, &b, &ns);
+		assert(rc == 0 && ns == (int64_t)36797400500 * 1000000 && "diff ns");
+	}
+	{
+		DateTime x;
+		int64_t sec;
+		int nsec;
+		dt_scan *s = dt_scan_compile("%d/%b/%Y:%H:%M:%S %z");
+		assert(s && dt_scan_parse(s, "10/Oct/2000:13:55:36 -0700", &x) == 26 && "scan apache");
+		assert(dt_to_unix(&x, &sec, &nsec) == 0 && sec == 971211336 && "scan apache value");
+		assert(dt_scan_parse(s, "10/Foo/2000:13:55:36 -0700", &x) == -1 && "scan mismatch");
+		dt_scan_free(s);
+		s = dt_scan_compile("%a, %d %b %Y %T %z");
+		assert(dt_scan_parse(s, "Tue, 5 Mar 2024 07:08:09 GMT", &x) > 0 && dt_to_unix(&x, &sec, &nsec) == 0 && sec == 1709622489 && "scan rfc2822");
+		dt_scan_free(s);
+		s = dt_scan_compile("%Y%m%d%H%M%f");
+		assert(dt_scan_parse(s, "20240305070809.25", &x) == 17 && dt_to_unix(&x, &sec, &nsec) == 0 && sec == 1709622489 && nsec == 250000000 && "scan packed");
+		dt_scan_free(s);
+		assert(dt_scan_compile("%Q") == NULL && "scan invalid");
+	}
+	{
+		char fmt[301];
+		memset(fmt, 'x', 300);
+		memcpy(fmt + 290, "%Y", 2);
+		fmt[300] = 0;
+		assert(strlen(dt_strftime(fmt, 1, "2024-01-01")) == 302 && "strftime long output");
+	}
+	{
+		char buf[32];
+		const char *argv[DT_MAX_ARGS + 1];
+		int i;
+		argv[0] = "2024-03-05 07:08:09.5";
+		argv[1] = "+1 day";
+		assert(dt_datetime_r(buf, sizeof(buf), 2, argv) == 19 && strcmp(buf, "2024-03-06 07:08:09") == 0 && "datetime_r");
+		assert(dt_date_r(buf, sizeof(buf), 1, argv) == 10 && strcmp(buf, "2024-03-05") == 0 && "date_r");
+		assert(dt_time_r(buf, 4, 1, argv) == 8 && strcmp(buf, "07:") == 0 && "time_r truncate");
+		assert(dt_strftime_r(buf, sizeof(buf), "%H:%M:%f", 1, argv) == 12 && strcmp(buf, "07:08:09.500") == 0 && "strftime_r");
+		argv[1] = "2024-03-04 07:08:09";
+		assert(dt_timediff_r(buf, sizeof(buf), 2, argv) == 24 && strcmp(buf, "+0000-00-01 00:00:00.500") == 0 && "timediff_r");
+		assert(dt_datetime_r(buf, sizeof(buf), 1, (argv[0] = "bogus", argv)) == -1 && "datetime_r error");
+		argv[0] = "2024-03-05";
+		for (i = 1; i <= DT_MAX_ARGS; i++)
+			argv[i] = "+1 day";
+		assert(dt_datetime_r(buf, sizeof(buf), DT_MAX_ARGS + 1, argv) == 19 && strcmp(buf, "2024-04-06 00:00:00") == 0 && "_r no arg limit");
+		assert(dt_date(33, "2024-03-05", "+1 day", "+1 day", "+1 day", "+1 day", "+1 day", "+1 day", "+1 day", "+1 day",
+			"+1 day", "+1 day", "+1 day", "+1 day", "+1 day", "+1 day", "+1 day", "+1 day", "+1 day", "+1 day", "+1 day",
+			"+1 day", "+1 day", "+1 day", "+1 day", "+1 day", "+1 day", "+1 day", "+1 day", "+1 day", "+1 day", "+1 day",
+			"+1 day", "+1 day") == NULL && "varargs limit");
+	}
+	{
+		/* in_zone 只用于不带偏移的字段, 带偏移或 Z 的字段不能再换算一次 */
+		const char *in = "a,2024-07-01 00:00:00\nb,2024-07-01 00:00:00+09:00\nc,2024-07-01T00:00:00Z\n";
+		const char *want = "a,2024-06-30 15:00:00\nb,2024-06-30 15:00:00\nc,2024-07-01 00:00:00\n";
+		char buf[128];
+		dt_conv_opts o;
+		dt_conv_stats st;
+		FILE *out = tmpfile();
+		size_t n;
+		int rc;
+		memset(&o, 0, sizeof(o));
+		memset(&st, 0, sizeof(st));
+		o.column = 1;
+		o.in_zone = tzone_get("Asia/Tokyo");
+		o.threads = 1;
+		assert(out && o.in_zone && "conv setup");
+		rc = dt_conv_buffer(in, strlen(in), out, &o, &st);
+		assert(rc == 0 && st.rows == 3 && st.errors == 0 && "conv in_zone");
+		rewind(out);
+		n = fread(buf, 1, sizeof(buf) - 1, out);
+		buf[n] = 0;
+		assert(strcmp(buf, want) == 0 && "conv in_zone mixed offsets");
+		fclose(out);
+	}
+	{
+		/* 大量找不到的名字不能占满缓存, 之后的有效时区照常加载 */
+		char name[32];
+		for (int i = 0; i < 1100; i++)
+		{
+			snprintf(name, sizeof(name), "Bogus/%d", i);
+			assert(tzone_get(name) == NULL && "tz bogus name");
+		}
+		assert(tzone_get("Europe/Paris") && "tz after many misses");
+		assert(tzone_get("Bogus/0") == NULL && "tz bogus name again");
+	}
+	{
+		/* 每个不同的 POSIX 规则串占一个缓存位置, 缓存满了以后新名字失败, 已缓存的照常可用 */
+		char name[32];
+		int nOk = 0, nFull = 0;
+		for (int i = 0; i < 2000; i++)
+		{
+			snprintf(name, sizeof(name), "UTC-0:%02d:%02d", i / 60, i % 60);
+			if (tzone_get(name))
+				nOk++;
+			else
+				nFull++;
+		}
+		assert(nOk > 0 && nOk <= 1024 && nFull > 0 && "tz cache bounded");
+		assert(tzone_get("UTC-0:00:01") && tzone_get("Asia/Shanghai") && "tz cached after full");
+		assert(tzone_get("UTC-0:59:59") == NULL && "tz new name after full");
+	}
 	return 0;
-}
\ No newline at end of file
+}
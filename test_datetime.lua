@@ -4,7 +4,7 @@ ffi.cdef [[
     const char *dt_time(int argc, ...);
     const char *dt_datetime(int argc, ...);
     const char *dt_date(int argc, ...);
-    int64_t dt_unixepoch(int argc, ...)
+    int64_t dt_unixepoch(int argc, ...);
     double dt_julianday(int argc, ...);
     const char *dt_timediff(int argc, ...);
     const char *dt_strftime(const char *zFmt, int argc, ...);
@@ -20,3 +20,29 @@ print(S.dt_unixepoch(2,"now","+1 days","localtime"))
 print(ffi.string(S.dt_timediff(2,"now","2013-01-01")))
 print(ffi.string(S.dt_strftime("小时 %H",3,"now","localtime","+2 hours")))
 
+
+local datetime = require "datetime"
+
+local t = datetime.new("2024-03-05 07:08:09.25", "subsec")
+assert(t:datetime() == "2024-03-05 07:08:09.250")
+assert(t.year == 2024 and t.month == 3 and t.second == 9 and t.nanosecond == 250000000)
+assert(t:modify("+1 days"):date() == "2024-03-06")
+assert(t:format("%H-%M") == "07-08")
+assert(tostring(t + 60) == "2024-03-05 07:09:09.250")
+local d = t - datetime.new("2024-03-01")
+assert(tostring(d) == "+0000-00-04 07:08:09.250")
+assert(datetime.new("2024-03-01") + d == t)
+assert(datetime.new("2024-03-01") < t)
+assert(datetime.unix(1709622489):datetime() == "2024-03-05 07:08:09")
+assert(t:bucket(1, "month"):datetime() == "2024-03-01 00:00:00.000")
+local scan = datetime.scanner("%d/%b/%Y:%H:%M:%S %z")
+assert(scan("10/Oct/2000:13:55:36 -0700"):datetime() == "2000-10-10 20:55:36")
+local fmt = datetime.formatter("%Y%m%d")
+assert(fmt(t) == "20240305")
+assert(t:format(string.rep("x", 300) .. "%Y") == string.rep("x", 300) .. "2024")
+for i = 1, 200 do
+    assert(t:format("%Y " .. i) == "2024 " .. i)
+end
+collectgarbage()
+assert(fmt(t) == "20240305" and t:format("%H-%M") == "07-08")
+print("datetime module ok")
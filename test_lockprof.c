@@ -0,0 +1,175 @@
+#include "spinlock.h"
+#include "rwlock.h"
+#include "testthread.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+
+/*
+ * 定义 LOCK_PROFILE 编译, 检查统计:
+ *   多个线程抢同一个 spinlock 和 rwlock, 加锁次数准确, 直方图的总数等于加锁次数
+ *   主线程持有锁时另一个线程来抢, 一定记为有竞争, 等待时间最长的锁排在最前
+ *   try 失败不计数, 交错释放的锁也能记录持有时间, 线程退出后统计保留
+ */
+
+#ifndef LOCK_PROFILE
+#error "test-lockprof must be built with LOCK_PROFILE"
+#endif
+
+#define NTHREAD 4
+#define NOPS 100000
+#define NREAD 50000
+#define HOLD_MS 20
+
+static struct spinlock Hot, Cold, Anon;
+static struct rwlock Table;
+/* 锁保护的普通变量不加 static: GCC 的 TSan 构建会把 static 变量的读缓存到原子操作之外 */
+int64_t Counter;
+int64_t Version;
+static atomic_int64 Sink;
+
+THREAD_MAIN(counterMain)
+{
+	(void)arg;
+	for (int i = 0; i < NOPS; i++)
+	{
+		spinlock_acquire(&Hot);
+		Counter++;
+		spinlock_release(&Hot);
+	}
+	return 0;
+}
+
+THREAD_MAIN(readerMain)
+{
+	int64_t sum = 0;
+	(void)arg;
+	for (int i = 0; i < NREAD; i++)
+	{
+		rwlock_acquire_read(&Table);
+		sum += Version;
+		rwlock_release_read(&Table);
+		if (i % 1000 == 0)
+		{
+			rwlock_acquire_write(&Table);
+			Version++;
+			rwlock_release_write(&Table);
+		}
+	}
+	atomic_int64_fetch_add(&Sink, sum, memory_order_relaxed);
+	return 0;
+}
+
+THREAD_MAIN(blockedMain)
+{
+	(void)arg;
+	spinlock_acquire(&Hot);
+	spinlock_release(&Hot);
+	rwlock_acquire_read(&Table);
+	rwlock_release_read(&Table);
+	return 0;
+}
+
+static const struct lockprof_stat *find(const struct lockprof_stat *st, int n, const char *name, const char *kind)
+{
+	for (int i = 0; i < n; i++)
+	{
+		if (strcmp(st[i].name, name) == 0 && strcmp(st[i].kind, kind) == 0)
+			return &st[i];
+	}
+	return NULL;
+}
+
+static int64_t histTotal(const int64_t *hist)
+{
+	int64_t total = 0;
+	for (int i = 0; i < LOCKPROF_BUCKETS; i++)
+		total += hist[i];
+	return total;
+}
+
+int main()
+{
+	static struct lockprof_stat st[LOCKPROF_MAX];
+	const struct lockprof_stat *hot, *cold, *anon, *rd, *wr;
+	thread_t th[NTHREAD];
+	char anonName[LOCKPROF_NAME];
+	int i, n;
+
+	spinlock_init_named(&Hot, "hot");
+	spinlock_init_named(&Cold, "cold");
+	spinlock_init(&Anon);
+	rwlock_init_named(&Table, "table");
+	snprintf(anonName, sizeof(anonName), "spinlock#%d", Anon.prof);
+
+	/* 主线程持有时来抢的线程一定有竞争 */
+	spinlock_acquire(&Hot);
+	rwlock_acquire_write(&Table);
+	START(th[0], blockedMain, 0);
+	SLEEP_MS(HOLD_MS);
+	spinlock_release(&Hot);
+	SLEEP_MS(HOLD_MS);
+	rwlock_release_write(&Table);
+	JOIN(th[0]);
+
+	/* try 失败不计数 */
+	assert(spinlock_try(&Cold) == 0 && "try free lock");
+	assert(spinlock_try(&Cold) != 0 && "try held lock");
+	spinlock_release(&Cold);
+	assert(rwlock_try_write(&Table) == 0 && "try free rwlock");
+	assert(rwlock_try_read(&Table) != 0 && "try read while written");
+	rwlock_release_write(&Table);
+
+	/* 交错释放 */
+	spinlock_acquire(&Cold);
+	spinlock_acquire(&Anon);
+	spinlock_release(&Cold);
+	spinlock_release(&Anon);
+
+	for (i = 0; i < NTHREAD; i++)
+		START(th[i], counterMain, 0);
+	for (i = 0; i < NTHREAD; i++)
+		JOIN(th[i]);
+	assert(Counter == (int64_t)NTHREAD * NOPS && "lost updates");
+	for (i = 0; i < NTHREAD; i++)
+		START(th[i], readerMain, 0);
+	for (i = 0; i < NTHREAD; i++)
+		JOIN(th[i]);
+
+	n = lockprof_snapshot(st, LOCKPROF_MAX);
+	hot = find(st, n, "hot", "spinlock");
+	cold = find(st, n, "cold", "spinlock");
+	anon = find(st, n, anonName, "spinlock");
+	rd = find(st, n, "table", "rwlock.read");
+	wr = find(st, n, "table", "rwlock.write");
+	assert(hot && cold && anon && rd && wr && "every lock registered");
+
+	assert(hot->acquires == (int64_t)NTHREAD * NOPS + 2 && "hot acquires");
+	assert(cold->acquires == 2 && cold->contended == 0 && "cold acquires");
+	assert(anon->acquires == 1 && "anon acquires");
+	assert(rd->acquires == (int64_t)NTHREAD * NREAD + 1 && "read acquires");
+	assert(wr->acquires == (int64_t)NTHREAD * (NREAD / 1000) + 2 && "write acquires");
+	assert(hot->contended >= 1 && rd->contended >= 1 && "blocked acquires are contended");
+	for (i = 0; i < n; i++)
+	{
+		assert(st[i].contended <= st[i].acquires && "contended <= acquires");
+		assert(histTotal(st[i].wait_hist) == st[i].acquires && "one wait sample per acquire");
+		assert(histTotal(st[i].hold_hist) == st[i].acquires && "one hold sample per release");
+		if (i > 0)
+			assert(st[i - 1].wait >= st[i].wait && "sorted by wait");
+	}
+	/* 被挡住 HOLD_MS 毫秒的锁排在前面, 持有时间的 p99 也看得出来 */
+	assert(strcmp(st[0].name, "hot") == 0 || strcmp(st[0].name, "table") == 0);
+	assert(hot->wait > cold->wait && "hot waited longer");
+	assert(lockprof_quantile(wr->hold_hist, 1.0) > lockprof_quantile(cold->hold_hist, 1.0) && "long write hold");
+	assert(lockprof_quantile(cold->hold_hist, 0.0) >= 1 && "quantile upper bound");
+
+	lockprof_report(stdout);
+	rwlock_destroy(&Table);
+	spinlock_destroy(&Anon);
+	spinlock_destroy(&Cold);
+	spinlock_destroy(&Hot);
+	return 0;
+}
@@ -0,0 +1,134 @@
+#include "mpmcq.h"
+#include "testthread.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+
+/*
+ * 压力测试: 容量很小的队列上 NPRODUCER 个生产者, NCONSUMER 个消费者,
+ * 一半线程用单个接口, 一半用批量接口. 检查每个值恰好收到一次,
+ * 且同一生产者的值按发送顺序到达同一个消费者.
+ */
+
+#define NPRODUCER 4
+#define NCONSUMER 4
+#define NITEM 200000
+#define CAPACITY 8
+
+static struct mpmcq Queue;
+static unsigned char Seen[NPRODUCER * NITEM];
+static atomic_int Received;
+
+/* 值编码为 生产者 * NITEM + 序号 + 1, 0 表示退出 */
+#define ITEM(p, i) ((void *)(uintptr_t)((p) * NITEM + (i) + 1))
+
+THREAD_MAIN(producerMain)
+{
+	int p = (int)(intptr_t)arg;
+	void *batch[5];
+	for (int i = 0; i < NITEM;)
+	{
+		if (p & 1)
+		{
+			int n = 0;
+			while (n < 5 && i < NITEM)
+			{
+				batch[n++] = ITEM(p, i);
+				i++;
+			}
+			assert(mpmcq_push_batch_wait(&Queue, batch, n) == n && "batch push");
+		}
+		else
+		{
+			mpmcq_push_wait(&Queue, ITEM(p, i));
+			i++;
+		}
+	}
+	return 0;
+}
+
+THREAD_MAIN(consumerMain)
+{
+	int c = (int)(intptr_t)arg;
+	int last[NPRODUCER];
+	void *batch[3];
+	memset(last, -1, sizeof(last));
+	for (;;)
+	{
+		int n;
+		if (c & 1)
+			n = mpmcq_pop_batch_wait(&Queue, batch, 3);
+		else
+			n = (batch[0] = mpmcq_pop_wait(&Queue), 1);
+		assert(n >= 1 && n <= 3 && "batch pop");
+		for (int k = 0; k < n; k++)
+		{
+			uintptr_t v = (uintptr_t)batch[k];
+			if (v == 0)
+			{
+				/* 批量取到的其余退出标记留给别的消费者 */
+				while (++k < n)
+					mpmcq_push_wait(&Queue, NULL);
+				return 0;
+			}
+			v--;
+			int p = (int)(v / NITEM), i = (int)(v % NITEM);
+			assert(p < NPRODUCER && "bad value");
+			assert(i > last[p] && "per-producer order");
+			last[p] = i;
+			assert(Seen[v] == 0 && "duplicate value");
+			Seen[v] = 1;
+			atomic_int_fetch_add(&Received, 1, memory_order_relaxed);
+		}
+	}
+}
+
+int main()
+{
+	{
+		struct mpmcq q;
+		void *v, *a[4] = {ITEM(0, 0), ITEM(0, 1), ITEM(0, 2), ITEM(0, 3)}, *b[4];
+		assert(mpmcq_init(&q, 3) == 0 && mpmcq_capacity(&q) == 4 && "capacity rounds up");
+		assert(mpmcq_pop(&q, &v) == 1 && "empty pop");
+		assert(mpmcq_push_batch(&q, a, 3) == 3 && "batch push");
+		assert(mpmcq_push_batch(&q, a + 3, 4) == 1 && "batch push stops when full");
+		assert(mpmcq_push(&q, a[0]) == 1 && "full push");
+		assert(mpmcq_size(&q) == 4 && "size");
+		assert(mpmcq_pop(&q, &v) == 0 && v == a[0] && "fifo");
+		assert(mpmcq_pop_batch(&q, b, 8) == 3 && b[0] == a[1] && b[2] == a[3] && "batch pop");
+		assert(mpmcq_pop_batch(&q, b, 8) == 0 && "empty batch pop");
+		/* 位置越过多轮后序号仍然正确 */
+		for (int i = 0; i < 100; i++)
+		{
+			assert(mpmcq_push(&q, a[i & 3]) == 0 && mpmcq_pop(&q, &v) == 0 && v == a[i & 3] && "wrap");
+		}
+		mpmcq_destroy(&q);
+	}
+	{
+		thread_t th[NPRODUCER + NCONSUMER];
+		int i;
+		mpmcq_init(&Queue, CAPACITY);
+		for (i = 0; i < NPRODUCER + NCONSUMER; i++)
+		{
+			intptr_t id = i < NPRODUCER ? i : i - NPRODUCER;
+			START(th[i], i < NPRODUCER ? producerMain : consumerMain, id);
+		}
+		for (i = 0; i < NPRODUCER + NCONSUMER; i++)
+		{
+			if (i == NPRODUCER)
+			{
+				for (int k = 0; k < NCONSUMER; k++)
+					mpmcq_push_wait(&Queue, NULL);
+			}
+			JOIN(th[i]);
+		}
+		assert(atomic_int_load(&Received) == NPRODUCER * NITEM && "lost values");
+		for (i = 0; i < NPRODUCER * NITEM; i++)
+			assert(Seen[i] && "value never received");
+		mpmcq_destroy(&Queue);
+		printf("mpmcq: %d values through a %d-slot queue\n", NPRODUCER * NITEM, CAPACITY);
+	}
+	return 0;
+}
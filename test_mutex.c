@@ -0,0 +1,172 @@
+#include "mutex.h"
+#include "testthread.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+
+/*
+ * 压力测试:
+ *   mutex      多个线程在锁里累加非原子计数器, 结果不能少
+ *   cond       容量很小的有界缓冲, 多个生产者消费者, 收到的总和一致
+ *   event      多个线程等同一个事件, set 后全部返回
+ *   semaphore  同时在临界区里的线程数不超过初值
+ * 以及各种 try 和超时的返回值.
+ */
+
+#define NTHREAD 4
+#define NOPS 200000
+#define NITEM 100000
+#define CAPACITY 4
+#define PERMITS 2
+
+static struct mutex Lock;
+static struct cond NotEmpty, NotFull;
+static struct event Event;
+static struct semaphore Sem;
+/* 锁保护的普通变量不加 static: GCC 的 TSan 构建会把 static 变量的读缓存到原子操作之外 */
+int64_t Counter;
+int Buffer[CAPACITY];
+int Head, Count;
+static atomic_int Active;
+static atomic_int Woken;
+
+THREAD_MAIN(counterMain)
+{
+	(void)arg;
+	for (int i = 0; i < NOPS; i++)
+	{
+		mutex_acquire(&Lock);
+		Counter++;
+		mutex_release(&Lock);
+	}
+	return 0;
+}
+
+THREAD_MAIN(producerMain)
+{
+	int id = (int)(intptr_t)arg;
+	for (int i = 0; i < NITEM; i++)
+	{
+		mutex_acquire(&Lock);
+		while (Count == CAPACITY)
+			cond_wait(&NotFull, &Lock);
+		Buffer[(Head + Count) % CAPACITY] = id * NITEM + i;
+		Count++;
+		mutex_release(&Lock);
+		cond_signal(&NotEmpty);
+	}
+	return 0;
+}
+
+THREAD_MAIN(consumerMain)
+{
+	int64_t *sum = (int64_t *)arg;
+	for (int i = 0; i < NITEM; i++)
+	{
+		mutex_acquire(&Lock);
+		while (Count == 0)
+			cond_wait(&NotEmpty, &Lock);
+		*sum += Buffer[Head];
+		Head = (Head + 1) % CAPACITY;
+		Count--;
+		mutex_release(&Lock);
+		cond_signal(&NotFull);
+	}
+	return 0;
+}
+
+THREAD_MAIN(eventMain)
+{
+	(void)arg;
+	event_wait(&Event);
+	assert(event_is_set(&Event) && "woken after set");
+	atomic_int_inc(&Woken);
+	return 0;
+}
+
+THREAD_MAIN(semaphoreMain)
+{
+	(void)arg;
+	for (int i = 0; i < NOPS / 10; i++)
+	{
+		semaphore_wait(&Sem);
+		assert(atomic_int_inc(&Active) <= PERMITS && "too many permits");
+		atomic_int_dec(&Active);
+		semaphore_post(&Sem, 1);
+	}
+	return 0;
+}
+
+int main()
+{
+	thread_t th[2 * NTHREAD];
+	int64_t sums[NTHREAD], total = 0;
+	int i;
+
+	mutex_init(&Lock);
+	cond_init(&NotEmpty);
+	cond_init(&NotFull);
+	event_init(&Event);
+	semaphore_init(&Sem, PERMITS);
+
+	/* try 和超时 */
+	assert(mutex_try(&Lock) == 0 && "try free lock");
+	assert(mutex_try(&Lock) == 1 && "try held lock");
+	assert(cond_timedwait(&NotEmpty, &Lock, 10) == 1 && "cond timeout");
+	mutex_release(&Lock);
+	assert(event_timedwait(&Event, 10) == 1 && "event timeout");
+	assert(semaphore_try(&Sem) == 0 && semaphore_try(&Sem) == 0 && "take permits");
+	assert(semaphore_try(&Sem) == 1 && "no permit left");
+	assert(semaphore_timedwait(&Sem, 10) == 1 && "semaphore timeout");
+	semaphore_post(&Sem, 2);
+
+	/* mutex */
+	for (i = 0; i < NTHREAD; i++)
+		START(th[i], counterMain, 0);
+	for (i = 0; i < NTHREAD; i++)
+		JOIN(th[i]);
+	assert(Counter == (int64_t)NTHREAD * NOPS && "lost updates");
+	assert(atomic_int_load(&Lock.state) == MUTEX_UNLOCKED && "unlocked at rest");
+
+	/* cond */
+	memset(sums, 0, sizeof(sums));
+	for (i = 0; i < NTHREAD; i++)
+	{
+		START(th[i], producerMain, i);
+		START(th[NTHREAD + i], consumerMain, &sums[i]);
+	}
+	for (i = 0; i < 2 * NTHREAD; i++)
+		JOIN(th[i]);
+	for (i = 0; i < NTHREAD; i++)
+		total += sums[i];
+	assert(Count == 0 && "buffer drained");
+	assert(total == (int64_t)NTHREAD * NITEM * (NTHREAD * NITEM - 1) / 2 && "every item consumed once");
+
+	/* event */
+	for (i = 0; i < NTHREAD; i++)
+		START(th[i], eventMain, 0);
+	SLEEP_MS(20);
+	assert(atomic_int_load(&Woken) == 0 && "waiters blocked before set");
+	event_set(&Event);
+	for (i = 0; i < NTHREAD; i++)
+		JOIN(th[i]);
+	assert(atomic_int_load(&Woken) == NTHREAD && "all waiters woken");
+	assert(event_wait(&Event) == 0 && event_timedwait(&Event, 0) == 0 && "set event stays set");
+
+	/* semaphore */
+	for (i = 0; i < NTHREAD; i++)
+		START(th[i], semaphoreMain, 0);
+	for (i = 0; i < NTHREAD; i++)
+		JOIN(th[i]);
+	assert(atomic_int_load(&Sem.count) == PERMITS && "permits returned");
+
+	printf("mutex: %lld increments, %lld items\n", (long long)Counter, (long long)NTHREAD * NITEM);
+	semaphore_destroy(&Sem);
+	event_destroy(&Event);
+	cond_destroy(&NotFull);
+	cond_destroy(&NotEmpty);
+	mutex_destroy(&Lock);
+	return 0;
+}
@@ -0,0 +1,211 @@
+#include "rcu.h"
+#include "testthread.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+
+/*
+ * 压力测试:
+ *   宽限期  普通线程和 QSBR 线程各停在读临界区里一段时间, rcu_synchronize 必须等到它们离开
+ *   替换    普通读者和 QSBR 读者不停读共享配置, 写者不停替换, 旧版本交给 rcu_call,
+ *           每隔一段改用 rcu_synchronize 后直接释放. 配置的两个字段必须一致,
+ *           每个读者看到的版本号不减. 释放前把 magic 改掉, 读到已释放的配置时断言失败 (配合 ASan 更可靠).
+ *           QSBR 读者时不时下线睡眠再上线.
+ * 线程退出后 rcu_barrier, 检查除当前版本外全部释放, 统计数字一致.
+ */
+
+#define NREADER 3
+#define NQSBR 3
+#define RUN_MS 300
+#define HOLD_MS 30
+#define LIVE 0x11ee
+#define DEAD 0xdead
+
+typedef struct config config;
+struct config
+{
+	struct rcu_head rcu; /* 必须是第一个成员 */
+	int magic;
+	int64_t a;
+	int64_t b;
+};
+
+static atomic_ptr Config;
+static atomic_int Stop;
+static atomic_int Entered;
+static atomic_int Left;
+static atomic_int64 Allocated;
+static atomic_int64 Freed;
+static atomic_int64 Reads;
+static atomic_int64 Updates;
+
+static config *newConfig(int64_t version)
+{
+	config *c = (config *)malloc(sizeof(config));
+	c->magic = LIVE;
+	c->a = c->b = version;
+	atomic_int64_fetch_add(&Allocated, 1, memory_order_relaxed);
+	return c;
+}
+
+static void freeConfig(struct rcu_head *head)
+{
+	config *c = (config *)head;
+	assert(c->magic == LIVE && "double free");
+	c->magic = DEAD;
+	free(c);
+	atomic_int64_fetch_add(&Freed, 1, memory_order_relaxed);
+}
+
+/* 读一次配置, 返回版本号 */
+static int64_t readConfig(int64_t last)
+{
+	config *c = (config *)rcu_dereference(&Config);
+	assert(c->magic == LIVE && "read after free");
+	assert(c->a == c->b && "torn config");
+	assert(c->a >= last && "version went back");
+	return c->a;
+}
+
+THREAD_MAIN(holdMain)
+{
+	int qsbr = (int)(intptr_t)arg;
+	if (qsbr)
+		rcu_register_thread();
+	else
+		rcu_read_lock();
+	atomic_int_store(&Entered, 1);
+	SLEEP_MS(HOLD_MS);
+	atomic_int_store(&Left, 1);
+	if (qsbr)
+	{
+		rcu_quiescent_state();
+		rcu_unregister_thread();
+	}
+	else
+	{
+		rcu_read_unlock();
+	}
+	return 0;
+}
+
+THREAD_MAIN(readerMain)
+{
+	int64_t last = 0, n = 0;
+	(void)arg;
+	while (!atomic_int_load_explicit(&Stop, memory_order_relaxed))
+	{
+		rcu_read_lock();
+		rcu_read_lock();
+		last = readConfig(last);
+		rcu_read_unlock();
+		last = readConfig(last);
+		rcu_read_unlock();
+		n++;
+	}
+	atomic_int64_fetch_add(&Reads, n, memory_order_relaxed);
+	return 0;
+}
+
+THREAD_MAIN(qsbrMain)
+{
+	int64_t last = 0, n = 0;
+	(void)arg;
+	rcu_register_thread();
+	while (!atomic_int_load_explicit(&Stop, memory_order_relaxed))
+	{
+		rcu_read_lock();
+		last = readConfig(last);
+		rcu_read_unlock();
+		if (++n % 16 == 0)
+			rcu_quiescent_state();
+		if (n % 20000 == 0)
+		{
+			rcu_thread_offline();
+			SLEEP_MS(1);
+			rcu_thread_online();
+		}
+	}
+	atomic_int64_fetch_add(&Reads, n, memory_order_relaxed);
+	rcu_unregister_thread();
+	return 0;
+}
+
+/* 每 100 个版本有一个用 rcu_synchronize 后直接释放 */
+THREAD_MAIN(writerMain)
+{
+	int64_t version = 0;
+	(void)arg;
+	while (!atomic_int_load_explicit(&Stop, memory_order_relaxed))
+	{
+		for (int k = 0; k < 10; k++)
+		{
+			config *old = (config *)atomic_ptr_exchange(&Config, newConfig(++version));
+			if (version % 100 == 0)
+			{
+				rcu_synchronize();
+				freeConfig(&old->rcu);
+			}
+			else
+			{
+				rcu_call(&old->rcu, freeConfig);
+			}
+		}
+		SLEEP_MS(1);
+	}
+	atomic_int64_store(&Updates, version);
+	return 0;
+}
+
+static void holdPhase(int qsbr)
+{
+	thread_t th;
+	struct rcu_stats st;
+	atomic_int_store(&Entered, 0);
+	atomic_int_store(&Left, 0);
+	START(th, holdMain, qsbr);
+	while (!atomic_int_load(&Entered))
+		SLEEP_MS(1);
+	rcu_stats(&st);
+	assert(st.qsbr == qsbr && "qsbr thread counted");
+	rcu_synchronize();
+	assert(atomic_int_load(&Left) && "grace period waited for the reader");
+	JOIN(th);
+}
+
+int main()
+{
+	thread_t th[NREADER + NQSBR], writer;
+	struct rcu_stats st;
+	int i;
+
+	atomic_ptr_init(&Config, newConfig(0));
+
+	holdPhase(0);
+	holdPhase(1);
+
+	for (i = 0; i < NREADER; i++)
+		START(th[i], readerMain, 0);
+	for (i = 0; i < NQSBR; i++)
+		START(th[NREADER + i], qsbrMain, 0);
+	START(writer, writerMain, 0);
+	SLEEP_MS(RUN_MS);
+	atomic_int_store(&Stop, 1);
+	JOIN(writer);
+	for (i = 0; i < NREADER + NQSBR; i++)
+		JOIN(th[i]);
+
+	rcu_barrier();
+	rcu_stats(&st);
+	assert(st.pending == 0 && st.retired == st.freed && "all callbacks ran");
+	assert(st.qsbr == 0 && "qsbr threads unregistered");
+	assert(atomic_int64_load(&Allocated) - atomic_int64_load(&Freed) == 1 && "only the current config is live");
+	assert(atomic_int64_load(&Reads) > 0 && "readers ran");
+
+	printf("rcu: %lld updates, %lld reads, %lld grace periods\n", (long long)atomic_int64_load(&Updates),
+	       (long long)atomic_int64_load(&Reads), (long long)st.gp);
+	freeConfig((struct rcu_head *)atomic_ptr_load(&Config));
+	return 0;
+}
@@ -0,0 +1,129 @@
+#include "seqlock.h"
+#include "testthread.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+
+/*
+ * 压力测试: 两个写者不停写入各字段相同的记录(最后一个字段是校验和),
+ * 多个读者检查读到的每条记录都完整, 且版本号单调不减.
+ */
+
+#define NREADER 4
+#define NWRITER 2
+#define NFIELD 7
+#define RUN_MS 500
+
+typedef struct record record;
+struct record
+{
+	uint64_t version;
+	uint32_t field[NFIELD];
+	uint32_t check;
+};
+
+SEQLOCK_DEFINE(seq_record, record)
+
+typedef struct config config;
+struct config
+{
+	uint16_t a;
+	uint8_t b;
+};
+
+SEQLOCK_DEFINE(seq_config, config)
+
+static struct seq_record Shared;
+static atomic_int64 Version;
+static atomic_int Stop;
+static uint64_t Reads[NREADER];
+
+static uint32_t checksum(const record *r)
+{
+	uint32_t h = (uint32_t)r->version;
+	for (int i = 0; i < NFIELD; i++)
+		h = h * 31 + r->field[i];
+	return h;
+}
+
+THREAD_MAIN(writerMain)
+{
+	(void)arg;
+	while (!atomic_int_load_explicit(&Stop, memory_order_relaxed))
+	{
+		record r;
+		memset(&r, 0, sizeof(r));
+		/* 版本号在写锁内取, 多个写者写入的版本号也是单调的 */
+		seqlock_write_begin(&Shared.lock);
+		r.version = (uint64_t)atomic_int64_fetch_add(&Version, 1, memory_order_relaxed) + 1;
+		for (int i = 0; i < NFIELD; i++)
+			r.field[i] = (uint32_t)r.version * 2654435761u;
+		r.check = checksum(&r);
+		seqlock_store(Shared.data, &r, sizeof(r));
+		seqlock_write_end(&Shared.lock);
+	}
+	return 0;
+}
+
+THREAD_MAIN(readerMain)
+{
+	uint64_t *pReads = (uint64_t *)arg, n = 0, last = 0;
+	while (!atomic_int_load_explicit(&Stop, memory_order_relaxed))
+	{
+		record r;
+		seq_record_read(&Shared, &r);
+		for (int i = 0; i < NFIELD; i++)
+			assert(r.field[i] == (uint32_t)r.version * 2654435761u && "torn field");
+		assert(r.check == checksum(&r) && "torn checksum");
+		assert(r.version >= last && "version went backwards");
+		last = r.version;
+		n++;
+	}
+	*pReads = n;
+	return 0;
+}
+
+int main()
+{
+	{
+		struct seq_config c;
+		config v = {7, 3}, out;
+		seq_config_init(&c, &v);
+		seq_config_read(&c, &out);
+		assert(out.a == 7 && out.b == 3 && "read initial value");
+		v.a = 65535;
+		seq_config_write(&c, &v);
+		seq_config_read(&c, &out);
+		assert(out.a == 65535 && out.b == 3 && "read written value");
+		assert(atomic_int_load(&c.lock.seq) == 2 && "sequence even after write");
+	}
+	{
+		record r;
+		thread_t th[NREADER + NWRITER];
+		uint64_t total = 0;
+		memset(&r, 0, sizeof(r));
+		seq_record_init(&Shared, &r);
+		for (int i = 0; i < NREADER + NWRITER; i++)
+		{
+			if (i < NREADER)
+				START(th[i], readerMain, &Reads[i]);
+			else
+				START(th[i], writerMain, NULL);
+		}
+		SLEEP_MS(RUN_MS);
+		atomic_int_store(&Stop, 1);
+		for (int i = 0; i < NREADER + NWRITER; i++)
+		{
+			JOIN(th[i]);
+		}
+		for (int i = 0; i < NREADER; i++)
+			total += Reads[i];
+		seq_record_read(&Shared, &r);
+		assert(r.version == (uint64_t)atomic_int64_load(&Version) && "last write visible");
+		printf("seqlock: %llu reads, %llu writes, no torn values\n", (unsigned long long)total,
+			   (unsigned long long)r.version);
+	}
+	return 0;
+}
@@ -0,0 +1,190 @@
+#include "smr.h"
+#include "testthread.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+
+/*
+ * 压力测试:
+ *   危险指针: 多个线程在 Treiber 栈上 push/pop, 弹出的节点立即 retire.
+ *   纪元: 多个读者在临界区里反复读共享配置, 一个写者不停替换并 retire 旧配置.
+ * 危险指针阶段检查待回收节点数有上界; 纪元方式在读者被换出时会积压, 不检查.
+ * 节点释放前把 magic 改掉, 读到已释放的节点时断言失败 (配合 ASan 更可靠).
+ * 线程退出后 smr_flush, 检查全部节点都已释放, 统计数字一致.
+ */
+
+#define NTHREAD 4
+#define NOPS 200000
+#define RUN_MS 300
+#define LIVE 0x11ee
+#define DEAD 0xdead
+
+typedef struct node node;
+struct node
+{
+	struct smr_node smr; /* 必须是第一个成员 */
+	atomic_ptr next;
+	int magic;
+	int value;
+};
+
+static atomic_ptr Top;
+static atomic_ptr Config;
+static atomic_int Stop;
+static atomic_int64 Allocated;
+static atomic_int64 Freed;
+
+static node *newNode(int value)
+{
+	node *n = (node *)malloc(sizeof(node));
+	atomic_ptr_init(&n->next, NULL);
+	n->magic = LIVE;
+	n->value = value;
+	atomic_int64_fetch_add(&Allocated, 1, memory_order_relaxed);
+	return n;
+}
+
+static void freeNode(struct smr_node *p)
+{
+	node *n = (node *)p;
+	assert(n->magic == LIVE && "double free");
+	n->magic = DEAD;
+	free(n);
+	atomic_int64_fetch_add(&Freed, 1, memory_order_relaxed);
+}
+
+static void push(node *n)
+{
+	void *top = atomic_ptr_load(&Top);
+	do
+	{
+		atomic_ptr_store_explicit(&n->next, top, memory_order_relaxed);
+	} while (!atomic_ptr_cmpxchg_weak(&Top, &top, n, memory_order_release));
+}
+
+static node *pop(void)
+{
+	for (;;)
+	{
+		node *top = (node *)smr_hp_protect(0, &Top);
+		if (top == NULL)
+			return NULL;
+		assert(top->magic == LIVE && "protected node freed");
+		if (atomic_ptr_cas(&Top, top, atomic_ptr_load(&top->next)))
+		{
+			smr_hp_clear(0);
+			return top;
+		}
+	}
+}
+
+THREAD_MAIN(stackMain)
+{
+	int id = (int)(intptr_t)arg;
+	for (int i = 0; i < NOPS; i++)
+	{
+		node *n;
+		push(newNode(id * NOPS + i));
+		if ((n = pop()) != NULL)
+			smr_hp_retire(&n->smr, freeNode);
+		if (i % 4096 == 0)
+		{
+			/* 每个线程待回收的节点不超过一批加上所有槽位数 */
+			struct smr_stats st;
+			smr_stats(&st);
+			assert(st.pending <= (NTHREAD + 1) * (SMR_BATCH + 64) && "hazard garbage bounded");
+		}
+	}
+	return 0;
+}
+
+THREAD_MAIN(readerMain)
+{
+	int64_t *pReads = (int64_t *)arg, n = 0;
+	while (!atomic_int_load_explicit(&Stop, memory_order_relaxed))
+	{
+		smr_epoch_enter();
+		for (int i = 0; i < 16; i++)
+		{
+			node *c = (node *)atomic_ptr_load_explicit(&Config, memory_order_acquire);
+			smr_epoch_enter(); /* 嵌套 */
+			assert(c->magic == LIVE && "config freed under reader");
+			smr_epoch_exit();
+			n += c->value >= 0;
+		}
+		smr_epoch_exit();
+	}
+	*pReads = n;
+	return 0;
+}
+
+THREAD_MAIN(writerMain)
+{
+	int v = 0;
+	(void)arg;
+	while (!atomic_int_load_explicit(&Stop, memory_order_relaxed))
+	{
+		node *old = (node *)atomic_ptr_exchange(&Config, newNode(++v));
+		smr_epoch_retire(&old->smr, freeNode);
+	}
+	return 0;
+}
+
+int main()
+{
+	thread_t th[NTHREAD + 1];
+	int64_t reads[NTHREAD];
+	struct smr_stats st;
+	node *n;
+	int i;
+
+	/* 单线程: 被保护的节点不释放, 清除后释放 */
+	{
+		node *a = newNode(1);
+		atomic_ptr_init(&Top, a);
+		assert(smr_hp_protect(1, &Top) == a && "protect");
+		atomic_ptr_store(&Top, NULL);
+		smr_hp_retire(&a->smr, freeNode);
+		smr_flush();
+		assert(a->magic == LIVE && "protected node kept");
+		smr_stats(&st);
+		assert(st.retired == 1 && st.pending == 1 && st.threads == 1 && "stats pending");
+		smr_hp_clear(1);
+		smr_flush();
+		smr_stats(&st);
+		assert(st.pending == 0 && atomic_int64_load(&Freed) == 1 && "freed after clear");
+	}
+
+	/* 危险指针 */
+	for (i = 0; i < NTHREAD; i++)
+		START(th[i], stackMain, i);
+	for (i = 0; i < NTHREAD; i++)
+		JOIN(th[i]);
+	while ((n = pop()) != NULL)
+		smr_hp_retire(&n->smr, freeNode);
+
+	/* 纪元 */
+	atomic_ptr_store(&Config, newNode(0));
+	for (i = 0; i < NTHREAD; i++)
+		START(th[i], readerMain, &reads[i]);
+	START(th[NTHREAD], writerMain, 0);
+	SLEEP_MS(RUN_MS);
+	atomic_int_store(&Stop, 1);
+	for (i = 0; i <= NTHREAD; i++)
+		JOIN(th[i]);
+	n = (node *)atomic_ptr_exchange(&Config, NULL);
+	smr_epoch_retire(&n->smr, freeNode);
+
+	/* 退出的线程留下的节点由这里回收 */
+	smr_flush();
+	smr_stats(&st);
+	printf("smr: retired %lld, freed %lld, pending %lld, scans %lld, epoch %lld\n", (long long)st.retired,
+		   (long long)st.freed, (long long)st.pending, (long long)st.scans, (long long)st.epoch);
+	assert(st.threads == 1 && "exited threads unregistered");
+	assert(st.pending == 0 && "all garbage reclaimed");
+	assert(st.retired == atomic_int64_load(&Allocated) && "every node retired");
+	assert(atomic_int64_load(&Freed) == atomic_int64_load(&Allocated) && "every node freed");
+	return 0;
+}
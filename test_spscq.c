@@ -0,0 +1,111 @@
+#include "spscq.h"
+#include "testthread.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+
+/*
+ * 压力测试: 1024 字节的队列上传 NRECORD 条变长记录 (0 到 MAXLEN 字节),
+ * 内容由序号决定, 消费者逐字节检查并每隔几条才归还一次空间, 覆盖回绕和写满.
+ */
+
+#define NRECORD 1000000
+#define MAXLEN 300
+#define CAPACITY 1024
+
+static struct spscq Queue;
+
+static size_t recordLen(uint32_t i)
+{
+	return (i * 2654435761u >> 7) % (MAXLEN + 1);
+}
+
+static unsigned char recordByte(uint32_t i, size_t k)
+{
+	return (unsigned char)(i * 31 + k);
+}
+
+THREAD_MAIN(producerMain)
+{
+	(void)arg;
+	for (uint32_t i = 0; i < NRECORD; i++)
+	{
+		size_t len = recordLen(i), reserve = len < 4 ? 4 : len;
+		unsigned char *p;
+		while ((p = (unsigned char *)spscq_reserve(&Queue, reserve)) == NULL)
+			YIELD();
+		assert(((uintptr_t)p & 7) == 0 && "record aligned");
+		for (size_t k = 0; k < len; k++)
+			p[k] = recordByte(i, k);
+		spscq_commit(&Queue, len);
+	}
+	return 0;
+}
+
+int main()
+{
+	{
+		struct spscq q;
+		const void *p;
+		size_t len;
+		char buf[100];
+		assert(spscq_init(&q, 100) == 0 && spscq_max_record(&q) == 56 && "capacity rounds up");
+		assert(spscq_peek(&q, &len) == NULL && "empty peek");
+		assert(spscq_reserve(&q, 57) == NULL && "record too large");
+		memset(buf, 'a', sizeof(buf));
+		assert(spscq_push(&q, buf, 40) == 0 && "push");
+		assert(spscq_push(&q, buf, 40) == 0 && "push");
+		assert(spscq_push(&q, buf, 40) == 1 && "push when full");
+		/* reserve 的空间可以只提交一部分 */
+		p = spscq_peek(&q, &len);
+		assert(p && len == 40 && memcmp(p, buf, 40) == 0 && "peek");
+		spscq_release(&q);
+		char *w = (char *)spscq_reserve(&q, 24);
+		assert(w && "reserve after release");
+		memcpy(w, "xyz", 3);
+		spscq_commit(&q, 3);
+		/* peek 不归还, 第二条之后才 release */
+		assert(spscq_peek(&q, &len) && len == 40 && "second record");
+		p = spscq_peek(&q, &len);
+		assert(p && len == 3 && memcmp(p, "xyz", 3) == 0 && "short commit");
+		assert(spscq_peek(&q, &len) == NULL && "drained");
+		/* 写位置在 112, 64 字节的记录要回绕到开头, 要用到 peek 过但没有归还的空间 */
+		assert(spscq_push(&q, buf, 56) == 1 && "space not released yet");
+		spscq_release(&q);
+		assert(spscq_push(&q, buf, 56) == 0 && "push wraps");
+		p = spscq_peek(&q, &len);
+		assert(p == (const void *)(q.buf + 8) && len == 56 && "wrapped record at start");
+		spscq_release(&q);
+		spscq_destroy(&q);
+	}
+	{
+		thread_t th;
+		uint32_t i = 0;
+		size_t len;
+		spscq_init(&Queue, CAPACITY);
+		START(th, producerMain, NULL);
+		while (i < NRECORD)
+		{
+			const unsigned char *p;
+			int n = 0;
+			while (n < 3 && (p = (const unsigned char *)spscq_peek(&Queue, &len)) != NULL)
+			{
+				assert(len == recordLen(i) && "record length");
+				for (size_t k = 0; k < len; k++)
+					assert(p[k] == recordByte(i, k) && "record content");
+				i++, n++;
+			}
+			if (n)
+				spscq_release(&Queue);
+			else
+				YIELD();
+		}
+		JOIN(th);
+		assert(spscq_peek(&Queue, &len) == NULL && "no extra records");
+		spscq_destroy(&Queue);
+		printf("spscq: %d records through a %d-byte ring\n", NRECORD, CAPACITY);
+	}
+	return 0;
+}
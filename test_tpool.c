@@ -0,0 +1,188 @@
+#include "tpool.h"
+#include "testthread.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+
+/*
+ * 线程池测试:
+ *   fork/join 递归计算斐波那契数, 和串行结果比较
+ *   parallel_for 的每个下标恰好执行一次, 包括嵌套在任务里的 parallel_for
+ *   多个外部线程同时提交和等待, 带亲和提示的任务也都执行
+ *   一个任务派生超过队列容量的子任务, 队列满时直接执行
+ *   工作线程都睡眠之后提交的任务能唤醒它们
+ * 最后检查统计数字.
+ */
+
+#define NTHREAD 4
+#define NSUBMIT 2000
+#define NFORK (TPOOL_DEQUE * 3)
+#define RANGE (1 << 20)
+
+static struct tpool *Pool;
+static atomic_int64 Counter;
+
+typedef struct fib fib;
+struct fib
+{
+	struct tpool_task task;
+	int n;
+	int64_t result;
+};
+
+static int64_t fibSerial(int n)
+{
+	return n < 2 ? n : fibSerial(n - 1) + fibSerial(n - 2);
+}
+
+static void fibTask(void *arg)
+{
+	fib *f = (fib *)arg, a, b;
+	assert(tpool_current(Pool) >= 0 && "tasks run on workers");
+	if (f->n < 2)
+	{
+		f->result = f->n;
+		return;
+	}
+	a.n = f->n - 1;
+	b.n = f->n - 2;
+	tpool_task_init(&a.task, fibTask, &a);
+	tpool_fork(Pool, &a.task);
+	fibTask(&b);
+	tpool_join(Pool, &a.task);
+	f->result = a.result + b.result;
+}
+
+static void markRange(int64_t begin, int64_t end, void *arg)
+{
+	unsigned char *seen = (unsigned char *)arg;
+	for (int64_t i = begin; i < end; i++)
+		seen[i]++;
+}
+
+static void countTask(void *arg)
+{
+	int *where = (int *)arg;
+	*where = tpool_current(Pool);
+	atomic_int64_fetch_add(&Counter, 1, memory_order_relaxed);
+}
+
+static void nestedTask(void *arg)
+{
+	tpool_parallel_for(Pool, 0, RANGE / 4, 100, markRange, arg);
+}
+
+static void wideTask(void *arg)
+{
+	struct tpool_task *children = (struct tpool_task *)malloc(NFORK * sizeof(struct tpool_task));
+	int *where = (int *)malloc(NFORK * sizeof(int));
+	int i;
+	(void)arg;
+	for (i = 0; i < NFORK; i++)
+	{
+		tpool_task_init(&children[i], countTask, &where[i]);
+		tpool_fork(Pool, &children[i]);
+	}
+	for (i = 0; i < NFORK; i++)
+		tpool_join(Pool, &children[i]);
+	for (i = 0; i < NFORK; i++)
+		assert(where[i] >= 0 && where[i] < NTHREAD && "child ran on a worker");
+	free(where);
+	free(children);
+}
+
+THREAD_MAIN(submitMain)
+{
+	struct tpool_task *tasks = (struct tpool_task *)malloc(NSUBMIT * sizeof(struct tpool_task));
+	int *where = (int *)malloc(NSUBMIT * sizeof(int));
+	int affinity = arg != NULL, i;
+	for (i = 0; i < NSUBMIT; i++)
+	{
+		tpool_task_init(&tasks[i], countTask, &where[i]);
+		if (affinity)
+			tpool_submit_to(Pool, i, &tasks[i]);
+		else
+			tpool_submit(Pool, &tasks[i]);
+	}
+	for (i = 0; i < NSUBMIT; i++)
+	{
+		tpool_join(Pool, &tasks[i]);
+		assert(tpool_task_done(&tasks[i]) && "joined task done");
+		assert(where[i] >= 0 && where[i] < NTHREAD && "submitted task ran on a worker");
+	}
+	free(where);
+	free(tasks);
+	return 0;
+}
+
+int main()
+{
+	unsigned char *seen = (unsigned char *)calloc(RANGE, 1);
+	struct tpool_stats st;
+	struct tpool_task task;
+	fib f;
+	int i;
+
+	Pool = tpool_create(NTHREAD);
+	assert(Pool && tpool_size(Pool) == NTHREAD && "create");
+	assert(tpool_current(Pool) == -1 && "main is not a worker");
+
+	/* fork/join */
+	f.n = 22;
+	tpool_task_init(&f.task, fibTask, &f);
+	tpool_submit(Pool, &f.task);
+	tpool_join(Pool, &f.task);
+	assert(f.result == fibSerial(22) && "fib");
+
+	/* parallel_for, 自动和固定粒度 */
+	tpool_parallel_for(Pool, 0, RANGE, 0, markRange, seen);
+	tpool_parallel_for(Pool, 0, RANGE, 7, markRange, seen);
+	tpool_parallel_for(Pool, 5, 5, 1, markRange, seen);
+	tpool_task_init(&task, nestedTask, seen);
+	tpool_submit(Pool, &task);
+	tpool_join(Pool, &task);
+	for (i = 0; i < RANGE; i++)
+		assert(seen[i] == (i < RANGE / 4 ? 3 : 2) && "each index exactly once per loop");
+
+	/* 外部线程提交 */
+	{
+		thread_t th[3];
+		for (i = 0; i < 3; i++)
+			START(th[i], submitMain, i == 2);
+		for (i = 0; i < 3; i++)
+			JOIN(th[i]);
+	}
+	assert(atomic_int64_load(&Counter) == 3 * NSUBMIT && "every submitted task ran");
+
+	/* 队列溢出 */
+	tpool_task_init(&task, wideTask, NULL);
+	tpool_submit(Pool, &task);
+	tpool_join(Pool, &task);
+	assert(atomic_int64_load(&Counter) == 3 * NSUBMIT + NFORK && "every forked task ran");
+
+	/* 等工作线程睡眠 */
+	for (i = 0; i < 100; i++)
+	{
+		tpool_stats(Pool, &st);
+		if (st.parked >= NTHREAD)
+			break;
+		SLEEP_MS(10);
+	}
+	tpool_task_init(&task, countTask, &i);
+	tpool_submit(Pool, &task);
+	tpool_join(Pool, &task);
+	assert(atomic_int64_load(&Counter) == 3 * NSUBMIT + NFORK + 1 && "parked workers woken");
+
+	tpool_stats(Pool, &st);
+	printf("tpool: executed %lld, stolen %lld, submitted %lld, parked %lld\n", (long long)st.executed,
+		   (long long)st.stolen, (long long)st.submitted, (long long)st.parked);
+	assert(st.threads == NTHREAD && "stats threads");
+	assert(st.submitted == 3 * NSUBMIT + 6 && "stats submitted");
+	assert(st.parked >= NTHREAD && "workers parked");
+	assert(st.executed >= st.submitted + NFORK && "stats executed");
+	tpool_destroy(Pool);
+	free(seen);
+	return 0;
+}
@@ -0,0 +1,53 @@
+#ifndef TESTTHREAD_H
+#define TESTTHREAD_H
+
+/*
+ * 测试和基准程序共用的线程封装, Win32 和 pthread 写法相同:
+ *   THREAD_MAIN(name)   定义线程函数, 参数叫 arg, 函数体 return 0 结束
+ *   thread_t            线程句柄
+ *   START(th, fn, arg)  启动线程, arg 可以是指针或整数, 失败时返回值为 0 (Win32) 或非 0 (pthread)
+ *   JOIN(th)            等线程结束并释放句柄
+ *   SLEEP_MS(ms)        睡眠毫秒
+ *   YIELD()             让出 CPU
+ *   cpu_count()         在线的 CPU 数
+ * 只给测试和基准程序用, 库代码不要包含.
+ */
+
+#include <stdint.h>
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+#define THREAD_MAIN(name) static DWORD WINAPI name(LPVOID arg)
+typedef HANDLE thread_t;
+#define START(th, fn, arg) ((th) = CreateThread(NULL, 0, fn, (LPVOID)(intptr_t)(arg), 0, NULL))
+#define JOIN(th) (WaitForSingleObject(th, INFINITE), CloseHandle(th))
+#define SLEEP_MS(ms) Sleep(ms)
+#define YIELD() SwitchToThread()
+#else
+#define THREAD_MAIN(name) static void *name(void *arg)
+typedef pthread_t thread_t;
+#define START(th, fn, arg) pthread_create(&(th), NULL, fn, (void *)(intptr_t)(arg))
+#define JOIN(th) pthread_join(th, NULL)
+#define SLEEP_MS(ms) usleep((ms) * 1000)
+#define YIELD() sched_yield()
+#endif
+
+static inline int
+cpu_count(void) {
+#ifdef _WIN32
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    return (int)si.dwNumberOfProcessors;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+#endif
+}
+
+#endif // TESTTHREAD_H
@@ -0,0 +1,122 @@
+#include "threadreg.h"
+#include <stdlib.h>
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+/*
+** Each registry owns one thread-exit key, created by the first thread
+** that claims a record.  The value stored under the key is the registry
+** itself, so a single hook serves every registry.
+*/
+#ifdef _WIN32
+static void WINAPI threadExitHook(void *p)
+{
+    if (p)
+        ((struct threadreg *)p)->exit();
+}
+
+static int createKey(struct threadreg *reg)
+{
+    DWORD key = FlsAlloc(threadExitHook);
+    if (key == FLS_OUT_OF_INDEXES)
+        return 0;
+    reg->key = key;
+    return 1;
+}
+
+static void setKey(struct threadreg *reg)
+{
+    FlsSetValue((DWORD)reg->key, reg);
+}
+
+static void yield(void)
+{
+    SwitchToThread();
+}
+#else
+typedef char threadreg_key_fits[sizeof(pthread_key_t) <= sizeof(uintptr_t) ? 1 : -1];
+
+static void threadExitHook(void *p)
+{
+    ((struct threadreg *)p)->exit();
+}
+
+static int createKey(struct threadreg *reg)
+{
+    pthread_key_t key;
+    if (pthread_key_create(&key, threadExitHook) != 0)
+        return 0;
+    reg->key = (uintptr_t)key;
+    return 1;
+}
+
+static void setKey(struct threadreg *reg)
+{
+    pthread_setspecific((pthread_key_t)reg->key, reg);
+}
+
+static void yield(void)
+{
+    sched_yield();
+}
+#endif
+
+/*
+** Without a key the exit hook never runs and the record stays claimed
+** after its thread is gone, which only costs memory.
+*/
+static void armExitHook(struct threadreg *reg)
+{
+    int state = atomic_int_load_explicit(&reg->keyState, memory_order_acquire);
+    if (state < 2)
+    {
+        if (state == 0 && atomic_int_cas(&reg->keyState, 0, 1))
+            atomic_int_store_explicit(&reg->keyState, createKey(reg) ? 2 : 3, memory_order_release);
+        while ((state = atomic_int_load_explicit(&reg->keyState, memory_order_acquire)) < 2)
+            yield();
+    }
+    if (state == 2)
+        setKey(reg);
+}
+
+struct threadreg_node *threadreg_claim(struct threadreg *reg)
+{
+    struct threadreg_node *n;
+    for (n = threadreg_first(reg); n; n = n->next)
+    {
+        if (atomic_int_load_explicit(&n->inUse, memory_order_relaxed) == 0 &&
+            atomic_int_cas(&n->inUse, 0, 1))
+            break;
+    }
+    if (n == NULL)
+    {
+        void *head;
+        n = (struct threadreg_node *)calloc(1, reg->size);
+        if (n == NULL)
+            abort();
+        atomic_int_init(&n->inUse, 1);
+        if (reg->init)
+            reg->init(n);
+        head = atomic_ptr_load(&reg->head);
+        do
+        {
+            n->next = (struct threadreg_node *)head;
+        } while (!atomic_ptr_cmpxchg_weak(&reg->head, &head, n, memory_order_release));
+    }
+    armExitHook(reg);
+    return n;
+}
+
+void threadreg_release(struct threadreg_node *node)
+{
+    atomic_int_store_explicit(&node->inUse, 0, memory_order_release);
+}
+
+struct threadreg_node *threadreg_first(struct threadreg *reg)
+{
+    return (struct threadreg_node *)atomic_ptr_load_explicit(&reg->head, memory_order_acquire);
+}
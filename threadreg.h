@@ -0,0 +1,53 @@
+#ifndef THREADREG_H
+#define THREADREG_H
+
+/*
+ * 每线程记录的登记表, smr, rcu, lockprof 共用.
+ * 记录挂在只增长的全局链表上, 任何线程都可以随时遍历, 不需要回收;
+ * 线程退出时记录标记为空闲, 下一个登记的线程直接复用.
+ * 线程第一次登记时挂上退出钩子 (pthread_key 析构函数或 Windows FLS 回调), 退出时调用 exit.
+ *
+ * 记录的第一个成员是 struct threadreg_node, 各模块用自己的线程局部指针缓存本线程的记录:
+ *   static struct threadreg Registry = THREADREG_INIT(sizeof(struct my_record), initRecord, myExit);
+ *   if (Self == NULL) Self = (struct my_record *)threadreg_claim(&Registry);
+ * exit 里清理完模块自己的状态后把 Self 置空, 再 threadreg_release(&me->node).
+ */
+
+#include "atomic.h"
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct threadreg_node {
+    struct threadreg_node *next; /* 发布之后不再改变 */
+    atomic_int inUse;
+};
+
+struct threadreg {
+    atomic_ptr head;                           /* struct threadreg_node 链表 */
+    size_t size;                               /* 记录大小 */
+    void (*init)(struct threadreg_node *node); /* 新分配 (已清零) 的记录发布之前调用, 可以为 NULL */
+    void (*exit)(void);                        /* 登记过的线程退出时调用 */
+    atomic_int keyState;                       /* 0 未创建, 1 创建中, 2 已创建, 3 创建失败 */
+    uintptr_t key;                             /* pthread_key_t 或 FLS 下标 */
+};
+
+#define THREADREG_INIT(size, init, exit) { 0, (size), (init), (exit), 0, 0 }
+
+/* 取一个空闲记录或者新分配一个, 并给调用线程挂上退出钩子; 内存不足时 abort */
+struct threadreg_node *threadreg_claim(struct threadreg *reg);
+
+/* 把记录还给登记表, 之后调用线程不能再访问它 */
+void threadreg_release(struct threadreg_node *node);
+
+/* 遍历: for (n = threadreg_first(reg); n; n = n->next), 包括空闲的记录 */
+struct threadreg_node *threadreg_first(struct threadreg *reg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // THREADREG_H
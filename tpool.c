@@ -0,0 +1,555 @@
+#include "tpool.h"
+#include "futex.h"
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#endif
+
+#define TPOOL_MASK (TPOOL_DEQUE - 1)
+
+/* tpool_task.state */
+#define TASK_DONE 1
+#define TASK_WAITER 2
+
+/* a worker blocked in tpool_join wakes up this often to look for work */
+#define JOIN_PARK_MS 1
+
+/*
+** One worker thread.  top is written by thieves, bottom and the slots
+** by the owner only, the mailbox by anyone who submits to this worker;
+** each group sits on its own cache line.  The counters are written by
+** the owner and read by tpool_stats().
+*/
+typedef struct tpool_worker tpool_worker;
+struct tpool_worker
+{
+    atomic_int64 top;           /* next slot to steal, only grows */
+    char pad0[ATOMIC_CACHELINE - sizeof(atomic_int64)];
+    atomic_int64 bottom;        /* next slot the owner pushes */
+    struct tpool *pool;
+    int index;
+    uint64_t rng;
+    atomic_int64 executed;
+    atomic_int64 stolen;
+    atomic_int64 parked;
+#ifdef _WIN32
+    HANDLE thread;
+#else
+    pthread_t thread;
+#endif
+    atomic_ptr slots[TPOOL_DEQUE];
+    char pad1[ATOMIC_CACHELINE];
+    struct llist_head mailbox;  /* tasks submitted with an affinity hint */
+    char pad2[ATOMIC_CACHELINE - sizeof(struct llist_head)];
+};
+
+struct tpool
+{
+    int nthread;
+    tpool_worker **workers;
+    char pad0[ATOMIC_CACHELINE - sizeof(int) - sizeof(tpool_worker **)];
+    struct llist_head inject;   /* tasks submitted from anywhere */
+    atomic_int64 submitted;
+    char pad1[ATOMIC_CACHELINE - sizeof(struct llist_head) - sizeof(atomic_int64)];
+    atomic_int idle;            /* eventcount parked workers sleep on */
+    atomic_int stop;
+};
+
+static ATOMIC_THREAD tpool_worker *Self;
+
+static int cpuCount(void)
+{
+#ifdef _WIN32
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    return (int)si.dwNumberOfProcessors;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+#endif
+}
+
+static void yield(void)
+{
+#ifdef _WIN32
+    SwitchToThread();
+#else
+    sched_yield();
+#endif
+}
+
+static tpool_worker *current(struct tpool *pool)
+{
+    tpool_worker *w = Self;
+    return w && w->pool == pool ? w : NULL;
+}
+
+/*
+** Chase-Lev deque.  The owner pushes and takes at bottom, thieves take
+** at top with a CAS; the owner only needs the CAS when it races them for
+** the last task.  Every access to top and bottom that the algorithm
+** orders store-before-load is seq_cst, which also orders the push with
+** the eventcount load in futex_ec_notify().
+*/
+static int dequePush(tpool_worker *w, struct tpool_task *task)
+{
+    int64_t b = atomic_int64_load_explicit(&w->bottom, memory_order_relaxed);
+    int64_t t = atomic_int64_load_explicit(&w->top, memory_order_acquire);
+    if (b - t >= TPOOL_DEQUE)
+        return 1;
+    atomic_ptr_store_explicit(&w->slots[b & TPOOL_MASK], task, memory_order_relaxed);
+    atomic_int64_store(&w->bottom, b + 1);
+    return 0;
+}
+
+static struct tpool_task *dequeTake(tpool_worker *w)
+{
+    int64_t b = atomic_int64_load_explicit(&w->bottom, memory_order_relaxed) - 1;
+    int64_t t;
+    struct tpool_task *task;
+    atomic_int64_store(&w->bottom, b);
+    t = atomic_int64_load(&w->top);
+    if (t > b)
+    {
+        atomic_int64_store_explicit(&w->bottom, b + 1, memory_order_release);
+        return NULL;
+    }
+    task = (struct tpool_task *)atomic_ptr_load_explicit(&w->slots[b & TPOOL_MASK], memory_order_relaxed);
+    if (t == b)
+    {
+        if (!atomic_int64_cas(&w->top, t, t + 1))
+            task = NULL;
+        atomic_int64_store_explicit(&w->bottom, b + 1, memory_order_release);
+    }
+    return task;
+}
+
+static struct tpool_task *dequeSteal(tpool_worker *w)
+{
+    int64_t t = atomic_int64_load(&w->top);
+    int64_t b = atomic_int64_load(&w->bottom);
+    struct tpool_task *task;
+    if (t >= b)
+        return NULL;
+    task = (struct tpool_task *)atomic_ptr_load_explicit(&w->slots[t & TPOOL_MASK], memory_order_relaxed);
+    if (!atomic_int64_cas(&w->top, t, t + 1))
+        return NULL;
+    return task;
+}
+
+static int dequeEmpty(tpool_worker *w)
+{
+    return atomic_int64_load(&w->top) >= atomic_int64_load(&w->bottom);
+}
+
+/*
+** Wake parked workers after publishing a task on a submission list.
+** llist_add only publishes with release, so instead of a plain load the
+** eventcount is read with a seq_cst RMW: either it sees the waiter bit,
+** or the waiter's futex_ec_prepare() comes later and synchronizes with
+** it and then sees the task.
+*/
+static void wakeWorkers(struct tpool *pool)
+{
+    if (atomic_int_fetch_add(&pool->idle, 0, memory_order_seq_cst) & 1)
+        futex_ec_notify(&pool->idle);
+}
+
+/*
+** Take every task on a submission list.  The list comes newest first;
+** all but the oldest go into w's deque so that w runs them in submission
+** order and thieves take the newest, and the oldest is returned to run
+** now.  If the deque fills up the rest goes back on the list.
+*/
+static struct tpool_task *grabList(tpool_worker *w, struct llist_head *list)
+{
+    struct llist_node *n, *last;
+    int pushed = 0;
+    if (llist_empty(list))
+        return NULL;
+    n = llist_del_all(list);
+    while (n && n->next)
+    {
+        struct llist_node *next = n->next;
+        if (dequePush(w, llist_entry(n, struct tpool_task, node)))
+        {
+            for (last = n; last->next; last = last->next)
+                ;
+            llist_add_batch(n, last, list);
+            n = NULL;
+            break;
+        }
+        pushed = 1;
+        n = next;
+    }
+    if (pushed)
+        futex_ec_notify(&w->pool->idle);
+    return n ? llist_entry(n, struct tpool_task, node) : NULL;
+}
+
+static struct tpool_task *findWork(tpool_worker *w)
+{
+    struct tpool *pool = w->pool;
+    struct tpool_task *task;
+    int n = pool->nthread, start, i;
+    if ((task = dequeTake(w)) != NULL)
+        return task;
+    if ((task = grabList(w, &w->mailbox)) != NULL)
+        return task;
+    if ((task = grabList(w, &pool->inject)) != NULL)
+        return task;
+    if (n == 1)
+        return NULL;
+    w->rng ^= w->rng << 13;
+    w->rng ^= w->rng >> 7;
+    w->rng ^= w->rng << 17;
+    start = (int)(w->rng % (uint64_t)n);
+    for (i = 0; i < n; i++)
+    {
+        tpool_worker *v = pool->workers[(start + i) % n];
+        if (v != w && (task = dequeSteal(v)) != NULL)
+        {
+            atomic_int64_store_explicit(&w->stolen,
+                atomic_int64_load_explicit(&w->stolen, memory_order_relaxed) + 1, memory_order_relaxed);
+            return task;
+        }
+    }
+    for (i = 0; i < n; i++)
+    {
+        tpool_worker *v = pool->workers[(start + i) % n];
+        if (v != w && (task = grabList(w, &v->mailbox)) != NULL)
+            return task;
+    }
+    return NULL;
+}
+
+/* seq_cst loads, ordered after futex_ec_prepare() */
+static int hasWork(struct tpool *pool)
+{
+    int i;
+    if (atomic_ptr_load(&pool->inject.first))
+        return 1;
+    for (i = 0; i < pool->nthread; i++)
+    {
+        tpool_worker *v = pool->workers[i];
+        if (!dequeEmpty(v) || atomic_ptr_load(&v->mailbox.first))
+            return 1;
+    }
+    return 0;
+}
+
+/* The task may be freed as soon as its state says done, so read nothing after. */
+static void runTask(tpool_worker *w, struct tpool_task *task)
+{
+    task->fn(task->arg);
+    if (w)
+        atomic_int64_store_explicit(&w->executed,
+            atomic_int64_load_explicit(&w->executed, memory_order_relaxed) + 1, memory_order_relaxed);
+    /* A wake on a freed task only causes a spurious wakeup elsewhere. */
+    if (atomic_int_exchange(&task->state, TASK_DONE) & TASK_WAITER)
+        futex_wake_all(&task->state);
+}
+
+static void workerLoop(tpool_worker *w)
+{
+    struct tpool *pool = w->pool;
+    int spins = 0;
+    Self = w;
+    for (;;)
+    {
+        struct tpool_task *task = findWork(w);
+        int key;
+        if (task)
+        {
+            runTask(w, task);
+            spins = 0;
+            continue;
+        }
+        if (++spins < TPOOL_SPIN)
+        {
+            yield();
+            continue;
+        }
+        key = futex_ec_prepare(&pool->idle);
+        if (hasWork(pool))
+            continue;
+        if (atomic_int_load(&pool->stop))
+            break;
+        atomic_int64_store_explicit(&w->parked,
+            atomic_int64_load_explicit(&w->parked, memory_order_relaxed) + 1, memory_order_relaxed);
+        futex_ec_wait(&pool->idle, key);
+        spins = 0;
+    }
+    Self = NULL;
+}
+
+#ifdef _WIN32
+static DWORD WINAPI workerMain(LPVOID arg)
+#else
+static void *workerMain(void *arg)
+#endif
+{
+    workerLoop((tpool_worker *)arg);
+    return 0;
+}
+
+static void stopWorkers(struct tpool *pool, int nstarted)
+{
+    atomic_int_store(&pool->stop, 1);
+    futex_ec_notify(&pool->idle);
+    for (int i = 0; i < nstarted; i++)
+    {
+#ifdef _WIN32
+        WaitForSingleObject(pool->workers[i]->thread, INFINITE);
+        CloseHandle(pool->workers[i]->thread);
+#else
+        pthread_join(pool->workers[i]->thread, NULL);
+#endif
+    }
+    for (int i = 0; i < pool->nthread; i++)
+        free(pool->workers[i]);
+    free(pool->workers);
+    free(pool);
+}
+
+struct tpool *tpool_create(int nthread)
+{
+    struct tpool *pool;
+    int i;
+    if (nthread <= 0)
+        nthread = cpuCount();
+    pool = (struct tpool *)calloc(1, sizeof(struct tpool));
+    if (pool == NULL)
+        return NULL;
+    pool->nthread = nthread;
+    pool->workers = (tpool_worker **)calloc(nthread, sizeof(tpool_worker *));
+    init_llist_head(&pool->inject);
+    atomic_int64_init(&pool->submitted, 0);
+    atomic_int_init(&pool->idle, 0);
+    atomic_int_init(&pool->stop, 0);
+    if (pool->workers == NULL)
+    {
+        free(pool);
+        return NULL;
+    }
+    /* every worker must exist before any thread starts stealing */
+    for (i = 0; i < nthread; i++)
+    {
+        tpool_worker *w = (tpool_worker *)calloc(1, sizeof(tpool_worker));
+        if (w == NULL)
+        {
+            stopWorkers(pool, 0);
+            return NULL;
+        }
+        atomic_int64_init(&w->top, 0);
+        atomic_int64_init(&w->bottom, 0);
+        for (int j = 0; j < TPOOL_DEQUE; j++)
+            atomic_ptr_init(&w->slots[j], NULL);
+        init_llist_head(&w->mailbox);
+        atomic_int64_init(&w->executed, 0);
+        atomic_int64_init(&w->stolen, 0);
+        atomic_int64_init(&w->parked, 0);
+        w->pool = pool;
+        w->index = i;
+        w->rng = 0x9e3779b97f4a7c15ULL * (uint64_t)(i + 1);
+        pool->workers[i] = w;
+    }
+    for (i = 0; i < nthread; i++)
+    {
+        tpool_worker *w = pool->workers[i];
+#ifdef _WIN32
+        w->thread = CreateThread(NULL, 0, workerMain, w, 0, NULL);
+        if (w->thread == NULL)
+#else
+        if (pthread_create(&w->thread, NULL, workerMain, w) != 0)
+#endif
+        {
+            stopWorkers(pool, i);
+            return NULL;
+        }
+    }
+    return pool;
+}
+
+void tpool_destroy(struct tpool *pool)
+{
+    if (pool)
+        stopWorkers(pool, pool->nthread);
+}
+
+int tpool_size(struct tpool *pool)
+{
+    return pool->nthread;
+}
+
+int tpool_current(struct tpool *pool)
+{
+    tpool_worker *w = current(pool);
+    return w ? w->index : -1;
+}
+
+void tpool_task_init(struct tpool_task *task, tpool_fn fn, void *arg)
+{
+    task->node.next = NULL;
+    task->fn = fn;
+    task->arg = arg;
+    atomic_int_init(&task->state, 0);
+}
+
+int tpool_task_done(struct tpool_task *task)
+{
+    return atomic_int_load_explicit(&task->state, memory_order_acquire) == TASK_DONE;
+}
+
+void tpool_submit(struct tpool *pool, struct tpool_task *task)
+{
+    atomic_int64_fetch_add(&pool->submitted, 1, memory_order_relaxed);
+    llist_add(&task->node, &pool->inject);
+    wakeWorkers(pool);
+}
+
+void tpool_submit_to(struct tpool *pool, int worker, struct tpool_task *task)
+{
+    tpool_worker *w = pool->workers[(unsigned)worker % (unsigned)pool->nthread];
+    atomic_int64_fetch_add(&pool->submitted, 1, memory_order_relaxed);
+    llist_add(&task->node, &w->mailbox);
+    wakeWorkers(pool);
+}
+
+void tpool_fork(struct tpool *pool, struct tpool_task *task)
+{
+    tpool_worker *w = current(pool);
+    if (w == NULL)
+    {
+        tpool_submit(pool, task);
+        return;
+    }
+    if (dequePush(w, task))
+    {
+        runTask(w, task);
+        return;
+    }
+    futex_ec_notify(&pool->idle);
+}
+
+/*
+** Wait for a task.  A worker keeps running other tasks meanwhile, the
+** one it waits for is usually at the bottom of its own deque.  When there
+** is nothing to run it parks on the task, briefly if it is a worker so
+** that it goes back to helping.
+*/
+void tpool_join(struct tpool *pool, struct tpool_task *task)
+{
+    tpool_worker *w = current(pool);
+    int spins = 0;
+    for (;;)
+    {
+        int s = atomic_int_load_explicit(&task->state, memory_order_acquire);
+        struct tpool_task *other;
+        if (s == TASK_DONE)
+            return;
+        if (w && (other = findWork(w)) != NULL)
+        {
+            runTask(w, other);
+            spins = 0;
+            continue;
+        }
+        if (++spins < TPOOL_SPIN)
+        {
+            yield();
+            continue;
+        }
+        if (s == 0 && !atomic_int_cas(&task->state, 0, TASK_WAITER))
+            continue;
+        futex_wait(&task->state, TASK_WAITER, w ? JOIN_PARK_MS : -1);
+    }
+}
+
+typedef struct forRange forRange;
+struct forRange
+{
+    struct tpool_task task;
+    struct tpool *pool;
+    int64_t begin;
+    int64_t end;
+    int64_t grain;
+    tpool_range_fn fn;
+    void *arg;
+};
+
+static void splitRange(forRange *r, const forRange *from, int64_t begin, int64_t end)
+{
+    r->pool = from->pool;
+    r->begin = begin;
+    r->end = end;
+    r->grain = from->grain;
+    r->fn = from->fn;
+    r->arg = from->arg;
+}
+
+/* Fork the upper half, run the lower half here, then join. */
+static void runRange(void *arg)
+{
+    forRange *r = (forRange *)arg;
+    forRange lo, hi;
+    int64_t mid;
+    if (r->end - r->begin <= r->grain)
+    {
+        r->fn(r->begin, r->end, r->arg);
+        return;
+    }
+    mid = r->begin + (r->end - r->begin) / 2;
+    splitRange(&hi, r, mid, r->end);
+    tpool_task_init(&hi.task, runRange, &hi);
+    tpool_fork(r->pool, &hi.task);
+    splitRange(&lo, r, r->begin, mid);
+    runRange(&lo);
+    tpool_join(r->pool, &hi.task);
+}
+
+void tpool_parallel_for(struct tpool *pool, int64_t begin, int64_t end, int64_t grain,
+                        tpool_range_fn fn, void *arg)
+{
+    forRange r;
+    if (end <= begin)
+        return;
+    if (grain <= 0)
+    {
+        grain = (end - begin) / ((int64_t)pool->nthread * 8);
+        if (grain < 1)
+            grain = 1;
+    }
+    r.pool = pool;
+    r.begin = begin;
+    r.end = end;
+    r.grain = grain;
+    r.fn = fn;
+    r.arg = arg;
+    if (current(pool))
+    {
+        runRange(&r);
+        return;
+    }
+    tpool_task_init(&r.task, runRange, &r);
+    tpool_submit(pool, &r.task);
+    tpool_join(pool, &r.task);
+}
+
+void tpool_stats(struct tpool *pool, struct tpool_stats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    for (int i = 0; i < pool->nthread; i++)
+    {
+        tpool_worker *w = pool->workers[i];
+        stats->executed += atomic_int64_load_explicit(&w->executed, memory_order_relaxed);
+        stats->stolen += atomic_int64_load_explicit(&w->stolen, memory_order_relaxed);
+        stats->parked += atomic_int64_load_explicit(&w->parked, memory_order_relaxed);
+    }
+    stats->submitted = atomic_int64_load_explicit(&pool->submitted, memory_order_relaxed);
+    stats->threads = pool->nthread;
+}
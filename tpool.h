@@ -0,0 +1,88 @@
+#ifndef TPOOL_H
+#define TPOOL_H
+
+/*
+ * 工作窃取线程池.
+ *
+ * 每个工作线程有一个 Chase-Lev 双端队列, 自己在底部压入和取出, 其他线程从顶部窃取.
+ * 外部线程提交的任务进全局注入队列, 带亲和提示的任务进目标线程的信箱 (都是 llist).
+ * 线程找任务的顺序: 自己的队列, 自己的信箱, 注入队列, 从随机的一个线程开始挨个窃取,
+ * 最后是其他线程的信箱 -- 亲和只是提示, 目标线程忙的时候别的线程会接手.
+ * 找不到任务时先自旋 TPOOL_SPIN 轮, 再在事件计数上睡眠 (见 futex.h).
+ *
+ * 任务由调用者分配, 可以在栈上, 从提交到 tpool_join 返回之前不能释放或重用.
+ * 池不为任务分配内存.
+ *   tpool_submit / tpool_submit_to  从任意线程提交
+ *   tpool_fork / tpool_join         在工作线程里派生子任务并等待, 等待时帮忙执行其他任务;
+ *                                   在外部线程里等同于 tpool_submit 和阻塞等待
+ *   tpool_parallel_for              把 [begin, end) 对半拆到不超过 grain 的小段并行执行
+ * tpool_destroy 之前要等待所有提交的任务完成.
+ */
+
+#include "atomic.h"
+#include "llist.h"
+#include <stdint.h>
+
+/* 每个工作线程队列的容量, 2 的幂. 队列满时 tpool_fork 直接执行任务 */
+#ifndef TPOOL_DEQUE
+#define TPOOL_DEQUE 1024
+#endif
+
+/* 睡眠之前找任务的轮数, 每轮之间让出 CPU */
+#ifndef TPOOL_SPIN
+#define TPOOL_SPIN 64
+#endif
+
+typedef void (*tpool_fn)(void *arg);
+typedef void (*tpool_range_fn)(int64_t begin, int64_t end, void *arg);
+
+struct tpool_task {
+    struct llist_node node; /* 注入队列和信箱里的链接 */
+    tpool_fn fn;
+    void *arg;
+    atomic_int state;
+};
+
+struct tpool_stats {
+    int64_t executed;  /* 工作线程执行的任务数 */
+    int64_t stolen;    /* 其中从其他线程窃取的 */
+    int64_t submitted; /* tpool_submit / tpool_submit_to 的次数 */
+    int64_t parked;    /* 工作线程睡眠的次数 */
+    int threads;
+};
+
+struct tpool;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* nthread <= 0 时用 CPU 数. 失败返回 NULL */
+struct tpool *tpool_create(int nthread);
+/* 执行完队列里剩下的任务后结束工作线程 */
+void tpool_destroy(struct tpool *pool);
+int tpool_size(struct tpool *pool);
+/* 当前线程在 pool 中的编号, 不是 pool 的工作线程返回 -1 */
+int tpool_current(struct tpool *pool);
+
+/* 每次提交前都要初始化 */
+void tpool_task_init(struct tpool_task *task, tpool_fn fn, void *arg);
+int tpool_task_done(struct tpool_task *task);
+
+void tpool_submit(struct tpool *pool, struct tpool_task *task);
+/* 优先由第 worker 个线程执行 */
+void tpool_submit_to(struct tpool *pool, int worker, struct tpool_task *task);
+void tpool_fork(struct tpool *pool, struct tpool_task *task);
+void tpool_join(struct tpool *pool, struct tpool_task *task);
+
+/* grain <= 0 时按线程数自动选择 */
+void tpool_parallel_for(struct tpool *pool, int64_t begin, int64_t end, int64_t grain,
+                        tpool_range_fn fn, void *arg);
+
+void tpool_stats(struct tpool *pool, struct tpool_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // TPOOL_H
@@ -0,0 +1,739 @@
+#include "tzone.h"
+#include "atomic.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <ctype.h>
+#ifdef _WIN32
+#include <Windows.h>
+#endif
+
+#define TZONE_SLOTS 1024
+#define TZONE_MISSES (TZONE_SLOTS / 4)
+#define TZONE_MAXFILE (1 << 20)
+
+typedef struct tztype tztype;
+struct tztype
+{
+    int32_t off;   /* UTC offset in seconds, east positive */
+    uint8_t isdst; /* True if this is a daylight saving type */
+    uint16_t abbr; /* Index of the abbreviation in tzone.chars */
+};
+
+/*
+** One transition date of a POSIX TZ rule:
+**
+**     Jn      julian day 1..365, February 29 is never counted
+**     n       zero based day 0..365, February 29 is counted
+**     Mm.w.d  day d (0==Sunday) of week w (5==last) of month m
+*/
+typedef struct tzdate tzdate;
+struct tzdate
+{
+    char kind;    /* 'J', 'N' or 'M' */
+    int16_t m, w; /* Month and week for 'M' */
+    int16_t d;    /* Weekday for 'M', day number otherwise */
+    int32_t time; /* Seconds after local midnight */
+};
+
+typedef struct tzrule tzrule;
+struct tzrule
+{
+    int32_t stdoff;  /* Standard offset, east positive */
+    int32_t dstoff;  /* Daylight offset, east positive */
+    int hasdst;      /* True if start/end are valid */
+    tzdate start;    /* Daylight time starts, in standard time */
+    tzdate end;      /* Daylight time ends, in daylight time */
+    char stdname[16];
+    char dstname[16];
+};
+
+struct tzone
+{
+    const char *name;
+    int ntrans;            /* Number of transitions */
+    int ntypes;            /* Number of local time types, at least 1 */
+    const int64_t *trans;  /* Transition times, UTC seconds, ascending */
+    const uint8_t *idx;    /* Local time type after each transition */
+    const tztype *types;
+    const char *chars;     /* Time zone abbreviations */
+    int hasrule;           /* True if rule applies after the last transition */
+    tzrule rule;
+    int missing;           /* Cached miss: the name was not found while ZoneGen + 1 == missing */
+    tzone *retired;        /* Next replaced miss in RetiredZones */
+};
+
+typedef struct zonedir zonedir;
+struct zonedir
+{
+    zonedir *retired;      /* Next replaced directory in RetiredDirs */
+    char path[];
+};
+
+static atomic_ptr Zones[TZONE_SLOTS];
+static atomic_ptr LocalZone;
+static atomic_int ZoneGen;  /* Bumped by tzone_set_dir, invalidates cached misses */
+static atomic_ptr RetiredZones;
+static atomic_int NMissing; /* Cached misses, at most TZONE_MISSES */
+static atomic_ptr ZoneDir;  /* zonedir set by tzone_set_dir, never changed in place */
+static atomic_ptr RetiredDirs;
+
+static const tztype UtcType = {0, 0, 0};
+static const tzone UtcZone = {"UTC", 0, 1, NULL, NULL, &UtcType, "UTC", 0, {0}, 0, NULL};
+
+/*
+** Days since 1970-01-01 of the proleptic gregorian date Y-M-D.
+*/
+static int64_t daysFromCivil(int64_t y, int m, int d)
+{
+    int64_t era, yoe, doy, doe;
+    y -= m <= 2;
+    era = (y >= 0 ? y : y - 399) / 400;
+    yoe = y - era * 400;
+    doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+/*
+** The gregorian year containing day z (days since 1970-01-01).
+*/
+static int64_t yearFromDays(int64_t z)
+{
+    int64_t era, doe, yoe, y, doy, mp;
+    z += 719468;
+    era = (z >= 0 ? z : z - 146096) / 146097;
+    doe = z - era * 146097;
+    yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    y = yoe + era * 400;
+    doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    mp = (5 * doy + 2) / 153;
+    return mp < 10 ? y : y + 1;
+}
+
+static int isLeap(int64_t y)
+{
+    return (y % 4 == 0 && y % 100 != 0) || y % 400 == 0;
+}
+
+static int64_t floorDiv(int64_t a, int64_t b)
+{
+    return a >= 0 ? a / b : -((-a + b - 1) / b);
+}
+
+/*
+** Local midnight (as seconds since 1970 without offset) of the day
+** described by rule date r in year y, plus the rule time.
+*/
+static int64_t ruleTime(const tzdate *r, int64_t y)
+{
+    int64_t day;
+    static const int mdays[] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+    switch (r->kind)
+    {
+    case 'J':
+    {
+        day = daysFromCivil(y, 1, 1) + r->d - 1;
+        if (isLeap(y) && r->d >= 60)
+            day++;
+        break;
+    }
+    case 'N':
+    {
+        day = daysFromCivil(y, 1, 1) + r->d;
+        break;
+    }
+    default:
+    {
+        int wd, n;
+        int64_t first = daysFromCivil(y, r->m, 1);
+        n = mdays[r->m - 1] + (r->m == 2 && isLeap(y));
+        wd = (int)(((first + 4) % 7 + 7) % 7); /* 1970-01-01 was a Thursday */
+        day = first + (r->d - wd + 7) % 7 + (r->w - 1) * 7;
+        while (day >= first + n)
+            day -= 7;
+        break;
+    }
+    }
+    return day * 86400 + r->time;
+}
+
+static int32_t ruleOffset(const tzrule *r, int64_t t, int *isdst)
+{
+    int64_t y, s, e;
+    int dst;
+    if (!r->hasdst)
+    {
+        *isdst = 0;
+        return r->stdoff;
+    }
+    y = yearFromDays(floorDiv(t + r->stdoff, 86400));
+    s = ruleTime(&r->start, y) - r->stdoff;
+    e = ruleTime(&r->end, y) - r->dstoff;
+    if (s < e)
+        dst = t >= s && t < e;
+    else
+        dst = !(t >= e && t < s);
+    *isdst = dst;
+    return dst ? r->dstoff : r->stdoff;
+}
+
+/*
+** Parse [+-]hh[:mm[:ss]] into seconds.  Return a pointer past the
+** time or NULL on error.
+*/
+static const char *parseRuleTime(const char *z, int32_t *pSec)
+{
+    int sgn = 1, v[3] = {0, 0, 0}, i;
+    if (*z == '+' || *z == '-')
+        sgn = *z++ == '-' ? -1 : 1;
+    for (i = 0; i < 3; i++)
+    {
+        if (!isdigit((unsigned char)*z))
+            return NULL;
+        while (isdigit((unsigned char)*z))
+            v[i] = v[i] * 10 + *z++ - '0';
+        if (*z != ':')
+            break;
+        z++;
+    }
+    if (v[0] > 167 || v[1] > 59 || v[2] > 59)
+        return NULL;
+    *pSec = sgn * (v[0] * 3600 + v[1] * 60 + v[2]);
+    return z;
+}
+
+static const char *parseRuleName(const char *z, char *zOut)
+{
+    int n = 0;
+    if (*z == '<')
+    {
+        for (z++; *z && *z != '>'; z++)
+            if (n < 15)
+                zOut[n++] = *z;
+        if (*z++ != '>')
+            return NULL;
+    }
+    else
+    {
+        for (; isalpha((unsigned char)*z); z++)
+            if (n < 15)
+                zOut[n++] = *z;
+    }
+    zOut[n] = 0;
+    return n >= 3 ? z : NULL;
+}
+
+static const char *parseRuleDate(const char *z, tzdate *d)
+{
+    int v[3] = {0, 0, 0}, i;
+    d->kind = *z == 'J' || *z == 'M' ? *z++ : 'N';
+    for (i = 0; i < (d->kind == 'M' ? 3 : 1); i++)
+    {
+        if (i > 0 && *z++ != '.')
+            return NULL;
+        if (!isdigit((unsigned char)*z))
+            return NULL;
+        while (isdigit((unsigned char)*z))
+            v[i] = v[i] * 10 + *z++ - '0';
+    }
+    if (d->kind == 'M')
+    {
+        if (v[0] < 1 || v[0] > 12 || v[1] < 1 || v[1] > 5 || v[2] > 6)
+            return NULL;
+        d->m = v[0];
+        d->w = v[1];
+        d->d = v[2];
+    }
+    else
+    {
+        if (v[0] > 365 || (d->kind == 'J' && v[0] < 1))
+            return NULL;
+        d->d = v[0];
+    }
+    d->time = 7200;
+    if (*z == '/' && (z = parseRuleTime(z + 1, &d->time)) == NULL)
+        return NULL;
+    return z;
+}
+
+/*
+** Parse a POSIX TZ string such as "CST-8" or "EST5EDT,M3.2.0,M11.1.0".
+** Return 0 on success.
+*/
+static int parseRule(const char *z, tzrule *r)
+{
+    memset(r, 0, sizeof(*r));
+    if ((z = parseRuleName(z, r->stdname)) == NULL)
+        return 1;
+    if ((z = parseRuleTime(z, &r->stdoff)) == NULL)
+        return 1;
+    r->stdoff = -r->stdoff;
+    if (*z == 0)
+        return 0;
+    if ((z = parseRuleName(z, r->dstname)) == NULL)
+        return 1;
+    r->dstoff = r->stdoff + 3600;
+    if (*z && *z != ',')
+    {
+        if ((z = parseRuleTime(z, &r->dstoff)) == NULL)
+            return 1;
+        r->dstoff = -r->dstoff;
+    }
+    if (*z == 0)
+        z = ",M3.2.0,M11.1.0";
+    if (*z++ != ',' || (z = parseRuleDate(z, &r->start)) == NULL)
+        return 1;
+    if (*z++ != ',' || (z = parseRuleDate(z, &r->end)) == NULL)
+        return 1;
+    r->hasdst = 1;
+    return *z != 0;
+}
+
+static uint32_t be32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static int64_t be64(const uint8_t *p)
+{
+    return (int64_t)(((uint64_t)be32(p) << 32) | be32(p + 4));
+}
+
+static tzone *newZone(const char *name, int ntrans, int ntypes, int nchars)
+{
+    size_t nName = strlen(name) + 1;
+    size_t sz = sizeof(tzone) + ntrans * sizeof(int64_t) + ntypes * sizeof(tztype) + ntrans + nchars + 1 + nName;
+    char *mem = (char *)calloc(1, sz);
+    tzone *z = (tzone *)mem;
+    if (z == NULL)
+        return NULL;
+    mem += sizeof(tzone);
+    z->trans = (int64_t *)mem;
+    mem += ntrans * sizeof(int64_t);
+    z->types = (tztype *)mem;
+    mem += ntypes * sizeof(tztype);
+    z->idx = (uint8_t *)mem;
+    mem += ntrans;
+    z->chars = mem;
+    mem += nchars + 1;
+    memcpy(mem, name, nName);
+    z->name = mem;
+    z->ntrans = ntrans;
+    z->ntypes = ntypes;
+    return z;
+}
+
+/*
+** Build a zone from the content of a TZif file (RFC 8536).  Version 2+
+** files are read from their 64-bit data block and footer.
+*/
+static tzone *parseTZif(const char *name, const uint8_t *p, size_t n)
+{
+    uint32_t isutcnt, isstdcnt, leapcnt, timecnt, typecnt, charcnt;
+    size_t tsize = 4, need, i;
+    const uint8_t *end = p + n;
+    tzone *z;
+    int64_t *trans;
+    uint8_t *idx;
+    tztype *types;
+
+    if (n < 44 || memcmp(p, "TZif", 4) != 0)
+        return NULL;
+    for (;;)
+    {
+        isutcnt = be32(p + 20);
+        isstdcnt = be32(p + 24);
+        leapcnt = be32(p + 28);
+        timecnt = be32(p + 32);
+        typecnt = be32(p + 36);
+        charcnt = be32(p + 40);
+        if (typecnt == 0 || typecnt > 256 || timecnt > 100000 || charcnt > 65535)
+            return NULL;
+        need = timecnt * tsize + timecnt + typecnt * 6 + charcnt + leapcnt * (tsize + 4) + isstdcnt + isutcnt;
+        if ((size_t)(end - p) < 44 + need)
+            return NULL;
+        if (tsize == 8 || p[4] < '2')
+            break;
+        /* Skip the version 1 block, use the 64-bit one */
+        p += 44 + need;
+        if ((size_t)(end - p) < 44 || memcmp(p, "TZif", 4) != 0)
+            return NULL;
+        tsize = 8;
+    }
+    p += 44;
+    z = newZone(name, (int)timecnt, (int)typecnt, (int)charcnt);
+    if (z == NULL)
+        return NULL;
+    trans = (int64_t *)z->trans;
+    idx = (uint8_t *)z->idx;
+    types = (tztype *)z->types;
+    for (i = 0; i < timecnt; i++, p += tsize)
+    {
+        trans[i] = tsize == 8 ? be64(p) : (int32_t)be32(p);
+        if (i > 0 && trans[i] <= trans[i - 1])
+            goto bad;
+    }
+    for (i = 0; i < timecnt; i++, p++)
+    {
+        if (*p >= typecnt)
+            goto bad;
+        idx[i] = *p;
+    }
+    for (i = 0; i < typecnt; i++, p += 6)
+    {
+        types[i].off = (int32_t)be32(p);
+        types[i].isdst = p[4] != 0;
+        types[i].abbr = p[5] < charcnt ? p[5] : 0;
+    }
+    memcpy((char *)z->chars, p, charcnt);
+    p += charcnt + leapcnt * (tsize + 4) + isstdcnt + isutcnt;
+    if (tsize == 8 && p < end && *p == '\n')
+    {
+        char zRule[128];
+        const uint8_t *e = memchr(p + 1, '\n', end - p - 1);
+        if (e && e - p - 1 < (int)sizeof(zRule) && e > p + 1)
+        {
+            memcpy(zRule, p + 1, e - p - 1);
+            zRule[e - p - 1] = 0;
+            z->hasrule = parseRule(zRule, &z->rule) == 0;
+        }
+    }
+    return z;
+bad:
+    free(z);
+    return NULL;
+}
+
+static tzone *ruleZone(const char *name)
+{
+    tzrule r;
+    tzone *z;
+    if (parseRule(name, &r))
+        return NULL;
+    z = newZone(name, 0, 1, 0);
+    if (z == NULL)
+        return NULL;
+    ((tztype *)z->types)->off = r.stdoff;
+    z->rule = r;
+    z->hasrule = 1;
+    return z;
+}
+
+static tzone *loadFile(const char *name, const char *zPath)
+{
+    FILE *f = fopen(zPath, "rb");
+    uint8_t *buf;
+    size_t n;
+    tzone *z;
+    if (f == NULL)
+        return NULL;
+    buf = (uint8_t *)malloc(TZONE_MAXFILE);
+    if (buf == NULL)
+    {
+        fclose(f);
+        return NULL;
+    }
+    n = fread(buf, 1, TZONE_MAXFILE, f);
+    fclose(f);
+    z = parseTZif(name, buf, n);
+    free(buf);
+    return z;
+}
+
+static uint32_t hashName(const char *z)
+{
+    uint32_t h = 2166136261u;
+    while (*z)
+        h = (h ^ (uint8_t)*z++) * 16777619u;
+    return h;
+}
+
+static const tzone *findZone(const char *name)
+{
+    uint32_t h = hashName(name);
+    for (int i = 0; i < TZONE_SLOTS; i++)
+    {
+        const tzone *z = (const tzone *)atomic_ptr_load_explicit(&Zones[(h + i) % TZONE_SLOTS], memory_order_acquire);
+        if (z == NULL)
+            return NULL;
+        if (strcmp(z->name, name) == 0)
+            return z;
+    }
+    return NULL;
+}
+
+static void retireZone(tzone *r)
+{
+    void *head = atomic_ptr_load(&RetiredZones);
+    do
+    {
+        r->retired = (tzone *)head;
+    } while (!atomic_ptr_cmpxchg_weak(&RetiredZones, &head, r, memory_order_release));
+}
+
+/*
+** Publish z in the zone cache.  If another thread installed a zone with
+** the same name first, z is freed and the winner returned.  A zone or a
+** newer miss replaces a stale miss; readers may still be looking at the
+** old entry, so it moves to RetiredZones instead of being freed.  Zones
+** are never removed otherwise, so readers need no lock.
+**
+** Misses take at most TZONE_MISSES slots, and when the table is full a
+** zone evicts a miss of any name, so bad names can never lock real zones
+** out.  Return NULL, after freeing z, if z is a miss over the limit or
+** the cache is full.
+*/
+static const tzone *addZone(tzone *z)
+{
+    uint32_t h = hashName(z->name);
+    if (z->missing && atomic_int_fetch_add(&NMissing, 1, memory_order_relaxed) >= TZONE_MISSES)
+    {
+        atomic_int_dec(&NMissing);
+        free(z);
+        return NULL;
+    }
+    for (int i = 0; i < TZONE_SLOTS; i++)
+    {
+        atomic_ptr *slot = &Zones[(h + i) % TZONE_SLOTS];
+        const tzone *old = (const tzone *)atomic_ptr_load(slot);
+        if (old == NULL)
+        {
+            if (atomic_ptr_cas(slot, NULL, z))
+                return z;
+            old = (const tzone *)atomic_ptr_load(slot);
+        }
+        if (old && strcmp(old->name, z->name) == 0)
+        {
+            if (old->missing && old->missing != z->missing && atomic_ptr_cas(slot, (void *)old, z))
+            {
+                retireZone((tzone *)old);
+                atomic_int_dec(&NMissing);
+                return z;
+            }
+            if (z->missing)
+                atomic_int_dec(&NMissing);
+            free(z);
+            return (const tzone *)atomic_ptr_load(slot);
+        }
+    }
+    for (int i = 0; i < TZONE_SLOTS && !z->missing; i++)
+    {
+        atomic_ptr *slot = &Zones[(h + i) % TZONE_SLOTS];
+        const tzone *old = (const tzone *)atomic_ptr_load(slot);
+        if (old && old->missing && atomic_ptr_cas(slot, (void *)old, z))
+        {
+            retireZone((tzone *)old);
+            atomic_int_dec(&NMissing);
+            return z;
+        }
+    }
+    if (z->missing)
+        atomic_int_dec(&NMissing);
+    free(z);
+    return NULL;
+}
+
+static int validName(const char *name)
+{
+    if (name[0] == 0 || name[0] == '/' || name[0] == '\\')
+        return 0;
+    return strstr(name, "..") == NULL;
+}
+
+/*
+** Readers may still be using the old directory, so it moves to
+** RetiredDirs.  The new one is visible before ZoneGen changes, so a miss
+** cached under the new generation was looked up in the new directory.
+*/
+void tzone_set_dir(const char *dir)
+{
+    size_t n = strlen(dir ? dir : "");
+    zonedir *d = (zonedir *)malloc(sizeof(zonedir) + n + 1), *old;
+    void *head;
+    if (d == NULL)
+        return;
+    memcpy(d->path, dir ? dir : "", n + 1);
+    old = (zonedir *)atomic_ptr_exchange(&ZoneDir, d);
+    if (old)
+    {
+        head = atomic_ptr_load(&RetiredDirs);
+        do
+        {
+            old->retired = (zonedir *)head;
+        } while (!atomic_ptr_cmpxchg_weak(&RetiredDirs, &head, old, memory_order_release));
+    }
+    atomic_int_inc(&ZoneGen);
+}
+
+int tzone_load_data(const char *name, const void *data, size_t len)
+{
+    const tzone *cached;
+    tzone *z;
+    if (name == NULL || ((cached = findZone(name)) != NULL && !cached->missing))
+        return 0;
+    z = parseTZif(name, (const uint8_t *)data, len);
+    if (z == NULL)
+        return 1;
+    return addZone(z) ? 0 : 1;
+}
+
+const tzone *tzone_utc(void)
+{
+    return &UtcZone;
+}
+
+const tzone *tzone_get(const char *name)
+{
+    const tzone *cached;
+    tzone *z = NULL;
+    int gen;
+    if (name == NULL || strcmp(name, "localtime") == 0)
+        return tzone_local();
+    if (strcmp(name, "UTC") == 0 || strcmp(name, "utc") == 0 || strcmp(name, "Z") == 0)
+        return &UtcZone;
+    gen = atomic_int_load_explicit(&ZoneGen, memory_order_acquire) + 1;
+    if ((cached = findZone(name)) != NULL && (!cached->missing || cached->missing == gen))
+        return cached->missing ? NULL : cached;
+    if (validName(name))
+    {
+        char zPath[512];
+        const zonedir *zd = (const zonedir *)atomic_ptr_load_explicit(&ZoneDir, memory_order_acquire);
+        const char *dir = zd && zd->path[0] ? zd->path : getenv("TZDIR");
+        snprintf(zPath, sizeof(zPath), "%s/%s", dir && dir[0] ? dir : "/usr/share/zoneinfo", name);
+        z = loadFile(name, zPath);
+    }
+    if (z == NULL)
+        z = ruleZone(name);
+    if (z == NULL)
+    {
+        /* Remember the miss so a bad "tz:NAME" does not hit the disk every time */
+        z = newZone(name, 0, 0, 0);
+        if (z == NULL)
+            return NULL;
+        z->missing = gen;
+    }
+    cached = addZone(z);
+    return cached && !cached->missing ? cached : NULL;
+}
+
+#ifdef _WIN32
+/*
+** Describe the system time zone as a POSIX TZ string.
+*/
+static int windowsRule(char *zBuf, int n)
+{
+    TIME_ZONE_INFORMATION tzi;
+    if (GetTimeZoneInformation(&tzi) == TIME_ZONE_ID_INVALID)
+        return 1;
+    if (tzi.DaylightDate.wMonth == 0)
+    {
+        snprintf(zBuf, n, "<STD>%c%d:%02d", tzi.Bias < 0 ? '-' : '+', abs(tzi.Bias) / 60, abs(tzi.Bias) % 60);
+    }
+    else
+    {
+        int dst = tzi.Bias + tzi.DaylightBias;
+        snprintf(zBuf, n, "<STD>%c%d:%02d<DST>%c%d:%02d,M%d.%d.%d/%d:%02d,M%d.%d.%d/%d:%02d",
+                 tzi.Bias < 0 ? '-' : '+', abs(tzi.Bias) / 60, abs(tzi.Bias) % 60,
+                 dst < 0 ? '-' : '+', abs(dst) / 60, abs(dst) % 60,
+                 tzi.DaylightDate.wMonth, tzi.DaylightDate.wDay, tzi.DaylightDate.wDayOfWeek,
+                 tzi.DaylightDate.wHour, tzi.DaylightDate.wMinute,
+                 tzi.StandardDate.wMonth, tzi.StandardDate.wDay, tzi.StandardDate.wDayOfWeek,
+                 tzi.StandardDate.wHour, tzi.StandardDate.wMinute);
+    }
+    return 0;
+}
+#endif
+
+const tzone *tzone_local(void)
+{
+    const tzone *z = (const tzone *)atomic_ptr_load_explicit(&LocalZone, memory_order_acquire);
+    const char *env;
+    tzone *owned = NULL;
+    if (z)
+        return z;
+    env = getenv("TZ");
+    if (env && env[0])
+    {
+        if (env[0] == ':')
+            env++;
+        if (env[0] == '/')
+            z = owned = loadFile("localtime", env);
+        else
+            z = tzone_get(env);
+    }
+    else
+    {
+#ifdef _WIN32
+        char zRule[128];
+        if (windowsRule(zRule, sizeof(zRule)) == 0)
+            z = owned = ruleZone(zRule);
+#else
+        z = owned = loadFile("localtime", "/etc/localtime");
+#endif
+    }
+    if (z == NULL)
+        z = &UtcZone;
+    if (!atomic_ptr_cas(&LocalZone, NULL, (void *)z))
+    {
+        free(owned);
+        z = (const tzone *)atomic_ptr_load(&LocalZone);
+    }
+    return z;
+}
+
+const char *tzone_name(const tzone *z)
+{
+    return z->name;
+}
+
+int32_t tzone_offset(const tzone *z, int64_t t, int *isdst, const char **abbr)
+{
+    const tztype *tt;
+    int dst;
+    if (z->hasrule && (z->ntrans == 0 || t >= z->trans[z->ntrans - 1]))
+    {
+        int32_t off = ruleOffset(&z->rule, t, &dst);
+        if (isdst)
+            *isdst = dst;
+        if (abbr)
+            *abbr = dst ? z->rule.dstname : z->rule.stdname;
+        return off;
+    }
+    if (z->ntrans == 0 || t < z->trans[0])
+    {
+        tt = &z->types[0];
+    }
+    else
+    {
+        int lo = 0, hi = z->ntrans - 1;
+        while (lo < hi)
+        {
+            int mid = (lo + hi + 1) / 2;
+            if (z->trans[mid] <= t)
+                lo = mid;
+            else
+                hi = mid - 1;
+        }
+        tt = &z->types[z->idx[lo]];
+    }
+    if (isdst)
+        *isdst = tt->isdst;
+    if (abbr)
+        *abbr = &z->chars[tt->abbr];
+    return tt->off;
+}
+
+int64_t tzone_to_utc(const tzone *z, int64_t local)
+{
+    int64_t guess = local - tzone_offset(z, local, NULL, NULL);
+    for (int i = 0; i < 3; i++)
+    {
+        int64_t next = local - tzone_offset(z, guess, NULL, NULL);
+        if (next == guess)
+            break;
+        guess = next;
+    }
+    return guess;
+}
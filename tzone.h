@@ -0,0 +1,53 @@
+#ifndef TJ_TZONE_H
+#define TJ_TZONE_H
+
+/*
+ * 时区引擎
+ *
+ * 从 TZif 文件(/usr/share/zoneinfo 或内嵌数据)加载时区, 加载后的转换表
+ * 不可变, 缓存在无锁哈希表中, 查询只做原子读和二分查找.
+ * 超出转换表的时间使用 TZif 尾部的 POSIX TZ 规则计算.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct tzone tzone;
+
+/* 设置 zoneinfo 目录, 默认取环境变量 TZDIR, 否则为 /usr/share/zoneinfo. 可以和查询并发调用, 已缓存的时区不受影响 */
+void tzone_set_dir(const char *dir);
+
+/* 注册一份内嵌的 TZif 数据, 之后 tzone_get(name) 直接使用它 */
+int tzone_load_data(const char *name, const void *data, size_t len);
+
+/*
+ * 按名字取时区, 如 "Asia/Shanghai", 也接受 POSIX TZ 串如 "CST-8". 失败返回 NULL.
+ * 找不到的名字也会缓存, tzone_set_dir 之后重新查找. 缓存最多 1024 个名字, 其中找不到的名字最多占 1/4,
+ * 超过后不再缓存; 表满时新加载的时区挤掉缓存的失败名字, 都是有效时区时新名字返回 NULL.
+ */
+const tzone *tzone_get(const char *name);
+
+/* 进程本地时区(TZ 环境变量或 /etc/localtime), 第一次调用时加载 */
+const tzone *tzone_local(void);
+const tzone *tzone_utc(void);
+
+const char *tzone_name(const tzone *z);
+
+/*
+ * 返回 UTC 秒数 t 处的偏移(秒, 东正西负).
+ * isdst/abbr 可以为 NULL.
+ */
+int32_t tzone_offset(const tzone *z, int64_t t, int *isdst, const char **abbr);
+
+/* 把本地时间秒数转换为 UTC 秒数, 夏令时切换处不存在或重复的本地时间取迭代收敛到的一侧 */
+int64_t tzone_to_utc(const tzone *z, int64_t local);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
@@ -1,5 +1,7 @@
 #include "ystring.h"
 #include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
 
 YString::YString()
 {